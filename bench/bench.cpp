@@ -0,0 +1,152 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <new>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <fmt/core.h>
+
+// Allocations are counted per thread so background threads (loggers, curl) don't
+// show up in the numbers for the benchmark thread.
+static thread_local uint64_t alloc_count = 0;
+static thread_local uint64_t alloc_bytes = 0;
+
+void *operator new(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+namespace OctoPrintControl::Bench {
+
+struct Benchmark {
+    std::string name;
+    BenchmarkFunction fn;
+};
+
+static std::vector<Benchmark> &Benchmarks() {
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+void Register(std::string name, BenchmarkFunction fn) {
+    Benchmarks().push_back({ name, fn });
+}
+
+std::string LoadFixture(std::string name) {
+    std::ifstream in(std::string(OCTOPRINTCONTROL_BENCH_FIXTURES) + "/" + name, std::ios::binary);
+    if (!in.good()) throw std::runtime_error(fmt::format("Couldn't open fixture {}", name));
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+void State::Start() {
+    this->allocs = alloc_count;
+    this->alloc_bytes = ::alloc_bytes;
+    this->start = std::chrono::steady_clock::now();
+}
+
+void State::Stop() {
+    this->elapsed = std::chrono::steady_clock::now() - this->start;
+    this->allocs = alloc_count - this->allocs;
+    this->alloc_bytes = ::alloc_bytes - this->alloc_bytes;
+}
+
+struct Sample {
+    double ns_per_op;
+    double allocs_per_op;
+    double alloc_bytes_per_op;
+};
+
+static Sample RunSample(Benchmark &b, State &state) {
+    state.done = 0;
+    b.fn(state);
+    if (state.done <= state.iterations) throw std::runtime_error(fmt::format("{} didn't run its loop to completion", b.name));
+
+    std::chrono::duration<double, std::nano> elapsed = state.elapsed;
+    return Sample{
+        .ns_per_op = elapsed.count() / state.iterations,
+        .allocs_per_op = (double)state.allocs / state.iterations,
+        .alloc_bytes_per_op = (double)state.alloc_bytes / state.iterations
+    };
+}
+
+static void RunBenchmark(Benchmark &b, size_t samples, double sample_ms) {
+    State state;
+
+    // grow the iteration count until one sample takes long enough to time reliably
+    Sample s = RunSample(b, state);
+    while (s.ns_per_op * state.iterations < sample_ms * 1e6 / 10 && state.iterations < 1000000000) {
+        state.iterations *= 10;
+        s = RunSample(b, state);
+    }
+    state.iterations = std::max<size_t>(1, (size_t)(sample_ms * 1e6 / s.ns_per_op));
+
+    // warm up at the final size, then measure
+    RunSample(b, state);
+
+    std::vector<Sample> results;
+    for (size_t i=0;i<samples;i++) results.push_back(RunSample(b, state));
+
+    std::sort(results.begin(), results.end(), [](const Sample &a, const Sample &b) { return a.ns_per_op < b.ns_per_op; });
+    double median = results[results.size() / 2].ns_per_op;
+
+    // median absolute deviation, as a percentage, is what to watch for noisy runs
+    std::vector<double> dev;
+    for (Sample &r : results) dev.push_back(std::abs(r.ns_per_op - median));
+    std::sort(dev.begin(), dev.end());
+    double mad = dev[dev.size() / 2] / median * 100.0;
+
+    std::string throughput = "-";
+    if (state.bytes) throughput = fmt::format("{:.1f}", state.bytes / median * 1e9 / (1024 * 1024));
+
+    fmt::print("{:<44} {:>12.1f} {:>12.1f} {:>6.1f}% {:>10} {:>10.1f} {:>12.0f}\n",
+        b.name, median, results.front().ns_per_op, mad, throughput, results.front().allocs_per_op, results.front().alloc_bytes_per_op);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    std::string filter;
+    size_t samples = 15;
+    double sample_ms = 50;
+
+    for (int i=1;i<argc;i++) {
+        std::string arg = argv[i];
+        if (arg=="--samples" && i + 1 < argc) samples = std::stoul(argv[++i]);
+        else if (arg=="--sample-ms" && i + 1 < argc) sample_ms = std::stod(argv[++i]);
+        else if (arg=="--help") {
+            fmt::print("Usage: {} [--samples N] [--sample-ms MS] [filter]\n", argv[0]);
+            return 0;
+        } else filter = arg;
+    }
+
+    OctoPrintControl::Log::SetLevels("warn");
+
+    fmt::print("{:<44} {:>12} {:>12} {:>7} {:>10} {:>10} {:>12}\n", "benchmark", "ns/op", "min ns/op", "mad", "MiB/s", "allocs/op", "alloc B/op");
+
+    for (OctoPrintControl::Bench::Benchmark &b : OctoPrintControl::Bench::Benchmarks()) {
+        if (filter.size() && b.name.find(filter)==std::string::npos) continue;
+        OctoPrintControl::Bench::RunBenchmark(b, samples, sample_ms);
+    }
+
+    return 0;
+}
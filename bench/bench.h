@@ -0,0 +1,78 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include <cinttypes>
+#include <chrono>
+
+#include "discord.h"
+#include "octoprint.h"
+#include "printer.h"
+
+namespace OctoPrintControl::Bench {
+
+// Setup goes before the measured loop:
+//     while (state.KeepRunning()) { ...one operation... }
+// only the loop is timed and counted for allocations.
+struct State {
+    size_t iterations = 1;
+
+    bool KeepRunning() {
+        if (this->done==0) this->Start();
+        if (this->done++ < this->iterations) return true;
+        this->Stop();
+        return false;
+    }
+
+    // bytes processed by one operation, for throughput
+    void SetBytesProcessed(size_t bytes) { this->bytes = bytes; }
+
+    size_t bytes = 0;
+
+    void Start();
+    void Stop();
+
+    size_t done = 0;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration elapsed;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+};
+
+typedef std::function<void(State &state)> BenchmarkFunction;
+
+void Register(std::string name, BenchmarkFunction fn);
+
+struct Registration {
+    Registration(std::string name, BenchmarkFunction fn) { Register(name, fn); }
+};
+
+#define OCTOPRINTCONTROL_BENCHMARK(fn) static ::OctoPrintControl::Bench::Registration fn##_registration(#fn, fn)
+
+// Reads a file from the fixtures directory.
+std::string LoadFixture(std::string name);
+
+template<typename T>
+inline void DoNotOptimize(T const &value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+// Reaches the private parsing and serialization entry points of the classes
+// being measured.
+struct Access {
+    static void OnWebsocketData(Discord::Socket &socket, std::vector<char> data) { socket.OnWebsocketData(data); }
+    static void ProcessMessageArray(OctoPrint::Socket &socket, std::vector<char> data) { socket.ProcessMessageArray(data); }
+    static void OnSocketCurrent(Printer &printer, std::string msgtype, nlohmann::json data) { printer.OnSocketCurrent(msgtype, data); }
+    static void WriteHeartbeat(std::string &out, int64_t seq) { Discord::Socket::WriteHeartbeat(out, seq); }
+    static void WriteIdentify(Discord::Socket &socket, std::string &out) { socket.WriteIdentify(out); }
+};
+
+}
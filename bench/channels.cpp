@@ -0,0 +1,50 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <fmt/core.h>
+
+#include "octoprintcontrol.h"
+
+// GetChannel's cache. ChannelCacheChurn cycles through more channels than the
+// cache holds so every lookup makes a channel and evicts one, ChannelNew is the
+// channel alone.
+namespace OctoPrintControl::Bench {
+
+static void UseConfig(size_t cache_size) {
+    std::shared_ptr<Config> config(new Config);
+    config->startup.token = "bench";
+    config->channel_cache_size = cache_size;
+    SetConfig(config);
+}
+
+static void ChannelCacheHit(State &state) {
+    UseConfig(256);
+    GetChannel("1000000000000000001");
+
+    while (state.KeepRunning()) DoNotOptimize(GetChannel("1000000000000000001"));
+}
+OCTOPRINTCONTROL_BENCHMARK(ChannelCacheHit);
+
+static void ChannelCacheChurn(State &state) {
+    UseConfig(256);
+    std::vector<std::string> ids;
+    for (int i=0;i<1000;i++) ids.push_back(fmt::format("{}", 1000000000000000000ULL + i));
+
+    size_t i = 0;
+    while (state.KeepRunning()) DoNotOptimize(GetChannel(ids[i++ % ids.size()]));
+}
+OCTOPRINTCONTROL_BENCHMARK(ChannelCacheChurn);
+
+static void ChannelNew(State &state) {
+    while (state.KeepRunning()) {
+        std::shared_ptr<Discord::Channel> channel(new Discord::Channel("bench", "1000000000000000001"));
+        DoNotOptimize(channel);
+    }
+}
+OCTOPRINTCONTROL_BENCHMARK(ChannelNew);
+
+}
@@ -0,0 +1,67 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <algorithm>
+#include <fmt/core.h>
+
+#include "imagehash.h"
+
+// ImageHash::Compute with SSE2/NEON averaging against the scalar loop, on the
+// size a JPEG snapshot decodes to at 1/8 scale and on a full 1080p frame. Each
+// one checks that both give the same hash before timing.
+namespace OctoPrintControl::ImageHash::Bench {
+
+using namespace OctoPrintControl::Bench;
+
+// a gradient with a few shapes on it and some sensor noise
+static std::vector<uint8_t> Frame(size_t width, size_t height, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> grey(width * height);
+    for (size_t y=0;y<height;y++) {
+        for (size_t x=0;x<width;x++) {
+            int v = (int)(x * 160 / width) + (int)(y * 60 / height);
+            if ((x / (width / 5) + y / (height / 4)) % 3==0) v += 40;
+            v += (int)(rng() % 7) - 3;
+            grey[y * width + x] = (uint8_t)std::clamp(v, 0, 255);
+        }
+    }
+    return grey;
+}
+
+static void Check(size_t width, size_t height) {
+    std::vector<uint8_t> a = Frame(width, height, 1);
+    std::vector<uint8_t> b = Frame(width, height, 2);
+    Hash simd = Compute(a.data(), width, height, width);
+    Hash scalar = ComputeScalar(a.data(), width, height, width);
+    if (simd.bits!=scalar.bits || simd.mean!=scalar.mean) throw std::runtime_error(fmt::format("ImageHash {}x{}: SIMD and scalar hashes differ", width, height));
+
+    // the same scene with different noise
+    int d = Distance(simd, Compute(b.data(), width, height, width));
+    if (d > 4) throw std::runtime_error(fmt::format("ImageHash {}x{}: same scene is {} bits apart", width, height, d));
+}
+
+static void Run(State &state, size_t width, size_t height, Hash (*compute)(const uint8_t*, size_t, size_t, size_t)) {
+    Check(width, height);
+    std::vector<uint8_t> grey = Frame(width, height, 1);
+
+    state.SetBytesProcessed(grey.size());
+    while (state.KeepRunning()) DoNotOptimize(compute(grey.data(), width, height, width));
+}
+
+static void ImageHash80x60Scalar(State &state) { Run(state, 80, 60, ComputeScalar); }
+OCTOPRINTCONTROL_BENCHMARK(ImageHash80x60Scalar);
+
+static void ImageHash80x60(State &state) { Run(state, 80, 60, Compute); }
+OCTOPRINTCONTROL_BENCHMARK(ImageHash80x60);
+
+static void ImageHash1080pScalar(State &state) { Run(state, 1920, 1080, ComputeScalar); }
+OCTOPRINTCONTROL_BENCHMARK(ImageHash1080pScalar);
+
+static void ImageHash1080p(State &state) { Run(state, 1920, 1080, Compute); }
+OCTOPRINTCONTROL_BENCHMARK(ImageHash1080p);
+
+}
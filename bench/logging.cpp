@@ -0,0 +1,147 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <nlohmann/json.hpp>
+#include <spdlog/async.h>
+#include <spdlog/async_logger.h>
+#include <spdlog/sinks/base_sink.h>
+#include <spdlog/sinks/basic_file_sink.h>
+
+#include "discord.h"
+#include "log.h"
+
+// What logging costs the thread that logs. GatewayMessageLog* parse a command
+// message on the gateway socket and log the line App writes for it, compare them
+// with GatewayMessageLogFiltered where the line is below the level. LogLine* is
+// just the line, and LogLineSlowSink* writes to a sink that takes 20us a line,
+// like a terminal that can't keep up.
+namespace OctoPrintControl::Bench {
+
+static const char *pattern = "%Y-%m-%d %H:%M:%S.%e - %n - %^%l%$ - %v";
+
+class SlowSink : public spdlog::sinks::base_sink<std::mutex> {
+protected:
+    void sink_it_(const spdlog::details::log_msg &msg) override {
+        spdlog::memory_buf_t formatted;
+        this->formatter_->format(msg, formatted);
+        DoNotOptimize(formatted);
+        std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+        while (std::chrono::steady_clock::now() < until);
+    }
+    void flush_() override {}
+};
+
+static spdlog::sink_ptr NullSink() {
+    spdlog::sink_ptr sink(new spdlog::sinks::basic_file_sink_mt("/dev/null"));
+    sink->set_pattern(pattern);
+    return sink;
+}
+
+static spdlog::sink_ptr SlowNullSink() {
+    spdlog::sink_ptr sink(new SlowSink);
+    sink->set_pattern(pattern);
+    return sink;
+}
+
+static std::shared_ptr<spdlog::logger> SyncLogger(spdlog::sink_ptr sink) {
+    return std::shared_ptr<spdlog::logger>(new spdlog::logger("Gateway", sink));
+}
+
+// the logger keeps the pool alive until it's done
+struct AsyncLogger {
+    AsyncLogger(spdlog::sink_ptr sink, spdlog::async_overflow_policy policy)
+    :pool(new spdlog::details::thread_pool(Log::Options().queue_size, 1)),
+     logger(new spdlog::async_logger("Gateway", sink, pool, policy)) {}
+
+    std::shared_ptr<spdlog::details::thread_pool> pool;
+    std::shared_ptr<spdlog::logger> logger;
+};
+
+static void GatewayMessageLog(State &state, std::shared_ptr<spdlog::logger> logger) {
+    std::string fixture = LoadFixture("discord_message_create.json");
+    std::vector<char> data(fixture.begin(), fixture.end());
+
+    Log::Logger log(logger, {{"shard", "0"}});
+    Discord::Socket socket("bench");
+    socket.AddEventCallback("MESSAGE_CREATE", [&log](std::string, nlohmann::json d) {
+        nlohmann::json &author = d.at("author");
+        log.info("{}({}) -> {}", author.at("username").get<std::string>(), author.at("id").get<std::string>(), d.at("content").get<std::string>());
+    });
+
+    state.SetBytesProcessed(data.size());
+    while (state.KeepRunning()) Access::OnWebsocketData(socket, data);
+}
+
+static void LogLine(State &state, std::shared_ptr<spdlog::logger> logger) {
+    Log::Logger log(logger, {{"shard", "0"}});
+    std::string author = "printfarmer";
+    std::string id = "290384756102938475";
+    std::string content = "!printer-status ender3";
+
+    while (state.KeepRunning()) log.info("{}({}) -> {}", author, id, content);
+}
+
+static void GatewayMessageLogFiltered(State &state) {
+    std::shared_ptr<spdlog::logger> logger = SyncLogger(NullSink());
+    logger->set_level(spdlog::level::warn);
+    GatewayMessageLog(state, logger);
+}
+OCTOPRINTCONTROL_BENCHMARK(GatewayMessageLogFiltered);
+
+// formatted and written on the calling thread, how every logger used to work
+static void GatewayMessageLogSync(State &state) {
+    GatewayMessageLog(state, SyncLogger(NullSink()));
+}
+OCTOPRINTCONTROL_BENCHMARK(GatewayMessageLogSync);
+
+// Log::Start's default
+static void GatewayMessageLogAsync(State &state) {
+    AsyncLogger async(NullSink(), spdlog::async_overflow_policy::overrun_oldest);
+    GatewayMessageLog(state, async.logger);
+}
+OCTOPRINTCONTROL_BENCHMARK(GatewayMessageLogAsync);
+
+static void LogLineFiltered(State &state) {
+    std::shared_ptr<spdlog::logger> logger = SyncLogger(NullSink());
+    logger->set_level(spdlog::level::warn);
+    LogLine(state, logger);
+}
+OCTOPRINTCONTROL_BENCHMARK(LogLineFiltered);
+
+static void LogLineSync(State &state) {
+    LogLine(state, SyncLogger(NullSink()));
+}
+OCTOPRINTCONTROL_BENCHMARK(LogLineSync);
+
+static void LogLineAsync(State &state) {
+    AsyncLogger async(NullSink(), spdlog::async_overflow_policy::overrun_oldest);
+    LogLine(state, async.logger);
+}
+OCTOPRINTCONTROL_BENCHMARK(LogLineAsync);
+
+static void LogLineSlowSinkSync(State &state) {
+    LogLine(state, SyncLogger(SlowNullSink()));
+}
+OCTOPRINTCONTROL_BENCHMARK(LogLineSlowSinkSync);
+
+// the queue fills and the oldest lines are dropped instead of waiting
+static void LogLineSlowSinkAsync(State &state) {
+    AsyncLogger async(SlowNullSink(), spdlog::async_overflow_policy::overrun_oldest);
+    LogLine(state, async.logger);
+}
+OCTOPRINTCONTROL_BENCHMARK(LogLineSlowSinkAsync);
+
+// the queue fills and every line waits for the writer
+static void LogLineSlowSinkAsyncBlock(State &state) {
+    AsyncLogger async(SlowNullSink(), spdlog::async_overflow_policy::block);
+    LogLine(state, async.logger);
+}
+OCTOPRINTCONTROL_BENCHMARK(LogLineSlowSinkAsyncBlock);
+
+}
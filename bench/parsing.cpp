@@ -0,0 +1,162 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "discord.h"
+#include "octoprint.h"
+#include "printer.h"
+#include "http.h"
+#include "utils.h"
+
+namespace OctoPrintControl::Bench {
+
+static void DiscordSocketOnWebsocketData(State &state) {
+    std::string fixture = LoadFixture("discord_message_create.json");
+    std::vector<char> data(fixture.begin(), fixture.end());
+
+    Discord::Socket socket("bench");
+    size_t events = 0;
+    socket.AddEventCallback("MESSAGE_CREATE", [&events](std::string, nlohmann::json d) { DoNotOptimize(d); events++; });
+
+    state.SetBytesProcessed(data.size());
+    while (state.KeepRunning()) Access::OnWebsocketData(socket, data);
+    DoNotOptimize(events);
+}
+OCTOPRINTCONTROL_BENCHMARK(DiscordSocketOnWebsocketData);
+
+// events nobody subscribed to still have to be parsed
+static void DiscordSocketOnWebsocketDataUnhandled(State &state) {
+    std::string fixture = LoadFixture("discord_typing_start.json");
+    std::vector<char> data(fixture.begin(), fixture.end());
+
+    Discord::Socket socket("bench");
+
+    state.SetBytesProcessed(data.size());
+    while (state.KeepRunning()) Access::OnWebsocketData(socket, data);
+}
+OCTOPRINTCONTROL_BENCHMARK(DiscordSocketOnWebsocketDataUnhandled);
+
+static void OctoPrintSocketProcessMessageArray(State &state) {
+    std::string fixture = LoadFixture("octoprint_current.txt");
+    std::vector<char> data(fixture.begin(), fixture.end());
+
+    OctoPrint::Socket socket("ws://127.0.0.1:1");
+    size_t messages = 0;
+    socket.AddCallback("current", [&messages](std::string, nlohmann::json d) { DoNotOptimize(d); messages++; });
+
+    state.SetBytesProcessed(data.size());
+    while (state.KeepRunning()) Access::ProcessMessageArray(socket, data);
+    DoNotOptimize(messages);
+}
+OCTOPRINTCONTROL_BENCHMARK(OctoPrintSocketProcessMessageArray);
+
+// two frames in one websocket message
+static void OctoPrintSocketProcessMessageArrayEvents(State &state) {
+    std::string fixture = LoadFixture("octoprint_event.txt");
+    std::vector<char> data(fixture.begin(), fixture.end());
+
+    OctoPrint::Socket socket("ws://127.0.0.1:1");
+    size_t messages = 0;
+    socket.AddCallback("event", [&messages](std::string, nlohmann::json d) { DoNotOptimize(d); messages++; });
+    socket.AddCallback("plugin", [&messages](std::string, nlohmann::json d) { DoNotOptimize(d); messages++; });
+
+    state.SetBytesProcessed(data.size());
+    while (state.KeepRunning()) Access::ProcessMessageArray(socket, data);
+    DoNotOptimize(messages);
+}
+OCTOPRINTCONTROL_BENCHMARK(OctoPrintSocketProcessMessageArrayEvents);
+
+static void PrinterOnSocketCurrent(State &state) {
+    std::string fixture = LoadFixture("octoprint_current.txt");
+    nlohmann::json current = nlohmann::json::parse(fixture.substr(1))[0]["current"];
+
+    Printer printer("Bench", "http://127.0.0.1:1", "bench");
+
+    while (state.KeepRunning()) Access::OnSocketCurrent(printer, "current", current);
+    DoNotOptimize(printer.Progress());
+}
+OCTOPRINTCONTROL_BENCHMARK(PrinterOnSocketCurrent);
+
+static std::shared_ptr<Discord::ChannelMessage> StatusMessage(size_t image_size) {
+    std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
+    msg->reference_message = "1239283747568697394";
+
+    std::shared_ptr<Discord::ChannelMessageEmbed> e = Discord::NewChannelMessageEmbed("Ender 3");
+    e->fields.push_back(Discord::NewChannelMessageEmbedField("Status", "Printing", true));
+    e->fields.push_back(Discord::NewChannelMessageEmbedField("File", "benchy_0.2mm_PLA_MK3S_1h29m.gcode", true));
+    e->fields.push_back(Discord::NewChannelMessageEmbedField("Temperatures", "```\nbed    :  59.80° /  60.00°\ntool0  : 214.90° / 215.00°\n```\n"));
+    msg->embeds.push_back(e);
+
+    if (image_size) {
+        msg->attachments.push_back(Discord::NewChannelMessageAttachment("webcam.jpg", "image/jpeg", std::vector<char>(image_size, (char)0x5A)));
+        e->image_url = "attachment://webcam.jpg";
+    }
+
+    return msg;
+}
+
+static void ChannelMessageToMultiPart(State &state) {
+    std::shared_ptr<Discord::ChannelMessage> msg = StatusMessage(0);
+
+    while (state.KeepRunning()) DoNotOptimize(msg->ToMultiPart());
+}
+OCTOPRINTCONTROL_BENCHMARK(ChannelMessageToMultiPart);
+
+// a typical 720p webcam snapshot
+static void ChannelMessageToMultiPartSnapshot(State &state) {
+    std::shared_ptr<Discord::ChannelMessage> msg = StatusMessage(256 * 1024);
+
+    state.SetBytesProcessed(256 * 1024);
+    while (state.KeepRunning()) DoNotOptimize(msg->ToMultiPart());
+}
+OCTOPRINTCONTROL_BENCHMARK(ChannelMessageToMultiPartSnapshot);
+
+// and handed to curl, without sending it
+static void ChannelMessageToMimeSnapshot(State &state) {
+    std::shared_ptr<Discord::ChannelMessage> msg = StatusMessage(256 * 1024);
+    CURL *curl = curl_easy_init();
+
+    state.SetBytesProcessed(256 * 1024);
+    while (state.KeepRunning()) curl_mime_free(msg->ToMultiPart()->ToMime(curl));
+
+    curl_easy_cleanup(curl);
+}
+OCTOPRINTCONTROL_BENCHMARK(ChannelMessageToMimeSnapshot);
+
+static void UtilsTokenize(State &state) {
+    std::string msg = "!printer-status ender3";
+
+    state.SetBytesProcessed(msg.size());
+    while (state.KeepRunning()) DoNotOptimize(Utils::Tokenize(msg));
+}
+OCTOPRINTCONTROL_BENCHMARK(UtilsTokenize);
+
+// every guild message is tokenized, including long chat messages
+static void UtilsTokenizeLong(State &state) {
+    std::string msg;
+    while (msg.size() < 1900) msg += "the quick brown fox jumps over the lazy dog ";
+
+    state.SetBytesProcessed(msg.size());
+    while (state.KeepRunning()) DoNotOptimize(Utils::Tokenize(msg));
+}
+OCTOPRINTCONTROL_BENCHMARK(UtilsTokenizeLong);
+
+// a 1 MiB response delivered in curl's default 16 KiB chunks
+static void HTTPDataWriteCallback(State &state) {
+    std::vector<char> chunk(16 * 1024, 'x');
+    const size_t chunks = 64;
+
+    state.SetBytesProcessed(chunk.size() * chunks);
+    while (state.KeepRunning()) {
+        std::vector<char> body;
+        for (size_t c=0;c<chunks;c++) HTTP::DataWriteCallback(chunk.data(), 1, chunk.size(), &body);
+        DoNotOptimize(body);
+    }
+}
+OCTOPRINTCONTROL_BENCHMARK(HTTPDataWriteCallback);
+
+}
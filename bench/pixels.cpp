@@ -0,0 +1,126 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <fmt/core.h>
+#include <Magick++.h>
+
+#include "octoprint.h"
+#include "pixels.h"
+
+// The snapshot transforms at 720p, 1080p and 4K: the plain loops, the kernels
+// for this cpu, and the Magick::Image operation they replace. The first two are
+// checked for identical bytes before timing.
+namespace OctoPrintControl::Pixels::Bench {
+
+using namespace OctoPrintControl::Bench;
+
+struct Size {
+    const char *name;
+    size_t width;
+    size_t height;
+};
+
+static const Size sizes[] = {
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "4K", 3840, 2160 }
+};
+
+// a gradient with a few shapes on it and some sensor noise, in every channel
+static Image Frame(size_t width, size_t height, size_t channels) {
+    std::mt19937 rng(1);
+    Image img(width, height, channels);
+    for (size_t y=0;y<height;y++) {
+        uint8_t *row = img.Row(y);
+        for (size_t x=0;x<width;x++) {
+            for (size_t c=0;c<channels;c++) {
+                int v = (int)(x * 160 / width) + (int)(y * 60 / height) + (int)c * 20;
+                if ((x / (width / 5) + y / (height / 4)) % 3==0) v += 40;
+                v += (int)(rng() % 7) - 3;
+                row[x * channels + c] = (uint8_t)std::clamp(v, 0, 255);
+            }
+        }
+    }
+    return img;
+}
+
+struct Op {
+    const char *name;
+    size_t channels;
+    std::function<Image(const Image&)> pixels;
+    std::function<void(Magick::Image&)> magick;
+};
+
+static const Op ops[] = {
+    { "FlipH", 3,
+        [](const Image &img) { Image out = img; FlipHorizontal(out); return out; },
+        [](Magick::Image &img) { img.flop(); } },
+    { "Rotate90", 3,
+        [](const Image &img) { return Rotate90(img, false); },
+        [](Magick::Image &img) { img.rotate(-90); } },
+    { "Rotate90Y", 1,
+        [](const Image &img) { return Rotate90(img, false); },
+        [](Magick::Image &img) { img.rotate(-90); } },
+    { "BoxHalf", 3,
+        [](const Image &img) { return Downscale(img, img.width / 2, img.height / 2, Filter::Box); },
+        [](Magick::Image &img) { img.scale(Magick::Geometry(img.columns() / 2, img.rows() / 2)); } },
+    { "Bilinear640", 3,
+        [](const Image &img) { return Downscale(img, 640, img.height * 640 / img.width, Filter::Bilinear); },
+        [](Magick::Image &img) { img.resize(Magick::Geometry(640, img.rows() * 640 / img.columns())); } }
+};
+
+static void Check(const Op &op, const Size &size) {
+    Image img = Frame(size.width, size.height, op.channels);
+    SetLevel(Level::Scalar);
+    Image scalar = op.pixels(img);
+    SetLevel(Detected());
+    Image simd = op.pixels(img);
+    if (scalar.data!=simd.data || scalar.width!=simd.width || scalar.height!=simd.height) {
+        throw std::runtime_error(fmt::format("Pixels {} {}: {} and scalar output differ", op.name, size.name, Name(Detected())));
+    }
+}
+
+static void Run(State &state, const Op &op, const Size &size, Level level) {
+    Check(op, size);
+    Image img = Frame(size.width, size.height, op.channels);
+
+    SetLevel(level);
+    state.SetBytesProcessed(img.data.size());
+    while (state.KeepRunning()) DoNotOptimize(op.pixels(img));
+    SetLevel(Detected());
+}
+
+static void RunMagick(State &state, const Op &op, const Size &size) {
+    OctoPrint::WaitForMagick();
+    Image img = Frame(size.width, size.height, op.channels);
+    Magick::Image source = Write(img);
+
+    state.SetBytesProcessed(img.data.size());
+    while (state.KeepRunning()) {
+        Magick::Image copy = source;
+        op.magick(copy);
+        DoNotOptimize(copy);
+    }
+}
+
+// PixelsFlipH1080pScalar, PixelsFlipH1080p and PixelsFlipH1080pMagick for
+// every op and size
+static bool registered = []() {
+    for (const Op &op : ops) {
+        for (const Size &size : sizes) {
+            std::string name = fmt::format("Pixels{}{}", op.name, size.name);
+            Register(name + "Scalar", [&op, &size](State &state) { Run(state, op, size, Level::Scalar); });
+            Register(name, [&op, &size](State &state) { Run(state, op, size, Detected()); });
+            Register(name + "Magick", [&op, &size](State &state) { RunMagick(state, op, size); });
+        }
+    }
+    return true;
+}();
+
+}
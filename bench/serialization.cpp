@@ -0,0 +1,195 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+#include <fmt/core.h>
+
+#include "discord.h"
+#include "json.h"
+
+// Outgoing payloads written by JSON::Writer, against building the same document
+// with nlohmann::json and dumping it, which is how they used to be made. *Dom is
+// the old way. Each one checks that both give the same bytes before timing.
+namespace OctoPrintControl::Bench {
+
+static std::shared_ptr<Discord::ChannelMessage> StatusMessage() {
+    std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage("Status for \"Ender 3\"");
+    msg->reference_message = "1239283747568697394";
+
+    std::shared_ptr<Discord::ChannelMessageEmbed> e = Discord::NewChannelMessageEmbed("Ender 3", "", 0x00FF00);
+    e->fields.push_back(Discord::NewChannelMessageEmbedField("Status", "Printing", true));
+    e->fields.push_back(Discord::NewChannelMessageEmbedField("File", "benchy_0.2mm_PLA_MK3S_1h29m.gcode", true));
+    e->fields.push_back(Discord::NewChannelMessageEmbedField("Temperatures", "```\nbed    :  59.80° /  60.00°\ntool0  : 214.90° / 215.00°\n```\n"));
+    e->image_url = "attachment://webcam.jpg";
+    msg->embeds.push_back(e);
+
+    msg->attachments.push_back(Discord::NewChannelMessageAttachment("webcam.jpg", "image/jpeg", std::vector<char>(16, (char)0x5A)));
+
+    std::shared_ptr<Discord::ActionRowComponent> row(new Discord::ActionRowComponent);
+    row->AddComponent(std::shared_ptr<Discord::ButtonComponent>(new Discord::ButtonComponent(2, "Pause", "pause:ender3")));
+    row->AddComponent(std::shared_ptr<Discord::ButtonComponent>(new Discord::ButtonComponent(4, "Cancel", "cancel:ender3")));
+    msg->components.push_back(row);
+
+    return msg;
+}
+
+// the payload_json part as ChannelMessage::ToMultiPart used to build it, buttons
+// are the only component it can hold
+static std::string StatusMessageDom(Discord::ChannelMessage &msg) {
+    nlohmann::json payload_data = {
+        { "content", msg.content },
+        { "components", nlohmann::json::array() },
+        { "attachments", nlohmann::json::array() },
+        { "embeds", nlohmann::json::array() }
+    };
+
+    if (msg.reference_message.size() > 0) {
+        payload_data["message_reference"] = {
+            { "message_id", msg.reference_message }
+        };
+    }
+
+    for (size_t c=0;c<msg.components.size();c++) {
+        nlohmann::json buttons = nlohmann::json::array();
+        buttons.push_back({ { "type", 2 }, { "style", 2 }, { "label", "Pause" }, { "custom_id", "pause:ender3" } });
+        buttons.push_back({ { "type", 2 }, { "style", 4 }, { "label", "Cancel" }, { "custom_id", "cancel:ender3" } });
+        payload_data["components"].push_back({ { "type", 1 }, { "components", buttons } });
+    }
+
+    for (size_t i=0;i<msg.attachments.size();i++) {
+        payload_data["attachments"].push_back({
+            { "id", i },
+            { "description", msg.attachments[i]->description },
+            { "filename", msg.attachments[i]->filename }
+        });
+    }
+
+    for (std::shared_ptr<Discord::ChannelMessageEmbed> e : msg.embeds) {
+        nlohmann::json embed = {
+            { "type", "rich" },
+            { "color", e->color }
+        };
+        if (e->title.size()) embed["title"] = e->title;
+        if (e->description.size()) embed["description"] = e->description;
+        if (e->fields.size()) {
+            embed["fields"] = nlohmann::json::array();
+            for (std::shared_ptr<Discord::ChannelMessageEmbedField> f : e->fields) {
+                embed["fields"].push_back({
+                    { "name", f->name },
+                    { "value", f->value },
+                    { "inline", f->isinline }
+                });
+            }
+        }
+        if (e->image_url.size()) embed["image"] = nlohmann::json({ { "url", e->image_url } });
+        payload_data["embeds"].push_back(embed);
+    }
+
+    return payload_data.dump();
+}
+
+static std::string StatusMessageWriter(Discord::ChannelMessage &msg, std::string &out) {
+    out.clear();
+    JSON::Writer json(out);
+    msg.WriteJSON(json);
+    return out;
+}
+
+static std::string HeartbeatDom(int64_t seq) {
+    nlohmann::json msg = {
+        { "op", 1 },
+        { "d", (seq > 0 ? nlohmann::json(seq) : nlohmann::json(nullptr)) }
+    };
+    return msg.dump();
+}
+
+static std::string IdentifyDom(std::string token, int intents, int shard_id, int shard_count) {
+    nlohmann::json msg = {
+        { "op", 2 },
+        { "d", {
+            { "token", token },
+            { "properties", {
+                { "os", "windows" },
+                { "browser", "OctoPrintControl" },
+                { "device", "OctoPrintControl" }
+            }},
+            { "intents", intents },
+            { "shard", { shard_id, shard_count } }
+        }}
+    };
+    return msg.dump();
+}
+
+static void Same(const char *name, const std::string &dom, const std::string &writer) {
+    if (dom!=writer) throw std::runtime_error(fmt::format("{}: writer output differs\n  dom:    {}\n  writer: {}", name, dom, writer));
+}
+
+static void StatusMessagePayloadDom(State &state) {
+    std::shared_ptr<Discord::ChannelMessage> msg = StatusMessage();
+
+    while (state.KeepRunning()) DoNotOptimize(StatusMessageDom(*msg));
+}
+OCTOPRINTCONTROL_BENCHMARK(StatusMessagePayloadDom);
+
+static void StatusMessagePayload(State &state) {
+    std::shared_ptr<Discord::ChannelMessage> msg = StatusMessage();
+    std::string out;
+    Same("StatusMessagePayload", StatusMessageDom(*msg), StatusMessageWriter(*msg, out));
+
+    while (state.KeepRunning()) {
+        out.clear();
+        JSON::Writer json(out);
+        msg->WriteJSON(json);
+        DoNotOptimize(out);
+    }
+}
+OCTOPRINTCONTROL_BENCHMARK(StatusMessagePayload);
+
+static void GatewayHeartbeatDom(State &state) {
+    while (state.KeepRunning()) DoNotOptimize(HeartbeatDom(1234567));
+}
+OCTOPRINTCONTROL_BENCHMARK(GatewayHeartbeatDom);
+
+static void GatewayHeartbeat(State &state) {
+    std::string out;
+    Access::WriteHeartbeat(out, 1234567);
+    Same("GatewayHeartbeat", HeartbeatDom(1234567), out);
+    out.clear();
+    Access::WriteHeartbeat(out, -1);
+    Same("GatewayHeartbeat", HeartbeatDom(-1), out);
+
+    while (state.KeepRunning()) {
+        out.clear();
+        Access::WriteHeartbeat(out, 1234567);
+        DoNotOptimize(out);
+    }
+}
+OCTOPRINTCONTROL_BENCHMARK(GatewayHeartbeat);
+
+static const char *token = "MTIzNDU2Nzg5MDEyMzQ1Njc4.GbEnCh.abcdefghijklmnopqrstuvwxyz0123456789AB";
+
+static void GatewayIdentifyDom(State &state) {
+    while (state.KeepRunning()) DoNotOptimize(IdentifyDom(token, Discord::IntentGuildMessages | Discord::IntentMessageContent, 3, 8));
+}
+OCTOPRINTCONTROL_BENCHMARK(GatewayIdentifyDom);
+
+static void GatewayIdentify(State &state) {
+    Discord::Socket socket(token);
+    socket.Shard(3, 8);
+    std::string out;
+    Access::WriteIdentify(socket, out);
+    Same("GatewayIdentify", IdentifyDom(token, Discord::IntentGuildMessages | Discord::IntentMessageContent, 3, 8), out);
+
+    while (state.KeepRunning()) {
+        out.clear();
+        Access::WriteIdentify(socket, out);
+        DoNotOptimize(out);
+    }
+}
+OCTOPRINTCONTROL_BENCHMARK(GatewayIdentify);
+
+}
@@ -0,0 +1,68 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <random>
+#include <stdexcept>
+#include <fmt/core.h>
+#include <Magick++.h>
+
+#include "octoprint.h"
+#include "pixels.h"
+
+// OctoPrint::EncodeToBudget on a 1280x960 frame with a budget it only meets
+// after all three shrinks. The check first walks budgets down to find one, and
+// fails if any result is over budget while the image it was last scaled to
+// would have fit.
+namespace OctoPrintControl::OctoPrint::Bench {
+
+using namespace OctoPrintControl::Bench;
+
+static const size_t width = 1280;
+static const size_t height = 960;
+
+// noise, so the encoder can't do much with it
+static Magick::Image Frame() {
+    std::mt19937 rng(1);
+    Pixels::Image px(width, height, 3);
+    for (uint8_t &v : px.data) v = (uint8_t)(rng() & 0xFF);
+    return Pixels::Write(px);
+}
+
+static size_t ThreeShrinkBudget(const Magick::Image &frame) {
+    Magick::Image full = frame;
+    full.magick("JPEG");
+    Magick::Blob start;
+    full.write(&start);
+
+    for (size_t budget=start.length() / 2;budget > 1024;budget=budget * 3 / 4) {
+        Magick::Image img = frame;
+        size_t quality;
+        int shrinks;
+        Magick::Blob blob = EncodeToBudget(img, { "jpeg", budget, 0 }, quality, shrinks);
+
+        if (blob.length() > budget) {
+            Magick::Blob again;
+            img.write(&again);
+            if (again.length() <= budget) throw std::runtime_error(fmt::format("EncodeToBudget: {} bytes for a {} byte budget, the last shrink fits in {}", blob.length(), budget, again.length()));
+        } else if (shrinks==3) return budget;
+    }
+    throw std::runtime_error("EncodeToBudget: no budget fit only after three shrinks");
+}
+
+static void SnapshotEncodeThreeShrinks(State &state) {
+    WaitForMagick();
+    Magick::Image frame = Frame();
+    SnapshotEncoding encoding = { "jpeg", ThreeShrinkBudget(frame), 0 };
+
+    state.SetBytesProcessed(width * height * 3);
+    while (state.KeepRunning()) {
+        Magick::Image img = frame;
+        size_t quality;
+        int shrinks;
+        DoNotOptimize(EncodeToBudget(img, encoding, quality, shrinks));
+    }
+}
+OCTOPRINTCONTROL_BENCHMARK(SnapshotEncodeThreeShrinks);
+
+}
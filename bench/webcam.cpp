@@ -0,0 +1,80 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "bench.h"
+#include <string>
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <fmt/core.h>
+
+#include "mjpeg.h"
+
+// MJPEG::Parser finding frames in a webcam stream as mjpg-streamer sends it,
+// fed in the chunk sizes curl hands over. Each one checks that every frame
+// comes out whole before timing.
+namespace OctoPrintControl::MJPEG::Bench {
+
+using namespace OctoPrintControl::Bench;
+
+// Markers as a real frame has them, with a scan of random bytes so the parser
+// sees stuffed 0xFF bytes and restart markers as often as it would.
+static std::string Frame(size_t scan_bytes, unsigned seed) {
+    std::string jpeg("\xFF\xD8\xFF\xE0\x00\x10JFIF\x00\x01\x01\x00\x00\x01\x00\x01\x00\x00", 20);
+    jpeg += "\xFF\xDB";
+    jpeg += std::string("\x00\x43\x00", 3) + std::string(64, '\x10');
+    jpeg += std::string("\xFF\xC0\x00\x0B\x08\x01\xE0\x02\x80\x01\x01\x11\x00", 13);
+    jpeg += std::string("\xFF\xDA\x00\x08\x01\x01\x00\x00\x3F\x00", 10);
+
+    std::mt19937 rng(seed);
+    int restart = 0;
+    for (size_t i=0;i<scan_bytes;i++) {
+        char c = (char)(rng() & 0xFF);
+        jpeg += c;
+        if (c=='\xFF') jpeg += '\x00';
+        if (i % 4096==4095) {
+            jpeg += '\xFF';
+            jpeg += (char)(0xD0 + restart);
+            restart = (restart + 1) % 8;
+        }
+    }
+
+    jpeg += "\xFF\xD9";
+    return jpeg;
+}
+
+static void ParseStream(State &state, size_t chunk) {
+    std::vector<std::string> frames;
+    std::string stream;
+    for (unsigned i=0;i<8;i++) {
+        frames.push_back(Frame(96 * 1024, i));
+        stream += fmt::format("--boundarydonotcross\r\nContent-Type: image/jpeg\r\nContent-Length: {}\r\nX-Timestamp: 1718000000.{:06}\r\n\r\n", frames.back().size(), i);
+        stream += frames.back();
+        stream += "\r\n";
+    }
+
+    size_t found = 0;
+    bool whole = true;
+    Parser parser([&](const char *data, size_t size) {
+        whole = whole && std::string(data, size)==frames[found % frames.size()];
+        found++;
+    });
+    for (size_t i=0;i<stream.size();i+=chunk) parser.Feed(stream.data() + i, std::min(chunk, stream.size() - i));
+    if (found!=frames.size() || !whole) throw std::runtime_error(fmt::format("ParseStream: {} of {} frames found, whole: {}", found, frames.size(), whole));
+
+    // no comparison in the measured loop
+    Parser timed([&found](const char *data, size_t size) { DoNotOptimize(data); found++; });
+    state.SetBytesProcessed(stream.size());
+    while (state.KeepRunning()) {
+        for (size_t i=0;i<stream.size();i+=chunk) timed.Feed(stream.data() + i, std::min(chunk, stream.size() - i));
+    }
+    DoNotOptimize(found);
+}
+
+static void MJPEGParse16K(State &state) { ParseStream(state, 16 * 1024); }
+OCTOPRINTCONTROL_BENCHMARK(MJPEGParse16K);
+
+static void MJPEGParse1K(State &state) { ParseStream(state, 1024); }
+OCTOPRINTCONTROL_BENCHMARK(MJPEGParse1K);
+
+}
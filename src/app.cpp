@@ -3,13 +3,13 @@
 // License: MIT (see LICENSE)
 #include "app.h"
 #include <curl/curl.h>
-#include <spdlog/sinks/stdout_color_sinks.h>
 #include <string>
 #include <chrono>
 #include <thread>
 #include <fstream>
 #include <filesystem>
 #include <fmt/core.h>
+#include <fmt/ranges.h>
 #include <ranges>
 #include <signal.h>
 #include "utils.h"
@@ -19,13 +19,58 @@
 #include "printer.h"
 #include "version.h"
 #include "octoprintcontrol.h"
-
-#include <Magick++.h>
+#include "trace.h"
+#include "io.h"
+#include "timelapse.h"
 
 namespace OctoPrintControl {
 
+// handlers make blocking REST calls, so they run on the workers, one at a time
+// per key to keep them in the order the socket delivered them
+static std::function<void(std::string, nlohmann::json)> OnWorker(std::string key, std::function<void(std::string, nlohmann::json)> cb) {
+    return [key, cb](std::string type, nlohmann::json data) {
+        IO::Submit(key, [cb, type, data]() { cb(type, data); });
+    };
+}
+
+// info, HTTP=warn, Printer=debug
+static std::string LogLevels(const Config &config) {
+    std::string levels = config.log_level;
+    for (auto &[category, level] : config.log_levels) levels += fmt::format(", {}={}", category, level);
+    return levels;
+}
+
 #define BIND_COMMAND(cmd) std::bind(&cmd, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4)
 
+static IO::Task<void> SampleTimelapse(std::shared_ptr<Printer> printer) {
+    try {
+        OctoPrint::WebcamSnapshot snapshot = co_await printer->client->GetWebcamFrameAsync();
+        printer->timelapse->Add(std::move(snapshot.data));
+    } catch (std::runtime_error &err) {
+        Log::Get("App")->debug("Couldn't get a timelapse frame from {}: {}", printer->Name(), err.what());
+    }
+}
+
+// Discord's attachment limit for bots
+static const size_t max_clip_bytes = 10 * 1024 * 1024;
+
+static void PostTimelapse(std::string name, std::string file, Timelapse::Clip clip) {
+    if (clip.data.size() > max_clip_bytes) {
+        Log::Get("App")->warn("Timelapse for {} is {} KiB, too large to upload", name, clip.data.size() / 1024);
+        return;
+    }
+
+    std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
+    std::shared_ptr<Discord::ChannelMessageEmbed> em = Discord::NewChannelMessageEmbed(name, "Timelapse", 0x00FF00);
+    em->fields.push_back(Discord::NewChannelMessageEmbedField("File", file));
+    // videos can't be an embed's image, they show under it
+    if (clip.content_type.starts_with("image/")) em->image_url = "attachment://" + clip.filename;
+    msg->embeds.push_back(em);
+    msg->attachments.push_back(Discord::NewChannelMessageAttachment(clip.filename, clip.content_type, std::move(clip.data)));
+
+    GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
+}
+
 void App::HandleSignal(int signum) {
     switch(signum) {
     case SIGTERM:
@@ -34,19 +79,38 @@ void App::HandleSignal(int signum) {
     case SIGINT:
         this->log->warn("Caught SIGINT, shutting down...");
         break;
+#ifdef SIGUSR1
+    case SIGUSR1:
+        this->dump_trace = true;
+        return;
+#endif
     default:
         return;
     }
     this->running = false;
 }
 
-App::App(int argc, char *argv[]) {
-    spdlog::set_pattern("%Y-%m-%d %H:%M:%S.%e - %n - %^%l%$ - %v");
-    spdlog::set_level(spdlog::level::trace);
-    spdlog::set_default_logger(spdlog::stdout_color_mt("OctoPrintControl"));
+App::App(int argc, char *argv[])
+:start_time(std::chrono::steady_clock::now()) {
+    this->conf_path = std::filesystem::current_path() / "OctoPrintControl.json";
+    if (argc==2) {
+        this->conf_path = argv[1];
+    }
+
+    // logging is set up from the config, so what's wrong with it is logged after
+    std::vector<std::string> warnings;
+    std::shared_ptr<const Config> config;
+    std::string error;
+    try {
+        config = Config::Load(this->conf_path, warnings);
+    } catch (std::runtime_error &err) {
+        error = err.what();
+    }
+
+    Log::Start(config ? config->startup.log : Log::Options());
+    if (config) Log::SetLevels(config->log_level, config->log_levels);
+    this->log = Log::Get("App");
 
-    this->log = spdlog::stdout_color_mt("App");
-    
     this->log->info("===========================================================");
     this->log->info(" OctoPrint Control Init");
     this->log->info("-----------------------------------------------------------");
@@ -56,31 +120,36 @@ App::App(int argc, char *argv[]) {
     this->log->info(" Git Commit: " OCTOPRINTCONTROL_GIT_HASH);
     this->log->info("-----------------------------------------------------------");
 
-    Magick::InitializeMagick(argv[0]);
-
-    std::filesystem::path conf_path = std::filesystem::current_path() / "OctoPrintControl.json";
-    if (argc==2) {
-        conf_path = argv[1];
-    }
-
-    this->log->info("Loading configuration from {}", conf_path.string());
-
-    try {
-        std::ifstream confstream(conf_path);
-        ::OctoPrintControl::config = nlohmann::json::parse(confstream);
-    } catch (nlohmann::json::parse_error &err) {
-        this->log->critical("Couldn't parse config: {}", err.what());
+    this->log->info("Loading configuration from {}", this->conf_path.string());
+    for (std::string &w : warnings) this->log->warn("{}", w);
+    if (!config) {
+        this->log->critical("{}", error);
+        Log::Stop();
         exit(-1);
     }
+    SetConfig(config);
+
+    // slow enough to be worth overlapping with connecting
+    OctoPrint::InitializeMagick(argv[0], [this]() { this->StartupReady("magick"); });
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
 
-    try {
-        ::OctoPrintControl::config.at("token").get_to(this->token);
-    } catch (...) {
-        this->log->error("Config must have a string value for `token`.");
-        exit(-1);
+    if (config->startup.discord_api_url.size()) {
+        this->log->warn("Using Discord API at {}", config->startup.discord_api_url);
+        Discord::SetAPIBaseURL(config->startup.discord_api_url);
+    }
+    if (config->startup.discord_http_version!=HTTP::Version::HTTP1 && !HTTP::HTTP2Available()) {
+        this->log->warn("curl was built without HTTP/2, using HTTP/1.1 for Discord");
+    }
+    Discord::SetHTTPVersion(config->startup.discord_http_version);
+
+    if (config->startup.http_compression) {
+        std::string encodings = HTTP::ContentEncodings();
+        if (encodings.empty()) this->log->warn("curl was built without any content decoders, responses won't be compressed");
+        else this->log->info("Asking for compressed responses: {}", encodings);
     }
+    HTTP::SetDefaultContentDecoding(config->startup.http_compression);
+    HTTP::SetDefaultCacheSize(config->startup.http_cache_size);
 
     ::OctoPrintControl::AddCommand(new Commands::Help);
     ::OctoPrintControl::AddCommand(new Commands::Ping);
@@ -88,120 +157,173 @@ App::App(int argc, char *argv[]) {
     ::OctoPrintControl::AddCommand(new Commands::PowerOn);
     ::OctoPrintControl::AddCommand(new Commands::PowerOff);
     ::OctoPrintControl::AddCommand(new Commands::PrinterStatus);
+    ::OctoPrintControl::AddCommand(new Commands::TraceDump);
 
-    try {
-        ::OctoPrintControl::config.at("updateChannel").get_to(this->update_channel);
-        this->log->info("Update Channel: {}", this->update_channel);
-    } catch (...) {
-        this->log->critical("No updateChannel specified in config.");
-        exit(-1);
-    }
+    this->log->info("Update Channel: {}", config->update_channel);
 
-    try {
-        for (nlohmann::json &id : ::OctoPrintControl::config.at("trustedUsers")) {
-            std::string uid = id.get<std::string>();
-            this->trusted_users.insert(uid);
-        }
+    if (config->trusted_users.size()) {
         this->log->info("Trusted users:");
-        for (std::string uid : this->trusted_users) {
+        for (std::string uid : config->trusted_users) {
             this->log->info("  {}", uid);
         }
-    } catch (...) {
-        this->log->warn("No trusted users specified in config.");
     }
 
-    try {
-        ::OctoPrintControl::config.at("printUpdateFreq").get_to(this->print_update_freq);
-    } catch(...) {
-        this->log->warn("No printUpdateFreq in config, using default.");
-        this->print_update_freq = 600;
-    }
-    this->log->info("Print Update Message Frequency: {} seconds", this->print_update_freq);
+    this->log->info("Message commands: {}, slash commands: {}", config->startup.message_commands ? "on" : "off", config->startup.slash_commands ? "on" : "off");
+    this->log->info("Print Update Message Frequency: {} seconds", config->print_update_freq);
+
+    Trace::Configure(config->startup.trace_sample_rate, config->startup.trace_buffer_size);
+    this->log->info("Command trace sample rate: {:.2f}, buffer: {} events", config->startup.trace_sample_rate, config->startup.trace_buffer_size);
+
+    const Log::Options &log_options = config->startup.log;
+    this->log->info("Log level: {}, queue: {}", LogLevels(*config),
+        log_options.queue_size ? fmt::format("{} messages, {} when full", log_options.queue_size, log_options.block ? "block" : "drop") : "off");
 }
 
 App::~App() {
+    this->config_watcher.reset();
+    this->metrics_server.reset();
+    IO::StopWork();
+    Timelapse::Stop();
     ::OctoPrintControl::gateway.reset();
-    for (auto &[id, printer] : ::OctoPrintControl::printers) printer.reset();
+    for (auto &[id, printer] : *GetPrinters()) printer->Disconnect();
+    SetPrinters(std::shared_ptr<const PrinterMap>(new PrinterMap));
+    IO::Stop();
     this->log->info("-----------------------------------------------------------");
     this->log->info(" Octoprint Control Shutdown");
     this->log->info("===========================================================");
     curl_global_cleanup();
+    Log::Stop();
 }
 
 int App::Run() {
-    if (::OctoPrintControl::config.contains("printers")) {
-        if (!::OctoPrintControl::config.at("printers").is_array()) {
-            this->log->error("`printers` must be an array.");
-            return -1;
+    std::shared_ptr<const Config> config = GetConfig();
+    const Config::Startup &startup = config->startup;
+
+    IO::Start(startup.io_threads, startup.io_pin_threads, startup.worker_threads);
+    this->log->info("I/O threads: {}{}, worker threads: {}", startup.io_threads, startup.io_pin_threads ? " (pinned)" : "", startup.worker_threads);
+    Timelapse::Start();
+
+    this->executor.reset(new Commands::Executor(startup.command_queue_limit, startup.channel_queue_limit));
+    this->log->info("Command queue limit: {}, per channel: {}", startup.command_queue_limit, startup.channel_queue_limit);
+
+    if (startup.metrics_port) {
+        try {
+            this->metrics_server.reset(new Metrics::Server(startup.metrics_address, startup.metrics_port));
+        } catch (std::runtime_error &err) {
+            this->log->error("Couldn't start metrics server: {}", err.what());
         }
+    }
 
+    if (config->printers.size()) {
         this->log->info("Connecting to printers...");
 
-        for (nlohmann::json &pconf : ::OctoPrintControl::config.at("printers")) {
+        std::shared_ptr<PrinterMap> printers(new PrinterMap);
+        for (const PrinterConfig &pconf : config->printers) (*printers)[pconf.id] = this->NewPrinter(pconf);
+        SetPrinters(printers);
+
+        for (auto &[id, p] : *printers) {
             try {
-                std::shared_ptr<Printer> p(new Printer(pconf.at("name"), pconf.at("url"), pconf.at("apiKey")));
-                ::OctoPrintControl::printers[pconf.at("id")] = p;
-                p->socket->AddCallback("event", std::bind(&App::OnPrinterEvent, this, pconf.at("id").get<std::string>(), p, std::placeholders::_1, std::placeholders::_2));
+                p->Connect();
             } catch(std::runtime_error &err) {
-                this->log->error("Error while connecting to {}: {}", pconf.at("name").get<std::string>(), err.what());
+                this->log->error("Error while connecting to {}: {}", p->Name(), err.what());
                 return -1;
-            } catch (...) {
-                this->log->error("Malformed printer config: {}", pconf.dump());
-                continue;
             }
         }
     }
 
-    if (::OctoPrintControl::printers.size()==0) {
+    if (GetPrinters()->size()==0) {
         this->log->error("No printers loaded.");
         return -1;
     }
 
     this->log->info("Connecting to Discord gateway...");
-    ::OctoPrintControl::gateway.reset(new Discord::Socket(this->token));
-    ::OctoPrintControl::gateway->AddEventCallback("READY", std::bind(&App::OnReady, this, std::placeholders::_1, std::placeholders::_2));
-    ::OctoPrintControl::gateway->AddEventCallback("MESSAGE_CREATE", std::bind(&App::OnNewMessage, this, std::placeholders::_1, std::placeholders::_2));
-    ::OctoPrintControl::gateway->AddEventCallback("INTERACTION_CREATE", std::bind(&App::OnNewInteraction, this, std::placeholders::_1, std::placeholders::_2));
+    ::OctoPrintControl::gateway.reset(new Discord::Gateway(startup.token));
+    if (startup.discord_gateway_url.size()) ::OctoPrintControl::gateway->GatewayURL(startup.discord_gateway_url);
+    if (startup.discord_shards) ::OctoPrintControl::gateway->Shards(startup.discord_shards);
+    // resuming skips identify and the READY/GUILD_CREATE replay after a restart
+    ::OctoPrintControl::gateway->SessionFile(startup.discord_session_file);
+    // without message commands the bot doesn't need guild messages or their content
+    if (!startup.message_commands) ::OctoPrintControl::gateway->Intents(0);
+    ::OctoPrintControl::gateway->AddEventCallback("READY", OnWorker("discord", std::bind(&App::OnReady, this, std::placeholders::_1, std::placeholders::_2)));
+    ::OctoPrintControl::gateway->AddEventCallback("MESSAGE_CREATE", OnWorker("discord", std::bind(&App::OnNewMessage, this, std::placeholders::_1, std::placeholders::_2)));
+    ::OctoPrintControl::gateway->AddEventCallback("INTERACTION_CREATE", OnWorker("discord", std::bind(&App::OnNewInteraction, this, std::placeholders::_1, std::placeholders::_2)));
+    ::OctoPrintControl::gateway->Connect();
+
+    try {
+        this->config_watcher.reset(new ConfigWatcher(this->conf_path, [this]() { this->ReloadConfig(); }));
+    } catch (std::runtime_error &err) {
+        this->log->error("Couldn't watch the config for changes: {}", err.what());
+    }
+
+    Metrics::Gauge &log_dropped = Metrics::GetGauge("octoprintcontrol_log_dropped_messages", "Log messages dropped because the queue was full.");
+
+    std::chrono::steady_clock::time_point last_expiry_sweep = std::chrono::steady_clock::now();
 
     this->running = true;
     while(this->running) {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        log_dropped.Set(Log::Dropped());
+
+        if (this->dump_trace) {
+            this->dump_trace = false;
+            this->WriteTrace();
+        }
 
         std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-        for(auto it=::OctoPrintControl::interactions.begin(); it!=::OctoPrintControl::interactions.end();) {
-            if (now > it->second->expires) {
-                it->second->ExpireInteraction();
-                it = ::OctoPrintControl::interactions.erase(it);
-            } else it++;
+        // interactions are only touched on the discord worker
+        if (now - last_expiry_sweep >= std::chrono::seconds(1)) {
+            last_expiry_sweep = now;
+            IO::Submit("discord", []() {
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                for(auto it=::OctoPrintControl::interactions.begin(); it!=::OctoPrintControl::interactions.end();) {
+                    if (now > it->second->expires) {
+                        it->second->ExpireInteraction();
+                        it = ::OctoPrintControl::interactions.erase(it);
+                    } else it++;
+                }
+            });
         }
 
-        for (auto &[id, printer] : ::OctoPrintControl::printers) {
+        std::shared_ptr<const Config> config = GetConfig();
+        for (auto &[id, printer] : *GetPrinters()) {
             if (printer->IsPrinting()) {
+                if (printer->timelapse && printer->timelapse->Due(now)) IO::Spawn(SampleTimelapse(printer));
+
                 if (!this->print_update_times.contains(id)) this->print_update_times[id] = now;
                 std::chrono::duration<double> since_update = now - this->print_update_times[id];
 
-                if (since_update.count() >= this->print_update_freq) {
+                if (since_update.count() >= config->print_update_freq) {
                     this->print_update_times[id] = now;
                     std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
                     std::shared_ptr<Discord::ChannelMessageEmbed> em = Discord::NewChannelMessageEmbed(printer->Name(), fmt::format("Printing Progress: {:.2f}%", printer->Progress()* 100) , 0x00FF00);
                     
                     try {
-                        std::string img_type;
-                        std::vector<char> img_data = printer->client->GetWebcamSnapshot(img_type);
-
-                        std::shared_ptr<Discord::ChannelMessageAttachment> img(new Discord::ChannelMessageAttachment);
-                        img->contentType = img_type;
-                        img->data = img_data;
-                        img->filename = "webcam.jpg";
-                        msg->attachments.push_back(img);
-                        em->image_url = "attachment://webcam.jpg";
+                        OctoPrint::WebcamSnapshot snapshot = printer->client->GetWebcamSnapshot();
+
+                        UpdateDedup &dedup = this->DedupFor(id, printer->Name());
+                        ImageHash::Hash hash = ImageHash::Of(snapshot.data);
+                        int distance = ImageHash::Distance(hash, dedup.hash);
+                        if (config->snapshot_dedup_distance >= 0 && distance <= config->snapshot_dedup_distance) {
+                            // nothing visibly changed, a dark enclosure or a paused print
+                            this->log->debug("Snapshot for {} is {} bits from the last one, leaving it out", printer->Name(), distance);
+                            dedup.skipped->Inc();
+                            dedup.saved_bytes->Inc(snapshot.data.size());
+                            em->description += "\nWebcam unchanged since the last update.";
+                        } else {
+                            dedup.posted->Inc();
+                            dedup.hash = hash;
+
+                            std::shared_ptr<Discord::ChannelMessageAttachment> img = Discord::NewChannelMessageAttachment(snapshot.filename, snapshot.type, std::move(snapshot.data));
+                            msg->attachments.push_back(img);
+                            em->image_url = "attachment://" + img->filename;
+                        }
                     } catch (...) {
                         this->log->warn("Couldn't get webcam snapshot.");
                     }
 
                     msg->embeds.push_back(em);
 
-                    GetChannel(this->update_channel)->CreateMessage(msg);
+                    GetChannel(config->update_channel)->CreateMessage(msg);
                 }
             }
         }
@@ -210,21 +332,201 @@ int App::Run() {
     return 0;
 }
 
+void App::WriteTrace() {
+    std::filesystem::path path = std::filesystem::current_path() / fmt::format("OctoPrintControl-trace-{}.json", time(NULL));
+
+    std::ofstream out(path);
+    out << Trace::DumpChromeTrace();
+
+    if (out.good()) this->log->info("Wrote trace to {}", path.string());
+    else this->log->error("Couldn't write trace to {}", path.string());
+}
+
+std::shared_ptr<Printer> App::NewPrinter(const PrinterConfig &pconf) {
+    std::shared_ptr<Printer> p(new Printer(pconf.name, pconf.url, pconf.api_key));
+    if (pconf.webcam_stream) p->client->UseWebcamStream(std::chrono::seconds(pconf.webcam_stream_idle));
+    if (pconf.snapshot_format.size()) {
+        OctoPrint::SnapshotEncoding encoding;
+        encoding.format = pconf.snapshot_format;
+        encoding.max_bytes = pconf.snapshot_max_kb * 1024;
+        encoding.max_width = pconf.snapshot_max_width;
+        p->client->SetSnapshotEncoding(encoding);
+    }
+    if (pconf.timelapse.size()) {
+        Timelapse::Options options;
+        options.format = pconf.timelapse;
+        options.width = pconf.timelapse_width;
+        options.budget = pconf.timelapse_budget_kb * 1024;
+        options.interval = std::chrono::seconds(pconf.timelapse_interval);
+        p->timelapse.reset(new Timelapse::Recorder(pconf.name, options));
+    }
+    p->AddReadyCallback([this, id = pconf.id]() {
+        bool all;
+        {
+            std::lock_guard<std::mutex> lock(this->startup_mutex);
+            this->printers_ready.insert(id);
+            all = this->printers_ready.size()>=GetPrinters()->size();
+        }
+        if (all) this->StartupReady("printers");
+    });
+    // the socket belongs to the printer, holding the printer here would keep it
+    // connected after it's removed
+    std::weak_ptr<Printer> weak = p;
+    p->socket->AddCallback("event", OnWorker("printer:" + pconf.name, [this, id = pconf.id, weak](std::string type, nlohmann::json data) {
+        if (std::shared_ptr<Printer> printer = weak.lock()) this->OnPrinterEvent(id, printer, type, data);
+    }));
+    return p;
+}
+
+void App::ReloadConfig() {
+    std::shared_ptr<const Config> running = GetConfig();
+    std::shared_ptr<Config> next;
+    std::vector<std::string> warnings;
+    try {
+        next.reset(new Config(*Config::Load(this->conf_path, warnings)));
+    } catch (std::runtime_error &err) {
+        for (std::string &w : warnings) this->log->warn("{}", w);
+        this->log->error("Not reloading the config: {}", err.what());
+        return;
+    }
+    for (std::string &w : warnings) this->log->warn("{}", w);
+
+    if (next->printers.empty()) {
+        this->log->error("Not reloading the config: no printers loaded.");
+        return;
+    }
+
+    this->log->info("Reloading configuration from {}", this->conf_path.string());
+
+    if (!(next->startup==running->startup)) {
+        this->log->warn("Only printers, trustedUsers, printUpdateFreq, updateChannel and the log levels are reloaded, restart for the other changes to take effect.");
+        next->startup = running->startup;
+    }
+
+    std::map<std::string, PrinterConfig> was;
+    for (const PrinterConfig &pconf : running->printers) was[pconf.id] = pconf;
+
+    std::shared_ptr<const PrinterMap> running_printers = GetPrinters();
+    std::shared_ptr<PrinterMap> printers(new PrinterMap);
+    std::vector<std::shared_ptr<Printer>> added;
+    for (const PrinterConfig &pconf : next->printers) {
+        if (was.contains(pconf.id) && was.at(pconf.id)==pconf && running_printers->contains(pconf.id)) {
+            (*printers)[pconf.id] = running_printers->at(pconf.id);
+            continue;
+        }
+
+        this->log->info("{} printer `{}` ({})", was.contains(pconf.id) ? "Reconnecting" : "Adding", pconf.id, pconf.name);
+        (*printers)[pconf.id] = this->NewPrinter(pconf);
+        added.push_back(printers->at(pconf.id));
+    }
+
+    std::vector<std::shared_ptr<Printer>> removed;
+    for (auto &[id, p] : *running_printers) {
+        if (printers->contains(id) && printers->at(id)==p) continue;
+        if (!printers->contains(id)) this->log->info("Removing printer `{}` ({})", id, p->Name());
+        removed.push_back(p);
+    }
+
+    if (next->trusted_users!=running->trusted_users) this->log->info("Trusted users: {}", fmt::join(next->trusted_users, ", "));
+    if (next->print_update_freq!=running->print_update_freq) this->log->info("Print Update Message Frequency: {} seconds", next->print_update_freq);
+    if (next->channel_cache_size!=running->channel_cache_size) this->log->info("Channel cache size: {}", next->channel_cache_size);
+    if (next->update_channel!=running->update_channel) this->log->info("Update Channel: {}", next->update_channel);
+    if (next->log_level!=running->log_level || next->log_levels!=running->log_levels) {
+        Log::SetLevels(next->log_level, next->log_levels);
+        this->log->info("Log level: {}", LogLevels(*next));
+    }
+
+    SetConfig(next);
+    SetPrinters(printers);
+
+    // commands already running keep their printer until they finish
+    for (std::shared_ptr<Printer> &p : removed) p->Disconnect();
+    for (std::shared_ptr<Printer> &p : added) {
+        try {
+            p->Connect();
+        } catch (std::runtime_error &err) {
+            this->log->error("Error while connecting to {}: {}", p->Name(), err.what());
+        }
+    }
+
+    // the printer choices of the slash commands changed
+    if (added.size() || removed.size()) {
+        IO::Submit("discord", [this]() {
+            if (this->slash_commands_registered) this->RegisterApplicationCommands(this->application_id);
+        });
+    }
+}
+
+void App::StartupReady(std::string subsystem) {
+    std::lock_guard<std::mutex> lock(this->startup_mutex);
+    if (!this->startup_pending.erase(subsystem)) return;
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - this->start_time;
+    this->log->info("Startup: {} ready after {:.0f} ms", subsystem, elapsed.count());
+    Metrics::GetGauge("octoprintcontrol_startup_milliseconds", "Time from starting to each subsystem being ready.", {{"subsystem", subsystem}}).Set((int64_t)elapsed.count());
+
+    if (this->startup_pending.empty()) this->log->info("Startup: complete after {:.0f} ms", elapsed.count());
+}
+
+App::UpdateDedup &App::DedupFor(const std::string &id, const std::string &name) {
+    UpdateDedup &dedup = this->update_dedup[id];
+    if (dedup.name==name) return dedup;
+
+    dedup.name = name;
+    dedup.skipped = &Metrics::GetCounter("octoprintcontrol_snapshot_dedup_total", "Progress update snapshots by whether they were left out as unchanged.", {{"printer", name}, {"result", "skipped"}});
+    dedup.posted = &Metrics::GetCounter("octoprintcontrol_snapshot_dedup_total", "Progress update snapshots by whether they were left out as unchanged.", {{"printer", name}, {"result", "posted"}});
+    dedup.saved_bytes = &Metrics::GetCounter("octoprintcontrol_snapshot_dedup_saved_bytes_total", "Snapshot bytes not uploaded because they were unchanged.", {{"printer", name}});
+    return dedup;
+}
+
 void App::OnReady(std::string, nlohmann::json data) {
     this->user_id = data.at("user").at("id").get<std::string>();
+    this->StartupReady("gateway");
+
+    // every shard gets a READY, the first one does the startup work
+    if (data.contains("shard") && data.at("shard").at(0).get<int>()!=0) {
+        this->log->info("Shard {} of {} ready", data.at("shard").at(0).get<int>(), data.at("shard").at(1).get<int>());
+        return;
+    }
+    if (data.value("resumed", false)) this->log->info("Resumed the previous gateway session");
+
+    this->application_id = data.at("application").at("id").get<std::string>();
+    if (GetConfig()->startup.slash_commands && !this->slash_commands_registered) {
+        this->RegisterApplicationCommands(this->application_id);
+    }
 
     std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
     std::shared_ptr<Discord::ChannelMessageEmbed> em = Discord::NewChannelMessageEmbed("OctoPrint Control Startup", "", 0x4B80D6);
     msg->embeds.push_back(em);
     em->fields.push_back(Discord::NewChannelMessageEmbedField("Version", "0.0.1", true));
     std::string printerlist = "";
-    for (auto [name, printer]: ::OctoPrintControl::printers) printerlist += fmt::format("- `{}` ({})\n", name, printer->Name());
+    for (auto &[name, printer]: *GetPrinters()) printerlist += fmt::format("- `{}` ({})\n", name, printer->Name());
     em->fields.push_back(Discord::NewChannelMessageEmbedField("Printers", printerlist));
 
-    GetChannel(this->update_channel)->CreateMessage(msg);
+    GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
+}
+
+void App::RegisterApplicationCommands(std::string application) {
+    nlohmann::json commands = nlohmann::json::array();
+    for (auto &[id, c] : ::OctoPrintControl::commands) commands.push_back(c->ApplicationCommand());
+
+    std::shared_ptr<const Config> config = GetConfig();
+    try {
+        Discord::Application(config->startup.token, application).BulkOverwriteCommands(commands, config->startup.command_guild);
+        this->slash_commands_registered = true;
+        this->log->info("Registered {} slash commands{}", commands.size(), config->startup.command_guild.size() ? " in guild " + config->startup.command_guild : "");
+    } catch (std::runtime_error &err) {
+        this->log->error("{}", err.what());
+    }
+}
+
+static IO::Task<void> ReplyBusy(std::shared_ptr<Commands::Context> ctx) {
+    co_await ctx->Reply(Discord::NewChannelMessage("⏳ I'm busy right now, try again in a moment."));
 }
 
 void App::OnNewMessage(std::string, nlohmann::json data) {
+    std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+
     std::string author_id = data.at("author").at("id").get<std::string>();
 
     if (author_id == this->user_id) return; // we don't care about our own messages
@@ -244,20 +546,105 @@ void App::OnNewMessage(std::string, nlohmann::json data) {
 
     if (::OctoPrintControl::commands.contains(tokens[0].substr(1))) {
         std::string author_name = data.at("author").at("username").get<std::string>();
-        if (!this->trusted_users.contains(author_id)) {
+        if (!GetConfig()->trusted_users.contains(author_id)) {
             GetChannel(channel_id)->AddReaction(message_id, "🚫");
             this->log->warn("UNTRUSTED USER {}({}) attempted to use {}", author_name, author_id, content);
             return;
         }
 
         this->log->info("{}({}) -> {}", author_name, author_id, content);
-        ::OctoPrintControl::commands[tokens[0].substr(1)]->Run(channel_id, message_id, author_id, std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+
+        std::shared_ptr<Commands::Context> ctx(new Commands::MessageContext(channel_id, message_id, author_id));
+        std::string command = tokens[0].substr(1);
+        std::vector<std::string> args(tokens.begin() + 1, tokens.end());
+        bool queued = this->executor->Enqueue(channel_id, [this, ctx, command, args, content, message_id, received]() {
+            return this->RunCommand(ctx, command, args, content, message_id, received);
+        });
+
+        if (!queued) IO::Spawn(ReplyBusy(ctx));
+    }
+}
+
+IO::Task<void> App::OnApplicationCommand(nlohmann::json data, std::chrono::steady_clock::time_point received) {
+    std::string id = data.at("id").get<std::string>();
+    std::string channel_id = data.at("channel_id").get<std::string>();
+    // member is only there for interactions in a guild
+    nlohmann::json author = data.contains("member") ? data.at("member").at("user") : data.at("user");
+    std::string author_id = author.at("id").get<std::string>();
+    std::string author_name = author.at("username").get<std::string>();
+    std::string command = data.at("data").at("name").get<std::string>();
+
+    std::vector<std::string> args;
+    std::string content = "/" + command;
+    if (data.at("data").contains("options")) {
+        for (nlohmann::json &option : data.at("data").at("options")) {
+            nlohmann::json &value = option.at("value");
+            args.push_back(value.is_string() ? value.get<std::string>() : value.dump());
+            content += " " + args.back();
+        }
+    }
+
+    std::shared_ptr<Commands::InteractionContext> ctx(new Commands::InteractionContext(channel_id, author_id, data.at("application_id").get<std::string>(), id, data.at("token").get<std::string>()));
+
+    // Discord only waits 3 seconds for the first response
+    co_await ctx->Defer();
+
+    if (!::OctoPrintControl::commands.contains(command)) {
+        this->log->warn("Got an application command we don't have: {}", command);
+        co_await ctx->Reply(Discord::NewChannelMessage("❗Error: unknown command."));
+        co_return;
+    }
+
+    if (!GetConfig()->trusted_users.contains(author_id)) {
+        this->log->warn("UNTRUSTED USER {}({}) attempted to use {}", author_name, author_id, content);
+        co_await ctx->Reply(Discord::NewChannelMessage("🚫"));
+        co_return;
+    }
+
+    this->log->info("{}({}) -> {}", author_name, author_id, content);
+
+    bool queued = this->executor->Enqueue(channel_id, [this, ctx, command, args, content, id, received]() {
+        return this->RunCommand(ctx, command, args, content, id, received);
+    });
+
+    if (!queued) co_await ReplyBusy(ctx);
+}
+
+IO::Task<void> App::RunCommand(std::shared_ptr<Commands::Context> ctx, std::string command, std::vector<std::string> args, std::string content, std::string id, std::chrono::steady_clock::time_point received) {
+    Trace::Span span("App::RunCommand", "command", true);
+    span.Arg("content", content);
+    if (span.Active()) {
+        // message and interaction ids are snowflakes, the top 42 bits are ms since the Discord epoch (2015)
+        std::chrono::system_clock::time_point sent(std::chrono::milliseconds((std::stoull(id) >> 22) + 1420070400000ULL));
+        std::chrono::system_clock::duration delay = std::chrono::system_clock::now() - sent;
+        if (delay.count() > 0) {
+            Trace::AddCompleteEvent("Gateway delay", "gateway", received - std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay), received);
+        }
+        Trace::AddCompleteEvent("Command queue", "command", received, std::chrono::steady_clock::now());
+    }
+
+    {
+        Trace::Span run_span("BotCommand::Run", "command");
+        if (run_span.Active()) run_span.Name(fmt::format("BotCommand::{}::Run", command));
+        try {
+            co_await ::OctoPrintControl::commands[command]->Run(ctx, args);
+        } catch (std::exception &err) {
+            this->log->error("{} failed: {}", content, err.what());
+        }
     }
+
+    co_await ctx->Finish();
 }
 
 void App::OnNewInteraction(std::string, nlohmann::json data) {
-    if (data.at("type").get<int>()!=3) {
-        this->log->warn("Got an interaction that wasn't from a component.");
+    int type = data.at("type").get<int>();
+    if (type==2) { // APPLICATION_COMMAND
+        IO::Spawn(this->OnApplicationCommand(data, std::chrono::steady_clock::now()));
+        return;
+    }
+
+    if (type!=3) {
+        this->log->warn("Got an interaction that wasn't from a component or command.");
         return;
     }
 
@@ -290,20 +677,18 @@ void App::OnPrinterEvent(std::string printer_id, std::shared_ptr<Printer> printe
         msg->embeds.push_back(em);
 
         try {
-            std::string img_type;
-            std::vector<char> img_data = printer->client->GetWebcamSnapshot(img_type);
+            OctoPrint::WebcamSnapshot snapshot = printer->client->GetWebcamSnapshot();
 
-            std::shared_ptr<Discord::ChannelMessageAttachment> img(new Discord::ChannelMessageAttachment);
-            img->contentType = img_type;
-            img->data = img_data;
-            img->filename = "webcam.jpg";
+            std::shared_ptr<Discord::ChannelMessageAttachment> img = Discord::NewChannelMessageAttachment(snapshot.filename, snapshot.type, std::move(snapshot.data));
             msg->attachments.push_back(img);
-            em->image_url = "attachment://webcam.jpg";
+            em->image_url = "attachment://" + img->filename;
         } catch (...) {
             this->log->warn("Couldn't get webcam snapshot.");
         }
 
-        GetChannel(this->update_channel)->CreateMessage(msg);
+        if (printer->timelapse) printer->timelapse->Clear();
+
+        GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
 
         this->print_update_times[printer_id] = std::chrono::steady_clock::now();
     } else if (event_type=="PrintCancelled") {
@@ -314,20 +699,17 @@ void App::OnPrinterEvent(std::string printer_id, std::shared_ptr<Printer> printe
         msg->embeds.push_back(em);
 
         try {
-            std::string img_type;
-            std::vector<char> img_data = printer->client->GetWebcamSnapshot(img_type);
+            OctoPrint::WebcamSnapshot snapshot = printer->client->GetWebcamSnapshot();
 
-            std::shared_ptr<Discord::ChannelMessageAttachment> img(new Discord::ChannelMessageAttachment);
-            img->contentType = img_type;
-            img->data = img_data;
-            img->filename = "webcam.jpg";
+            std::shared_ptr<Discord::ChannelMessageAttachment> img = Discord::NewChannelMessageAttachment(snapshot.filename, snapshot.type, std::move(snapshot.data));
             msg->attachments.push_back(img);
-            em->image_url = "attachment://webcam.jpg";
+            em->image_url = "attachment://" + img->filename;
         } catch (...) {
             this->log->warn("Couldn't get webacm snapshot");
         }
 
-        GetChannel(this->update_channel)->CreateMessage(msg);
+        GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
+        if (printer->timelapse) printer->timelapse->Clear();
         this->print_update_times.erase(printer_id);
     } else if (event_type=="PrintDone") {
         std::string file = data["payload"]["name"].get<std::string>();
@@ -337,33 +719,32 @@ void App::OnPrinterEvent(std::string printer_id, std::shared_ptr<Printer> printe
         msg->embeds.push_back(em);
 
         try {
-            std::string img_type;
-            std::vector<char> img_data = printer->client->GetWebcamSnapshot(img_type);
+            OctoPrint::WebcamSnapshot snapshot = printer->client->GetWebcamSnapshot();
 
-            std::shared_ptr<Discord::ChannelMessageAttachment> img(new Discord::ChannelMessageAttachment);
-            img->contentType = img_type;
-            img->data = img_data;
-            img->filename = "webcam.jpg";
+            std::shared_ptr<Discord::ChannelMessageAttachment> img = Discord::NewChannelMessageAttachment(snapshot.filename, snapshot.type, std::move(snapshot.data));
             msg->attachments.push_back(img);
-            em->image_url = "attachment://webcam.jpg";
+            em->image_url = "attachment://" + img->filename;
         } catch (...) {
             this->log->warn("Couldn't get webacm snapshot");
         }
 
-        GetChannel(this->update_channel)->CreateMessage(msg);
+        GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
+        if (printer->timelapse) {
+            printer->timelapse->Finish([name = printer->Name(), file](Timelapse::Clip clip) { PostTimelapse(name, file, std::move(clip)); });
+        }
         this->print_update_times.erase(printer_id);
     } else if (event_type=="Connected") {
         std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
         std::shared_ptr<Discord::ChannelMessageEmbed> em = Discord::NewChannelMessageEmbed(printer->Name(), "Connected", 0x00FF00);
         msg->embeds.push_back(em);
 
-        GetChannel(this->update_channel)->CreateMessage(msg);
+        GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
     } else if (event_type=="Disconnected") {
         std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
         std::shared_ptr<Discord::ChannelMessageEmbed> em = Discord::NewChannelMessageEmbed(printer->Name(), "Disconnected", 0xFF0000);
         msg->embeds.push_back(em);
 
-        GetChannel(this->update_channel)->CreateMessage(msg);
+        GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
     } else if (event_type=="plugin_psucontrol_psu_state_changed") {
         bool is_on = data["payload"]["isPSUOn"].get<bool>();
         std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
@@ -373,7 +754,7 @@ void App::OnPrinterEvent(std::string printer_id, std::shared_ptr<Printer> printe
             msg->embeds.push_back(Discord::NewChannelMessageEmbed(printer->Name(), "Power OFF", 0xFFFFFF));
         }
 
-        GetChannel(this->update_channel)->CreateMessage(msg);
+        GetChannel(GetConfig()->update_channel)->CreateMessage(msg);
     }
 }
 
@@ -10,11 +10,18 @@
 #include <map>
 #include <chrono>
 #include <set>
+#include <mutex>
+#include <filesystem>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 
+#include "config.h"
+#include "log.h"
 #include "printer.h"
 #include "discord.h"
+#include "metrics.h"
+#include "imagehash.h"
+#include "command.h"
 
 namespace OctoPrintControl {
 
@@ -27,25 +34,62 @@ public:
     void HandleSignal(int signum);
 
 private:
-    std::string token;
-
     void OnReady(std::string, nlohmann::json data);
     void OnNewMessage(std::string, nlohmann::json data);
     void OnNewInteraction(std::string, nlohmann::json data);
+    IO::Task<void> OnApplicationCommand(nlohmann::json data, std::chrono::steady_clock::time_point received);
+    // queued on the executor, id is the snowflake of the message or interaction
+    IO::Task<void> RunCommand(std::shared_ptr<Commands::Context> ctx, std::string command, std::vector<std::string> args, std::string content, std::string id, std::chrono::steady_clock::time_point received);
+
+    void RegisterApplicationCommands(std::string application);
     void OnPrinterEvent(std::string printer_id, std::shared_ptr<Printer> printer, std::string, nlohmann::json data);
 
-    std::string user_id;
-    std::string update_channel;
+    // not connected yet, so it can be added to the printers first
+    std::shared_ptr<Printer> NewPrinter(const PrinterConfig &pconf);
+    // run on a worker when the config file changes, connections for printers
+    // that didn't change are left alone
+    void ReloadConfig();
 
-    std::set<std::string> trusted_users;
+    std::filesystem::path conf_path;
+    std::shared_ptr<ConfigWatcher> config_watcher;
+
+    std::string user_id;
+    std::string application_id;
 
-    uint64_t print_update_freq;
+    bool slash_commands_registered = false;
 
     bool running = false;
+    bool dump_trace = false;
+
+    void WriteTrace();
+
+    // logs how long a subsystem took to start, once, and then the whole startup
+    // once every subsystem is ready
+    void StartupReady(std::string subsystem);
+    std::chrono::steady_clock::time_point start_time;
+    std::mutex startup_mutex;
+    std::set<std::string> startup_pending = { "magick", "printers", "gateway" };
+    std::set<std::string> printers_ready;
+
+    std::shared_ptr<Log::Logger> log;
+
+    std::shared_ptr<Metrics::Server> metrics_server;
 
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Commands::Executor> executor;
 
     std::map<std::string, std::chrono::steady_clock::time_point> print_update_times;
+    // progress update snapshots of one printer, only used by Run
+    struct UpdateDedup {
+        // of the snapshot last posted
+        ImageHash::Hash hash;
+        // the metrics are labelled with it, and found again if it changes
+        std::string name;
+        Metrics::Counter *skipped = nullptr;
+        Metrics::Counter *posted = nullptr;
+        Metrics::Counter *saved_bytes = nullptr;
+    };
+    UpdateDedup &DedupFor(const std::string &id, const std::string &name);
+    std::map<std::string, UpdateDedup> update_dedup;
 };
 
 
@@ -1,179 +1,339 @@
-#include <spdlog/sinks/stdout_color_sinks.h>
 #include "command.h"
 
 #include "octoprintcontrol.h"
+#include "trace.h"
+#include "io.h"
 
 namespace OctoPrintControl::Commands {
 
-static bool ValidateCommandPrinterArg(std::vector<std::string> args, std::string channel, std::string message) {
+// replies with the problem and returns nullptr if the argument isn't a printer
+static IO::Task<std::shared_ptr<Printer>> CommandPrinterArg(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
     if (args.size()!=1) {
-        std::shared_ptr<Discord::ChannelMessage> msg(new Discord::ChannelMessage);
-        msg->content = "❗Error: you must specify a printer.";
-        msg->reference_message = message;
-        GetChannel(channel)->CreateMessage(msg);
-        return false;
+        co_await ctx->Reply(Discord::NewChannelMessage("❗Error: you must specify a printer."));
+        co_return nullptr;
     }
 
-    if (!::OctoPrintControl::printers.contains(args[0])) {
-        std::shared_ptr<Discord::ChannelMessage> msg(new Discord::ChannelMessage);
-        msg->content = fmt::format("❗Error: `{}` not a recognized printer.", args[0]);
-        msg->reference_message = message;
-        GetChannel(channel)->CreateMessage(msg);
-        return false;
+    std::shared_ptr<Printer> p = ::OctoPrintControl::GetPrinter(args[0]);
+    if (!p) {
+        co_await ctx->Reply(Discord::NewChannelMessage(fmt::format("❗Error: `{}` not a recognized printer.", args[0])));
+        co_return nullptr;
     }
 
+    co_return p;
+}
+
+static IO::Task<void> ReplyError(std::shared_ptr<Context> ctx, std::string what, std::string error) {
+    std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
+    msg->content = what + ":\n```\n";
+    msg->content += error;
+    msg->content += "\n```";
+    co_await ctx->Reply(msg);
+}
+
+static nlohmann::json PrinterOption() {
+    nlohmann::json option = {
+        { "type", 3 }, // string
+        { "name", "printer" },
+        { "description", "The printer, see list-printers." },
+        { "required", true }
+    };
+
+    // Discord allows up to 25 choices, any more and it's typed in
+    std::shared_ptr<const PrinterMap> printers = ::OctoPrintControl::GetPrinters();
+    if (printers->size() <= 25) {
+        option["choices"] = nlohmann::json::array();
+        for (auto &[id, p] : *printers) {
+            option["choices"].push_back({ { "name", p->Name() }, { "value", id } });
+        }
+    }
+
+    return nlohmann::json::array({ option });
+}
+
+MessageContext::MessageContext(std::string channel, std::string message, std::string author)
+:Context(channel, author), message(message) {
+}
+
+IO::Task<void> MessageContext::Reply(std::shared_ptr<Discord::ChannelMessage> msg) {
+    msg->reference_message = this->message;
+    co_await GetChannel(this->channel)->CreateMessageAsync(msg);
+}
+
+IO::Task<void> MessageContext::React(std::string emoji) {
+    co_await GetChannel(this->channel)->AddReactionAsync(this->message, emoji);
+}
+
+IO::Task<void> MessageContext::Typing() {
+    co_await GetChannel(this->channel)->TriggerTypingAsync();
+}
+
+IO::Task<void> MessageContext::Finish() {
+    co_return;
+}
+
+InteractionContext::InteractionContext(std::string channel, std::string author, std::string application, std::string id, std::string token)
+:Context(channel, author), application(application), token(token) {
+    this->interaction.reset(new Discord::Interaction(::OctoPrintControl::GetConfig()->startup.token, id));
+}
+
+IO::Task<void> InteractionContext::Defer() {
+    co_await this->interaction->CreateResponseAsync(this->token, 5); // DEFERRED_CHANNEL_MESSAGE_WITH_SOURCE
+}
+
+IO::Task<void> InteractionContext::Reply(std::shared_ptr<Discord::ChannelMessage> msg) {
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        first = !this->replied;
+        this->replied = true;
+    }
+
+    if (first) co_await this->interaction->EditOriginalResponseAsync(this->application, this->token, msg);
+    else co_await this->interaction->CreateFollowupMessageAsync(this->application, this->token, msg);
+}
+
+IO::Task<void> InteractionContext::React(std::string emoji) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->reaction += emoji;
+    co_return;
+}
+
+IO::Task<void> InteractionContext::Typing() {
+    co_return;
+}
+
+IO::Task<void> InteractionContext::Finish() {
+    std::string content;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->replied) co_return;
+        content = this->reaction.size() ? this->reaction : "❗ The command failed.";
+    }
+
+    co_await this->Reply(Discord::NewChannelMessage(content));
+}
+
+// nullptr if the snapshot couldn't be fetched
+static IO::Task<std::shared_ptr<Discord::ChannelMessageAttachment>> SnapshotAttachment(std::shared_ptr<Printer> p) {
+    try {
+        OctoPrint::WebcamSnapshot snapshot = co_await p->client->GetWebcamSnapshotAsync();
+
+        co_return Discord::NewChannelMessageAttachment(snapshot.filename, snapshot.type, std::move(snapshot.data));
+    } catch (...) {
+        co_return nullptr;
+    }
+}
+
+Executor::Executor(size_t maxQueued, size_t maxPerChannel)
+:maxQueued(maxQueued), maxPerChannel(maxPerChannel) {
+    this->depth = &Metrics::GetGauge("octoprintcontrol_command_queue_depth", "Commands queued or running.");
+    this->rejected = &Metrics::GetCounter("octoprintcontrol_commands_rejected_total", "Commands dropped because the queue was full.");
+
+    this->log = Log::Get("Commands");
+}
+
+bool Executor::Enqueue(std::string channel, std::function<IO::Task<void>()> run) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        std::deque<std::function<IO::Task<void>()>> &q = this->channels[channel];
+        if (this->queued >= this->maxQueued || q.size() >= this->maxPerChannel) {
+            if (q.size()==0) this->channels.erase(channel);
+            this->rejected->Inc();
+            this->log->warn("Command queue full, dropping command in {}.", channel);
+            return false;
+        }
+
+        this->queued++;
+        this->depth->Inc();
+        q.push_back(run);
+        // a command is already running here and will start this one when it's done
+        if (q.size() > 1) return true;
+    }
+
+    IO::Submit("command:" + channel, [this, channel]() { IO::Spawn(this->Drain(channel)); });
     return true;
 }
 
+IO::Task<void> Executor::Drain(std::string channel) {
+    while (true) {
+        std::function<IO::Task<void>()> run;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            run = this->channels[channel].front();
+        }
+
+        try {
+            co_await run();
+        } catch (std::exception &err) {
+            this->log->error("Command in {} failed: {}", channel, err.what());
+        }
+
+        bool done = false;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            std::deque<std::function<IO::Task<void>()>> &q = this->channels[channel];
+            q.pop_front();
+            this->queued--;
+            this->depth->Dec();
+            if (q.size()==0) {
+                this->channels.erase(channel);
+                done = true;
+            }
+        }
+        if (done) co_return;
+    }
+}
+
 void BotCommand::SetupLogger() {
-    this->log = spdlog::get(fmt::format("BotCommand::{}", this->Id()));
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt(fmt::format("BotCommand::{}", this->Id()));
+    this->log = Log::Get("Commands", {{"command", this->Id()}});
 }
 
-void Help::Run(std::string channel, std::string message, std::string author, std::vector<std::string> args) {
+nlohmann::json BotCommand::ApplicationCommand() {
+    // Discord limits descriptions to 100 characters
+    std::string description = this->Description();
+    if (description.size() > 100) description = description.substr(0, 97) + "...";
+
+    return {
+        { "type", 1 }, // CHAT_INPUT
+        { "name", this->Id() },
+        { "description", description },
+        { "options", this->Options() }
+    };
+}
+
+IO::Task<void> Help::Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
     std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-    msg->reference_message = message;
     msg->content = "Available commands:\n";
     for (auto [id, c] : commands) {
         msg->content += fmt::format("- `!{}` : {}\n", id, c->Description());
     }
 
-    GetChannel(channel)->CreateMessage(msg);
+    co_await ctx->Reply(msg);
 }
 
-void Ping::Run(std::string channel, std::string message, std::string author, std::vector<std::string> args) {
-    std::shared_ptr<Discord::Channel> c = GetChannel(channel);
-
-    c->AddReaction(message, "🏓");
-
+IO::Task<void> Ping::Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
     std::chrono::duration<double, std::milli> ping = gateway->GatewayLatency();
     std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-    msg->reference_message = message;
     msg->content = fmt::format("Pong!\nGateway latency: {:.2f} ms", ping.count());
-    c->CreateMessage(msg);
+
+    co_await IO::WhenAll(ctx->React("🏓"), ctx->Reply(msg));
 }
 
-void ListPrinters::Run(std::string channel, std::string message, std::string author, std::vector<std::string> args) {
+IO::Task<void> ListPrinters::Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
     std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
     msg->content = "I know about the following printers:\n";
-    for (std::string p : std::views::keys(::OctoPrintControl::printers)) {
-        msg->content += fmt::format("- `{}` ({}) \n", p, ::OctoPrintControl::printers[p]->Name());
+    for (auto &[id, p] : *::OctoPrintControl::GetPrinters()) {
+        msg->content += fmt::format("- `{}` ({}) \n", id, p->Name());
     }
-    msg->reference_message = message;
-    GetChannel(channel)->CreateMessage(msg);
+    co_await ctx->Reply(msg);
 }
 
-void PowerOn::Run(std::string channel, std::string message, std::string author, std::vector<std::string> args) {
-    if (!ValidateCommandPrinterArg(args, channel, message)) return;
+nlohmann::json PowerOn::Options() {
+    return PrinterOption();
+}
+
+IO::Task<void> PowerOn::Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
+    std::shared_ptr<Printer> p = co_await CommandPrinterArg(ctx, args);
+    if (!p) co_return;
 
     bool isOn = false;
+    std::string error;
     try {
-        isOn = ::OctoPrintControl::printers[args[0]]->IsOn();
+        isOn = co_await p->IsOnAsync();
     } catch (std::runtime_error &err) {
-        std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-        msg->content = "Couldn't get current PSU state:\n```\n";
-        msg->content += err.what();
-        msg->content += "\n```";
-        msg->reference_message = message;
-        GetChannel(channel)->CreateMessage(msg);
-        return;
+        error = err.what();
+    }
+    if (error.size()) {
+        co_await ReplyError(ctx, "Couldn't get current PSU state", error);
+        co_return;
     }
 
     if (isOn) {
-        std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-        msg->content = fmt::format("{} is already on!", ::OctoPrintControl::printers[args[0]]->Name());
-        msg->reference_message = message;
-        GetChannel(channel)->CreateMessage(msg);
-        return;
+        co_await ctx->Reply(Discord::NewChannelMessage(fmt::format("{} is already on!", p->Name())));
+        co_return;
     }
-    
+
     try {
-        std::thread t(&Printer::PowerOn, ::OctoPrintControl::printers[args[0]]);
-        t.detach();
+        co_await p->PowerOnAsync();
     } catch (std::runtime_error &err) {
-        std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-        msg->content = "Couldn't turn PSU on:\n```\n";
-        msg->content += err.what();
-        msg->content += "\n```";
-        msg->reference_message = message;
-        GetChannel(channel)->CreateMessage(msg);
-        return;
+        error = err.what();
+    }
+    if (error.size()) {
+        co_await ReplyError(ctx, "Couldn't turn PSU on", error);
+        co_return;
     }
 
-    GetChannel(channel)->AddReaction(message, "🔌");
+    co_await ctx->React("🔌");
 }
 
-void PowerOff::Run(std::string channel, std::string message, std::string author, std::vector<std::string> args) {
-    if (!ValidateCommandPrinterArg(args, channel, message)) return;
+nlohmann::json PowerOff::Options() {
+    return PrinterOption();
+}
 
-    std::shared_ptr<Printer> p = ::OctoPrintControl::printers[args[0]];
+IO::Task<void> PowerOff::Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
+    std::shared_ptr<Printer> p = co_await CommandPrinterArg(ctx, args);
+    if (!p) co_return;
 
     bool isOn = false;
+    std::string error;
     try {
-        isOn = p->IsOn();
+        isOn = co_await p->IsOnAsync();
     } catch (std::runtime_error &err) {
-        std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-        msg->content = "Couldn't get current PSU state:\n```\n";
-        msg->content += err.what();
-        msg->content += "\n```";
-        msg->reference_message = message;
-        GetChannel(channel)->CreateMessage(msg);
-        return;
+        error = err.what();
+    }
+    if (error.size()) {
+        co_await ReplyError(ctx, "Couldn't get current PSU state", error);
+        co_return;
     }
 
     if (!isOn) {
-        std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-        msg->content = fmt::format("{} is already off!", p->Name());
-        msg->reference_message = message;
-        GetChannel(channel)->CreateMessage(msg);
-        return;
+        co_await ctx->Reply(Discord::NewChannelMessage(fmt::format("{} is already off!", p->Name())));
+        co_return;
     }
 
     std::shared_ptr<Discord::ChannelMessage> msg(new Discord::ChannelMessage);
     msg->content = fmt::format("⚠️ CONFIRM: Power off {}?", args[0]);
-    msg->reference_message = message;
     std::shared_ptr<Discord::ActionRowComponent> row(new Discord::ActionRowComponent);
     row->AddComponent(std::shared_ptr<Discord::ButtonComponent>(new Discord::ButtonComponent(1, "Cancel", "cancel")));
     row->AddComponent(std::shared_ptr<Discord::ButtonComponent>(new Discord::ButtonComponent(4, "Confirm", "confirm")));
 
     msg->components.push_back(row);
 
-    GetChannel(channel)->CreateMessage(msg);
+    co_await ctx->Reply(msg);
 
     if (msg->id.size()==0) {
         this->log->error("Couldn't create message for power off.");
-        return;
+        co_return;
     }
 
-    std::shared_ptr<Interactions::PrinterPowerOffInteraction> pi(new Interactions::PrinterPowerOffInteraction(p, channel, msg->id, message));
+    // slash commands have no message to react to
+    std::shared_ptr<MessageContext> mctx = std::dynamic_pointer_cast<MessageContext>(ctx);
+    std::shared_ptr<Interactions::PrinterPowerOffInteraction> pi(new Interactions::PrinterPowerOffInteraction(p, ctx->channel, msg->id, mctx ? mctx->message : ""));
     pi->expires = std::chrono::steady_clock::now() + std::chrono::seconds(60);
-    ::OctoPrintControl::interactions[msg->id] = pi;
+    // interactions are only touched on the discord worker, in order with the
+    // other gateway events
+    IO::Submit("discord", [pi, id=msg->id]() { ::OctoPrintControl::interactions[id] = pi; });
 }
 
-void PrinterStatus::Run(std::string channel, std::string message, std::string author, std::vector<std::string> args) {
-    if (!ValidateCommandPrinterArg(args, channel, message)) return;
-
-    GetChannel(channel)->TriggerTyping();
+nlohmann::json PrinterStatus::Options() {
+    return PrinterOption();
+}
 
-    std::shared_ptr<Printer> p = ::OctoPrintControl::printers[args[0]];
+IO::Task<void> PrinterStatus::Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
+    std::shared_ptr<Printer> p = co_await CommandPrinterArg(ctx, args);
+    if (!p) co_return;
 
     std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage();
-    msg->reference_message = message;
     std::shared_ptr<Discord::ChannelMessageEmbed> e = Discord::NewChannelMessageEmbed(p->Name());
 
-    try {
-        std::string img_type;
-        std::vector<char> img_data = p->client->GetWebcamSnapshot(img_type);
-
-        std::shared_ptr<Discord::ChannelMessageAttachment> img(new Discord::ChannelMessageAttachment);
-        img->contentType = img_type;
-        img->data = img_data;
-        img->filename = "webcam.jpg";
+    // the typing indicator and the snapshot don't depend on each other
+    auto [typing, img] = co_await IO::WhenAll(ctx->Typing(), SnapshotAttachment(p));
+    if (img) {
         msg->attachments.push_back(img);
-        e->image_url = "attachment://webcam.jpg";
-    } catch (...) {
+        e->image_url = "attachment://" + img->filename;
+    } else {
         this->log->warn("Couldn't get webacm snapshot");
-    }    
+    }
 
     e->fields.push_back(Discord::NewChannelMessageEmbedField("Status", p->StatusText(), true));
     if (p->IsConnected()) {
@@ -191,7 +351,17 @@ void PrinterStatus::Run(std::string channel, std::string message, std::string au
     }
     msg->embeds.push_back(e);
 
-    GetChannel(channel)->CreateMessage(msg);
+    co_await ctx->Reply(msg);
+}
+
+IO::Task<void> TraceDump::Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) {
+    std::string trace = Trace::DumpChromeTrace();
+
+    std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage("Recent command traces, open in chrome://tracing or https://ui.perfetto.dev");
+
+    msg->attachments.push_back(Discord::NewChannelMessageAttachment("trace.json", "application/json", std::vector<char>(trace.begin(), trace.end())));
+
+    co_await ctx->Reply(msg);
 }
 
 }
\ No newline at end of file
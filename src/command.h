@@ -5,23 +5,122 @@
 #include <spdlog/spdlog.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <nlohmann/json.hpp>
+
+#include "task.h"
+#include "log.h"
+#include "metrics.h"
+#include "discord.h"
 
 namespace OctoPrintControl::Commands {
 
+// Where a command came from and how to answer it.
+class Context {
+public:
+    Context(std::string channel, std::string author) :channel(channel), author(author) {}
+    virtual ~Context() {}
+
+    std::string channel;
+    std::string author;
+
+    // msg->id is set once it has been sent
+    virtual IO::Task<void> Reply(std::shared_ptr<Discord::ChannelMessage> msg) = 0;
+    // acknowledges the command without a reply
+    virtual IO::Task<void> React(std::string emoji) = 0;
+    // shows that a reply is on its way
+    virtual IO::Task<void> Typing() = 0;
+    // called after the command has run, even if it failed
+    virtual IO::Task<void> Finish() = 0;
+};
+
+// A `!command` message, replies reference it.
+class MessageContext : public Context {
+public:
+    MessageContext(std::string channel, std::string message, std::string author);
+
+    IO::Task<void> Reply(std::shared_ptr<Discord::ChannelMessage> msg);
+    IO::Task<void> React(std::string emoji);
+    IO::Task<void> Typing();
+    IO::Task<void> Finish();
+
+    std::string message;
+};
+
+// An application (slash) command. Defer is sent before the command is queued,
+// the first reply then replaces Discord's "thinking..." message.
+class InteractionContext : public Context {
+public:
+    InteractionContext(std::string channel, std::string author, std::string application, std::string id, std::string token);
+
+    IO::Task<void> Defer();
+
+    IO::Task<void> Reply(std::shared_ptr<Discord::ChannelMessage> msg);
+    // there's no message to react to, the emoji is the reply if nothing else is sent
+    IO::Task<void> React(std::string emoji);
+    IO::Task<void> Typing();
+    IO::Task<void> Finish();
+
+private:
+    std::string application;
+    std::string token;
+    std::shared_ptr<Discord::Interaction> interaction;
+
+    std::mutex mutex;
+    bool replied = false;
+    std::string reaction;
+};
+
 class BotCommand {
 public:
     virtual ~BotCommand() {}
 
     virtual std::string Id() = 0;
     virtual std::string Description() = 0;
-    virtual void Run(std::string channel, std::string message, std::string author, std::vector<std::string> args) = 0;
+    // application command options, https://discord.com/developers/docs/interactions/application-commands
+    virtual nlohmann::json Options() { return nlohmann::json::array(); }
+    // commands are coroutines so they can wait on requests without holding a thread
+    virtual IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args) = 0;
+
+    // this command for registering with Discord
+    nlohmann::json ApplicationCommand();
 
 protected:
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Log::Logger> log;
 
     void SetupLogger();
 };
 
+// Runs commands on the worker pool. Commands in a channel run one at a time in
+// the order they were queued, different channels run in parallel.
+class Executor {
+public:
+    // limits on commands queued or running, in total and per channel
+    Executor(size_t maxQueued, size_t maxPerChannel);
+
+    // false if a limit was hit and the command was dropped
+    bool Enqueue(std::string channel, std::function<IO::Task<void>()> run);
+
+private:
+    IO::Task<void> Drain(std::string channel);
+
+    std::shared_ptr<Log::Logger> log;
+
+    size_t maxQueued;
+    size_t maxPerChannel;
+
+    std::mutex mutex;
+    size_t queued = 0;
+    // the front of each queue is the running command
+    std::map<std::string, std::deque<std::function<IO::Task<void>()>>> channels;
+
+    Metrics::Gauge *depth;
+    Metrics::Counter *rejected;
+};
+
 class Help : public BotCommand {
 public:
     Help() { this->SetupLogger(); }
@@ -29,7 +128,7 @@ public:
     std::string Id() { return "help"; }
     std::string Description() { return "Lists available OctoPrintControl commands."; }
 
-    void Run(std::string channel, std::string message, std::string author, std::vector<std::string> args);
+    IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args);
 };
 
 class Ping : public BotCommand {
@@ -39,7 +138,7 @@ public:
     std::string Id() { return "ping"; }
     std::string Description() { return "A command to test that the bot application is running. It will also return some version and connection info."; }
 
-    void Run(std::string channel, std::string message, std::string author, std::vector<std::string> args);
+    IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args);
 };
 
 class ListPrinters : public BotCommand {
@@ -49,7 +148,7 @@ public:
     std::string Id() { return "list-printers"; }
     std::string Description() { return "Returns a list of printers this bot can interact with and monitor."; }
 
-    void Run(std::string channel, std::string message, std::string author, std::vector<std::string> args);
+    IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args);
 };
 
 class PowerOn : public BotCommand {
@@ -59,7 +158,8 @@ public:
     std::string Id() { return "power-on"; }
     std::string Description() { return "Power on a printer using the PSU Control plugin."; }
 
-    void Run(std::string channel, std::string message, std::string author, std::vector<std::string> args);
+    nlohmann::json Options();
+    IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args);
 };
 
 class PowerOff : public BotCommand {
@@ -69,7 +169,8 @@ public:
     std::string Id() { return "power-off"; }
     std::string Description() { return "Power off a printer using the PSU Control plugin."; }
 
-    void Run(std::string channel, std::string message, std::string author, std::vector<std::string> args);
+    nlohmann::json Options();
+    IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args);
 };
 
 class PrinterStatus : public BotCommand {
@@ -79,7 +180,18 @@ public:
     std::string Id() { return "printer-status"; }
     std::string Description() { return "Display current printer status and webcam view."; }
 
-    void Run(std::string channel, std::string message, std::string author, std::vector<std::string> args);
+    nlohmann::json Options();
+    IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args);
+};
+
+class TraceDump : public BotCommand {
+public:
+    TraceDump() { this->SetupLogger(); }
+
+    std::string Id() { return "trace-dump"; }
+    std::string Description() { return "Upload recent command traces as a Chrome trace_event JSON file."; }
+
+    IO::Task<void> Run(std::shared_ptr<Context> ctx, std::vector<std::string> args);
 };
 
 }
\ No newline at end of file
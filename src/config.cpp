@@ -0,0 +1,323 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "config.h"
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fmt/core.h>
+#include <fmt/ranges.h>
+#include <nlohmann/json.hpp>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace OctoPrintControl {
+
+std::shared_ptr<const Config> Config::Load(std::filesystem::path path, std::vector<std::string> &warnings) {
+    std::ifstream confstream(path);
+    if (!confstream) throw std::runtime_error(fmt::format("Couldn't open {}", path.string()));
+
+    nlohmann::json conf;
+    try {
+        conf = nlohmann::json::parse(confstream);
+    } catch (nlohmann::json::parse_error &err) {
+        throw std::runtime_error(fmt::format("Couldn't parse config: {}", err.what()));
+    }
+
+    std::shared_ptr<Config> c(new Config);
+
+    try {
+        conf.at("token").get_to(c->startup.token);
+    } catch (...) {
+        throw std::runtime_error("Config must have a string value for `token`.");
+    }
+
+    try {
+        conf.at("updateChannel").get_to(c->update_channel);
+    } catch (...) {
+        throw std::runtime_error("No updateChannel specified in config.");
+    }
+
+    try {
+        for (nlohmann::json &id : conf.at("trustedUsers")) c->trusted_users.insert(id.get<std::string>());
+    } catch (...) {
+        warnings.push_back("No trusted users specified in config.");
+    }
+
+    try {
+        conf.at("printUpdateFreq").get_to(c->print_update_freq);
+    } catch (...) {
+        warnings.push_back("No printUpdateFreq in config, using default.");
+        c->print_update_freq = 600;
+    }
+
+    try {
+        if (conf.contains("snapshotDedupDistance")) conf.at("snapshotDedupDistance").get_to(c->snapshot_dedup_distance);
+    } catch (...) {
+        warnings.push_back("snapshotDedupDistance must be a number, using the default.");
+        c->snapshot_dedup_distance = 4;
+    }
+
+    try {
+        if (conf.contains("channelCacheSize")) conf.at("channelCacheSize").get_to(c->channel_cache_size);
+    } catch (...) {
+        warnings.push_back("channelCacheSize must be a number, using the default.");
+        c->channel_cache_size = 256;
+    }
+
+    if (conf.contains("printers")) {
+        if (!conf.at("printers").is_array()) throw std::runtime_error("`printers` must be an array.");
+
+        std::set<std::string> ids;
+        for (nlohmann::json &pconf : conf.at("printers")) {
+            PrinterConfig p;
+            try {
+                pconf.at("id").get_to(p.id);
+                pconf.at("name").get_to(p.name);
+                pconf.at("url").get_to(p.url);
+                pconf.at("apiKey").get_to(p.api_key);
+            } catch (...) {
+                warnings.push_back(fmt::format("Malformed printer config: {}", pconf.dump()));
+                continue;
+            }
+            try {
+                if (pconf.contains("webcamStream")) pconf.at("webcamStream").get_to(p.webcam_stream);
+                if (pconf.contains("webcamStreamIdleSeconds")) pconf.at("webcamStreamIdleSeconds").get_to(p.webcam_stream_idle);
+            } catch (...) {
+                p.webcam_stream = false;
+                p.webcam_stream_idle = 60;
+                warnings.push_back(fmt::format("webcamStream must be a boolean and webcamStreamIdleSeconds a number for {}, using defaults.", p.name));
+            }
+            try {
+                if (pconf.contains("snapshotFormat")) pconf.at("snapshotFormat").get_to(p.snapshot_format);
+                if (pconf.contains("snapshotMaxKB")) pconf.at("snapshotMaxKB").get_to(p.snapshot_max_kb);
+                if (pconf.contains("snapshotMaxWidth")) pconf.at("snapshotMaxWidth").get_to(p.snapshot_max_width);
+                if (p.snapshot_format.size() && p.snapshot_format!="jpeg" && p.snapshot_format!="webp" && p.snapshot_format!="avif") throw std::runtime_error("format");
+            } catch (...) {
+                p.snapshot_format.clear();
+                p.snapshot_max_kb = 0;
+                p.snapshot_max_width = 0;
+                warnings.push_back(fmt::format("snapshotFormat must be \"jpeg\", \"webp\" or \"avif\" and snapshotMaxKB and snapshotMaxWidth numbers for {}, snapshots are uploaded as they are.", p.name));
+            }
+            try {
+                if (pconf.contains("timelapse")) pconf.at("timelapse").get_to(p.timelapse);
+                if (pconf.contains("timelapseIntervalSeconds")) pconf.at("timelapseIntervalSeconds").get_to(p.timelapse_interval);
+                if (pconf.contains("timelapseWidth")) pconf.at("timelapseWidth").get_to(p.timelapse_width);
+                if (pconf.contains("timelapseBudgetKB")) pconf.at("timelapseBudgetKB").get_to(p.timelapse_budget_kb);
+                if (p.timelapse.size() && p.timelapse!="gif" && p.timelapse!="webp" && p.timelapse!="mp4") throw std::runtime_error("format");
+                if (!p.timelapse_interval || !p.timelapse_width || !p.timelapse_budget_kb) throw std::runtime_error("zero");
+            } catch (...) {
+                p.timelapse.clear();
+                warnings.push_back(fmt::format("timelapse must be \"gif\", \"webp\" or \"mp4\" and timelapseIntervalSeconds, timelapseWidth and timelapseBudgetKB positive numbers for {}, no timelapse.", p.name));
+            }
+            if (!ids.insert(p.id).second) {
+                warnings.push_back(fmt::format("Printer id `{}` is used more than once, skipping {}", p.id, p.name));
+                continue;
+            }
+            c->printers.push_back(p);
+        }
+    }
+
+    try {
+        if (conf.contains("logLevel")) conf.at("logLevel").get_to(c->log_level);
+        if (conf.contains("logLevels")) conf.at("logLevels").get_to(c->log_levels);
+    } catch (...) {
+        warnings.push_back("logLevel must be a string and logLevels an object of strings, using defaults.");
+    }
+    // spdlog takes anything it doesn't know as off
+    if (spdlog::level::from_str(c->log_level)==spdlog::level::off && c->log_level!="off") {
+        warnings.push_back(fmt::format("Unknown logLevel `{}`, using info.", c->log_level));
+        c->log_level = "info";
+    }
+    for (auto it=c->log_levels.begin(); it!=c->log_levels.end();) {
+        const std::vector<std::string> &categories = Log::Categories();
+        if (std::find(categories.begin(), categories.end(), it->first)==categories.end()) {
+            warnings.push_back(fmt::format("Unknown log category `{}` in logLevels, the categories are {}.", it->first, fmt::join(categories, ", ")));
+            it = c->log_levels.erase(it);
+        } else if (spdlog::level::from_str(it->second)==spdlog::level::off && it->second!="off") {
+            warnings.push_back(fmt::format("Unknown level `{}` for {} in logLevels.", it->second, it->first));
+            it = c->log_levels.erase(it);
+        } else it++;
+    }
+
+    Config::Startup &s = c->startup;
+
+    try {
+        std::string full = "drop";
+        if (conf.contains("logQueueSize")) conf.at("logQueueSize").get_to(s.log.queue_size);
+        if (conf.contains("logQueueFull")) conf.at("logQueueFull").get_to(full);
+        if (full!="drop" && full!="block") throw std::runtime_error(full);
+        s.log.block = full=="block";
+    } catch (...) {
+        warnings.push_back("logQueueSize must be a number and logQueueFull \"drop\" or \"block\", using defaults.");
+        s.log = Log::Options();
+    }
+
+    try {
+        if (conf.contains("discordApiUrl")) conf.at("discordApiUrl").get_to(s.discord_api_url);
+        if (conf.contains("discordGatewayUrl")) conf.at("discordGatewayUrl").get_to(s.discord_gateway_url);
+    } catch (...) {
+        warnings.push_back("discordApiUrl and discordGatewayUrl must be strings, using defaults.");
+    }
+
+    try {
+        std::string version = "2";
+        if (conf.contains("discordHttpVersion")) conf.at("discordHttpVersion").get_to(version);
+        if (version=="1.1") s.discord_http_version = HTTP::Version::HTTP1;
+        else if (version=="2") s.discord_http_version = HTTP::Version::HTTP2;
+        else if (version=="2-prior-knowledge") s.discord_http_version = HTTP::Version::HTTP2PriorKnowledge;
+        else throw std::runtime_error(version);
+    } catch (...) {
+        warnings.push_back("discordHttpVersion must be \"1.1\", \"2\" or \"2-prior-knowledge\", using 2.");
+        s.discord_http_version = HTTP::Version::HTTP2;
+    }
+
+    try {
+        if (conf.contains("httpCompression")) conf.at("httpCompression").get_to(s.http_compression);
+        if (conf.contains("httpCacheSize")) conf.at("httpCacheSize").get_to(s.http_cache_size);
+    } catch (...) {
+        warnings.push_back("httpCompression must be a boolean and httpCacheSize a number, using defaults.");
+        s.http_compression = false;
+        s.http_cache_size = 32;
+    }
+
+    try {
+        if (conf.contains("discordShards")) conf.at("discordShards").get_to(s.discord_shards);
+    } catch (...) {
+        warnings.push_back("discordShards must be a number, using the recommended count.");
+    }
+
+    s.discord_session_file = (std::filesystem::current_path() / "OctoPrintControl-session.json").string();
+    try {
+        if (conf.contains("discordSessionFile")) conf.at("discordSessionFile").get_to(s.discord_session_file);
+    } catch (...) {
+        warnings.push_back("discordSessionFile must be a string, using the default.");
+    }
+
+    try {
+        if (conf.contains("messageCommands")) conf.at("messageCommands").get_to(s.message_commands);
+        if (conf.contains("slashCommands")) conf.at("slashCommands").get_to(s.slash_commands);
+        if (conf.contains("commandGuild")) conf.at("commandGuild").get_to(s.command_guild);
+    } catch (...) {
+        warnings.push_back("messageCommands and slashCommands must be booleans and commandGuild a string, using defaults.");
+    }
+
+    try {
+        if (conf.contains("traceSampleRate")) conf.at("traceSampleRate").get_to(s.trace_sample_rate);
+        if (conf.contains("traceBufferSize")) conf.at("traceBufferSize").get_to(s.trace_buffer_size);
+    } catch (...) {
+        warnings.push_back("traceSampleRate and traceBufferSize must be numbers, using defaults.");
+    }
+
+    try {
+        if (conf.contains("ioThreads")) conf.at("ioThreads").get_to(s.io_threads);
+        if (conf.contains("ioPinThreads")) conf.at("ioPinThreads").get_to(s.io_pin_threads);
+        if (conf.contains("workerThreads")) conf.at("workerThreads").get_to(s.worker_threads);
+    } catch (...) {
+        warnings.push_back("ioThreads and workerThreads must be numbers and ioPinThreads a boolean, using defaults.");
+    }
+    if (s.io_threads < 1) s.io_threads = 1;
+    if (s.worker_threads < 1) s.worker_threads = 1;
+
+    try {
+        if (conf.contains("commandQueueLimit")) conf.at("commandQueueLimit").get_to(s.command_queue_limit);
+        if (conf.contains("channelQueueLimit")) conf.at("channelQueueLimit").get_to(s.channel_queue_limit);
+    } catch (...) {
+        warnings.push_back("commandQueueLimit and channelQueueLimit must be numbers, using defaults.");
+    }
+
+    try {
+        if (conf.contains("metricsPort")) conf.at("metricsPort").get_to(s.metrics_port);
+        if (conf.contains("metricsAddress")) conf.at("metricsAddress").get_to(s.metrics_address);
+    } catch (...) {
+        warnings.push_back("`metricsPort` must be a number and `metricsAddress` a string.");
+        s.metrics_port = 0;
+    }
+
+    return c;
+}
+
+// used where inotify isn't available
+static const std::chrono::seconds poll_interval(2);
+// editors often save with a few writes in a row
+static const std::chrono::milliseconds settle_time(250);
+
+ConfigWatcher::ConfigWatcher(std::filesystem::path path, std::function<void()> changed)
+:path(path), changed(changed) {
+    this->log = Log::Get("Config");
+
+    this->reactor = IO::Next();
+    if (!this->reactor) throw std::runtime_error("No IO reactor is running.");
+
+    std::error_code ec;
+    this->last_write = std::filesystem::last_write_time(path, ec);
+
+#ifdef __linux__
+    std::filesystem::path dir = path.parent_path();
+    if (dir.empty()) dir = ".";
+    this->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (this->fd >= 0 && inotify_add_watch(this->fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(this->fd);
+        this->fd = -1;
+    }
+    if (this->fd < 0) this->log->warn("Couldn't watch {} with inotify, checking it every {} seconds instead: {}", dir.string(), poll_interval.count(), strerror(errno));
+#endif
+
+    this->reactor->Invoke([this]() {
+        if (this->fd >= 0) this->reactor->Watch(this->fd, IO::Readable, [this](int) { this->OnEvents(); });
+        else this->poll_timer = this->reactor->After(poll_interval, [this]() { this->Poll(); });
+    });
+    this->log->info("Watching {} for changes", path.string());
+}
+
+ConfigWatcher::~ConfigWatcher() {
+    this->reactor->Invoke([this]() {
+        if (this->fd >= 0) this->reactor->Unwatch(this->fd);
+        this->reactor->Cancel(this->settle_timer);
+        this->reactor->Cancel(this->poll_timer);
+    });
+#ifdef __linux__
+    if (this->fd >= 0) close(this->fd);
+#endif
+}
+
+void ConfigWatcher::OnEvents() {
+#ifdef __linux__
+    alignas(inotify_event) char buf[4096];
+    bool ours = false;
+    ssize_t n;
+    while ((n = read(this->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            inotify_event *ev = (inotify_event*)p;
+            if (ev->len && this->path.filename()==ev->name) ours = true;
+            p += sizeof(inotify_event) + ev->len;
+        }
+    }
+    if (ours) this->Changed();
+#endif
+}
+
+void ConfigWatcher::Poll() {
+    std::error_code ec;
+    std::filesystem::file_time_type write = std::filesystem::last_write_time(this->path, ec);
+    if (!ec && write!=this->last_write) {
+        this->last_write = write;
+        this->Changed();
+    }
+    this->poll_timer = this->reactor->After(poll_interval, [this]() { this->Poll(); });
+}
+
+void ConfigWatcher::Changed() {
+    this->reactor->Cancel(this->settle_timer);
+    this->settle_timer = this->reactor->After(settle_time, [this]() {
+        this->settle_timer = 0;
+        IO::Submit("config", this->changed);
+    });
+}
+
+}
@@ -0,0 +1,130 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <functional>
+#include <filesystem>
+#include <cinttypes>
+#include <spdlog/spdlog.h>
+
+#include "io.h"
+#include "http.h"
+#include "log.h"
+
+namespace OctoPrintControl {
+
+struct PrinterConfig {
+    std::string id;
+    std::string name;
+    std::string url;
+    std::string api_key;
+    // snapshots from the webcam's stream instead of its snapshot url, see
+    // MJPEG::Stream
+    bool webcam_stream = false;
+    uint64_t webcam_stream_idle = 60;
+    // jpeg, webp or avif to re-encode snapshots before they're uploaded, see
+    // OctoPrint::SnapshotEncoding
+    std::string snapshot_format;
+    uint64_t snapshot_max_kb = 0;
+    uint64_t snapshot_max_width = 0;
+    // gif, webp or mp4 clips posted when a print is done, empty for none
+    std::string timelapse;
+    uint64_t timelapse_interval = 30;
+    uint64_t timelapse_width = 480;
+    uint64_t timelapse_budget_kb = 4096;
+
+    bool operator==(const PrinterConfig&) const = default;
+};
+
+// A parsed OctoPrintControl.json. Snapshots are never changed once loaded, a
+// reload parses a new one and swaps it in, see GetConfig.
+struct Config {
+    // applied while running when the file changes
+    std::string update_channel;
+    std::set<std::string> trusted_users;
+    uint64_t print_update_freq = 600;
+    // progress updates leave the snapshot out if it's within this many bits of
+    // the last one posted, see ImageHash. Negative to always post it.
+    int snapshot_dedup_distance = 4;
+    std::vector<PrinterConfig> printers;
+    // Discord channels kept ready for messages, see GetChannel
+    size_t channel_cache_size = 256;
+    // for categories not in log_levels
+    std::string log_level = "info";
+    std::map<std::string, std::string> log_levels;
+
+    // the rest only takes effect on a restart
+    struct Startup {
+        std::string token;
+        std::string discord_api_url;
+        std::string discord_gateway_url;
+        // 0 for Discord's recommended count
+        int discord_shards = 0;
+        std::string discord_session_file;
+        HTTP::Version discord_http_version = HTTP::Version::HTTP2;
+
+        // for every HTTP client, Discord's and the printers'
+        bool http_compression = false;
+        size_t http_cache_size = 32;
+
+        bool message_commands = true;
+        bool slash_commands = true;
+        std::string command_guild;
+
+        double trace_sample_rate = 1.0;
+        size_t trace_buffer_size = 8192;
+
+        int io_threads = 1;
+        bool io_pin_threads = false;
+        size_t worker_threads = 4;
+
+        size_t command_queue_limit = 64;
+        size_t channel_queue_limit = 4;
+
+        // 0 to not serve metrics
+        int metrics_port = 0;
+        std::string metrics_address = "127.0.0.1";
+
+        Log::Options log;
+
+        bool operator==(const Startup&) const = default;
+    } startup;
+
+    // throws std::runtime_error if the file can't be parsed or a required
+    // setting is missing, bad optional settings are left at defaults and added
+    // to warnings, they are loaded before logging is set up
+    static std::shared_ptr<const Config> Load(std::filesystem::path path, std::vector<std::string> &warnings);
+};
+
+// Calls changed on a worker once the file has been written or replaced. The
+// directory is watched since editors usually save by renaming a new file over
+// the old one, a burst of writes is reported once.
+class ConfigWatcher {
+public:
+    ConfigWatcher(std::filesystem::path path, std::function<void()> changed);
+    ~ConfigWatcher();
+
+private:
+    void OnEvents();
+    void Poll();
+    void Changed();
+
+    std::shared_ptr<Log::Logger> log;
+
+    std::filesystem::path path;
+    std::function<void()> changed;
+
+    IO::Reactor *reactor;
+    // inotify, -1 when polling the modification time instead
+    int fd = -1;
+    IO::TimerId settle_timer = 0;
+    IO::TimerId poll_timer = 0;
+    std::filesystem::file_time_type last_write;
+};
+
+}
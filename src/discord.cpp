@@ -6,101 +6,136 @@
 #include <fmt/core.h>
 #include <random>
 #include <chrono>
-#include <spdlog/sinks/stdout_color_sinks.h>
-
-static const char *const BASE_URL = "https://discord.com/api/v10";
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <mutex>
+#include <map>
+#include "metrics.h"
+#include "trace.h"
+
+static std::string base_url = "https://discord.com/api/v10";
+static OctoPrintControl::HTTP::Version http_version = OctoPrintControl::HTTP::Version::HTTP2;
 static const char *const USER_AGENT = "DiscordBot (https://github.com/The-EG/OctoPrintControl, " OCTOPRINTCONTROL_VERSION_MAJOR_S "." OCTOPRINTCONTROL_VERSION_MINOR_S "." OCTOPRINTCONTROL_VERSION_PATCH_S ")";
 
 namespace OctoPrintControl::Discord {
 
+void SetAPIBaseURL(std::string url) {
+    base_url = url;
+}
+
+void SetHTTPVersion(HTTP::Version version) {
+    http_version = version;
+}
+
+// One client for every REST object with the same token, it holds no per
+// request state. Dropped once the last object using it is gone.
+static std::shared_ptr<HTTP::Client> RESTTransport(const std::string &token) {
+    static std::mutex mutex;
+    static std::map<std::pair<std::string, HTTP::Version>, std::weak_ptr<HTTP::Client>> transports;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::weak_ptr<HTTP::Client> &weak = transports[{ token, http_version }];
+    std::shared_ptr<HTTP::Client> client = weak.lock();
+    if (!client) {
+        client.reset(new HTTP::Client(USER_AGENT));
+        client->SetVersion(http_version);
+        client->AddHeader(fmt::format("Authorization: Bot {}", token));
+        weak = client;
+    }
+    return client;
+}
+
 RESTClient::RESTClient(std::string token) 
 :token(token) {
-    this->log = spdlog::get("Discord::RESTClient");
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt("Discord::RESTClient");
-
-    this->client.reset(new HTTP::Client(USER_AGENT));
-    this->client->AddHeader(fmt::format("Authorization: Bot {}", this->token));
+    this->log = Log::Get("Discord");
+    this->client = RESTTransport(this->token);
 }
 
 RESTClient::~RESTClient() {
 }
 
-nlohmann::json ActionRowComponent::ToJSON() {
-    nlohmann::json comps = nlohmann::json::array();
-    for (std::shared_ptr<ChannelMessageComponent> c : this->components) {
-        comps.push_back(c->ToJSON());
-    }
-
-    return {
-        { "type", 1 },
-        { "components", comps }
-    };
+void ActionRowComponent::WriteJSON(JSON::Writer &json) {
+    json.BeginObject();
+    json.Key("components").BeginArray();
+    for (std::shared_ptr<ChannelMessageComponent> c : this->components) c->WriteJSON(json);
+    json.EndArray();
+    json.Key("type").Int(1);
+    json.EndObject();
 }
 
 void ActionRowComponent::AddComponent(std::shared_ptr<ChannelMessageComponent> component) {
     this->components.push_back(component);
 }
 
-nlohmann::json ButtonComponent::ToJSON() {
-    return {
-        { "type", 2 },
-        { "style", this->style },
-        { "label", this->label },
-        { "custom_id", this->id }
-    };
+void ButtonComponent::WriteJSON(JSON::Writer &json) {
+    json.BeginObject();
+    json.Key("custom_id").String(this->id);
+    json.Key("label").String(this->label);
+    json.Key("style").Int(this->style);
+    json.Key("type").Int(2);
+    json.EndObject();
 }
 
-std::shared_ptr<HTTP::MultiPartRequestData> ChannelMessage::ToMultiPart() {
-     nlohmann::json payload_data = {
-        { "content", this->content },
-        { "components", nlohmann::json::array() },
-        { "attachments", nlohmann::json::array() },
-        { "embeds", nlohmann::json::array() }
-    };
+void ChannelMessage::WriteJSON(JSON::Writer &json) {
+    json.BeginObject();
 
-    if (this->reference_message.size() > 0) {
-        payload_data["message_reference"] = {
-            { "message_id", this->reference_message }
-        };
+    json.Key("attachments").BeginArray();
+    for (size_t i=0;i<this->attachments.size();i++) {
+        json.BeginObject();
+        json.Key("description").String(this->attachments[i]->description);
+        json.Key("filename").String(this->attachments[i]->filename);
+        json.Key("id").Int(i);
+        json.EndObject();
     }
+    json.EndArray();
 
-    for (std::shared_ptr<ChannelMessageComponent> c : this->components) {
-        payload_data["components"].push_back(c->ToJSON());
-        }
+    json.Key("components").BeginArray();
+    for (std::shared_ptr<ChannelMessageComponent> c : this->components) c->WriteJSON(json);
+    json.EndArray();
 
-    for (size_t i=0;i<this->attachments.size();i++) {
-        payload_data["attachments"].push_back({
-            { "id", i },
-            { "description", this->attachments[i]->description },
-            { "filename", this->attachments[i]->filename }
-        });
-    }
+    json.Key("content").String(this->content);
 
+    json.Key("embeds").BeginArray();
     for (std::shared_ptr<ChannelMessageEmbed> e : this->embeds) {
-        nlohmann::json embed = {
-            { "type", "rich" },
-            { "color", e->color }
-        };
-        if (e->title.size()) embed["title"] = e->title;
-        if (e->description.size()) embed["description"] = e->description;
+        json.BeginObject();
+        json.Key("color").Int(e->color);
+        if (e->description.size()) json.Key("description").String(e->description);
         if (e->fields.size()) {
-            embed["fields"] = nlohmann::json::array();
+            json.Key("fields").BeginArray();
             for (std::shared_ptr<ChannelMessageEmbedField> f : e->fields) {
-                nlohmann::json field = {
-                    { "name", f->name },
-                    { "value", f->value },
-                    { "inline", f->isinline }
-                };
-                embed["fields"].push_back(field);
+                json.BeginObject();
+                json.Key("inline").Bool(f->isinline);
+                json.Key("name").String(f->name);
+                json.Key("value").String(f->value);
+                json.EndObject();
             }
+            json.EndArray();
         }
-        if (e->image_url.size()) embed["image"] = nlohmann::json({ { "url", e->image_url } });
-        payload_data["embeds"].push_back(embed);
+        if (e->image_url.size()) json.Key("image").BeginObject().Key("url").String(e->image_url).EndObject();
+        if (e->title.size()) json.Key("title").String(e->title);
+        json.Key("type").String("rich");
+        json.EndObject();
     }
+    json.EndArray();
+
+    if (this->reference_message.size() > 0) {
+        json.Key("message_reference").BeginObject().Key("message_id").String(this->reference_message).EndObject();
+    }
+
+    json.EndObject();
+}
+
+std::shared_ptr<HTTP::MultiPartRequestData> ChannelMessage::ToMultiPart() {
+    Trace::Span span("Discord::ChannelMessage::ToMultiPart", "discord");
+
+    std::string payload;
+    JSON::Writer json(payload);
+    this->WriteJSON(json);
 
     std::shared_ptr<HTTP::MultiPartRequestData> mp(new HTTP::MultiPartRequestData);
-    std::string payloadstr = payload_data.dump();
-    mp->AddPart("payload_json", payloadstr.c_str());
+    mp->AddPart("payload_json", std::move(payload));
     for (size_t i=0; i<this->attachments.size(); i++) {
         mp->AddFile(fmt::format("files[{}]", i), this->attachments[i]->filename, this->attachments[i]->contentType, this->attachments[i]->data);
     }
@@ -110,20 +145,21 @@ std::shared_ptr<HTTP::MultiPartRequestData> ChannelMessage::ToMultiPart() {
 
 Channel::Channel(std::string token, std::string id) 
 :RESTClient(token), id(id) {
-    this->log = spdlog::get("Discord.Channel." + this->id);
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt("Discord.Channel." + this->id);
+    this->log = Log::Get("Discord", {{"channel", this->id}});
 }
 
-void Channel::CreateMessage(std::shared_ptr<ChannelMessage> message) {
+std::shared_ptr<HTTP::Request> Channel::CreateMessageRequest(std::shared_ptr<ChannelMessage> message) {
     std::string endpoint = fmt::format("/channels/{}/messages", this->id);
     
     std::shared_ptr<HTTP::Request> req(new HTTP::Request);
-    req->url = BASE_URL + endpoint;
+    req->url = base_url + endpoint;
     req->method = HTTP::RequestMethod::POST;
     req->body = message->ToMultiPart();
 
-    std::shared_ptr<HTTP::Response> resp = this->client->Perform(req);
+    return req;
+}
 
+void Channel::CreateMessageDone(std::shared_ptr<ChannelMessage> message, std::shared_ptr<HTTP::Response> resp) {
     if (resp->code!=200) {
         this->log->warn("Couldn't create message: {}", std::string(resp->body.begin(), resp->body.end()));
         return;
@@ -138,6 +174,16 @@ void Channel::CreateMessage(std::shared_ptr<ChannelMessage> message) {
     message->id = data["id"].get<std::string>();
 }
 
+void Channel::CreateMessage(std::shared_ptr<ChannelMessage> message) {
+    Trace::Span span("Discord::Channel::CreateMessage", "discord");
+    this->CreateMessageDone(message, this->client->Perform(this->CreateMessageRequest(message)));
+}
+
+IO::Task<void> Channel::CreateMessageAsync(std::shared_ptr<ChannelMessage> message) {
+    Trace::Span span("Discord::Channel::CreateMessage", "discord");
+    this->CreateMessageDone(message, co_await this->client->PerformAsync(this->CreateMessageRequest(message)));
+}
+
 void Channel::EditMessage(std::shared_ptr<ChannelMessage> message) {
     if (message->id.size()==0) {
         this->log->error("Can't edit message without an id.");
@@ -147,7 +193,7 @@ void Channel::EditMessage(std::shared_ptr<ChannelMessage> message) {
     std::string endpoint = fmt::format("/channels/{}/messages/{}", this->id, message->id);
 
     std::shared_ptr<HTTP::Request> req(new HTTP::Request);
-    req->url = BASE_URL + endpoint;
+    req->url = base_url + endpoint;
     req->method = HTTP::RequestMethod::PATCH;
     req->body = message->ToMultiPart();
 
@@ -163,7 +209,7 @@ void Channel::DeleteMessage(std::string id) {
     
     std::shared_ptr<HTTP::Request> req(new HTTP::Request);
     req->method = HTTP::RequestMethod::DELETE;
-    req->url = BASE_URL + endpoint;
+    req->url = base_url + endpoint;
 
     std::shared_ptr<HTTP::Response> resp = this->client->Perform(req);
 
@@ -172,40 +218,133 @@ void Channel::DeleteMessage(std::string id) {
     }
 }
 
-void Channel::AddReaction(std::string message, std::string reaction) {
+std::shared_ptr<HTTP::Request> Channel::AddReactionRequest(std::string message, std::string reaction) {
     std::string endpoint = fmt::format("/channels/{}/messages/{}/reactions/{}/@me", this->id, message, this->client->EscapeString(reaction));
 
-    std::shared_ptr<HTTP::Request> req = HTTP::NewPutRequest(BASE_URL + endpoint);
-    std::shared_ptr<HTTP::Response> resp = this->client->Perform(req);
+    return HTTP::NewPutRequest(base_url + endpoint);
 }
 
-void Channel::TriggerTyping() {
+void Channel::AddReaction(std::string message, std::string reaction) {
+    Trace::Span span("Discord::Channel::AddReaction", "discord");
+    std::shared_ptr<HTTP::Response> resp = this->client->Perform(this->AddReactionRequest(message, reaction));
+}
+
+IO::Task<void> Channel::AddReactionAsync(std::string message, std::string reaction) {
+    Trace::Span span("Discord::Channel::AddReaction", "discord");
+    std::shared_ptr<HTTP::Response> resp = co_await this->client->PerformAsync(this->AddReactionRequest(message, reaction));
+}
+
+std::shared_ptr<HTTP::Request> Channel::TriggerTypingRequest() {
     std::string endpoint = fmt::format("/channels/{}/typing", this->id);
 
     std::shared_ptr<HTTP::Request> req(new HTTP::Request);
-    req->url = BASE_URL + endpoint;
+    req->url = base_url + endpoint;
     req->method = HTTP::RequestMethod::POST;
-    
-    std::shared_ptr<HTTP::Response> resp = this->client->Perform(req);
+
+    return req;
+}
+
+void Channel::TriggerTyping() {
+    Trace::Span span("Discord::Channel::TriggerTyping", "discord");
+    std::shared_ptr<HTTP::Response> resp = this->client->Perform(this->TriggerTypingRequest());
+}
+
+IO::Task<void> Channel::TriggerTypingAsync() {
+    Trace::Span span("Discord::Channel::TriggerTyping", "discord");
+    std::shared_ptr<HTTP::Response> resp = co_await this->client->PerformAsync(this->TriggerTypingRequest());
+}
+
+// Gateway payloads are written here and copied into the send queue, so the
+// buffer keeps its capacity between sends.
+static std::string &GatewayBuffer() {
+    thread_local std::string buffer;
+    buffer.clear();
+    return buffer;
 }
 
 Socket::Socket(std::string token)
 :token(token) {
-    this->log = spdlog::get("Discord::Socket");
-    if (!this->log) this->log = spdlog::stdout_color_mt("Discord::Socket");
+    this->log = Log::Get("Gateway");
 
     this->AddEventCallback("READY", std::bind(&Socket::ProcessReadyEvent, this, std::placeholders::_1, std::placeholders::_2));
+    this->AddEventCallback("RESUMED", std::bind(&Socket::ProcessResumedEvent, this, std::placeholders::_1, std::placeholders::_2));
 
     this->http.reset(new HTTP::Client(USER_AGENT));
-    
-    this->Reconnect();
+    this->http->SetVersion(http_version);
+
+    this->Shard(0, 1);
+}
+
+void Socket::GatewayURL(std::string url) {
+    this->ws_url = url + "?v10&encoding=json";
+}
+
+void Socket::Intents(int intents) {
+    this->intents = intents;
+}
+
+void Socket::Shard(int id, int count) {
+    this->shard_id = id;
+    this->shard_count = count;
+
+    if (count > 1) this->log = Log::Get("Gateway", {{"shard", std::to_string(id)}});
+
+    this->hb_rtt = &Metrics::GetHistogram("octoprintcontrol_gateway_heartbeat_rtt_seconds", "Time between sending a gateway heartbeat and its ACK.", Metrics::LatencyBuckets, {{"shard", std::to_string(id)}});
+}
+
+void Socket::IdentifyLimit(IdentifyLimiter limiter) {
+    this->identify_limiter = limiter;
+}
+
+void Socket::Resume(SessionState state) {
+    this->session = state.id;
+    this->resume_url = state.resume_url;
+    this->seq = state.seq;
+    this->haveID = true;
+
+    std::lock_guard<std::mutex> lock(this->session_mutex);
+    this->saved = state;
+}
+
+SessionState Socket::Session() {
+    std::lock_guard<std::mutex> lock(this->session_mutex);
+    return this->saved;
+}
+
+void Socket::Connect() {
+    this->reactor = IO::Next();
+    if (!this->reactor) throw std::runtime_error("No IO reactor is running.");
+
+    this->Reconnect(this->resume_url!="");
+}
+
+void Socket::Disconnect() {
+    if (!this->reactor) return;
+
+    this->reactor->Invoke([this]() {
+        this->Checkpoint();
+        this->reactor->Cancel(this->hb_timer);
+        this->reactor->Cancel(this->retry_timer);
+        this->reactor->Cancel(this->identify_timer);
+        this->websocket.reset();
+    });
+}
+
+void Socket::Checkpoint() {
+    std::lock_guard<std::mutex> lock(this->session_mutex);
+    this->saved = SessionState{ .id = this->session, .resume_url = this->resume_url, .seq = this->seq };
 }
 
 Socket::~Socket() {
     this->log->debug("Shutting down gateway socket");
-    this->runHB = false;
-    if (this->hbThread.joinable()) this->hbThread.join();
-    this->websocket.reset();
+    if (!this->reactor) return;
+
+    this->reactor->Invoke([this]() {
+        this->reactor->Cancel(this->hb_timer);
+        this->reactor->Cancel(this->retry_timer);
+        this->reactor->Cancel(this->identify_timer);
+        this->websocket.reset();
+    });
 }
 
 void Socket::AddEventCallback(std::string event, SocketEventCallback callback) {
@@ -215,7 +354,7 @@ void Socket::AddEventCallback(std::string event, SocketEventCallback callback) {
 }
 
 void Socket::GetGatewayURL() {
-    std::shared_ptr<HTTP::Request> req = HTTP::NewGetRequest(BASE_URL + std::string("/gateway"));
+    std::shared_ptr<HTTP::Request> req = HTTP::NewGetRequest(base_url + "/gateway");
     std::shared_ptr<HTTP::Response> resp = this->http->Perform(req);
 
     if (!(200 <= resp->code && resp->code < 300)) {
@@ -234,90 +373,127 @@ void Socket::GetGatewayURL() {
     this->ws_url += "?v10&encoding=json";
 }
 
-void Socket::HBThreadMain() {
-    this->runHB = true;
+void Socket::StartHeartbeat() {
+    this->reactor->Cancel(this->hb_timer);
+
     std::default_random_engine rand;
     std::uniform_real_distribution<double> jitterDist(0, 1);
     rand.seed((unsigned int)std::chrono::high_resolution_clock::now().time_since_epoch().count());
 
     double jitter = jitterDist(rand);
     std::chrono::milliseconds duration((long)(this->hb_int * jitter));
-    this->log->info("Starting heartbeat thread, waiting {:0.2f} seconds before sending first heartbeat.", duration.count() / 1000.0);
-    std::this_thread::sleep_for(duration);
+    this->log->info("Starting heartbeat, waiting {:0.2f} seconds before sending first heartbeat.", duration.count() / 1000.0);
+
+    this->hb_timer = this->reactor->After(duration, [this]() {
+        this->haveAck = false;
+        this->SendHeartbeat(this->seq);
+        this->ScheduleHeartbeat();
+    });
+}
+
+void Socket::ScheduleHeartbeat() {
+    this->hb_timer = this->reactor->After(std::chrono::milliseconds(this->hb_int), [this]() { this->HeartbeatTick(); });
+}
+
+void Socket::HeartbeatTick() {
+    if (!this->haveAck) {
+        this->log->error("Didn't get HB ack, disconnecting.");
+        this->websocket->Disconnect();
+        this->Reconnect(this->resume_url!="");
+        return;
+    }
+
     this->haveAck = false;
     this->SendHeartbeat(this->seq);
+    this->ScheduleHeartbeat();
+    this->Checkpoint();
+}
 
-    while (this->runHB) {
-        std::chrono::duration<double, std::milli> since_last = std::chrono::steady_clock::now() - this->last_hb_sent;
-        if (since_last.count() >= this->hb_int) {
-            if (!this->haveAck) {
-                this->log->error("Didn't get HB ack, disconnecting.");
-                this->websocket->Disconnect();
-                this->Reconnect(this->resume_url!="");
-                break;
-            } else {
-                this->haveAck = false;
-                this->SendHeartbeat(this->seq);
-            }
-        }        
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));        
+void Socket::Reconnect(bool resume) {
+    if (this->websocket) {
+        Metrics::GetCounter("octoprintcontrol_gateway_reconnects_total", "Discord gateway reconnect attempts.", {{"resume", resume ? "true" : "false"}, {"shard", std::to_string(this->shard_id)}}).Inc();
     }
 
-    this->log->debug("HB Thread end");
+    std::weak_ptr<Socket> weak = this->weak_from_this();
+    this->reactor->Post([weak, resume]() {
+        if (std::shared_ptr<Socket> self = weak.lock()) self->StartConnect(resume);
+    });
 }
 
-void Socket::Reconnect(bool resume) {
-    std::thread t(&Socket::ConnectThreadMain, this, resume);
-    t.detach();
+void Socket::RetryConnect(bool resume) {
+    this->retry_timer = this->reactor->After(std::chrono::seconds(30), [this, resume]() { this->StartConnect(resume); });
 }
 
-void Socket::ConnectThreadMain(bool resume) {
-    while (this->ws_url=="") {
-        try {
-            this->GetGatewayURL();
-        } catch (std::runtime_error &err) {
-            this->log->error("Couldn't get Gateway URL, trying again in 30 seconds: {}", err.what());
-            std::this_thread::sleep_for(std::chrono::seconds(30));
-        }
+void Socket::StartConnect(bool resume) {
+    this->reactor->Cancel(this->retry_timer);
+
+    if (this->ws_url=="") {
+        // a blocking REST call, so it can't run on the reactor
+        std::weak_ptr<Socket> weak = this->weak_from_this();
+        IO::Submit("discord-gateway", [weak, resume]() {
+            std::shared_ptr<Socket> self = weak.lock();
+            if (!self) return;
+
+            try {
+                self->GetGatewayURL();
+            } catch (std::runtime_error &err) {
+                self->log->error("Couldn't get Gateway URL: {}", err.what());
+            }
+
+            self->reactor->Post([weak, resume]() {
+                std::shared_ptr<Socket> self = weak.lock();
+                if (!self) return;
+
+                if (self->ws_url!="") {
+                    self->StartConnect(resume);
+                    return;
+                }
+                self->log->error("No Gateway URL, trying again in 30 seconds.");
+                self->RetryConnect(resume);
+            });
+        });
+        return;
     }
 
-    this->runHB = false;
-    if (this->hbThread.joinable()) this->hbThread.join();
+    this->reactor->Cancel(this->hb_timer);
+    this->reactor->Cancel(this->identify_timer);
+    this->gatewayOpen = false;
+
+    std::string ws_name = this->shard_count > 1 ? fmt::format("discord-gateway:{}", this->shard_id) : "discord-gateway";
 
     if (resume) {
         this->log->info("Attempting to resume connection to {}", this->resume_url);
-        this->websocket.reset(new Websocket::Client(this->resume_url));
+        this->websocket.reset(new Websocket::Client(this->resume_url, ws_name, this->reactor));
     } else {
         this->haveID = false;
         this->resume_url = "";
         this->log->info("Attempting to (re)connect to {}", this->ws_url);
-        this->websocket.reset(new Websocket::Client(this->ws_url));
+        this->websocket.reset(new Websocket::Client(this->ws_url, ws_name, this->reactor));
     }
 
     this->websocket->AddDataReceivedCallback(std::bind(&Socket::OnWebsocketData, this, std::placeholders::_1));
 
-    do {
-        try {
-            this->websocket->Connect();
-            break;
-        } catch(std::runtime_error &err) {
-            this->log->error("Error while connecting, trying again in 30 seconds: {}", err.what());
-            std::this_thread::sleep_for(std::chrono::seconds(30));
-        }
-    } while (true);
+    this->websocket->AddConnectedCallback([this, resume]() {
+        this->gatewayOpen = true;
+        if (!resume) return;
 
-    if (resume) {
-        nlohmann::json resume = {
-            { "op", 6 },
-            { "d", {
-                { "token", this->token },
-                { "session_id", this->session },
-                { "seq", this->seq }
-            }}
-        };
+        std::string &msg = GatewayBuffer();
+        this->WriteResume(msg);
         this->log->info("Resuming sessions {}", this->session);
-        this->websocket->Send(resume.dump());
-    } 
+        this->websocket->Send(msg);
+    });
+
+    // a lost connection is noticed by the missing heartbeat ack
+    this->websocket->AddClosedCallback([this, resume](std::string error) {
+        if (this->gatewayOpen) {
+            this->log->warn("Gateway connection lost: {}", error);
+            return;
+        }
+        this->log->error("Error while connecting, trying again in 30 seconds: {}", error);
+        this->RetryConnect(resume);
+    });
+
+    this->websocket->Connect();
 }
 
 void Socket::OnWebsocketData(std::vector<char> data) {
@@ -365,16 +541,19 @@ void Socket::OnWebsocketData(std::vector<char> data) {
         case 10: // open
             this->hb_int = msg["d"]["heartbeat_interval"].get<uint64_t>();
             this->log->debug("Got open message, hb_interval = {}", this->hb_int);
-            this->hbThread = std::thread(&Socket::HBThreadMain, this);
+            this->StartHeartbeat();
+            // identify doesn't need to wait for the first heartbeat, which is jittered
+            // over the whole interval
+            if (!this->haveID) {
+                this->Identify();
+                this->haveID = true;
+            }
             break;
         case 11: //hb ack
             this->haveAck = true;
             //this->log->info("Websocket heartbeat acknowledged.");
-            if (!this->haveID) {
-                this->SendIdentify();
-                this->haveID = true;
-            }
             this->gateway_latency = std::chrono::steady_clock::now() - this->last_hb_sent;
+            this->hb_rtt->Observe(this->gateway_latency.count() / 1000.0);
             break;
         default:
             this->log->warn("Unhandled opcode: {}", msg.at("op").get<int>());
@@ -383,31 +562,68 @@ void Socket::OnWebsocketData(std::vector<char> data) {
     }   
 }
 
+void Socket::WriteHeartbeat(std::string &out, int64_t seq) {
+    JSON::Writer json(out);
+    json.BeginObject();
+    if (seq > 0) json.Key("d").Int(seq);
+    else json.Key("d").Null();
+    json.Key("op").Int(1);
+    json.EndObject();
+}
+
 void Socket::SendHeartbeat(int64_t seq) {
-    nlohmann::json msg = {
-        { "op", 1 },
-        { "d", (seq > 0 ? nlohmann::json(seq) : nlohmann::json(nullptr)) }
-    };
+    std::string &msg = GatewayBuffer();
+    WriteHeartbeat(msg, seq);
 
-    this->websocket->Send(msg.dump());
+    this->websocket->Send(msg);
     this->last_hb_sent = std::chrono::steady_clock::now();
 }
 
+void Socket::Identify() {
+    std::chrono::milliseconds wait = this->identify_limiter ? this->identify_limiter() : std::chrono::milliseconds(0);
+    if (wait.count()==0) {
+        this->SendIdentify();
+        return;
+    }
+
+    this->log->info("Waiting {:0.1f} seconds to identify.", wait.count() / 1000.0);
+    this->identify_timer = this->reactor->After(wait, [this]() { this->SendIdentify(); });
+}
+
+void Socket::WriteIdentify(std::string &out) {
+    JSON::Writer json(out);
+    json.BeginObject();
+    json.Key("d").BeginObject();
+    json.Key("intents").Int(this->intents);
+    json.Key("properties").BeginObject();
+    json.Key("browser").String("OctoPrintControl");
+    json.Key("device").String("OctoPrintControl");
+    json.Key("os").String("windows");
+    json.EndObject();
+    json.Key("shard").BeginArray().Int(this->shard_id).Int(this->shard_count).EndArray();
+    json.Key("token").String(this->token);
+    json.EndObject();
+    json.Key("op").Int(2);
+    json.EndObject();
+}
+
+void Socket::WriteResume(std::string &out) {
+    JSON::Writer json(out);
+    json.BeginObject();
+    json.Key("d").BeginObject();
+    json.Key("seq").Int(this->seq);
+    json.Key("session_id").String(this->session);
+    json.Key("token").String(this->token);
+    json.EndObject();
+    json.Key("op").Int(6);
+    json.EndObject();
+}
+
 void Socket::SendIdentify() {
-    nlohmann::json msg = {
-        { "op", 2 },
-        { "d", {
-            { "token", this->token },
-            { "properties", {
-                { "os", "windows" },
-                { "browser", "OctoPrintControl" },
-                { "device", "OctoPrintControl" }
-            }},
-            { "intents", (1 << 9) | (1 << 15)}
-        }}
-    };
+    std::string &msg = GatewayBuffer();
+    this->WriteIdentify(msg);
 
-    this->websocket->Send(msg.dump());
+    this->websocket->Send(msg);
 }
 
 void Socket::DispatchEvent(nlohmann::json event) {
@@ -423,15 +639,302 @@ void Socket::ProcessReadyEvent(std::string, nlohmann::json event) {
     this->session = event.at("session_id").get<std::string>();
     this->resume_url = event.at("resume_gateway_url").get<std::string>() + "?v10&encoding=json";
     this->log->info("Got session = {} and resume_url = {}", this->session, this->resume_url);
+    this->Checkpoint();
+}
+
+void Socket::ProcessResumedEvent(std::string, nlohmann::json) {
+    this->log->info("Resumed session {}", this->session);
+    this->Checkpoint();
+}
+
+Gateway::Gateway(std::string token)
+:token(token) {
+    this->log = Log::Get("Gateway");
+
+    this->http.reset(new HTTP::Client(USER_AGENT));
+    this->http->SetVersion(http_version);
+    this->http->AddHeader(fmt::format("Authorization: Bot {}", this->token));
+}
+
+Gateway::~Gateway() {
+    if (this->reactor) {
+        this->reactor->Invoke([this]() {
+            this->reactor->Cancel(this->retry_timer);
+            this->reactor->Cancel(this->save_timer);
+        });
+    }
+
+    // leave the sessions open so the next start can resume them
+    {
+        std::lock_guard<std::mutex> lock(this->shards_mutex);
+        for (std::shared_ptr<Socket> &shard : this->shards) shard->Disconnect();
+    }
+    this->SaveSessions();
+
+    std::lock_guard<std::mutex> lock(this->shards_mutex);
+    this->shards.clear();
+}
+
+void Gateway::GatewayURL(std::string url) {
+    this->ws_url = url;
+}
+
+void Gateway::Intents(int intents) {
+    this->intents = intents;
+}
+
+void Gateway::Shards(int count) {
+    this->shard_count = count;
+}
+
+void Gateway::SessionFile(std::string path) {
+    this->session_file = path;
+}
+
+void Gateway::AddEventCallback(std::string event, SocketEventCallback callback) {
+    this->event_callbacks[event].push_back(callback);
+}
+
+void Gateway::Connect() {
+    this->reactor = IO::Next();
+    if (!this->reactor) throw std::runtime_error("No IO reactor is running.");
+
+    if (this->connect_start==std::chrono::steady_clock::time_point()) this->connect_start = std::chrono::steady_clock::now();
+
+    if (this->ws_url.size() && this->shard_count > 0) {
+        this->Start();
+        return;
+    }
+
+    // a blocking REST call, so it runs on a worker and retries from the reactor
+    std::weak_ptr<Gateway> weak = this->weak_from_this();
+    IO::Submit("discord-gateway", [weak]() {
+        std::shared_ptr<Gateway> self = weak.lock();
+        if (!self) return;
+
+        if (self->GetGatewayBot()) {
+            self->Start();
+            return;
+        }
+
+        self->log->error("Couldn't get gateway info, trying again in 30 seconds.");
+        self->reactor->Post([weak]() {
+            std::shared_ptr<Gateway> self = weak.lock();
+            if (!self) return;
+            self->retry_timer = self->reactor->After(std::chrono::seconds(30), [weak]() {
+                if (std::shared_ptr<Gateway> self = weak.lock()) self->Connect();
+            });
+        });
+    });
+}
+
+bool Gateway::GetGatewayBot() {
+    std::shared_ptr<HTTP::Response> resp;
+    try {
+        resp = this->http->Perform(HTTP::NewGetRequest(base_url + "/gateway/bot"));
+    } catch (std::runtime_error &err) {
+        this->log->error("{}", err.what());
+        return false;
+    }
+
+    if (resp->code!=200) {
+        this->log->error("Error while retrieving Discord gateway info: {}", std::string(resp->body.begin(), resp->body.end()));
+        return false;
+    }
+
+    try {
+        nlohmann::json info = nlohmann::json::parse(resp->body);
+        if (this->ws_url=="") this->ws_url = info.at("url").get<std::string>();
+        if (this->shard_count < 1) this->shard_count = info.at("shards").get<int>();
+        this->max_concurrency = info.at("session_start_limit").at("max_concurrency").get<int>();
+    } catch (nlohmann::json::exception &err) {
+        this->log->error("Couldn't parse gateway info: {}", err.what());
+        return false;
+    }
+
+    if (this->shard_count < 1) this->shard_count = 1;
+    if (this->max_concurrency < 1) this->max_concurrency = 1;
+    return true;
+}
+
+void Gateway::Start() {
+    this->log->info("Connecting {} shard{} to {}, identify concurrency {}", this->shard_count, this->shard_count==1 ? "" : "s", this->ws_url, this->max_concurrency);
+    this->identify_next.assign(this->max_concurrency, std::chrono::steady_clock::now());
+    this->LoadSessions();
+
+    std::lock_guard<std::mutex> lock(this->shards_mutex);
+    for (int i=0;i<this->shard_count;i++) {
+        std::shared_ptr<Socket> shard(new Socket(this->token));
+        shard->GatewayURL(this->ws_url);
+        shard->Intents(this->intents);
+        shard->Shard(i, this->shard_count);
+        shard->IdentifyLimit([this, i]() { return this->ReserveIdentify(i); });
+        if (this->resume[i].resume_url.size()) shard->Resume(this->resume[i]);
+
+        // ahead of the other callbacks, so the READY is saved before they run
+        auto ready = [this, i](std::string event, nlohmann::json data) { this->OnShardReady(i, event, data); };
+        shard->AddEventCallback("READY", ready);
+        shard->AddEventCallback("RESUMED", ready);
+        for (auto &[event, cbs] : this->event_callbacks) {
+            shard->AddEventCallback(event, [this](std::string event, nlohmann::json data) { this->Dispatch(event, data); });
+        }
+        // each shard gets its own reactor
+        shard->Connect();
+        this->shards.push_back(shard);
+    }
+
+    std::weak_ptr<Gateway> weak = this->weak_from_this();
+    this->reactor->Post([weak]() {
+        if (std::shared_ptr<Gateway> self = weak.lock()) self->ScheduleSave();
+    });
+}
+
+void Gateway::Dispatch(std::string event, nlohmann::json data) {
+    std::map<std::string, std::list<SocketEventCallback>>::iterator cbs = this->event_callbacks.find(event);
+    if (cbs==this->event_callbacks.end()) return;
+    for (SocketEventCallback &cb : cbs->second) cb(event, data);
+}
+
+void Gateway::OnShardReady(int shard, std::string event, nlohmann::json data) {
+    bool replay = false;
+    nlohmann::json replay_data;
+    {
+        std::lock_guard<std::mutex> lock(this->session_mutex);
+        if (event=="READY") {
+            this->ready = {
+                { "user", data.at("user") },
+                { "application", data.at("application") }
+            };
+        }
+
+        if (!this->shard_ready[shard]) {
+            this->shard_ready[shard] = true;
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - this->connect_start;
+            bool resumed = event=="RESUMED";
+            this->log->info("Shard {} {} {:.0f} ms after connecting", shard, resumed ? "resumed" : "ready", elapsed.count() * 1000.0);
+            Metrics::GetGauge("octoprintcontrol_gateway_ready_milliseconds", "Time from starting the gateway to a shard's first READY or RESUMED.", {{"shard", std::to_string(shard)}, {"resumed", resumed ? "true" : "false"}}).Set((int64_t)(elapsed.count() * 1000.0));
+
+            // handlers still expect a READY when the bot starts
+            if (resumed && this->ready.size()) {
+                replay = true;
+                replay_data = this->ready;
+                replay_data["session_id"] = this->resume[shard].id;
+                replay_data["resume_gateway_url"] = this->resume[shard].resume_url;
+                replay_data["shard"] = { shard, this->shard_count };
+                replay_data["resumed"] = true;
+            }
+        }
+    }
+
+    this->SaveSessions();
+    if (replay) this->Dispatch("READY", replay_data);
+}
+
+void Gateway::LoadSessions() {
+    this->resume.assign(this->shard_count, SessionState());
+    this->shard_ready.assign(this->shard_count, false);
+    if (this->session_file.empty() || !std::filesystem::exists(this->session_file)) return;
+
+    try {
+        std::ifstream in(this->session_file);
+        nlohmann::json saved = nlohmann::json::parse(in);
+        if (saved.at("shards").get<int>()!=this->shard_count) {
+            this->log->info("Saved sessions are for {} shards, identifying instead.", saved.at("shards").get<int>());
+            return;
+        }
+
+        for (int i=0;i<this->shard_count;i++) {
+            nlohmann::json &s = saved.at("sessions").at(i);
+            this->resume[i] = SessionState{
+                .id = s.at("session_id").get<std::string>(),
+                .resume_url = s.at("resume_url").get<std::string>(),
+                .seq = s.at("seq").get<int64_t>()
+            };
+        }
+        this->ready = saved.at("ready");
+        this->log->info("Loaded saved sessions from {}", this->session_file);
+    } catch (nlohmann::json::exception &err) {
+        this->log->warn("Couldn't load saved sessions from {}: {}", this->session_file, err.what());
+        this->resume.assign(this->shard_count, SessionState());
+    }
+}
+
+void Gateway::SaveSessions() {
+    if (this->session_file.empty()) return;
+
+    nlohmann::json sessions = nlohmann::json::array();
+    {
+        std::lock_guard<std::mutex> lock(this->shards_mutex);
+        if (this->shards.empty()) return;
+        for (std::shared_ptr<Socket> &shard : this->shards) {
+            SessionState state = shard->Session();
+            sessions.push_back({
+                { "session_id", state.id },
+                { "resume_url", state.resume_url },
+                { "seq", state.seq }
+            });
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(this->session_mutex);
+    nlohmann::json saved = {
+        { "shards", this->shard_count },
+        { "ready", this->ready },
+        { "sessions", sessions }
+    };
+
+    // written next to it first, so a crash can't leave a partial file
+    std::string tmp = this->session_file + ".tmp";
+    {
+        std::ofstream out(tmp);
+        out << saved.dump();
+        if (!out.good()) {
+            this->log->warn("Couldn't write sessions to {}", tmp);
+            return;
+        }
+    }
+
+    std::error_code err;
+    std::filesystem::rename(tmp, this->session_file, err);
+    if (err) this->log->warn("Couldn't save sessions to {}: {}", this->session_file, err.message());
+}
+
+void Gateway::ScheduleSave() {
+    this->save_timer = this->reactor->After(std::chrono::seconds(30), [this]() {
+        this->SaveSessions();
+        this->ScheduleSave();
+    });
+}
+
+std::chrono::milliseconds Gateway::ReserveIdentify(int shard) {
+    std::lock_guard<std::mutex> lock(this->identify_mutex);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point &next = this->identify_next[shard % this->max_concurrency];
+
+    std::chrono::steady_clock::time_point at = std::max(now, next);
+    next = at + std::chrono::seconds(5);
+    return std::chrono::ceil<std::chrono::milliseconds>(at - now);
+}
+
+std::chrono::duration<double, std::milli> Gateway::GatewayLatency() {
+    std::lock_guard<std::mutex> lock(this->shards_mutex);
+    std::chrono::duration<double, std::milli> total(0);
+    int connected = 0;
+    for (std::shared_ptr<Socket> &shard : this->shards) {
+        if (shard->GatewayLatency().count()==0) continue;
+        total += shard->GatewayLatency();
+        connected++;
+    }
+    return connected ? total / connected : total;
 }
 
 Interaction::Interaction(std::string token, std::string id)
 :RESTClient(token), id(id) {
-    this->log = spdlog::get("Interaction::"+id);
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt("Interaction::" + id);
+    this->log = Log::Get("Discord", {{"interaction", id}});
 }
 
-void Interaction::CreateResponse(std::string token, int type) {
+std::shared_ptr<HTTP::Request> Interaction::CreateResponseRequest(std::string token, int type) {
     nlohmann::json body = {
         { "type", type}
     };
@@ -440,13 +943,84 @@ void Interaction::CreateResponse(std::string token, int type) {
     std::shared_ptr<HTTP::Request> req(new HTTP::Request);
     req->method = HTTP::RequestMethod::POST;
     req->body.reset(new HTTP::JSONRequestData(body));
-    req->url = BASE_URL + endpoint;
+    req->url = base_url + endpoint;
 
-    std::shared_ptr<HTTP::Response> resp = this->client->Perform(req);
+    return req;
+}
 
+void Interaction::CreateResponseDone(std::shared_ptr<HTTP::Response> resp) {
     if (resp->code!=204) {
         this->log->error("Couldn't create interaction response");
     }
 }
 
+void Interaction::CreateResponse(std::string token, int type) {
+    this->CreateResponseDone(this->client->Perform(this->CreateResponseRequest(token, type)));
+}
+
+IO::Task<void> Interaction::CreateResponseAsync(std::string token, int type) {
+    Trace::Span span("Discord::Interaction::CreateResponse", "discord");
+    this->CreateResponseDone(co_await this->client->PerformAsync(this->CreateResponseRequest(token, type)));
+}
+
+void Interaction::ResponseMessageDone(std::shared_ptr<ChannelMessage> message, std::shared_ptr<HTTP::Response> resp) {
+    if (resp->code!=200) {
+        this->log->warn("Couldn't send interaction response: {}", std::string(resp->body.begin(), resp->body.end()));
+        return;
+    }
+
+    if (resp->contentType!="application/json") {
+        this->log->error("Interaction response isn't json.");
+        return;
+    }
+
+    nlohmann::json data = nlohmann::json::parse(resp->body);
+    message->id = data["id"].get<std::string>();
+}
+
+IO::Task<void> Interaction::EditOriginalResponseAsync(std::string application, std::string token, std::shared_ptr<ChannelMessage> message) {
+    Trace::Span span("Discord::Interaction::EditOriginalResponse", "discord");
+    std::string endpoint = fmt::format("/webhooks/{}/{}/messages/@original", application, token);
+
+    std::shared_ptr<HTTP::Request> req(new HTTP::Request);
+    req->url = base_url + endpoint;
+    req->method = HTTP::RequestMethod::PATCH;
+    req->body = message->ToMultiPart();
+
+    this->ResponseMessageDone(message, co_await this->client->PerformAsync(req));
+}
+
+IO::Task<void> Interaction::CreateFollowupMessageAsync(std::string application, std::string token, std::shared_ptr<ChannelMessage> message) {
+    Trace::Span span("Discord::Interaction::CreateFollowupMessage", "discord");
+    std::string endpoint = fmt::format("/webhooks/{}/{}", application, token);
+
+    std::shared_ptr<HTTP::Request> req(new HTTP::Request);
+    req->url = base_url + endpoint;
+    req->method = HTTP::RequestMethod::POST;
+    req->body = message->ToMultiPart();
+
+    this->ResponseMessageDone(message, co_await this->client->PerformAsync(req));
+}
+
+Application::Application(std::string token, std::string id)
+:RESTClient(token), id(id) {
+    this->log = Log::Get("Discord", {{"application", id}});
+}
+
+void Application::BulkOverwriteCommands(nlohmann::json commands, std::string guild) {
+    std::string endpoint = fmt::format("/applications/{}/commands", this->id);
+    if (guild.size()) endpoint = fmt::format("/applications/{}/guilds/{}/commands", this->id, guild);
+
+    std::shared_ptr<HTTP::Request> req(new HTTP::Request);
+    req->method = HTTP::RequestMethod::PUT;
+    req->body.reset(new HTTP::JSONRequestData(commands));
+    req->url = base_url + endpoint;
+
+    std::shared_ptr<HTTP::Response> resp = this->client->Perform(req);
+
+    if (resp->code!=200) {
+        throw std::runtime_error(fmt::format("Couldn't register application commands: {} {}", resp->code, std::string(resp->body.begin(), resp->body.end())));
+    }
+}
+
 }
\ No newline at end of file
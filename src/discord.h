@@ -11,14 +11,32 @@
 #include <map>
 #include <chrono>
 #include <list>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 
 #include "http.h"
+#include "log.h"
+#include "io.h"
+#include "task.h"
 #include "websocket.h"
+#include "metrics.h"
+#include "json.h"
+
+namespace OctoPrintControl::Bench { struct Access; }
 
 namespace OctoPrintControl::Discord {
 
+// defaults to https://discord.com/api/v10, set before creating any clients
+void SetAPIBaseURL(std::string url);
+// defaults to HTTP2, set before creating any clients
+void SetHTTPVersion(HTTP::Version version);
+
+// gateway intents, application command interactions are sent without any
+constexpr int IntentGuildMessages = 1 << 9;
+constexpr int IntentMessageContent = 1 << 15;
+
+// Objects for a token share one HTTP client, so they're cheap to make.
 class RESTClient {
 public:
     RESTClient(std::string token);
@@ -27,7 +45,7 @@ public:
 private:
     std::string token;
 
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Log::Logger> log;
 
 protected:
     std::shared_ptr<HTTP::Client> client;
@@ -51,17 +69,19 @@ struct ChannelMessageAttachment {
     std::string filename;
     std::string description;
     std::string contentType;
-    std::vector<char> data;
+    // shared with the upload, don't change it once set
+    std::shared_ptr<const std::vector<char>> data;
 };
 
 class ChannelMessageComponent {
 public:
-    virtual nlohmann::json ToJSON() = 0;
+    // writes the component's object, keys in sorted order
+    virtual void WriteJSON(JSON::Writer &json) = 0;
 };
 
 class ActionRowComponent : public ChannelMessageComponent {
 public:
-    nlohmann::json ToJSON();
+    void WriteJSON(JSON::Writer &json);
     void AddComponent(std::shared_ptr<ChannelMessageComponent> component);
 private:
     std::list<std::shared_ptr<ChannelMessageComponent>> components;
@@ -70,7 +90,7 @@ private:
 class ButtonComponent : public ChannelMessageComponent {
 public:
     ButtonComponent(int style, std::string label, std::string id) :style(style), label(label), id(id) {}
-    nlohmann::json ToJSON();
+    void WriteJSON(JSON::Writer &json);
 private:
     int style;
     std::string label;
@@ -89,6 +109,8 @@ struct ChannelMessage {
     ChannelMessageComponentList components;
     ChannelMessageEmbedList embeds;
 
+    // the payload_json part
+    void WriteJSON(JSON::Writer &json);
     std::shared_ptr<HTTP::MultiPartRequestData> ToMultiPart();
 };
 
@@ -96,6 +118,16 @@ inline std::shared_ptr<ChannelMessage> NewChannelMessage(std::string content="")
     return std::shared_ptr<ChannelMessage>(new ChannelMessage{ .content=content });
 }
 
+inline std::shared_ptr<ChannelMessageAttachment> NewChannelMessageAttachment(std::string filename, std::string contentType, std::vector<char> data) {
+    return std::shared_ptr<ChannelMessageAttachment>(
+        new ChannelMessageAttachment{
+            .filename = filename,
+            .contentType = contentType,
+            .data = std::shared_ptr<const std::vector<char>>(new std::vector<char>(std::move(data)))
+        }
+    );
+}
+
 inline std::shared_ptr<ChannelMessageEmbed> NewChannelMessageEmbed(std::string title="", std::string description="", int color=0xFFFFFF) {
     return std::shared_ptr<ChannelMessageEmbed>(
         new ChannelMessageEmbed{
@@ -122,74 +154,228 @@ public:
     void AddReaction(std::string message, std::string reaction);
     void TriggerTyping();
 
+    // message->id is set once the task is done
+    IO::Task<void> CreateMessageAsync(std::shared_ptr<ChannelMessage> message);
+    IO::Task<void> AddReactionAsync(std::string message, std::string reaction);
+    IO::Task<void> TriggerTypingAsync();
+
 private:
+    std::shared_ptr<HTTP::Request> CreateMessageRequest(std::shared_ptr<ChannelMessage> message);
+    void CreateMessageDone(std::shared_ptr<ChannelMessage> message, std::shared_ptr<HTTP::Response> resp);
+    std::shared_ptr<HTTP::Request> AddReactionRequest(std::string message, std::string reaction);
+    std::shared_ptr<HTTP::Request> TriggerTypingRequest();
+
     std::string id;
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Log::Logger> log;
 };
 
 typedef std::function<void(std::string, nlohmann::json)> SocketEventCallback;
+// called before each identify, returns how long to wait before sending it
+typedef std::function<std::chrono::milliseconds()> IdentifyLimiter;
 
-class Socket {
+struct SessionState {
+    std::string id;
+    std::string resume_url;
+    int64_t seq = -1;
+};
+
+// The gateway connection and its timers live on an IO::Reactor, event callbacks
+// are run on the reactor thread. Must be owned by a std::shared_ptr to connect.
+class Socket : public std::enable_shared_from_this<Socket> {
 public:
     Socket(std::string token);
     ~Socket();
 
+    // add callbacks first, events can arrive as soon as this is called
+    void Connect();
+
+    // skips asking the REST API for the gateway URL
+    void GatewayURL(std::string url);
+
+    // sent with the next identify, defaults to guild messages and their content
+    void Intents(int intents);
+
+    // set before connecting, defaults to shard 0 of 1
+    void Shard(int id, int count);
+    void IdentifyLimit(IdentifyLimiter limiter);
+
+    // resume this session on connect instead of identifying, an invalid session
+    // falls back to identify
+    void Resume(SessionState state);
+    // as of the last READY, RESUMED or heartbeat
+    SessionState Session();
+    // closes the connection without ending the session, so it can be resumed later
+    void Disconnect();
+
     void AddEventCallback(std::string event, SocketEventCallback callback);
     std::chrono::duration<double, std::milli> GatewayLatency() { return this->gateway_latency; }
 
 private:
-    void HBThreadMain();
+    friend struct Bench::Access;
+
+    void StartHeartbeat();
+    void ScheduleHeartbeat();
+    void HeartbeatTick();
 
     void GetGatewayURL();
 
     void SendHeartbeat(int64_t seq);
+    void Identify();
     void SendIdentify();
 
+    // gateway payloads, appended to out
+    static void WriteHeartbeat(std::string &out, int64_t seq);
+    void WriteIdentify(std::string &out);
+    void WriteResume(std::string &out);
+
     void OnWebsocketData(std::vector<char> data);
 
     void DispatchEvent(nlohmann::json event);
 
     void ProcessReadyEvent(std::string, nlohmann::json event);
+    void ProcessResumedEvent(std::string, nlohmann::json event);
+    void Checkpoint();
 
     void Reconnect(bool resume=false);
-    void ConnectThreadMain(bool resume);
+    void StartConnect(bool resume);
+    void RetryConnect(bool resume);
 
     std::chrono::steady_clock::time_point last_hb_sent;
-    std::chrono::duration<double, std::milli> gateway_latency;
+    std::chrono::duration<double, std::milli> gateway_latency{0};
+    Metrics::Histogram *hb_rtt;
 
     std::map<std::string, std::list<SocketEventCallback>> event_callbacks;
 
     std::string ws_url;
 
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Log::Logger> log;
 
     std::string token;
 
     std::string session;
     std::string resume_url;
 
+    std::mutex session_mutex;
+    SessionState saved;
+
+    int intents = IntentGuildMessages | IntentMessageContent;
+    int shard_id = 0;
+    int shard_count = 1;
+    IdentifyLimiter identify_limiter;
+
     uint64_t hb_int = 0;
     int64_t seq = -1;
     bool haveAck = false;
     bool haveID = false;
+    bool gatewayOpen = false;
 
-    bool runHB = false;
-
-    std::thread hbThread;
+    IO::Reactor *reactor = nullptr;
+    IO::TimerId hb_timer = 0;
+    IO::TimerId retry_timer = 0;
+    IO::TimerId identify_timer = 0;
 
     std::shared_ptr<HTTP::Client> http;
     std::shared_ptr<Websocket::Client> websocket;
 };
 
+// Runs a Socket for each shard, using the shard count and identify concurrency
+// from /gateway/bot. Events from every shard go to the same callbacks, which are
+// run on that shard's reactor thread. Must be owned by a std::shared_ptr.
+class Gateway : public std::enable_shared_from_this<Gateway> {
+public:
+    Gateway(std::string token);
+    ~Gateway();
+
+    // add callbacks first, the shards connect once /gateway/bot has answered
+    void Connect();
+
+    // skips the url from /gateway/bot
+    void GatewayURL(std::string url);
+    void Intents(int intents);
+    // 0 uses the count recommended by Discord
+    void Shards(int count);
+    // sessions are saved here and resumed on the next start, nothing is saved if
+    // it's empty. A shard resumed from the file gets the saved READY dispatched
+    // once it's resumed.
+    void SessionFile(std::string path);
+
+    void AddEventCallback(std::string event, SocketEventCallback callback);
+    // averaged over the connected shards
+    std::chrono::duration<double, std::milli> GatewayLatency();
+
+private:
+    bool GetGatewayBot();
+    void Start();
+    void Dispatch(std::string event, nlohmann::json data);
+    std::chrono::milliseconds ReserveIdentify(int shard);
+
+    void LoadSessions();
+    void SaveSessions();
+    void ScheduleSave();
+    void OnShardReady(int shard, std::string event, nlohmann::json data);
+
+    std::shared_ptr<Log::Logger> log;
+
+    std::string token;
+    std::string ws_url;
+    int intents = IntentGuildMessages | IntentMessageContent;
+    int shard_count = 0;
+    int max_concurrency = 1;
+
+    std::map<std::string, std::list<SocketEventCallback>> event_callbacks;
+
+    // identify buckets are shard % max_concurrency, each gets one identify per 5 seconds
+    std::mutex identify_mutex;
+    std::vector<std::chrono::steady_clock::time_point> identify_next;
+
+    std::mutex shards_mutex;
+    std::vector<std::shared_ptr<Socket>> shards;
+
+    std::string session_file;
+    std::mutex session_mutex;
+    // sessions loaded from the file, by shard
+    std::vector<SessionState> resume;
+    // user and application from the last READY
+    nlohmann::json ready;
+    std::vector<bool> shard_ready;
+    std::chrono::steady_clock::time_point connect_start;
+
+    IO::Reactor *reactor = nullptr;
+    IO::TimerId retry_timer = 0;
+    IO::TimerId save_timer = 0;
+    std::shared_ptr<HTTP::Client> http;
+};
+
 class Interaction : public RESTClient {
 public:
     Interaction(std::string token, std::string id);
 
     void CreateResponse(std::string token, int type);
+    IO::Task<void> CreateResponseAsync(std::string token, int type);
+
+    // the response to a deferred interaction, message->id is set once done
+    IO::Task<void> EditOriginalResponseAsync(std::string application, std::string token, std::shared_ptr<ChannelMessage> message);
+    IO::Task<void> CreateFollowupMessageAsync(std::string application, std::string token, std::shared_ptr<ChannelMessage> message);
+
+private:
+    std::shared_ptr<HTTP::Request> CreateResponseRequest(std::string token, int type);
+    void CreateResponseDone(std::shared_ptr<HTTP::Response> resp);
+    void ResponseMessageDone(std::shared_ptr<ChannelMessage> message, std::shared_ptr<HTTP::Response> resp);
+
+    std::string id;
+    std::shared_ptr<Log::Logger> log;
+};
+
+class Application : public RESTClient {
+public:
+    Application(std::string token, std::string id);
+
+    // replaces all of the application's commands, or a guild's if guild is given
+    void BulkOverwriteCommands(nlohmann::json commands, std::string guild="");
 
 private:
     std::string id;
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Log::Logger> log;
 };
 
 }
\ No newline at end of file
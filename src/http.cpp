@@ -3,38 +3,77 @@
 // License: MIT (see LICENSE)
 #include "http.h"
 #include <fmt/core.h>
-#include <spdlog/sinks/stdout_color_sinks.h>
+#include <fmt/ranges.h>
 #include <stdexcept>
+#include <chrono>
+#include <future>
+#include <array>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include "metrics.h"
+#include "trace.h"
 
 namespace OctoPrintControl::HTTP {
 
 void MultiPartRequestData::AddPart(std::string name, std::string data) {
     std::shared_ptr<Part> p(new Part);
-    
+    std::shared_ptr<const std::string> owned(new std::string(std::move(data)));
+
     p->name = name;
-    p->data = std::vector<char>(data.begin(), data.end());
+    p->data = owned->data();
+    p->size = owned->size();
+    p->owner = owned;
 
     this->parts.push_back(p);
 }
 
-void MultiPartRequestData::AddFile(std::string name, std::string filename, std::string filetype, std::vector<char> data) {
+void MultiPartRequestData::AddFile(std::string name, std::string filename, std::string filetype, std::shared_ptr<const std::vector<char>> data) {
     std::shared_ptr<Part> p(new Part);
 
     p->name = name;
     p->filename = filename;
     p->filetype = filetype;
-    p->data = std::vector<char>(data.begin(), data.end());
+    p->data = data->data();
+    p->size = data->size();
+    p->owner = data;
     
     this->parts.push_back(p);
 }
 
+// where curl is in a part, it can rewind to resend the body
+struct PartReader {
+    std::shared_ptr<const MultiPartRequestData::Part> part;
+    size_t offset = 0;
+};
+
+static size_t PartRead(char *buffer, size_t size, size_t nitems, void *arg) {
+    PartReader *r = static_cast<PartReader*>(arg);
+    size_t n = std::min(size * nitems, r->part->size - r->offset);
+    memcpy(buffer, r->part->data + r->offset, n);
+    r->offset += n;
+    return n;
+}
+
+static int PartSeek(void *arg, curl_off_t offset, int origin) {
+    PartReader *r = static_cast<PartReader*>(arg);
+    if (origin!=SEEK_SET || offset < 0 || (size_t)offset > r->part->size) return CURL_SEEKFUNC_CANTSEEK;
+    r->offset = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+static void PartFree(void *arg) {
+    delete static_cast<PartReader*>(arg);
+}
+
 curl_mime *MultiPartRequestData::ToMime(CURL *curl) {
     curl_mime *mime = curl_mime_init(curl);
 
     for (std::shared_ptr<Part> p : this->parts) {
         curl_mimepart *part = curl_mime_addpart(mime);
         curl_mime_name(part, p->name.c_str());
-        curl_mime_data(part, p->data.data(), p->data.size());
+        // curl_mime_data would copy the whole part
+        curl_mime_data_cb(part, (curl_off_t)p->size, &PartRead, &PartSeek, &PartFree, new PartReader{ p });
         if (p->filename.size()) curl_mime_filename(part, p->filename.c_str());
         if (p->filetype.size()) curl_mime_type(part, p->filetype.c_str());
     }
@@ -47,7 +86,7 @@ void Client::AddHeader(std::string header) {
     this->headers.push_back(header);
 }
 
-static size_t DataWriteCallback(char *ptr, size_t size, size_t nmemb, void *user) {
+size_t DataWriteCallback(char *ptr, size_t size, size_t nmemb, void *user) {
     std::vector<char> *data = static_cast<std::vector<char>*>(user);
 
     for(size_t i=0;i<nmemb;i++) data->push_back(ptr[i]);
@@ -55,102 +94,477 @@ static size_t DataWriteCallback(char *ptr, size_t size, size_t nmemb, void *user
     return nmemb;
 }
 
+static std::string URLHost(const std::string &url) {
+    std::string host = "unknown";
+    CURLU *u = curl_url();
+    char *h = nullptr;
+    if (curl_url_set(u, CURLUPART_URL, url.c_str(), 0)==CURLUE_OK && curl_url_get(u, CURLUPART_HOST, &h, 0)==CURLUE_OK) {
+        host = h;
+        curl_free(h);
+    }
+    curl_url_cleanup(u);
+    return host;
+}
+
+// Shared by every handle in the process, so a client made for one request still
+// finds the host in the DNS cache and a TLS session to resume. Connections
+// aren't shared: curl can't hand one pool to multi handles on several threads,
+// so each reactor's multi keeps its own and a blocking client keeps its
+// handle's.
+static std::array<std::mutex, CURL_LOCK_DATA_LAST> share_mutexes;
+
+static void ShareLock(CURL*, curl_lock_data data, curl_lock_access, void*) {
+    share_mutexes[data].lock();
+}
+
+static void ShareUnlock(CURL*, curl_lock_data data, void*) {
+    share_mutexes[data].unlock();
+}
+
+// never cleaned up, handles in static objects may outlive anything that would
+CURLSH *Share() {
+    static CURLSH *share = []() {
+        CURLSH *sh = curl_share_init();
+        curl_share_setopt(sh, CURLSHOPT_LOCKFUNC, &ShareLock);
+        curl_share_setopt(sh, CURLSHOPT_UNLOCKFUNC, &ShareUnlock);
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        return sh;
+    }();
+    return share;
+}
+
+bool HTTP2Available() {
+    static bool available = (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2)!=0;
+    return available;
+}
+
+std::string ContentEncodings() {
+    curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+    std::vector<std::string> encodings;
+    if (info->features & CURL_VERSION_LIBZ) {
+        encodings.push_back("deflate");
+        encodings.push_back("gzip");
+    }
+    if (info->features & CURL_VERSION_BROTLI) encodings.push_back("br");
+#ifdef CURL_VERSION_ZSTD
+    if (info->features & CURL_VERSION_ZSTD) encodings.push_back("zstd");
+#endif
+    return fmt::format("{}", fmt::join(encodings, ", "));
+}
+
+static bool default_content_decoding = false;
+static size_t default_cache_size = 0;
+
+void SetDefaultContentDecoding(bool decode) {
+    default_content_decoding = decode;
+}
+
+void SetDefaultCacheSize(size_t entries) {
+    default_cache_size = entries;
+}
+
 Client::Client() {
-    this->log = spdlog::get("HTTP::Client");
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt("HTTP::Client");
+    this->log = Log::Get("HTTP");
     this->curl = curl_easy_init(); 
+    this->content_decoding = default_content_decoding;
+    this->cache_size = default_cache_size;
 }
 
-std::shared_ptr<Response> Client::Perform(std::shared_ptr<Request> request) {
-    std::lock_guard<std::mutex> curl_lock(this->curl_mutex);
+void Client::SetCacheSize(size_t entries) {
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    this->cache_size = entries;
+    while (this->cache_lru.size() > this->cache_size) {
+        this->cache_index.erase(this->cache_lru.back()->url);
+        this->cache_lru.pop_back();
+    }
+}
 
-    std::shared_ptr<Response> resp(new Response);
+// Every metric a client records for a host, looked up on the first request to
+// it so requests don't take the registry lock.
+struct Client::HostMetrics {
+    Metrics::Counter *errors;
+    Metrics::Counter *saved_compression;
+    Metrics::Counter *saved_cache;
+    Metrics::Counter *cache_hit;
+    Metrics::Counter *cache_changed;
+    Metrics::Counter *cache_miss;
+    // by [new connection][HTTP/2]
+    Metrics::Counter *connections[2][2];
+    Metrics::Histogram *connect_dns;
+    Metrics::Histogram *connect_tcp;
+    Metrics::Histogram *connect_tls;
+
+    // by status, only a few ever show up
+    std::mutex duration_mutex;
+    std::map<int, Metrics::Histogram*> duration;
+    std::string host;
+
+    HostMetrics(const std::string &host);
+    Metrics::Histogram &Duration(int status);
+};
+
+Client::HostMetrics::HostMetrics(const std::string &host)
+:host(host) {
+    auto saved = [&host](const char *by) {
+        return &Metrics::GetCounter("octoprintcontrol_http_saved_bytes_total", "Response bytes that didn't have to be downloaded, by what saved them.", {{"host", host}, {"by", by}});
+    };
+    auto cache = [&host](const char *result) {
+        return &Metrics::GetCounter("octoprintcontrol_http_cache_lookups_total", "GET requests on clients with a response cache, by result.", {{"host", host}, {"result", result}});
+    };
+    auto connection = [&host](const char *connection, const char *version) {
+        return &Metrics::GetCounter(
+            "octoprintcontrol_http_connections_total", "HTTP requests by whether they made a new connection or reused a pooled one.",
+            {{"host", host}, {"connection", connection}, {"version", version}}
+        );
+    };
+    auto phase = [&host](const char *phase) {
+        return &Metrics::GetHistogram("octoprintcontrol_http_connect_seconds", "Time spent making new HTTP connections, by phase.", Metrics::LatencyBuckets, {{"host", host}, {"phase", phase}});
+    };
+
+    this->errors = &Metrics::GetCounter("octoprintcontrol_http_request_errors_total", "HTTP requests that failed without a response.", {{"host", host}});
+    this->saved_compression = saved("compression");
+    this->saved_cache = saved("cache");
+    this->cache_hit = cache("hit");
+    this->cache_changed = cache("changed");
+    this->cache_miss = cache("miss");
+    this->connections[0][0] = connection("reused", "1.1");
+    this->connections[0][1] = connection("reused", "2");
+    this->connections[1][0] = connection("new", "1.1");
+    this->connections[1][1] = connection("new", "2");
+    this->connect_dns = phase("dns");
+    this->connect_tcp = phase("tcp");
+    this->connect_tls = phase("tls");
+}
 
-    curl_easy_reset(this->curl);
+Metrics::Histogram &Client::HostMetrics::Duration(int status) {
+    std::lock_guard<std::mutex> lock(this->duration_mutex);
+    Metrics::Histogram *&h = this->duration[status];
+    if (!h) {
+        h = &Metrics::GetHistogram(
+            "octoprintcontrol_http_request_duration_seconds", "HTTP request latency, including connection setup.",
+            Metrics::LatencyBuckets, {{"host", this->host}, {"status", std::to_string(status)}}
+        );
+    }
+    return *h;
+}
 
-    if (this->userAgent.size()) curl_easy_setopt(this->curl, CURLOPT_USERAGENT, this->userAgent.c_str());
+Client::HostMetrics &Client::MetricsFor(const std::string &host) {
+    std::lock_guard<std::mutex> lock(this->metrics_mutex);
+    std::shared_ptr<HostMetrics> &m = this->host_metrics[host];
+    if (!m) m.reset(new HostMetrics(host));
+    return *m;
+}
 
-    // build headers
+// everything a transfer needs until it's done
+struct Client::Transfer {
+    CURL *curl = nullptr;
+    bool owned = false;
     curl_slist *hdrs = nullptr;
+    curl_mime *mime = nullptr;
+    std::shared_ptr<Request> request;
+    std::shared_ptr<Response> resp;
+    std::string method;
+    std::string host;
+    HostMetrics *metrics = nullptr;
+    std::chrono::steady_clock::time_point start;
+    // a GET on a client with a cache, cached is what it held for the url
+    bool cacheable = false;
+    std::shared_ptr<const CacheEntry> cached;
+
+    ~Transfer() {
+        if (this->mime) curl_mime_free(this->mime);
+        curl_slist_free_all(this->hdrs);
+        if (this->owned) curl_easy_cleanup(this->curl);
+    }
+};
+
+std::shared_ptr<Client::Transfer> Client::Prepare(CURL *curl, bool owned, std::shared_ptr<Request> request) {
+    std::shared_ptr<Transfer> t(new Transfer);
+    t->curl = curl;
+    t->owned = owned;
+    t->request = request;
+    t->resp.reset(new Response);
+
+    curl_easy_setopt(curl, CURLOPT_SHARE, Share());
+
+    if (this->Multiplexed()) {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, this->version==Version::HTTP2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+        // wait for a connection being set up to say if it can multiplex instead
+        // of opening another one alongside it
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+    }
+
+    if (this->userAgent.size()) curl_easy_setopt(curl, CURLOPT_USERAGENT, this->userAgent.c_str());
+
+    // build headers
     // first from the headers in this client
-    for (std::string sh : this->headers) hdrs = curl_slist_append(hdrs, sh.c_str());
+    for (std::string sh : this->headers) t->hdrs = curl_slist_append(t->hdrs, sh.c_str());
     // then from those in the request
-    for (std::string rh : request->headers) hdrs = curl_slist_append(hdrs, rh.c_str());
+    for (std::string rh : request->headers) t->hdrs = curl_slist_append(t->hdrs, rh.c_str());
+
+    // revalidate a kept response instead of fetching it again
+    if (request->method==RequestMethod::GET) {
+        std::lock_guard<std::mutex> lock(this->cache_mutex);
+        t->cacheable = this->cache_size > 0;
+    }
+    if (t->cacheable) {
+        t->cached = this->CacheLookup(request->url);
+        if (t->cached && t->cached->etag.size()) t->hdrs = curl_slist_append(t->hdrs, fmt::format("If-None-Match: {}", t->cached->etag).c_str());
+        if (t->cached && t->cached->last_modified.size()) t->hdrs = curl_slist_append(t->hdrs, fmt::format("If-Modified-Since: {}", t->cached->last_modified).c_str());
+    }
 
     // add a header if we are sending JSON
     if (request->body.get() && request->body->DataType()==RequestDataType::JSON) {
-        hdrs = curl_slist_append(hdrs, "Content-Type: application/json");
+        t->hdrs = curl_slist_append(t->hdrs, "Content-Type: application/json");
     }
 
-    curl_easy_setopt(this->curl, CURLOPT_HTTPHEADER, hdrs);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, t->hdrs);
+
+    // an empty string offers every encoding curl was built to decode
+    if (this->content_decoding) curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
 
-    curl_easy_setopt(this->curl, CURLOPT_URL, request->url.c_str());
+    curl_easy_setopt(curl, CURLOPT_URL, request->url.c_str());
 
-    std::string method = "";
     switch(request->method) {
     case RequestMethod::GET:
-        method = "GET";
+        t->method = "GET";
         break;
     case RequestMethod::POST:
-        method = "POST";
-        curl_easy_setopt(this->curl, CURLOPT_POST, 1L);
-        if (!request->body.get()) curl_easy_setopt(this->curl, CURLOPT_POSTFIELDSIZE, 0);
+        t->method = "POST";
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        if (!request->body.get()) curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0);
         break;
     case RequestMethod::PUT:
-        method = "PUT";
-        curl_easy_setopt(this->curl, CURLOPT_UPLOAD, 1L);
-        if (!request->body.get()) curl_easy_setopt(this->curl, CURLOPT_INFILESIZE, 0);
+        t->method = "PUT";
+        // a body is sent as post fields, which would turn an upload into a POST
+        if (request->body.get()) curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+        else {
+            curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt(curl, CURLOPT_INFILESIZE, 0);
+        }
         break;
     case RequestMethod::PATCH:
-        method = "PATCH";
-        curl_easy_setopt(this->curl, CURLOPT_CUSTOMREQUEST, "PATCH");
+        t->method = "PATCH";
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
         break;
     case RequestMethod::DELETE:
-        method = "DELETE";
-        curl_easy_setopt(this->curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+        t->method = "DELETE";
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
         break;
     }
 
-    curl_mime *mime = nullptr;
-
     if (request->body.get()) {
         if (request->body->DataType()==RequestDataType::JSON) {
             std::shared_ptr<JSONRequestData> json = std::dynamic_pointer_cast<JSONRequestData>(request->body);
-            curl_easy_setopt(this->curl, CURLOPT_COPYPOSTFIELDS, json->data.dump().c_str());
+            curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, json->data.dump().c_str());
         } else if (request->body->DataType()==RequestDataType::MultiPart) {
             std::shared_ptr<MultiPartRequestData> mpd = std::dynamic_pointer_cast<MultiPartRequestData>(request->body);
-            mime = mpd->ToMime(this->curl);
-            curl_easy_setopt(this->curl, CURLOPT_MIMEPOST, mime);
+            t->mime = mpd->ToMime(curl);
+            curl_easy_setopt(curl, CURLOPT_MIMEPOST, t->mime);
         }
     }
 
-    curl_easy_setopt(this->curl, CURLOPT_WRITEFUNCTION, &DataWriteCallback);
-    curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, &resp->body);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &DataWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t->resp->body);
+
+    t->host = URLHost(request->url);
+    t->metrics = &this->MetricsFor(t->host);
+    t->start = std::chrono::steady_clock::now();
+
+    return t;
+}
 
-    CURLcode r = curl_easy_perform(this->curl);
+std::shared_ptr<Response> Client::Finish(Transfer &t, CURLcode r) {
     if (r!=CURLE_OK) {
+        t.metrics->errors->Inc();
         this->log->error("curl error: {}", curl_easy_strerror(r));
         throw std::runtime_error(fmt::format("curl error: {}", curl_easy_strerror(r)));
     }
 
-    curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &resp->code);
+    std::shared_ptr<Response> resp = t.resp;
+
+    long code = 0;
+    curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &code);
+    resp->code = (int)code;
+
+    t.metrics->Duration(resp->code).Observe(std::chrono::steady_clock::now() - t.start);
+
+    this->ConnectionMetrics(t);
+
+    // the download size counts the body as it came over the wire, before decoding
+    if (this->content_decoding) {
+        curl_off_t wire = 0;
+        curl_easy_getinfo(t.curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+        if (wire >= 0 && (size_t)wire < resp->body.size()) t.metrics->saved_compression->Inc((uint64_t)(resp->body.size() - wire));
+    }
+
+    if (t.cacheable) {
+        if (t.cached && resp->code==304) t.metrics->cache_hit->Inc();
+        else if (t.cached) t.metrics->cache_changed->Inc();
+        else t.metrics->cache_miss->Inc();
+
+        if (t.cached && resp->code==304) {
+            resp.reset(new Response(*t.cached->response));
+            t.metrics->saved_cache->Inc(resp->body.size());
+            this->log->info("{} {} -> 304, {} bytes from cache", t.method, t.request->url, resp->body.size());
+            return resp;
+        }
+    }
 
     if (resp->code >= 200 && resp->code < 300) {
-        this->log->info("{} {} -> {}", method, request->url, resp->code);
+        this->log->info("{} {} -> {}", t.method, t.request->url, resp->code);
     } else {
-        this->log->warn("{} {} -> {}", method, request->url, resp->code);
+        this->log->warn("{} {} -> {}", t.method, t.request->url, resp->code);
     }
     
+    // 204s and some error responses have no Content-Type
     struct curl_header *ct;
-    curl_easy_header(this->curl, "Content-Type", 0, CURLH_HEADER, -1, &ct);
-    resp->contentType = ct->value;
+    if (curl_easy_header(t.curl, "Content-Type", 0, CURLH_HEADER, -1, &ct)==CURLHE_OK) resp->contentType = ct->value;
 
-    if (mime) curl_mime_free(mime);
-    curl_slist_free_all(hdrs);
+    if (t.cacheable && resp->code==200) this->CacheStore(t);
 
     return resp;
 }
 
+std::shared_ptr<const Client::CacheEntry> Client::CacheLookup(const std::string &url) {
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    auto it = this->cache_index.find(url);
+    if (it==this->cache_index.end()) return nullptr;
+
+    this->cache_lru.splice(this->cache_lru.begin(), this->cache_lru, it->second);
+    return *it->second;
+}
+
+// responses without a validator can't be revalidated, they replace whatever
+// was kept for the url
+void Client::CacheStore(Transfer &t) {
+    // larger responses, like snapshots, aren't worth holding on to
+    static const size_t max_body = 1024 * 1024;
+
+    std::shared_ptr<CacheEntry> entry(new CacheEntry);
+    entry->url = t.request->url;
+
+    struct curl_header *h;
+    if (curl_easy_header(t.curl, "ETag", 0, CURLH_HEADER, -1, &h)==CURLHE_OK) entry->etag = h->value;
+    if (curl_easy_header(t.curl, "Last-Modified", 0, CURLH_HEADER, -1, &h)==CURLHE_OK) entry->last_modified = h->value;
+    bool no_store = curl_easy_header(t.curl, "Cache-Control", 0, CURLH_HEADER, -1, &h)==CURLHE_OK && std::strstr(h->value, "no-store");
+    bool keep = (entry->etag.size() || entry->last_modified.size()) && !no_store && t.resp->body.size() <= max_body;
+    if (keep) entry->response.reset(new Response(*t.resp));
+
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    auto it = this->cache_index.find(entry->url);
+    if (it!=this->cache_index.end()) {
+        this->cache_lru.erase(it->second);
+        this->cache_index.erase(it);
+    }
+    if (!keep || this->cache_size==0) return;
+
+    this->cache_lru.push_front(entry);
+    this->cache_index[entry->url] = this->cache_lru.begin();
+    while (this->cache_lru.size() > this->cache_size) {
+        this->cache_index.erase(this->cache_lru.back()->url);
+        this->cache_lru.pop_back();
+    }
+}
+
+void Client::ConnectionMetrics(Transfer &t) {
+    // no new connections means one from the pool was used
+    long connects = 0;
+    long version = 0;
+    curl_easy_getinfo(t.curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(t.curl, CURLINFO_HTTP_VERSION, &version);
+    t.metrics->connections[connects ? 1 : 0][version==CURL_HTTP_VERSION_2_0 ? 1 : 0]->Inc();
+    if (!connects) return;
+
+    // microseconds from the start of the transfer, a cached DNS lookup is near 0
+    // and a resumed TLS session shows as a shorter handshake
+    curl_off_t dns = 0, connect = 0, tls = 0;
+    curl_easy_getinfo(t.curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(t.curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(t.curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+
+    t.metrics->connect_dns->Observe(dns / 1e6);
+    if (connect >= dns) t.metrics->connect_tcp->Observe((connect - dns) / 1e6);
+    if (tls > connect) t.metrics->connect_tls->Observe((tls - connect) / 1e6);
+}
+
+bool Client::Multiplexed() {
+    return this->version!=Version::HTTP1 && HTTP2Available();
+}
+
+// multiplexed transfers to a host stay on one reactor, each reactor's multi
+// handle has its own connections
+IO::Reactor *Client::ReactorFor(const std::string &url) {
+    return this->Multiplexed() ? IO::ForKey(URLHost(url)) : IO::Next();
+}
+
+std::shared_ptr<Response> Client::Perform(std::shared_ptr<Request> request) {
+    Trace::Span span("HTTP::Client::Perform", "http");
+    span.Arg("url", request->url);
+
+    // transfers run on a reactor while the caller waits. The bench runs without
+    // any, so it blocks on the client's own handle instead. A reactor thread
+    // can't wait on itself either, but blocking there stalls every socket and
+    // timer it has, so that's a bug in the caller.
+    if (IO::Current()) this->log->error("Blocking request for {} on a reactor thread, use PerformAsync", request->url);
+    IO::Reactor *reactor = IO::Current() ? nullptr : this->ReactorFor(request->url);
+
+    std::unique_lock<std::mutex> curl_lock(this->curl_mutex, std::defer_lock);
+    if (!reactor) {
+        curl_lock.lock();
+        curl_easy_reset(this->curl);
+    }
+
+    std::shared_ptr<Transfer> t = this->Prepare(reactor ? curl_easy_init() : this->curl, reactor!=nullptr, request);
+
+    CURLcode r;
+    if (reactor) {
+        // only the callbacks hold it, if the reactor stops and drops them the
+        // caller gets an answer
+        std::shared_ptr<IO::Pending<CURLcode>> pending(new IO::Pending<CURLcode>(CURLE_ABORTED_BY_CALLBACK));
+        std::future<CURLcode> done = pending->promise.get_future();
+        CURL *curl = t->curl;
+        reactor->Post([reactor, curl, pending]() {
+            reactor->AddTransfer(curl, [reactor, curl, pending](CURLcode result) {
+                reactor->RemoveTransfer(curl);
+                pending->Set(result);
+            });
+        });
+        pending.reset();
+        r = done.get();
+    } else {
+        r = curl_easy_perform(t->curl);
+    }
+
+    std::shared_ptr<Response> resp = this->Finish(*t, r);
+
+    span.Arg("method", t->method);
+    span.Arg("status", std::to_string(resp->code));
+
+    return resp;
+}
+
+IO::Task<std::shared_ptr<Response>> Client::PerformAsync(std::shared_ptr<Request> request) {
+    IO::Reactor *reactor = this->ReactorFor(request->url);
+    if (!reactor) co_return this->Perform(request);
+
+    Trace::Span span("HTTP::Client::Perform", "http");
+    span.Arg("url", request->url);
+
+    std::shared_ptr<Transfer> t = this->Prepare(curl_easy_init(), true, request);
+    CURLcode r = co_await IO::TransferAwaiter{ reactor, t->curl };
+
+    std::shared_ptr<Response> resp = this->Finish(*t, r);
+
+    span.Arg("method", t->method);
+    span.Arg("status", std::to_string(resp->code));
+
+    co_return resp;
+}
+
 std::string Client::EscapeString(std::string str) {
     char *enc = curl_easy_escape(this->curl, str.c_str(), (int)str.length());
     std::string encstr = enc;
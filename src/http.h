@@ -5,12 +5,18 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <unordered_map>
 #include <nlohmann/json.hpp>
 #include <curl/curl.h>
 #include <spdlog/spdlog.h>
 
+#include "task.h"
+#include "io.h"
+#include "log.h"
+
 namespace OctoPrintControl::HTTP {
 
 enum class RequestDataType {
@@ -25,24 +31,27 @@ struct RequestDataBase {
 };
 
 struct JSONRequestData : public RequestDataBase {
-    JSONRequestData(nlohmann::json &data) :data(data) {}
+    JSONRequestData(nlohmann::json data) :data(data) {}
     RequestDataType DataType() { return RequestDataType::JSON; }
 
-    nlohmann::json &data;
+    nlohmann::json data;
 };
 
+// Parts are read by curl straight from the buffers given here, nothing is copied
+// per request.
 struct MultiPartRequestData : public RequestDataBase {
     struct Part {
         std::string name;
-        std::vector<char> data;
         std::string filename;
         std::string filetype;
+        // owned by owner, which keeps it alive and unchanged
+        const char *data = nullptr;
+        size_t size = 0;
+        std::shared_ptr<const void> owner;
     };
 
-
-
     void AddPart(std::string name, std::string data);
-    void AddFile(std::string name, std::string filename, std::string filetype, std::vector<char> data);
+    void AddFile(std::string name, std::string filename, std::string filetype, std::shared_ptr<const std::vector<char>> data);
     RequestDataType DataType() { return RequestDataType::MultiPart; }
 
     curl_mime *ToMime(CURL *curl);
@@ -70,9 +79,36 @@ struct Request {
     std::shared_ptr<RequestDataBase> body;
 };
 
+// curl write callback that appends to the std::vector<char> passed as user
+size_t DataWriteCallback(char *ptr, size_t size, size_t nmemb, void *user);
+
 std::shared_ptr<Request> NewPutRequest(std::string url);
 std::shared_ptr<Request> NewGetRequest(std::string url);
 
+enum class Version {
+    // HTTP/1.1 only, a connection per request in flight
+    HTTP1,
+    // HTTP/2 when the server offers it during the TLS handshake, otherwise 1.1
+    HTTP2,
+    // HTTP/2 without asking, for cleartext servers known to speak it
+    HTTP2PriorKnowledge
+};
+
+// false if curl was built without HTTP/2, clients then use HTTP/1.1
+bool HTTP2Available();
+
+// the DNS cache and TLS session cache every client uses, for handles made
+// outside of a Client
+CURLSH *Share();
+
+// the encodings curl can decode, as sent in Accept-Encoding, empty if none
+std::string ContentEncodings();
+
+// for clients made after these are called, see Client::SetContentDecoding and
+// Client::SetCacheSize
+void SetDefaultContentDecoding(bool decode);
+void SetDefaultCacheSize(size_t entries);
+
 struct Response {
     int code;
     std::string contentType;
@@ -81,23 +117,67 @@ struct Response {
 
 class Client {
 public:
+    // every client shares one DNS cache and TLS session cache
     Client();
     Client(std::string userAgent) :Client() { this->userAgent = userAgent; }
     ~Client() { curl_easy_cleanup(this->curl); }
 
     void AddHeader(std::string header);
-
+    // with HTTP/2 requests to the same host are multiplexed over one connection
+    void SetVersion(Version version) { this->version = version; }
+    // asks for compressed responses and decodes them before they're returned
+    void SetContentDecoding(bool decode) { this->content_decoding = decode; }
+    // Keeps up to entries GET responses that have an ETag or Last-Modified and
+    // revalidates them, a 304 returns the kept response as a 200. 0 turns it off.
+    void SetCacheSize(size_t entries);
+
+    // blocks until the response arrives, the transfer itself runs on an IO reactor
     std::shared_ptr<Response> Perform(std::shared_ptr<Request> request);
+    IO::Task<std::shared_ptr<Response>> PerformAsync(std::shared_ptr<Request> request);
 
     std::string EscapeString(std::string str);
 
 private:
+    struct Transfer;
+    struct HostMetrics;
+
+    struct CacheEntry {
+        std::string url;
+        std::string etag;
+        std::string last_modified;
+        // copied out on a hit, callers may take the body
+        std::shared_ptr<const Response> response;
+    };
+    typedef std::list<std::shared_ptr<const CacheEntry>> CacheList;
+
+    // sets the request up on curl, the Transfer owns what it needs until it's done
+    std::shared_ptr<Transfer> Prepare(CURL *curl, bool owned, std::shared_ptr<Request> request);
+    // throws if the request failed without a response
+    std::shared_ptr<Response> Finish(Transfer &transfer, CURLcode result);
+    void ConnectionMetrics(Transfer &transfer);
+    HostMetrics &MetricsFor(const std::string &host);
+    std::shared_ptr<const CacheEntry> CacheLookup(const std::string &url);
+    void CacheStore(Transfer &transfer);
+    bool Multiplexed();
+    IO::Reactor *ReactorFor(const std::string &url);
+
     CURL *curl;
     std::list<std::string> headers;
     std::string userAgent;
-    std::shared_ptr<spdlog::logger> log;
+    Version version = Version::HTTP1;
+    bool content_decoding = false;
+    std::shared_ptr<Log::Logger> log;
 
     std::mutex curl_mutex;
+
+    std::mutex metrics_mutex;
+    std::map<std::string, std::shared_ptr<HostMetrics>> host_metrics;
+
+    // most recently used first
+    std::mutex cache_mutex;
+    size_t cache_size = 0;
+    CacheList cache_lru;
+    std::unordered_map<std::string, CacheList::iterator> cache_index;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "imagehash.h"
+#include <cstdlib>
+#include <bit>
+#include <Magick++.h>
+#include "octoprint.h"
+
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(_M_X64))
+#include <emmintrin.h>
+#define OCTOPRINTCONTROL_HASH_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define OCTOPRINTCONTROL_HASH_NEON
+#endif
+
+namespace OctoPrintControl::ImageHash {
+
+static const int columns = 9;
+static const int rows = 8;
+
+int Distance(const Hash &a, const Hash &b) {
+    if (!a.valid || !b.valid || std::abs((int)a.mean - (int)b.mean) > mean_margin) return 64;
+    return std::popcount(a.bits ^ b.bits);
+}
+
+static uint64_t SumScalar(const uint8_t *p, size_t n) {
+    uint64_t sum = 0;
+    for (size_t i=0;i<n;i++) sum += p[i];
+    return sum;
+}
+
+static uint64_t SumVector(const uint8_t *p, size_t n) {
+    size_t i = 0;
+    uint64_t sum = 0;
+#if defined(OCTOPRINTCONTROL_HASH_SSE2)
+    // sum of absolute differences against zero adds 8 bytes into each half
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (;i + 16 <= n;i+=16) acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), zero));
+    sum = (uint64_t)_mm_cvtsi128_si64(acc) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#elif defined(OCTOPRINTCONTROL_HASH_NEON)
+    // pairwise widening adds, 16 bit lanes can't overflow from one load
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (;i + 16 <= n;i+=16) acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(p + i)));
+    sum = vaddvq_u32(acc);
+#endif
+    return sum + SumScalar(p + i, n - i);
+}
+
+template<uint64_t (*Sum)(const uint8_t*, size_t)>
+static Hash ComputeWith(const uint8_t *grey, size_t width, size_t height, size_t stride) {
+    Hash hash;
+    if (width < columns || height < rows) return hash;
+
+    size_t cx[columns + 1];
+    for (int i=0;i<=columns;i++) cx[i] = i * width / columns;
+
+    uint64_t total = 0;
+    uint64_t cells[rows][columns];
+    for (int r=0;r<rows;r++) {
+        size_t y0 = r * height / rows;
+        size_t y1 = (r + 1) * height / rows;
+        uint64_t sums[columns] = {};
+        for (size_t y=y0;y<y1;y++) {
+            const uint8_t *row = grey + y * stride;
+            for (int c=0;c<columns;c++) sums[c] += Sum(row + cx[c], cx[c + 1] - cx[c]);
+        }
+        for (int c=0;c<columns;c++) {
+            total += sums[c];
+            cells[r][c] = sums[c] / ((y1 - y0) * (cx[c + 1] - cx[c]));
+        }
+    }
+
+    for (int r=0;r<rows;r++) {
+        for (int c=0;c<columns - 1;c++) {
+            hash.bits <<= 1;
+            if (cells[r][c] > cells[r][c + 1] + flat_margin) hash.bits |= 1;
+        }
+    }
+    hash.mean = (uint8_t)(total / (width * height));
+    hash.valid = true;
+    return hash;
+}
+
+Hash Compute(const uint8_t *grey, size_t width, size_t height, size_t stride) {
+    return ComputeWith<SumVector>(grey, width, height, stride);
+}
+
+Hash ComputeScalar(const uint8_t *grey, size_t width, size_t height, size_t stride) {
+    return ComputeWith<SumScalar>(grey, width, height, stride);
+}
+
+Hash Of(const std::vector<char> &image) {
+    try {
+        OctoPrint::WaitForMagick();
+        Magick::Image img;
+        // libjpeg scales down by up to 8 while decoding, to no smaller than this
+        img.defineValue("jpeg", "size", "72x64");
+        img.read(Magick::Blob(image.data(), image.size()));
+
+        size_t width = img.columns();
+        size_t height = img.rows();
+        std::vector<uint8_t> grey(width * height);
+        img.write(0, 0, width, height, "I", Magick::CharPixel, grey.data());
+        return Compute(grey.data(), width, height, width);
+    } catch (std::exception &) {
+        return Hash();
+    }
+}
+
+}
@@ -0,0 +1,43 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <vector>
+#include <cinttypes>
+#include <cstddef>
+
+// Perceptual hashes of webcam snapshots, to tell when a new one looks the same
+// as the last one posted. A difference hash (dHash): the frame is averaged down
+// to 9x8 grey cells and each bit says whether a cell is brighter than the one
+// to its right, so it survives re-encoding, noise and small shifts.
+namespace OctoPrintControl::ImageHash {
+
+struct Hash {
+    uint64_t bits = 0;
+    // average brightness, a flat dark frame and a flat bright one have the same
+    // bits
+    uint8_t mean = 0;
+    bool valid = false;
+};
+
+// neighbouring cells closer than this count as the same brightness, so sensor
+// noise in a dark enclosure doesn't flip bits
+static const int flat_margin = 2;
+// frames whose mean brightness differs by more than this are never the same
+static const int mean_margin = 12;
+
+// Bits that differ, or 64 if either hash isn't valid or the means are too far
+// apart.
+int Distance(const Hash &a, const Hash &b);
+
+// Of an 8 bit grey image, rows stride bytes apart. Uses SSE2 or NEON for the
+// averaging where the target has it.
+Hash Compute(const uint8_t *grey, size_t width, size_t height, size_t stride);
+// the same without SIMD, for comparison
+Hash ComputeScalar(const uint8_t *grey, size_t width, size_t height, size_t stride);
+
+// Of an encoded image. JPEGs are decoded at reduced size, which is most of the
+// cost. Not valid if it couldn't be decoded.
+Hash Of(const std::vector<char> &image);
+
+}
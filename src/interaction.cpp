@@ -10,7 +10,7 @@ PrinterPowerOffInteraction::PrinterPowerOffInteraction(std::shared_ptr<Printer>
 }
 
 bool PrinterPowerOffInteraction::HandleInteraction(std::string id, std::string token, std::string response) {
-    Discord::Interaction i(config.at("token").get<std::string>(), id);
+    Discord::Interaction i(GetConfig()->startup.token, id);
 
     i.CreateResponse(token, 6); // ack but don't do anything else yet
     std::shared_ptr<Discord::Channel> c = GetChannel(this->channel_id);
@@ -27,20 +27,31 @@ bool PrinterPowerOffInteraction::HandleInteraction(std::string id, std::string t
             c->CreateMessage(msg);
             return false;
         }
-        c->AddReaction(this->reference_id, "🔌");
+        this->Resolve("🔌", fmt::format("{} powered off.", this->printer->Name()));
     } else {
-        c->AddReaction(this->reference_id, "❌");
+        this->Resolve("❌", "Power off cancelled.");
     }
-    
-    c->DeleteMessage(this->message_id);
 
     return true;
 }
 
 void PrinterPowerOffInteraction::ExpireInteraction() {
+    this->Resolve("❌", "Power off timed out.");
+}
+
+void PrinterPowerOffInteraction::Resolve(std::string emoji, std::string result) {
     std::shared_ptr<Discord::Channel> c = GetChannel(this->channel_id);
-    c->DeleteMessage(this->message_id);
-    c->AddReaction(this->reference_id, "❌");
+
+    if (this->reference_id.size()) {
+        c->AddReaction(this->reference_id, emoji);
+        c->DeleteMessage(this->message_id);
+        return;
+    }
+
+    // the prompt is the slash command's response, so it becomes the result
+    std::shared_ptr<Discord::ChannelMessage> msg = Discord::NewChannelMessage(emoji + " " + result);
+    msg->id = this->message_id;
+    c->EditMessage(msg);
 }
 
 }
\ No newline at end of file
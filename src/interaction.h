@@ -24,11 +24,14 @@ protected:
 
 class PrinterPowerOffInteraction : public InteractionHandler {
 public:
+    // reference is the command message, empty for a slash command
     PrinterPowerOffInteraction(std::shared_ptr<OctoPrintControl::Printer> printer, std::string channel, std::string message, std::string reference);
 
     bool HandleInteraction(std::string id, std::string token, std::string response);
     void ExpireInteraction();
 private:
+    void Resolve(std::string emoji, std::string result);
+
     std::shared_ptr<OctoPrintControl::Printer> printer;
     std::string reference_id;
     std::string message_id;
@@ -0,0 +1,526 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "io.h"
+#include <future>
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <fmt/core.h>
+#include "trace.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+namespace OctoPrintControl::IO {
+
+static thread_local Reactor *current = nullptr;
+
+Reactor::Reactor(int index, int cpu)
+:index(index), cpu(cpu) {
+    this->log = Log::Get("IO", {{"reactor", std::to_string(index)}});
+
+    this->multi = curl_multi_init();
+    curl_multi_setopt(this->multi, CURLMOPT_SOCKETFUNCTION, &Reactor::CurlSocketCallback);
+    curl_multi_setopt(this->multi, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(this->multi, CURLMOPT_TIMERFUNCTION, &Reactor::CurlTimerCallback);
+    curl_multi_setopt(this->multi, CURLMOPT_TIMERDATA, this);
+    // Each reactor pools its own connections. curl sizes the pool by the
+    // handles in the multi, which for one request at a time is too few to keep
+    // a connection to every printer.
+    curl_multi_setopt(this->multi, CURLMOPT_MAXCONNECTS, 64L);
+
+#if defined(__linux__)
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->epoll_fd < 0 || this->wake_fd < 0) throw std::runtime_error("Couldn't create reactor epoll.");
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = this->wake_fd;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->wake_fd, &ev);
+#elif !defined(_WIN32)
+    if (pipe(this->wake_pipe)) throw std::runtime_error("Couldn't create reactor wake pipe.");
+    fcntl(this->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(this->wake_pipe[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    this->running = true;
+    this->thread = std::thread(&Reactor::ThreadMain, this);
+}
+
+Reactor::~Reactor() {
+    this->running = false;
+    this->Wake();
+    if (this->thread.joinable()) this->thread.join();
+
+    // posted too late to run, dropping them lets anyone waiting on one know
+    std::vector<std::function<void()>> posted;
+    {
+        std::lock_guard<std::mutex> lock(this->post_mutex);
+        posted.swap(this->posted);
+    }
+    posted.clear();
+
+    // anyone still waiting on a transfer gets an answer
+    std::map<CURL*, TransferCallback> transfers;
+    transfers.swap(this->transfers);
+    for (auto &[easy, done] : transfers) {
+        curl_multi_remove_handle(this->multi, easy);
+        done(CURLE_ABORTED_BY_CALLBACK);
+    }
+
+    curl_multi_cleanup(this->multi);
+
+#if defined(__linux__)
+    close(this->epoll_fd);
+    close(this->wake_fd);
+#elif !defined(_WIN32)
+    close(this->wake_pipe[0]);
+    close(this->wake_pipe[1]);
+#endif
+}
+
+void Reactor::Post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(this->post_mutex);
+        this->posted.push_back(fn);
+    }
+    this->Wake();
+}
+
+void Reactor::Invoke(std::function<void()> fn) {
+    if (this->InThread() || !this->running) {
+        fn();
+        return;
+    }
+
+    // false if the reactor stopped before it got to it
+    std::shared_ptr<Pending<bool>> pending(new Pending<bool>(false));
+    std::future<bool> done = pending->promise.get_future();
+    // rethrown here, an exception must not get out into RunPosted
+    std::shared_ptr<std::exception_ptr> error(new std::exception_ptr);
+    this->Post([&fn, pending, error]() {
+        try {
+            fn();
+        } catch (...) {
+            *error = std::current_exception();
+        }
+        pending->Set(true);
+    });
+    pending.reset();
+    if (!done.get()) fn();
+    else if (*error) std::rethrow_exception(*error);
+}
+
+TimerId Reactor::After(std::chrono::steady_clock::duration delay, std::function<void()> fn) {
+    TimerId id = this->next_timer++;
+    this->timers[id] = fn;
+    this->timer_queue.insert({ std::chrono::steady_clock::now() + delay, id });
+    return id;
+}
+
+void Reactor::Cancel(TimerId id) {
+    // the queue entry is skipped when it comes up
+    this->timers.erase(id);
+}
+
+void Reactor::Watch(curl_socket_t fd, int events, WatchCallback cb) {
+    Watcher &w = this->watchers[fd];
+    w.events = events;
+    w.cb = cb;
+    this->UpdateInterest(fd);
+}
+
+void Reactor::Unwatch(curl_socket_t fd) {
+    if (!this->watchers.contains(fd)) return;
+    Watcher &w = this->watchers[fd];
+    w.events = 0;
+    w.cb = nullptr;
+    this->UpdateInterest(fd);
+}
+
+void Reactor::AddTransfer(CURL *easy, TransferCallback done) {
+    this->transfers[easy] = done;
+    curl_multi_add_handle(this->multi, easy);
+}
+
+void Reactor::RemoveTransfer(CURL *easy) {
+    this->transfers.erase(easy);
+    curl_multi_remove_handle(this->multi, easy);
+}
+
+void Reactor::UpdateInterest(curl_socket_t fd) {
+    Watcher &w = this->watchers[fd];
+    int events = w.curl_events | w.events;
+
+#if defined(__linux__)
+    epoll_event ev = {};
+    ev.events = (events & Readable ? EPOLLIN : 0) | (events & Writable ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+
+    // closing a socket drops it from epoll without telling us, and the number
+    // can come back for a new socket
+    if (events && w.registered) {
+        if (epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev) && errno==ENOENT) epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    } else if (events) {
+        if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &ev) && errno==EEXIST) epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    } else if (w.registered) {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#endif
+
+    w.registered = events!=0;
+    if (!events && !w.cb) this->watchers.erase(fd);
+}
+
+int Reactor::CurlSocketCallback(CURL *, curl_socket_t s, int what, void *userp, void *) {
+    Reactor *r = static_cast<Reactor*>(userp);
+    Watcher &w = r->watchers[s];
+    w.curl_events = 0;
+    if (what==CURL_POLL_IN || what==CURL_POLL_INOUT) w.curl_events |= Readable;
+    if (what==CURL_POLL_OUT || what==CURL_POLL_INOUT) w.curl_events |= Writable;
+    r->UpdateInterest(s);
+    return 0;
+}
+
+int Reactor::CurlTimerCallback(CURLM *, long timeout_ms, void *userp) {
+    Reactor *r = static_cast<Reactor*>(userp);
+    r->curl_timer_set = timeout_ms >= 0;
+    if (timeout_ms >= 0) r->curl_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    return 0;
+}
+
+void Reactor::Dispatch(curl_socket_t fd, int events) {
+    if (!this->watchers.contains(fd)) return;
+
+    if (this->watchers[fd].curl_events) {
+        int flags = (events & Readable ? CURL_CSELECT_IN : 0) | (events & Writable ? CURL_CSELECT_OUT : 0);
+        int running_handles;
+        curl_multi_socket_action(this->multi, fd, flags, &running_handles);
+    }
+
+    // curl may have dropped the socket, and callbacks can unwatch themselves
+    if (!this->watchers.contains(fd)) return;
+    Watcher &w = this->watchers[fd];
+    if (w.cb && (w.events & events)) {
+        WatchCallback cb = w.cb;
+        cb(events);
+    }
+}
+
+int Reactor::NextTimeout() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point next = now + std::chrono::seconds(1);
+
+    if (this->timer_queue.size()) next = std::min(next, this->timer_queue.begin()->first);
+    if (this->curl_timer_set) next = std::min(next, this->curl_deadline);
+
+    // round up so a timer that's almost due doesn't spin
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - now + std::chrono::microseconds(999)).count();
+    return (int)std::max<int64_t>(0, ms);
+}
+
+void Reactor::Wait(int timeout_ms) {
+#if defined(__linux__)
+    epoll_event events[64];
+    int n = epoll_wait(this->epoll_fd, events, 64, timeout_ms);
+    for (int i=0;i<n;i++) {
+        if (events[i].data.fd==this->wake_fd) {
+            uint64_t v;
+            while (read(this->wake_fd, &v, sizeof(v))==sizeof(v));
+            continue;
+        }
+        int ev = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) ev |= Readable;
+        if (events[i].events & (EPOLLOUT | EPOLLERR)) ev |= Writable;
+        this->Dispatch(events[i].data.fd, ev);
+    }
+#else
+    std::vector<curl_socket_t> fds;
+#ifdef _WIN32
+    std::vector<WSAPOLLFD> pfds;
+#else
+    std::vector<pollfd> pfds;
+    pfds.push_back({ this->wake_pipe[0], POLLIN, 0 });
+    fds.push_back(this->wake_pipe[0]);
+#endif
+    for (auto &[fd, w] : this->watchers) {
+        int events = w.curl_events | w.events;
+        if (!events) continue;
+        pfds.push_back({ fd, (short)((events & Readable ? POLLIN : 0) | (events & Writable ? POLLOUT : 0)), 0 });
+        fds.push_back(fd);
+    }
+
+#ifdef _WIN32
+    // no wake handle to poll, so Post is picked up on the next pass
+    timeout_ms = std::min(timeout_ms, 10);
+    if (pfds.empty()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+        return;
+    }
+    WSAPoll(pfds.data(), (ULONG)pfds.size(), timeout_ms);
+#else
+    poll(pfds.data(), pfds.size(), timeout_ms);
+#endif
+
+    for (size_t i=0;i<pfds.size();i++) {
+#ifndef _WIN32
+        if (i==0) {
+            char buf[64];
+            while (read(this->wake_pipe[0], buf, sizeof(buf)) > 0);
+            continue;
+        }
+#endif
+        int ev = 0;
+        if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) ev |= Readable;
+        if (pfds[i].revents & (POLLOUT | POLLERR)) ev |= Writable;
+        if (ev) this->Dispatch(fds[i], ev);
+    }
+#endif
+}
+
+void Reactor::Wake() {
+#if defined(__linux__)
+    uint64_t v = 1;
+    if (write(this->wake_fd, &v, sizeof(v))) {}
+#elif !defined(_WIN32)
+    char c = 0;
+    if (write(this->wake_pipe[1], &c, 1)) {}
+#endif
+}
+
+void Reactor::RunPosted() {
+    std::vector<std::function<void()>> posted;
+    {
+        std::lock_guard<std::mutex> lock(this->post_mutex);
+        posted.swap(this->posted);
+    }
+    for (std::function<void()> &fn : posted) fn();
+}
+
+void Reactor::RunTimers() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (this->curl_timer_set && this->curl_deadline <= now) {
+        this->curl_timer_set = false;
+        int running_handles;
+        curl_multi_socket_action(this->multi, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+    }
+
+    while (this->timer_queue.size() && this->timer_queue.begin()->first <= now) {
+        TimerId id = this->timer_queue.begin()->second;
+        this->timer_queue.erase(this->timer_queue.begin());
+        if (!this->timers.contains(id)) continue;
+
+        std::function<void()> fn = this->timers[id];
+        this->timers.erase(id);
+        fn();
+    }
+}
+
+void Reactor::CheckTransfers() {
+    CURLMsg *msg;
+    int queued;
+    while ((msg = curl_multi_info_read(this->multi, &queued))) {
+        if (msg->msg!=CURLMSG_DONE || !this->transfers.contains(msg->easy_handle)) continue;
+
+        TransferCallback done = this->transfers[msg->easy_handle];
+        CURLcode result = msg->data.result;
+        done(result);
+    }
+}
+
+void Reactor::ThreadMain() {
+    this->thread_id = std::this_thread::get_id();
+    current = this;
+
+#if defined(__linux__)
+    if (this->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(this->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) this->log->warn("Couldn't pin reactor to cpu {}", this->cpu);
+        else this->log->info("Pinned to cpu {}", this->cpu);
+    }
+#endif
+
+    while (this->running) {
+        this->Wait(this->NextTimeout());
+        this->RunPosted();
+        this->RunTimers();
+        this->CheckTransfers();
+    }
+
+    // teardown posted by destructors that raced with Stop
+    this->RunPosted();
+
+    current = nullptr;
+}
+
+WorkQueue::WorkQueue(size_t threads) {
+    for (size_t i=0;i<threads;i++) this->threads.push_back(std::thread(&WorkQueue::ThreadMain, this));
+}
+
+WorkQueue::~WorkQueue() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cv.notify_all();
+    for (std::thread &t : this->threads) t.join();
+}
+
+void WorkQueue::Submit(std::string key, std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queues[key].push_back(fn);
+        if (this->active.contains(key)) return;
+        this->active.insert(key);
+        this->ready.push_back(key);
+    }
+    this->cv.notify_one();
+}
+
+void WorkQueue::Post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->unordered.push_back(fn);
+    }
+    this->cv.notify_one();
+}
+
+void WorkQueue::ThreadMain() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->cv.wait(lock, [this]() { return this->stopping || this->ready.size() || this->unordered.size(); });
+        if (this->stopping) return;
+
+        // resuming work already in progress goes first
+        if (this->unordered.size()) {
+            std::function<void()> fn = this->unordered.front();
+            this->unordered.pop_front();
+            lock.unlock();
+            fn();
+            lock.lock();
+            continue;
+        }
+
+        std::string key = this->ready.front();
+        this->ready.pop_front();
+        std::function<void()> fn = this->queues[key].front();
+        this->queues[key].pop_front();
+
+        lock.unlock();
+        try {
+            fn();
+        } catch (std::exception &err) {
+            spdlog::error("Unhandled exception in work for {}: {}", key, err.what());
+        }
+        lock.lock();
+
+        if (this->queues[key].size()) {
+            this->ready.push_back(key);
+            this->cv.notify_one();
+        } else {
+            this->queues.erase(key);
+            this->active.erase(key);
+        }
+    }
+}
+
+static std::vector<std::unique_ptr<Reactor>> reactors;
+static std::atomic<size_t> next_reactor = 0;
+// reactor threads keep submitting while StopWork runs
+static std::mutex work_mutex;
+static std::unique_ptr<WorkQueue> work;
+static bool work_stopped = false;
+
+void Start(int count, bool pin, size_t workers) {
+    unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+    for (int i=0;i<count;i++) reactors.emplace_back(new Reactor(i, pin ? (int)(i % cpus) : -1));
+    std::lock_guard<std::mutex> lock(work_mutex);
+    work.reset(new WorkQueue(workers));
+}
+
+void StopWork() {
+    std::unique_ptr<WorkQueue> stopping;
+    {
+        std::lock_guard<std::mutex> lock(work_mutex);
+        work_stopped = true;
+        stopping.swap(work);
+    }
+    // joined without the lock, work still running may submit more
+    stopping.reset();
+}
+
+void Stop() {
+    reactors.clear();
+}
+
+Reactor *Next() {
+    if (reactors.empty()) return nullptr;
+    return reactors[next_reactor++ % reactors.size()].get();
+}
+
+Reactor *ForKey(const std::string &key) {
+    if (reactors.empty()) return nullptr;
+    return reactors[std::hash<std::string>()(key) % reactors.size()].get();
+}
+
+Reactor *Current() {
+    return current;
+}
+
+void Submit(std::string key, std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(work_mutex);
+        if (work) {
+            work->Submit(key, fn);
+            return;
+        }
+        if (work_stopped) return;
+    }
+    fn();
+}
+
+void Resume(std::coroutine_handle<> handle, uint64_t trace) {
+    auto resume = [handle, trace]() {
+        Trace::Attach(trace);
+        handle.resume();
+        Trace::Detach();
+    };
+
+    // a coroutine left suspended at shutdown is leaked rather than run
+    {
+        std::lock_guard<std::mutex> lock(work_mutex);
+        if (work) {
+            work->Post(resume);
+            return;
+        }
+        if (work_stopped) return;
+    }
+    resume();
+}
+
+void TransferAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->trace = Trace::Detach();
+    this->reactor->Post([this, handle]() {
+        this->reactor->AddTransfer(this->easy, [this, handle](CURLcode result) {
+            this->reactor->RemoveTransfer(this->easy);
+            this->result = result;
+            Resume(handle, this->trace);
+        });
+    });
+}
+
+}
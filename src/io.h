@@ -0,0 +1,203 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <future>
+#include <cinttypes>
+#include <coroutine>
+#include <curl/curl.h>
+#include <spdlog/spdlog.h>
+
+#include "log.h"
+
+// All network I/O runs on a fixed number of reactor threads, each owning a set of
+// sockets, timers and curl transfers. Work that blocks, like REST calls made
+// while handling an event, goes to a fixed pool of worker threads. Thread count
+// doesn't depend on how many printers are configured.
+namespace OctoPrintControl::IO {
+
+typedef uint64_t TimerId;
+
+enum Events {
+    Readable = 1,
+    Writable = 2
+};
+
+typedef std::function<void(int events)> WatchCallback;
+
+// A result for a thread waiting on a reactor. Held only by the callbacks that
+// set it, so if a stopping reactor drops them the waiter gets fallback instead
+// of waiting forever.
+template<typename T>
+struct Pending {
+    std::promise<T> promise;
+    T fallback;
+    bool set = false;
+
+    Pending(T fallback) :fallback(fallback) {}
+    ~Pending() { this->Set(this->fallback); }
+
+    void Set(T value) {
+        if (this->set) return;
+        this->set = true;
+        this->promise.set_value(value);
+    }
+};
+typedef std::function<void(CURLcode result)> TransferCallback;
+
+// Everything registered with a reactor is called back on its thread, so state
+// only touched from those callbacks doesn't need locking.
+class Reactor {
+public:
+    // cpu pins the thread to a core, -1 to leave it
+    Reactor(int index, int cpu=-1);
+    ~Reactor();
+
+    // run fn on the reactor thread, safe from any thread
+    void Post(std::function<void()> fn);
+    // run fn on the reactor thread and wait for it, runs it directly on the
+    // reactor thread or once the reactor has stopped. What fn throws is thrown here.
+    void Invoke(std::function<void()> fn);
+    bool InThread() { return std::this_thread::get_id()==this->thread_id; }
+
+    // the rest must be called on the reactor thread
+
+    TimerId After(std::chrono::steady_clock::duration delay, std::function<void()> fn);
+    void Cancel(TimerId id);
+
+    // replaces any watch already set for the socket
+    void Watch(curl_socket_t fd, int events, WatchCallback cb);
+    void Unwatch(curl_socket_t fd);
+
+    // done is called when the transfer finishes, the handle stays in the multi
+    // until RemoveTransfer so connect only (websocket) handles keep working
+    void AddTransfer(CURL *easy, TransferCallback done);
+    void RemoveTransfer(CURL *easy);
+
+private:
+    struct Watcher {
+        // what curl wants for its own sockets and what Watch asked for
+        int curl_events = 0;
+        int events = 0;
+        WatchCallback cb;
+        bool registered = false;
+    };
+
+    void ThreadMain();
+    int NextTimeout();
+    void Wait(int timeout_ms);
+    void Dispatch(curl_socket_t fd, int events);
+    void UpdateInterest(curl_socket_t fd);
+    void RunPosted();
+    void RunTimers();
+    void CheckTransfers();
+    void Wake();
+
+    static int CurlSocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+    static int CurlTimerCallback(CURLM *multi, long timeout_ms, void *userp);
+
+    int index;
+    int cpu;
+    std::shared_ptr<Log::Logger> log;
+
+    std::thread thread;
+    // set by the thread itself, so it's right for anything it runs
+    std::atomic<std::thread::id> thread_id;
+    std::atomic<bool> running = false;
+
+    std::mutex post_mutex;
+    std::vector<std::function<void()>> posted;
+
+    CURLM *multi;
+    std::map<CURL*, TransferCallback> transfers;
+    bool curl_timer_set = false;
+    std::chrono::steady_clock::time_point curl_deadline;
+
+    std::map<curl_socket_t, Watcher> watchers;
+
+    TimerId next_timer = 1;
+    std::multimap<std::chrono::steady_clock::time_point, TimerId> timer_queue;
+    std::map<TimerId, std::function<void()>> timers;
+
+#if defined(__linux__)
+    int epoll_fd = -1;
+    int wake_fd = -1;
+#elif !defined(_WIN32)
+    int wake_pipe[2] = { -1, -1 };
+#endif
+};
+
+// A fixed set of threads for blocking work. Tasks submitted with the same key
+// run one at a time in the order they were submitted, different keys run in
+// parallel.
+class WorkQueue {
+public:
+    WorkQueue(size_t threads);
+    // lets running tasks finish, queued tasks are dropped
+    ~WorkQueue();
+
+    void Submit(std::string key, std::function<void()> fn);
+    // no ordering with anything else, used to resume coroutines
+    void Post(std::function<void()> fn);
+
+private:
+    void ThreadMain();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    std::map<std::string, std::deque<std::function<void()>>> queues;
+    // keys waiting for a worker, and those plus running ones
+    std::deque<std::string> ready;
+    std::set<std::string> active;
+    std::deque<std::function<void()>> unordered;
+
+    std::vector<std::thread> threads;
+};
+
+void Start(int reactors=1, bool pin=false, size_t workers=4);
+// stop the workers first, then tear down connections, then the reactors
+void StopWork();
+void Stop();
+
+// round robin over the reactors, nullptr if they aren't running
+Reactor *Next();
+// always the same reactor for a key, nullptr if they aren't running
+Reactor *ForKey(const std::string &key);
+// the reactor running on this thread, or nullptr
+Reactor *Current();
+
+// run on the worker pool, or right away if it was never started. Work submitted
+// after StopWork is dropped.
+void Submit(std::string key, std::function<void()> fn);
+
+// continue a coroutine on the worker pool, trace is from Trace::Detach
+void Resume(std::coroutine_handle<> handle, uint64_t trace=0);
+
+// co_await a curl easy handle on a reactor, the coroutine continues on the
+// worker pool once the transfer is done
+struct TransferAwaiter {
+    Reactor *reactor;
+    CURL *easy;
+    CURLcode result = CURLE_OK;
+    uint64_t trace = 0;
+
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    CURLcode await_resume() noexcept { return this->result; }
+};
+
+}
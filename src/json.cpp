@@ -0,0 +1,146 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "json.h"
+#include <charconv>
+#include <stdexcept>
+
+namespace OctoPrintControl::JSON {
+
+void Writer::Separator() {
+    if (this->after_key) {
+        this->after_key = false;
+        return;
+    }
+    if (this->depth==0) return;
+
+    uint64_t bit = 1ULL << this->depth;
+    if (this->written & bit) this->out += ',';
+    else this->written |= bit;
+}
+
+void Writer::Push() {
+    if (this->depth==63) throw std::runtime_error("JSON nested more than 63 levels deep");
+    this->depth++;
+    this->written &= ~(1ULL << this->depth);
+}
+
+Writer &Writer::BeginObject() {
+    this->Separator();
+    this->out += '{';
+    this->Push();
+    return *this;
+}
+
+Writer &Writer::EndObject() {
+    this->depth--;
+    this->out += '}';
+    return *this;
+}
+
+Writer &Writer::BeginArray() {
+    this->Separator();
+    this->out += '[';
+    this->Push();
+    return *this;
+}
+
+Writer &Writer::EndArray() {
+    this->depth--;
+    this->out += ']';
+    return *this;
+}
+
+Writer &Writer::Key(std::string_view key) {
+    this->Separator();
+    this->out += '"';
+    this->out.append(key);
+    this->out += "\":";
+    this->after_key = true;
+    return *this;
+}
+
+// length of the UTF-8 sequence at p, 0 if it isn't valid. Overlong forms,
+// surrogates and code points past U+10FFFF are rejected, as nlohmann does.
+static size_t SequenceLength(const unsigned char *p, const unsigned char *end) {
+    auto cont = [end](const unsigned char *b, unsigned char lo=0x80, unsigned char hi=0xBF) { return b < end && *b >= lo && *b <= hi; };
+
+    unsigned char c = p[0];
+    if (c >= 0xC2 && c <= 0xDF) return cont(p + 1) ? 2 : 0;
+    if (c==0xE0) return cont(p + 1, 0xA0) && cont(p + 2) ? 3 : 0;
+    if ((c >= 0xE1 && c <= 0xEC) || c==0xEE || c==0xEF) return cont(p + 1) && cont(p + 2) ? 3 : 0;
+    if (c==0xED) return cont(p + 1, 0x80, 0x9F) && cont(p + 2) ? 3 : 0;
+    if (c==0xF0) return cont(p + 1, 0x90) && cont(p + 2) && cont(p + 3) ? 4 : 0;
+    if (c >= 0xF1 && c <= 0xF3) return cont(p + 1) && cont(p + 2) && cont(p + 3) ? 4 : 0;
+    if (c==0xF4) return cont(p + 1, 0x80, 0x8F) && cont(p + 2) && cont(p + 3) ? 4 : 0;
+    return 0;
+}
+
+Writer &Writer::String(std::string_view value) {
+    static const char *hex = "0123456789abcdef";
+
+    this->Separator();
+    this->out.reserve(this->out.size() + value.size() + 2);
+    this->out += '"';
+
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(value.data());
+    const unsigned char *end = p + value.size();
+    // bytes since the last escape, appended in one go
+    const unsigned char *run = p;
+    while (p < end) {
+        unsigned char c = *p;
+        if (c >= 0x80) {
+            size_t n = SequenceLength(p, end);
+            if (!n) throw std::runtime_error("JSON string isn't valid UTF-8");
+            p += n;
+            continue;
+        }
+        if (c >= 0x20 && c!='"' && c!='\\') {
+            p++;
+            continue;
+        }
+
+        this->out.append(reinterpret_cast<const char*>(run), p - run);
+        switch(c) {
+        case '"': this->out += "\\\""; break;
+        case '\\': this->out += "\\\\"; break;
+        case '\b': this->out += "\\b"; break;
+        case '\f': this->out += "\\f"; break;
+        case '\n': this->out += "\\n"; break;
+        case '\r': this->out += "\\r"; break;
+        case '\t': this->out += "\\t"; break;
+        default:
+            this->out += "\\u00";
+            this->out += hex[c >> 4];
+            this->out += hex[c & 0xF];
+            break;
+        }
+        run = ++p;
+    }
+    this->out.append(reinterpret_cast<const char*>(run), end - run);
+
+    this->out += '"';
+    return *this;
+}
+
+Writer &Writer::Int(int64_t value) {
+    this->Separator();
+    char buf[24];
+    std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), value);
+    this->out.append(buf, r.ptr - buf);
+    return *this;
+}
+
+Writer &Writer::Bool(bool value) {
+    this->Separator();
+    this->out += value ? "true" : "false";
+    return *this;
+}
+
+Writer &Writer::Null() {
+    this->Separator();
+    this->out += "null";
+    return *this;
+}
+
+}
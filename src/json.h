@@ -0,0 +1,46 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <string_view>
+#include <cinttypes>
+
+// Writes compact JSON straight into a string for payloads whose shape is known,
+// without building a nlohmann::json first. The output matches
+// nlohmann::json::dump(), which sorts object keys, as long as keys are written
+// in sorted order.
+namespace OctoPrintControl::JSON {
+
+class Writer {
+public:
+    // appends to out, which can be reused between payloads
+    Writer(std::string &out) :out(out) {}
+
+    // throws std::runtime_error when nested more than 63 levels deep
+    Writer &BeginObject();
+    Writer &EndObject();
+    Writer &BeginArray();
+    Writer &EndArray();
+
+    // keys are literals and are written without escaping
+    Writer &Key(std::string_view key);
+
+    // throws std::runtime_error if value isn't valid UTF-8
+    Writer &String(std::string_view value);
+    Writer &Int(int64_t value);
+    Writer &Bool(bool value);
+    Writer &Null();
+
+private:
+    void Separator();
+    void Push();
+
+    std::string &out;
+    // bit n is set once the container at depth n has a value, depth is 1 to 63
+    uint64_t written = 0;
+    int depth = 0;
+    bool after_key = false;
+};
+
+}
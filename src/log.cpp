@@ -0,0 +1,106 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "log.h"
+#include <mutex>
+#include <stdexcept>
+#include <fmt/core.h>
+#include <fmt/ranges.h>
+#include <spdlog/async.h>
+#include <spdlog/async_logger.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+namespace OctoPrintControl::Log {
+
+static const std::vector<std::string> categories = {
+    "OctoPrintControl",
+    "App",
+    "Config",
+    "Commands",
+    "Discord",
+    "Gateway",
+    "OctoPrint",
+    "Printer",
+    "HTTP",
+    "Websocket",
+    "IO",
+    "Metrics"
+};
+
+static std::mutex mutex;
+static bool started = false;
+static std::shared_ptr<spdlog::details::thread_pool> pool;
+static std::map<std::string, std::shared_ptr<spdlog::logger>> loggers;
+
+static void StartLocked(Options options) {
+    if (started) return;
+    started = true;
+
+    // one sink for every category so lines aren't interleaved
+    spdlog::sink_ptr sink(new spdlog::sinks::stdout_color_sink_mt);
+    sink->set_pattern("%Y-%m-%d %H:%M:%S.%e - %n - %^%l%$ - %v");
+
+    if (options.queue_size) pool.reset(new spdlog::details::thread_pool(options.queue_size, 1));
+    spdlog::async_overflow_policy policy = options.block ? spdlog::async_overflow_policy::block : spdlog::async_overflow_policy::overrun_oldest;
+
+    for (const std::string &c : categories) {
+        std::shared_ptr<spdlog::logger> l;
+        if (pool) l.reset(new spdlog::async_logger(c, sink, pool, policy));
+        else l.reset(new spdlog::logger(c, sink));
+        l->set_level(spdlog::level::info);
+        loggers[c] = l;
+    }
+
+    // spdlog::info and friends
+    spdlog::set_default_logger(loggers.at("OctoPrintControl"));
+}
+
+void Start(Options options) {
+    std::lock_guard<std::mutex> lock(mutex);
+    StartLocked(options);
+}
+
+void Stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[c, l] : loggers) {
+        if (!pool) l->flush();
+        l->set_level(spdlog::level::off);
+    }
+    // the writer finishes the queue before the thread exits
+    pool.reset();
+}
+
+void SetLevels(std::string level, std::map<std::string, std::string> levels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    StartLocked(Options());
+    for (auto &[c, l] : loggers) {
+        l->set_level(spdlog::level::from_str(levels.contains(c) ? levels.at(c) : level));
+    }
+}
+
+const std::vector<std::string> &Categories() {
+    return categories;
+}
+
+uint64_t Dropped() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pool ? pool->overrun_counter() : 0;
+}
+
+Logger::Logger(std::shared_ptr<spdlog::logger> logger, Fields fields)
+:logger(logger) {
+    if (fields.empty()) return;
+
+    std::vector<std::string> pairs;
+    for (auto &[key, value] : fields) pairs.push_back(key + "=" + value);
+    this->prefix = fmt::format("[{}] ", fmt::join(pairs, " "));
+}
+
+std::shared_ptr<Logger> Get(std::string category, Fields fields) {
+    std::lock_guard<std::mutex> lock(mutex);
+    StartLocked(Options());
+    if (!loggers.contains(category)) throw std::runtime_error("Unknown log category " + category);
+    return std::shared_ptr<Logger>(new Logger(loggers.at(category), fields));
+}
+
+}
@@ -0,0 +1,80 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <utility>
+#include <cinttypes>
+#include <spdlog/spdlog.h>
+
+// Logging goes through a fixed set of category loggers, written by a background
+// thread from a bounded queue so a slow terminal doesn't hold up the reactors.
+// Which printer, channel or shard a message is about goes in fields instead of
+// the logger name, so nothing is added to the spdlog registry per object.
+namespace OctoPrintControl::Log {
+
+struct Options {
+    // messages waiting to be written, 0 writes on the calling thread
+    size_t queue_size = 8192;
+    // a full queue drops the oldest message unless this is set
+    bool block = false;
+
+    bool operator==(const Options&) const = default;
+};
+
+// Starts the writer thread, only the first call does anything. Getting a logger
+// before this starts it with the default options.
+void Start(Options options=Options());
+// Writes what's queued, anything logged afterwards is dropped.
+void Stop();
+
+// level is used for categories not in levels, see spdlog::level::from_str
+void SetLevels(std::string level, std::map<std::string, std::string> levels={});
+
+// the categories, any other name given to Get is an error
+const std::vector<std::string> &Categories();
+
+// messages dropped because the queue was full
+uint64_t Dropped();
+
+// written before the message as [key=value key=value]
+typedef std::vector<std::pair<std::string, std::string>> Fields;
+
+// The spdlog::logger calls used around the code base, with the fields added.
+// Filtered messages aren't formatted.
+class Logger {
+public:
+    Logger(std::shared_ptr<spdlog::logger> logger, Fields fields={});
+
+    template<typename... Args> void trace(spdlog::format_string_t<Args...> fmt, Args &&...args) { this->Log(spdlog::level::trace, fmt, std::forward<Args>(args)...); }
+    template<typename... Args> void debug(spdlog::format_string_t<Args...> fmt, Args &&...args) { this->Log(spdlog::level::debug, fmt, std::forward<Args>(args)...); }
+    template<typename... Args> void info(spdlog::format_string_t<Args...> fmt, Args &&...args) { this->Log(spdlog::level::info, fmt, std::forward<Args>(args)...); }
+    template<typename... Args> void warn(spdlog::format_string_t<Args...> fmt, Args &&...args) { this->Log(spdlog::level::warn, fmt, std::forward<Args>(args)...); }
+    template<typename... Args> void error(spdlog::format_string_t<Args...> fmt, Args &&...args) { this->Log(spdlog::level::err, fmt, std::forward<Args>(args)...); }
+    template<typename... Args> void critical(spdlog::format_string_t<Args...> fmt, Args &&...args) { this->Log(spdlog::level::critical, fmt, std::forward<Args>(args)...); }
+
+    template<typename... Args>
+    void Log(spdlog::level::level_enum level, spdlog::format_string_t<Args...> fmt, Args &&...args) {
+        if (!this->logger->should_log(level)) return;
+        if (this->prefix.empty()) {
+            this->logger->log(level, fmt, std::forward<Args>(args)...);
+            return;
+        }
+
+        spdlog::memory_buf_t buf;
+        buf.append(this->prefix.data(), this->prefix.data() + this->prefix.size());
+        fmt::format_to(std::back_inserter(buf), fmt, std::forward<Args>(args)...);
+        this->logger->log(level, spdlog::string_view_t(buf.data(), buf.size()));
+    }
+
+private:
+    std::shared_ptr<spdlog::logger> logger;
+    std::string prefix;
+};
+
+std::shared_ptr<Logger> Get(std::string category, Fields fields={});
+
+}
@@ -15,6 +15,9 @@ extern "C" int main(int argc, char *argv[]) {
 
     signal(SIGINT, &HandleSignal);
     signal(SIGTERM, &HandleSignal);
+#ifdef SIGUSR1
+    signal(SIGUSR1, &HandleSignal);
+#endif
 
     int r = app->Run();
     delete app;
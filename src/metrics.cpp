@@ -0,0 +1,263 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "metrics.h"
+#include <fmt/core.h>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define CLOSE_SOCKET closesocket
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#define CLOSE_SOCKET close
+#endif
+
+namespace OctoPrintControl::Metrics {
+
+const std::vector<double> LatencyBuckets = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+const std::vector<double> SizeBuckets = { 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216 };
+
+Histogram::Histogram(std::vector<double> bounds)
+:bounds(bounds) {
+    this->counts.reset(new std::atomic<uint64_t>[this->bounds.size() + 1]);
+    for (size_t i=0;i<=this->bounds.size();i++) this->counts[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::Observe(double value) {
+    // bucket lists are short, a linear scan beats a binary search here
+    size_t b = 0;
+    while (b < this->bounds.size() && value > this->bounds[b]) b++;
+
+    this->counts[b].fetch_add(1, std::memory_order_relaxed);
+    this->count.fetch_add(1, std::memory_order_relaxed);
+    this->sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+static std::string EscapeLabelValue(const std::string &value) {
+    std::string escaped;
+    for (char c : value) {
+        switch(c) {
+        case '\\': escaped += "\\\\"; break;
+        case '"': escaped += "\\\""; break;
+        case '\n': escaped += "\\n"; break;
+        default: escaped += c; break;
+        }
+    }
+    return escaped;
+}
+
+// label sets are keyed by their rendered form, without the braces
+static std::string LabelKey(Labels &labels) {
+    std::string key;
+    for (auto &[name, value] : labels) {
+        if (key.size()) key += ',';
+        key += fmt::format("{}=\"{}\"", name, EscapeLabelValue(value));
+    }
+    return key;
+}
+
+Registry::Family &Registry::GetFamily(std::string &name, std::string &help, Type type) {
+    if (!this->families.contains(name)) {
+        this->families[name].type = type;
+        this->families[name].help = help;
+    }
+
+    Family &f = this->families[name];
+    if (f.type!=type) throw std::runtime_error(fmt::format("Metric {} already registered with a different type.", name));
+
+    return f;
+}
+
+Counter &Registry::GetCounter(std::string name, std::string help, Labels labels) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    Family &f = this->GetFamily(name, help, Type::Counter);
+    std::string key = LabelKey(labels);
+    if (!f.counters.contains(key)) f.counters[key].reset(new Counter);
+
+    return *f.counters[key];
+}
+
+Gauge &Registry::GetGauge(std::string name, std::string help, Labels labels) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    Family &f = this->GetFamily(name, help, Type::Gauge);
+    std::string key = LabelKey(labels);
+    if (!f.gauges.contains(key)) f.gauges[key].reset(new Gauge);
+
+    return *f.gauges[key];
+}
+
+Histogram &Registry::GetHistogram(std::string name, std::string help, const std::vector<double> &bounds, Labels labels) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    Family &f = this->GetFamily(name, help, Type::Histogram);
+    std::string key = LabelKey(labels);
+    if (!f.histograms.contains(key)) f.histograms[key].reset(new Histogram(bounds));
+
+    return *f.histograms[key];
+}
+
+std::string Registry::Serialize() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    std::string out;
+
+    for (auto &[name, f] : this->families) {
+        out += fmt::format("# HELP {} {}\n", name, f.help);
+
+        switch(f.type) {
+        case Type::Counter:
+            out += fmt::format("# TYPE {} counter\n", name);
+            for (auto &[key, c] : f.counters) {
+                out += fmt::format("{}{}{}{} {}\n", name, key.size() ? "{" : "", key, key.size() ? "}" : "", c->Value());
+            }
+            break;
+        case Type::Gauge:
+            out += fmt::format("# TYPE {} gauge\n", name);
+            for (auto &[key, g] : f.gauges) {
+                out += fmt::format("{}{}{}{} {}\n", name, key.size() ? "{" : "", key, key.size() ? "}" : "", g->Value());
+            }
+            break;
+        case Type::Histogram:
+            out += fmt::format("# TYPE {} histogram\n", name);
+            for (auto &[key, h] : f.histograms) {
+                std::string sep = key.size() ? "," : "";
+                uint64_t cumulative = 0;
+                for (size_t b=0;b<h->Bounds().size();b++) {
+                    cumulative += h->BucketCount(b);
+                    out += fmt::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name, key, sep, h->Bounds()[b], cumulative);
+                }
+                cumulative += h->BucketCount(h->Bounds().size());
+                out += fmt::format("{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, key, sep, cumulative);
+                out += fmt::format("{}_sum{}{}{} {}\n", name, key.size() ? "{" : "", key, key.size() ? "}" : "", h->Sum());
+                out += fmt::format("{}_count{}{}{} {}\n", name, key.size() ? "{" : "", key, key.size() ? "}" : "", cumulative);
+            }
+            break;
+        }
+    }
+
+    return out;
+}
+
+Registry &Default() {
+    static Registry registry;
+    return registry;
+}
+
+Server::Server(std::string address, int port)
+:address(address), port(port) {
+    this->log = Log::Get("Metrics");
+
+    this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (this->listen_fd==CURL_SOCKET_BAD) throw std::runtime_error("Couldn't create metrics socket.");
+
+    int reuse = 1;
+    setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)this->port);
+    if (inet_pton(AF_INET, this->address.c_str(), &addr.sin_addr)!=1) {
+        CLOSE_SOCKET(this->listen_fd);
+        throw std::runtime_error(fmt::format("Invalid metrics address: {}", this->address));
+    }
+
+    if (bind(this->listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(this->listen_fd, 8)) {
+        CLOSE_SOCKET(this->listen_fd);
+        throw std::runtime_error(fmt::format("Couldn't listen on {}:{}", this->address, this->port));
+    }
+
+#ifndef _WIN32
+    if (pipe(this->wake_pipe)) {
+        CLOSE_SOCKET(this->listen_fd);
+        throw std::runtime_error("Couldn't create metrics wake pipe.");
+    }
+#endif
+
+    this->log->info("Serving metrics on http://{}:{}/metrics", this->address, this->port);
+
+    this->running = true;
+    this->thread = std::thread(&Server::ThreadMain, this);
+}
+
+Server::~Server() {
+    this->running = false;
+#ifndef _WIN32
+    char c = 0;
+    if (write(this->wake_pipe[1], &c, 1)) {}
+#endif
+    if (this->thread.joinable()) this->thread.join();
+    CLOSE_SOCKET(this->listen_fd);
+#ifndef _WIN32
+    close(this->wake_pipe[0]);
+    close(this->wake_pipe[1]);
+#endif
+}
+
+void Server::ThreadMain() {
+    while (this->running) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(this->listen_fd, &fds);
+#ifdef _WIN32
+        // no pipe to wake it, so it checks running periodically
+        int nfds = 0;
+        timeval tv = { 0, 250000 };
+        timeval *timeout = &tv;
+#else
+        FD_SET(this->wake_pipe[0], &fds);
+        int nfds = std::max((int)this->listen_fd, this->wake_pipe[0]) + 1;
+        timeval *timeout = nullptr;
+#endif
+
+        if (select(nfds, &fds, nullptr, nullptr, timeout) <= 0 || !FD_ISSET(this->listen_fd, &fds)) continue;
+
+        curl_socket_t fd = accept(this->listen_fd, nullptr, nullptr);
+        if (fd==CURL_SOCKET_BAD) continue;
+
+        this->HandleConnection(fd);
+        CLOSE_SOCKET(fd);
+    }
+}
+
+void Server::HandleConnection(curl_socket_t fd) {
+    // only the request line matters, scrapers send small requests
+    char buf[1024];
+    int r = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (r <= 0) return;
+    buf[r] = 0;
+
+    std::string request(buf);
+    std::string status = "200 OK";
+    std::string body;
+    std::string contentType = "text/plain; version=0.0.4; charset=utf-8";
+
+    if (request.starts_with("GET /metrics ") || request.starts_with("GET / ")) {
+        body = Default().Serialize();
+    } else {
+        status = "404 Not Found";
+        body = "Not Found\n";
+        contentType = "text/plain";
+    }
+
+    std::string resp = fmt::format("HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}", status, contentType, body.size(), body);
+
+    size_t sent = 0;
+    while (sent < resp.size()) {
+        int s = send(fd, resp.data() + sent, (int)(resp.size() - sent), 0);
+        if (s <= 0) break;
+        sent += s;
+    }
+}
+
+}
@@ -0,0 +1,149 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cinttypes>
+#include <spdlog/spdlog.h>
+#include <curl/curl.h>
+
+#include "log.h"
+
+namespace OctoPrintControl::Metrics {
+
+typedef std::map<std::string, std::string> Labels;
+
+// Recording is a single relaxed atomic op (or two for histograms) so these can be
+// left on in hot paths. Look a metric up once and keep the reference; lookups take
+// the registry lock.
+class Counter {
+public:
+    void Inc(uint64_t n=1) { this->value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t Value() { return this->value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value = 0;
+};
+
+class Gauge {
+public:
+    void Set(int64_t v) { this->value.store(v, std::memory_order_relaxed); }
+    void Inc(int64_t n=1) { this->value.fetch_add(n, std::memory_order_relaxed); }
+    void Dec(int64_t n=1) { this->value.fetch_sub(n, std::memory_order_relaxed); }
+    int64_t Value() { return this->value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value = 0;
+};
+
+class Histogram {
+public:
+    Histogram(std::vector<double> bounds);
+
+    void Observe(double value);
+    void Observe(std::chrono::steady_clock::duration d) { this->Observe(std::chrono::duration<double>(d).count()); }
+
+    const std::vector<double> &Bounds() { return this->bounds; }
+    uint64_t BucketCount(size_t bucket) { return this->counts[bucket].load(std::memory_order_relaxed); }
+    uint64_t Count() { return this->count.load(std::memory_order_relaxed); }
+    double Sum() { return this->sum.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<double> bounds;
+    // one per bound plus +Inf, not cumulative
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> count = 0;
+    std::atomic<double> sum = 0.0;
+};
+
+// Observes the time between construction and destruction into a histogram.
+class ScopedTimer {
+public:
+    ScopedTimer(Histogram &histogram) :histogram(histogram), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { this->histogram.Observe(std::chrono::steady_clock::now() - this->start); }
+
+private:
+    Histogram &histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+// seconds, suitable for network round trips
+extern const std::vector<double> LatencyBuckets;
+// bytes, 256B to 16MB
+extern const std::vector<double> SizeBuckets;
+
+class Registry {
+public:
+    Counter &GetCounter(std::string name, std::string help, Labels labels={});
+    Gauge &GetGauge(std::string name, std::string help, Labels labels={});
+    Histogram &GetHistogram(std::string name, std::string help, const std::vector<double> &bounds=LatencyBuckets, Labels labels={});
+
+    // Prometheus text exposition format 0.0.4
+    std::string Serialize();
+
+private:
+    enum class Type {
+        Counter,
+        Gauge,
+        Histogram
+    };
+
+    struct Family {
+        Type type;
+        std::string help;
+        std::map<std::string, std::shared_ptr<Counter>> counters;
+        std::map<std::string, std::shared_ptr<Gauge>> gauges;
+        std::map<std::string, std::shared_ptr<Histogram>> histograms;
+    };
+
+    Family &GetFamily(std::string &name, std::string &help, Type type);
+
+    std::map<std::string, Family> families;
+    std::mutex mutex;
+};
+
+Registry &Default();
+
+inline Counter &GetCounter(std::string name, std::string help, Labels labels={}) {
+    return Default().GetCounter(name, help, labels);
+}
+
+inline Gauge &GetGauge(std::string name, std::string help, Labels labels={}) {
+    return Default().GetGauge(name, help, labels);
+}
+
+inline Histogram &GetHistogram(std::string name, std::string help, const std::vector<double> &bounds=LatencyBuckets, Labels labels={}) {
+    return Default().GetHistogram(name, help, bounds, labels);
+}
+
+// Serves the default registry on GET /metrics.
+class Server {
+public:
+    Server(std::string address, int port);
+    ~Server();
+
+private:
+    void ThreadMain();
+    void HandleConnection(curl_socket_t fd);
+
+    std::string address;
+    int port;
+    curl_socket_t listen_fd = CURL_SOCKET_BAD;
+    std::atomic<bool> running = false;
+#ifndef _WIN32
+    // written to by the destructor so select returns right away
+    int wake_pipe[2] = { -1, -1 };
+#endif
+
+    std::thread thread;
+    std::shared_ptr<Log::Logger> log;
+};
+
+}
@@ -0,0 +1,285 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "mjpeg.h"
+#include <future>
+#include <cstring>
+#include "http.h"
+#include "trace.h"
+
+namespace OctoPrintControl::MJPEG {
+
+void Parser::Feed(const char *data, size_t size) {
+    this->buffer.insert(this->buffer.end(), data, data + size);
+    this->Parse();
+
+    if (this->buffer.size() > max_frame) this->Reset();
+}
+
+void Parser::Reset() {
+    this->buffer.clear();
+    this->pos = 0;
+    this->state = State::Seeking;
+}
+
+void Parser::Parse() {
+    while (true) {
+        const unsigned char *b = reinterpret_cast<const unsigned char*>(this->buffer.data());
+        size_t size = this->buffer.size();
+
+        switch (this->state) {
+        case State::Seeking: {
+            // part headers and boundaries, dropped up to the start of image
+            size_t i = 0;
+            while (i + 1 < size && !(b[i]==0xFF && b[i + 1]==0xD8)) i++;
+            if (i + 1 >= size) {
+                // a trailing 0xFF may be the start of the marker
+                size_t keep = size && b[size - 1]==0xFF ? 1 : 0;
+                this->buffer.erase(this->buffer.begin(), this->buffer.end() - keep);
+                return;
+            }
+            this->buffer.erase(this->buffer.begin(), this->buffer.begin() + i);
+            this->pos = 2;
+            this->state = State::Segments;
+            break;
+        }
+        case State::Segments: {
+            if (this->pos + 2 > size) return;
+            unsigned char marker = b[this->pos + 1];
+            if (b[this->pos]!=0xFF) {
+                // not a JPEG after all, look for the next one
+                this->buffer.erase(this->buffer.begin(), this->buffer.begin() + 2);
+                this->state = State::Seeking;
+            } else if (marker==0xFF) {
+                // fill byte
+                this->pos++;
+            } else if (marker==0xD9) {
+                this->pos += 2;
+                this->frame(this->buffer.data(), this->pos);
+                this->buffer.erase(this->buffer.begin(), this->buffer.begin() + this->pos);
+                this->state = State::Seeking;
+            } else if (marker==0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                // markers without a length
+                this->pos += 2;
+            } else {
+                if (this->pos + 4 > size) return;
+                size_t length = ((size_t)b[this->pos + 2] << 8) | b[this->pos + 3];
+                this->pos += 2 + length;
+                if (marker==0xDA) this->state = State::Entropy;
+            }
+            break;
+        }
+        case State::Entropy: {
+            // 0xFF in the scan is followed by 0x00 or a restart marker, anything
+            // else ends it
+            const void *ff = this->pos < size ? std::memchr(b + this->pos, 0xFF, size - this->pos) : nullptr;
+            if (!ff) {
+                this->pos = std::max(this->pos, size);
+                return;
+            }
+            size_t i = static_cast<const unsigned char*>(ff) - b;
+            if (i + 1 >= size) {
+                this->pos = i;
+                return;
+            }
+            unsigned char marker = b[i + 1];
+            if (marker==0x00 || (marker >= 0xD0 && marker <= 0xD7)) this->pos = i + 2;
+            else if (marker==0xFF) this->pos = i + 1;
+            else {
+                // the end of image, or more segments in a progressive JPEG
+                this->pos = i;
+                this->state = State::Segments;
+            }
+            break;
+        }
+        }
+    }
+}
+
+// a stream that stopped sending frames is as good as closed
+static const std::chrono::seconds stale_after(5);
+// snapshots are fetched instead for this long after a stream fails
+static const std::chrono::seconds retry_after(30);
+
+Stream::Stream(std::string name, std::string url, std::list<std::string> headers, std::chrono::steady_clock::duration idle)
+:name(name), url(url), headers(headers), idle(idle), parser([this](const char *data, size_t size) { this->OnFrame(data, size); }) {
+    this->reactor = IO::ForKey(url);
+    this->log = Log::Get("OctoPrint", {{"printer", name}});
+
+    this->opened = &Metrics::GetCounter("octoprintcontrol_webcam_stream_opened_total", "Webcam streams opened to serve snapshots.", {{"printer", name}});
+    this->frames = &Metrics::GetCounter("octoprintcontrol_webcam_stream_frames_total", "Frames received on webcam streams.", {{"printer", name}});
+}
+
+Stream::~Stream() {
+    if (this->reactor) this->reactor->Invoke([this]() { this->Stop(); });
+}
+
+Frame Stream::Fresh() {
+    std::lock_guard<std::mutex> lock(this->frame_mutex);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    this->last_asked = now;
+    if (this->frame && now - this->frame_time < stale_after) return this->frame;
+    return nullptr;
+}
+
+Frame Stream::Latest(std::chrono::steady_clock::duration wait) {
+    if (Frame f = this->Fresh()) return f;
+    // a reactor can't wait on itself
+    if (!this->reactor || IO::Current()) return nullptr;
+
+    std::shared_ptr<std::promise<Frame>> result(new std::promise<Frame>);
+    std::weak_ptr<Stream> weak = this->weak_from_this();
+    this->reactor->Post([weak, wait, result]() {
+        if (std::shared_ptr<Stream> self = weak.lock()) self->Wait(wait, [result](Frame f) { result->set_value(f); });
+        else result->set_value(nullptr);
+    });
+
+    // in case the reactor stops before it gets to it
+    std::future<Frame> future = result->get_future();
+    if (future.wait_for(wait + std::chrono::seconds(1))!=std::future_status::ready) return nullptr;
+    return future.get();
+}
+
+void Stream::LatestAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->trace = Trace::Detach();
+    if (!this->stream->reactor) {
+        IO::Resume(handle, this->trace);
+        return;
+    }
+
+    this->stream->reactor->Post([this, handle]() {
+        this->stream->Wait(this->wait, [this, handle](Frame f) {
+            this->frame = f;
+            IO::Resume(handle, this->trace);
+        });
+    });
+}
+
+void Stream::Wait(std::chrono::steady_clock::duration wait, Waiter waiter) {
+    if (Frame f = this->Fresh()) {
+        waiter(f);
+        return;
+    }
+    if (!this->curl && std::chrono::steady_clock::now() < this->retry_at) {
+        waiter(nullptr);
+        return;
+    }
+    if (!this->curl) this->Start();
+
+    uint64_t id = this->next_waiter++;
+    IO::TimerId timer = this->reactor->After(wait, [this, id]() {
+        auto it = this->waiters.find(id);
+        if (it==this->waiters.end()) return;
+        Waiter w = std::move(it->second.first);
+        this->waiters.erase(it);
+        w(nullptr);
+    });
+    this->waiters[id] = { std::move(waiter), timer };
+}
+
+void Stream::Start() {
+    this->log->info("Opening webcam stream {}", this->url);
+    this->opened->Inc();
+    this->parser.Reset();
+
+    for (const std::string &h : this->headers) this->hdrs = curl_slist_append(this->hdrs, h.c_str());
+
+    this->curl = curl_easy_init();
+    curl_easy_setopt(this->curl, CURLOPT_URL, this->url.c_str());
+    curl_easy_setopt(this->curl, CURLOPT_SHARE, HTTP::Share());
+    curl_easy_setopt(this->curl, CURLOPT_HTTPHEADER, this->hdrs);
+    curl_easy_setopt(this->curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(this->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    // a webcam that stops sending is dropped instead of held open
+    curl_easy_setopt(this->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(this->curl, CURLOPT_LOW_SPEED_TIME, (long)stale_after.count());
+    curl_easy_setopt(this->curl, CURLOPT_WRITEFUNCTION, &Stream::WriteCallback);
+    curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, this);
+
+    this->reactor->AddTransfer(this->curl, [this](CURLcode result) { this->OnDone(result); });
+
+    this->reactor->Cancel(this->idle_timer);
+    this->idle_timer = this->reactor->After(this->idle, [this]() { this->CheckIdle(); });
+}
+
+void Stream::Stop() {
+    this->reactor->Cancel(this->idle_timer);
+    this->idle_timer = 0;
+
+    if (this->curl) {
+        this->reactor->RemoveTransfer(this->curl);
+        curl_easy_cleanup(this->curl);
+        this->curl = nullptr;
+    }
+    curl_slist_free_all(this->hdrs);
+    this->hdrs = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(this->frame_mutex);
+        this->frame.reset();
+    }
+    this->spare.reset();
+
+    std::map<uint64_t, std::pair<Waiter, IO::TimerId>> waiting;
+    waiting.swap(this->waiters);
+    for (auto &[id, w] : waiting) {
+        this->reactor->Cancel(w.second);
+        w.first(nullptr);
+    }
+}
+
+size_t Stream::WriteCallback(char *ptr, size_t size, size_t nmemb, void *user) {
+    static_cast<Stream*>(user)->parser.Feed(ptr, size * nmemb);
+    return size * nmemb;
+}
+
+void Stream::OnFrame(const char *data, size_t size) {
+    this->frames->Inc();
+
+    // moved out so ours isn't counted, anyone else holding it is a snapshot
+    // still using the frame
+    std::shared_ptr<std::vector<char>> next = std::move(this->spare);
+    if (!next || next.use_count() > 1) next.reset(new std::vector<char>);
+    next->assign(data, data + size);
+
+    Frame previous;
+    {
+        std::lock_guard<std::mutex> lock(this->frame_mutex);
+        previous = this->frame;
+        this->frame = next;
+        this->frame_time = std::chrono::steady_clock::now();
+    }
+    this->spare = std::const_pointer_cast<std::vector<char>>(std::move(previous));
+
+    std::map<uint64_t, std::pair<Waiter, IO::TimerId>> waiting;
+    waiting.swap(this->waiters);
+    for (auto &[id, w] : waiting) {
+        this->reactor->Cancel(w.second);
+        w.first(next);
+    }
+}
+
+void Stream::OnDone(CURLcode result) {
+    this->log->warn("Webcam stream ended, fetching snapshots for the next {} seconds: {}", retry_after.count(), curl_easy_strerror(result));
+    this->retry_at = std::chrono::steady_clock::now() + retry_after;
+    this->Stop();
+}
+
+void Stream::CheckIdle() {
+    std::chrono::steady_clock::time_point last;
+    {
+        std::lock_guard<std::mutex> lock(this->frame_mutex);
+        last = this->last_asked;
+    }
+
+    std::chrono::steady_clock::duration left = last + this->idle - std::chrono::steady_clock::now();
+    if (left > std::chrono::steady_clock::duration::zero()) {
+        this->idle_timer = this->reactor->After(left, [this]() { this->CheckIdle(); });
+        return;
+    }
+
+    this->log->info("Closing idle webcam stream {}", this->url);
+    this->Stop();
+}
+
+}
@@ -0,0 +1,139 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <coroutine>
+#include <cinttypes>
+#include <curl/curl.h>
+
+#include "io.h"
+#include "log.h"
+#include "metrics.h"
+
+// Webcam streams as mjpg-streamer, ustreamer and the like serve them: a
+// multipart/x-mixed-replace response that doesn't end, one JPEG per part.
+namespace OctoPrintControl::MJPEG {
+
+typedef std::shared_ptr<const std::vector<char>> Frame;
+
+// Finds JPEG frames in a stream fed in chunks of any size. Frames are delimited
+// by walking the JPEG's own markers and part headers are skipped over, so it
+// doesn't matter which boundary the server uses or whether it sends a
+// Content-Length.
+class Parser {
+public:
+    // data is only valid during the call
+    typedef std::function<void(const char *data, size_t size)> FrameCallback;
+
+    Parser(FrameCallback frame) :frame(frame) {}
+
+    void Feed(const char *data, size_t size);
+    // drops a partial frame, for a new connection
+    void Reset();
+
+    // larger frames are dropped, it's not a webcam
+    static const size_t max_frame = 16 * 1024 * 1024;
+
+private:
+    enum class State {
+        // before the start of image marker
+        Seeking,
+        // marker segments up to the start of scan
+        Segments,
+        // entropy coded data, up to the next marker
+        Entropy
+    };
+
+    void Parse();
+
+    FrameCallback frame;
+    // the frame so far, from its start of image marker
+    std::vector<char> buffer;
+    size_t pos = 0;
+    State state = State::Seeking;
+};
+
+// Keeps a webcam stream open in the background for as long as frames are being
+// asked for, so a snapshot is the latest frame instead of a new request. Opens
+// on the first request and closes after idle without one. Must be owned by a
+// std::shared_ptr.
+class Stream : public std::enable_shared_from_this<Stream> {
+public:
+    // name labels metrics and logs, headers are sent with the request
+    Stream(std::string name, std::string url, std::list<std::string> headers, std::chrono::steady_clock::duration idle);
+    ~Stream();
+
+    std::string URL() { return this->url; }
+
+    // The latest frame, waiting up to wait for the first one if the stream isn't
+    // open. nullptr if none came, or for a while after the stream failed.
+    Frame Latest(std::chrono::steady_clock::duration wait);
+
+    struct LatestAwaiter {
+        std::shared_ptr<Stream> stream;
+        std::chrono::steady_clock::duration wait;
+        Frame frame;
+        uint64_t trace = 0;
+
+        bool await_ready() noexcept { return (this->frame = this->stream->Fresh())!=nullptr; }
+        void await_suspend(std::coroutine_handle<> handle);
+        Frame await_resume() noexcept { return this->frame; }
+    };
+    // Latest for coroutines, continues on the worker pool
+    LatestAwaiter LatestAsync(std::chrono::steady_clock::duration wait) { return LatestAwaiter{ this->shared_from_this(), wait }; }
+
+private:
+    typedef std::function<void(Frame)> Waiter;
+
+    // the latest frame if the stream is open and it isn't stale, counts as a request
+    Frame Fresh();
+
+    // the rest run on the reactor
+    void Wait(std::chrono::steady_clock::duration wait, Waiter waiter);
+    void Start();
+    void Stop();
+    void OnFrame(const char *data, size_t size);
+    void OnDone(CURLcode result);
+    void CheckIdle();
+
+    static size_t WriteCallback(char *ptr, size_t size, size_t nmemb, void *user);
+
+    std::string name;
+    std::string url;
+    std::list<std::string> headers;
+    std::chrono::steady_clock::duration idle;
+
+    IO::Reactor *reactor;
+    std::shared_ptr<Log::Logger> log;
+    Parser parser;
+
+    CURL *curl = nullptr;
+    curl_slist *hdrs = nullptr;
+    IO::TimerId idle_timer = 0;
+    // not reopened before this after it failed, snapshots are fetched instead
+    std::chrono::steady_clock::time_point retry_at;
+    uint64_t next_waiter = 1;
+    std::map<uint64_t, std::pair<Waiter, IO::TimerId>> waiters;
+    // the frame before the latest, written over by the next one unless a
+    // snapshot still holds it
+    std::shared_ptr<std::vector<char>> spare;
+
+    std::mutex frame_mutex;
+    // nullptr while the stream is closed
+    Frame frame;
+    std::chrono::steady_clock::time_point frame_time;
+    std::chrono::steady_clock::time_point last_asked;
+
+    Metrics::Counter *opened;
+    Metrics::Counter *frames;
+};
+
+}
@@ -3,29 +3,143 @@
 // License: MIT (see LICENSE)
 #include "octoprint.h"
 #include <stdexcept>
+#include <string_view>
+#include <cmath>
 #include <chrono>
 #include <vector>
+#include <algorithm>
 #include <random>
+#include <future>
+#include <thread>
 #include <fmt/core.h>
-#include <spdlog/sinks/stdout_color_sinks.h>
 #include <Magick++.h>
+#include "trace.h"
+#include "pixels.h"
 
 namespace OctoPrintControl::OctoPrint {
 
+static std::shared_future<void> magick_init;
+
+void InitializeMagick(std::string path, std::function<void()> done) {
+    magick_init = std::async(std::launch::async, [path, done]() {
+        Magick::InitializeMagick(path.c_str());
+        done();
+    }).share();
+}
+
+// how long a snapshot waits for a stream that isn't open yet before it's
+// fetched instead
+static const std::chrono::seconds stream_first_frame(3);
+
+// the MIME type from the image's own signature, cameras don't always send a
+// Content-Type and stream frames don't have one
+static std::string ImageType(const std::vector<char> &data) {
+    auto starts = [&data](size_t at, std::string_view sig) { return data.size() >= at + sig.size() && std::string_view(data.data() + at, sig.size())==sig; };
+
+    if (starts(0, "\xFF\xD8\xFF")) return "image/jpeg";
+    if (starts(0, "\x89PNG")) return "image/png";
+    if (starts(0, "RIFF") && starts(8, "WEBP")) return "image/webp";
+    if (starts(4, "ftypavif") || starts(4, "ftypavis")) return "image/avif";
+    if (starts(0, "GIF8")) return "image/gif";
+    return "application/octet-stream";
+}
+
+static std::string Extension(const std::string &type) {
+    if (type=="image/jpeg") return "jpg";
+    if (type.starts_with("image/")) return type.substr(6);
+    return "bin";
+}
+
+static std::string EncodingType(const std::string &format) {
+    return format=="jpeg" ? "image/jpeg" : "image/" + format;
+}
+
+// qualities tried for a byte budget, the search stops after a few encodes
+static const size_t quality_high = 85;
+static const size_t quality_low = 40;
+static const int quality_steps = 3;
+static const int scale_steps = 3;
+
+// to width, keeping the aspect ratio. A box filter averages every pixel when
+// it's at least halved, bilinear would skip some.
+static Pixels::Image Shrink(const Pixels::Image &px, size_t width) {
+    size_t height = std::max<size_t>(1, px.height * width / px.width);
+    return Pixels::Downscale(px, width, height, px.width >= width * 2 ? Pixels::Filter::Box : Pixels::Filter::Bilinear);
+}
+
+Magick::Blob EncodeToBudget(Magick::Image &img, const SnapshotEncoding &encoding, size_t &quality, int &shrinks) {
+    const char *format = encoding.format=="jpeg" ? "JPEG" : encoding.format=="webp" ? "WEBP" : "AVIF";
+    img.strip();
+    img.magick(format);
+
+    auto write = [&img](size_t q) {
+        Magick::Blob blob;
+        img.quality(q);
+        img.write(&blob);
+        return blob;
+    };
+
+    quality = quality_high;
+    shrinks = 0;
+    Magick::Blob best = write(quality_high);
+    if (!encoding.max_bytes || best.length() <= encoding.max_bytes) return best;
+
+    // the last pass only encodes what the last shrink left
+    for (int s=0;s<=scale_steps;s++) {
+        Magick::Blob low = write(quality_low);
+        quality = quality_low;
+        best = low;
+        if (low.length() <= encoding.max_bytes) {
+            size_t lo = quality_low, hi = quality_high;
+            for (int i=0;i<quality_steps;i++) {
+                size_t mid = (lo + hi) / 2;
+                Magick::Blob blob = write(mid);
+                if (blob.length() <= encoding.max_bytes) {
+                    lo = mid;
+                    quality = mid;
+                    best = blob;
+                } else hi = mid;
+            }
+            return best;
+        }
+        if (s==scale_steps) break;
+
+        // bytes go roughly with the pixel count
+        double scale = std::sqrt((double)encoding.max_bytes / low.length()) * 0.9;
+        Pixels::Image px = Pixels::Read(img);
+        img = Pixels::Write(Shrink(px, std::max<size_t>(1, (size_t)(px.width * scale))));
+        img.magick(format);
+        shrinks++;
+    }
+    return best;
+}
+
+void WaitForMagick() {
+    std::shared_future<void> init = magick_init;
+    if (init.valid()) init.wait();
+}
+
 Client::Client(std::string name, std::string url, std::string apikey)
 :name(name), url(url), apikey(apikey) {
-    this->log = spdlog::get(fmt::format("OctoPrint::Client::{}", name));
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt(fmt::format("OctoPrint::Client::{}", name));
+    this->log = Log::Get("OctoPrint", {{"printer", name}});
 
     this->http.reset(new HTTP::Client());
     this->http->AddHeader(fmt::format("X-Api-Key: {}", this->apikey));
+
+    Metrics::Labels labels = {{ "printer", name }};
+    this->snapshot_fetch = &Metrics::GetHistogram("octoprintcontrol_snapshot_fetch_seconds", "Time to fetch webcam settings and a snapshot.", Metrics::LatencyBuckets, labels);
+    this->snapshot_process = &Metrics::GetHistogram("octoprintcontrol_snapshot_process_seconds", "Time spent transforming a webcam snapshot.", Metrics::LatencyBuckets, labels);
+    this->snapshot_bytes = &Metrics::GetHistogram("octoprintcontrol_snapshot_bytes", "Size of webcam snapshots as fetched.", Metrics::SizeBuckets, labels);
+    this->snapshot_encoded_bytes = &Metrics::GetHistogram("octoprintcontrol_snapshot_encoded_bytes", "Size of webcam snapshots as uploaded.", Metrics::SizeBuckets, labels);
+    this->snapshots_fetched = &Metrics::GetCounter("octoprintcontrol_snapshot_source_total", "Snapshots by where they came from.", {{"printer", name}, {"source", "fetch"}});
+    this->snapshots_streamed = &Metrics::GetCounter("octoprintcontrol_snapshot_source_total", "Snapshots by where they came from.", {{"printer", name}, {"source", "stream"}});
 }
 
 Client::~Client() {
     
 }
 
-nlohmann::json Client::PassiveLogin() {
+std::shared_ptr<HTTP::Request> Client::PassiveLoginRequest() {
     nlohmann::json reqData = {
         { "passive", true }
     };
@@ -34,9 +148,11 @@ nlohmann::json Client::PassiveLogin() {
     req->method = HTTP::RequestMethod::POST;
     req->url = this->url + "/api/login";
     req->body.reset(new HTTP::JSONRequestData(reqData));
-    
-    std::shared_ptr<HTTP::Response> resp = this->http->Perform(req);
 
+    return req;
+}
+
+nlohmann::json Client::PassiveLoginDone(std::shared_ptr<HTTP::Response> resp) {
     if (resp->code!=200) throw std::runtime_error("Couldn't authenticate");
     if (resp->contentType!="application/json") throw std::runtime_error("Expected JSON");
 
@@ -48,14 +164,24 @@ nlohmann::json Client::PassiveLogin() {
     }
 }
 
-nlohmann::json Client::PluginSimpleApiCommand(std::string plugin, nlohmann::json data) {
+nlohmann::json Client::PassiveLogin() {
+    return this->PassiveLoginDone(this->http->Perform(this->PassiveLoginRequest()));
+}
+
+IO::Task<nlohmann::json> Client::PassiveLoginAsync() {
+    co_return this->PassiveLoginDone(co_await this->http->PerformAsync(this->PassiveLoginRequest()));
+}
+
+std::shared_ptr<HTTP::Request> Client::PluginSimpleApiCommandRequest(std::string plugin, nlohmann::json data) {
     std::shared_ptr<HTTP::Request> req(new HTTP::Request);
     req->method = HTTP::RequestMethod::POST;
     req->url = this->url + "/api/plugin/" + plugin;
     req->body.reset(new HTTP::JSONRequestData(data));
 
-    std::shared_ptr<HTTP::Response> resp = this->http->Perform(req);
+    return req;
+}
 
+nlohmann::json Client::PluginSimpleApiCommandDone(std::shared_ptr<HTTP::Response> resp) {
     if (resp->code==200) {
         if (resp->contentType!="application/json") throw std::runtime_error("Expected JSON");
 
@@ -71,13 +197,15 @@ nlohmann::json Client::PluginSimpleApiCommand(std::string plugin, nlohmann::json
     }
 }
 
-std::vector<char> Client::GetWebcamSnapshot(std::string &imageType) {
-    std::string settingsStr;
-    std::string contentType;
+nlohmann::json Client::PluginSimpleApiCommand(std::string plugin, nlohmann::json data) {
+    return this->PluginSimpleApiCommandDone(this->http->Perform(this->PluginSimpleApiCommandRequest(plugin, data)));
+}
 
-    std::shared_ptr<HTTP::Request> settingsReq = HTTP::NewGetRequest(this->url + "/api/settings");
-    std::shared_ptr<HTTP::Response> settingsResp = this->http->Perform(settingsReq);
+IO::Task<nlohmann::json> Client::PluginSimpleApiCommandAsync(std::string plugin, nlohmann::json data) {
+    co_return this->PluginSimpleApiCommandDone(co_await this->http->PerformAsync(this->PluginSimpleApiCommandRequest(plugin, data)));
+}
 
+Client::WebcamSettings Client::WebcamSettingsDone(std::shared_ptr<HTTP::Response> settingsResp) {
     if (settingsResp->code!=200) {
         throw std::runtime_error("Couldn't retrieve webcam settings.");
     }
@@ -93,58 +221,216 @@ std::vector<char> Client::GetWebcamSnapshot(std::string &imageType) {
         throw std::runtime_error("Couldn't parse settings json.");
     }
 
-    std::string snapshotURL;
+    WebcamSettings webcam;
     try {
-        snapshotURL = settings.at("webcam").at("snapshotUrl");
+        webcam.snapshotURL = settings.at("webcam").at("snapshotUrl");
     } catch (nlohmann::json::type_error&) {
         throw std::runtime_error("Invalid settings json.");
     }
 
-    bool flipV = settings.at("webcam").at("flipV").get<bool>();
-    bool flipH = settings.at("webcam").at("flipH").get<bool>();
+    if (settings.at("webcam").contains("streamUrl") && settings.at("webcam").at("streamUrl").is_string()) {
+        webcam.streamURL = settings.at("webcam").at("streamUrl");
+    }
+
+    webcam.flipV = settings.at("webcam").at("flipV").get<bool>();
+    webcam.flipH = settings.at("webcam").at("flipH").get<bool>();
+    if (settings.at("webcam").contains("rotate90") && settings.at("webcam").at("rotate90").is_boolean()) {
+        webcam.rotate90 = settings.at("webcam").at("rotate90").get<bool>();
+    }
 
-    std::shared_ptr<HTTP::Request> req = HTTP::NewGetRequest(snapshotURL);
-    std::shared_ptr<HTTP::Response> resp = this->http->Perform(req);
+    return webcam;
+}
 
+WebcamSnapshot Client::SnapshotDone(std::shared_ptr<HTTP::Response> resp, WebcamSettings &webcam, std::chrono::steady_clock::time_point fetch_start, bool upload) {
     if (resp->code!=200) {
         throw std::runtime_error("Couldn't retrieve snapshot image.");
     }
 
-    std::vector<char> retData(resp->body.begin(), resp->body.end());
-    //for (char c : resp->body) retData.push_back(c);
+    return this->FrameDone(std::move(resp->body), webcam, fetch_start, this->snapshots_fetched, upload);
+}
 
-    if (flipH || flipV) {
-        Magick::Blob blob(retData.data(), retData.size());
-        Magick::Image img(blob);
-        if (flipV) img.flip();
-        if (flipH) img.flop();
+WebcamSnapshot Client::FrameDone(std::vector<char> data, WebcamSettings &webcam, std::chrono::steady_clock::time_point fetch_start, Metrics::Counter *source, bool upload) {
+    this->snapshot_fetch->Observe(std::chrono::steady_clock::now() - fetch_start);
+    this->snapshot_bytes->Observe((double)data.size());
+    source->Inc();
 
-        img.write(&blob);
-        retData.clear();
-        const char *bdata = static_cast<const char*>(blob.data());
-        for (size_t i=0;i<blob.length();i++) {
-            retData.push_back(bdata[i]);
+    WebcamSnapshot snapshot;
+    snapshot.data = std::move(data);
+    snapshot.type = ImageType(snapshot.data);
+
+    // a format Magick can't write, avif without its delegate, shouldn't cost
+    // every message its image
+    try {
+        bool encode = upload && this->NeedsEncode(snapshot);
+        if (webcam.flipH || webcam.flipV || webcam.rotate90 || encode) {
+            Metrics::ScopedTimer process_timer(*this->snapshot_process);
+            Trace::Span flip_span("Snapshot transform", "image");
+            WaitForMagick();
+            Magick::Blob blob(snapshot.data.data(), snapshot.data.size());
+            Magick::Image img(blob);
+            std::string type = snapshot.type;
+
+            // every transform in one trip through the raw pixels, Magick is only
+            // used to decode and encode
+            bool shrink = encode && this->encoding.max_width && (webcam.rotate90 ? img.rows() : img.columns()) > this->encoding.max_width;
+            if (webcam.flipH || webcam.flipV || webcam.rotate90 || shrink) {
+                // a new image from pixels doesn't know what it was read as
+                std::string format = img.magick();
+                size_t quality = img.quality();
+                Pixels::Image px = Pixels::Read(img);
+                if (webcam.flipV) Pixels::FlipVertical(px);
+                if (webcam.flipH) Pixels::FlipHorizontal(px);
+                // OctoPrint turns the view counter-clockwise
+                if (webcam.rotate90) px = Pixels::Rotate90(px, false);
+                if (shrink) px = Shrink(px, this->encoding.max_width);
+                img = Pixels::Write(px);
+                img.magick(format);
+                img.quality(quality);
+            }
+
+            if (encode) {
+                size_t quality;
+                int shrinks;
+                blob = EncodeToBudget(img, this->encoding, quality, shrinks);
+                type = EncodingType(this->encoding.format);
+                this->log->debug("Snapshot re-encoded from {} KiB {} to {} KiB {} at quality {}, {}x{} after {} shrinks",
+                    snapshot.data.size() / 1024, snapshot.type, blob.length() / 1024, type, quality, img.columns(), img.rows(), shrinks);
+            } else img.write(&blob);
+
+            // only replaced once everything worked
+            const char *bdata = static_cast<const char*>(blob.data());
+            snapshot.data.assign(bdata, bdata + blob.length());
+            snapshot.type = type;
         }
+    } catch (std::exception &err) {
+        this->log->error("Couldn't transform the snapshot, using it as it is: {}", err.what());
+    }
+
+    if (upload) this->snapshot_encoded_bytes->Observe((double)snapshot.data.size());
+    snapshot.filename = "webcam." + Extension(snapshot.type);
+    return snapshot;
+}
+
+bool Client::NeedsEncode(WebcamSnapshot &snapshot) {
+    if (this->encoding.format.empty()) return false;
+    if (snapshot.type!=EncodingType(this->encoding.format)) return true;
+    if (this->encoding.max_bytes && snapshot.data.size() > this->encoding.max_bytes) return true;
+    if (!this->encoding.max_width) return false;
+
+    // only the header is read for the size
+    WaitForMagick();
+    Magick::Image img;
+    img.ping(Magick::Blob(snapshot.data.data(), snapshot.data.size()));
+    return img.columns() > this->encoding.max_width;
+}
+
+WebcamSnapshot Client::GetWebcamSnapshot() {
+    Trace::Span span("OctoPrint::Client::GetWebcamSnapshot", "octoprint");
+    span.Arg("printer", this->name);
+
+    std::chrono::steady_clock::time_point fetch_start = std::chrono::steady_clock::now();
+
+    WebcamSettings webcam = this->WebcamSettingsDone(this->http->Perform(HTTP::NewGetRequest(this->url + "/api/settings")));
+
+    if (std::shared_ptr<MJPEG::Stream> stream = this->StreamFor(webcam)) {
+        if (MJPEG::Frame frame = stream->Latest(stream_first_frame)) return this->FrameDone(std::vector<char>(frame->begin(), frame->end()), webcam, fetch_start, this->snapshots_streamed, true);
     }
 
-    imageType = contentType;
+    return this->SnapshotDone(this->http->Perform(HTTP::NewGetRequest(webcam.snapshotURL)), webcam, fetch_start, true);
+}
+
+IO::Task<WebcamSnapshot> Client::GetWebcamSnapshotAsync() {
+    return this->WebcamSnapshotAsync(true);
+}
+
+IO::Task<WebcamSnapshot> Client::GetWebcamFrameAsync() {
+    return this->WebcamSnapshotAsync(false);
+}
+
+IO::Task<WebcamSnapshot> Client::WebcamSnapshotAsync(bool upload) {
+    Trace::Span span("OctoPrint::Client::GetWebcamSnapshot", "octoprint");
+    span.Arg("printer", this->name);
+
+    std::chrono::steady_clock::time_point fetch_start = std::chrono::steady_clock::now();
+
+    WebcamSettings webcam = this->WebcamSettingsDone(co_await this->http->PerformAsync(HTTP::NewGetRequest(this->url + "/api/settings")));
+
+    if (std::shared_ptr<MJPEG::Stream> stream = this->StreamFor(webcam)) {
+        MJPEG::Frame frame = co_await stream->LatestAsync(stream_first_frame);
+        if (frame) co_return this->FrameDone(std::vector<char>(frame->begin(), frame->end()), webcam, fetch_start, this->snapshots_streamed, upload);
+    }
+
+    co_return this->SnapshotDone(co_await this->http->PerformAsync(HTTP::NewGetRequest(webcam.snapshotURL)), webcam, fetch_start, upload);
+}
+
+void Client::UseWebcamStream(std::chrono::steady_clock::duration idle) {
+    std::lock_guard<std::mutex> lock(this->stream_mutex);
+    this->stream_idle = idle;
+    this->stream.reset();
+}
+
+std::shared_ptr<MJPEG::Stream> Client::StreamFor(WebcamSettings &webcam) {
+    std::lock_guard<std::mutex> lock(this->stream_mutex);
+    if (this->stream_idle==std::chrono::steady_clock::duration::zero() || webcam.streamURL.empty()) return nullptr;
+
+    // OctoPrint's default is relative to its own url
+    std::string url = webcam.streamURL;
+    CURLU *u = curl_url();
+    char *full = nullptr;
+    if (curl_url_set(u, CURLUPART_URL, this->url.c_str(), 0)==CURLUE_OK &&
+        curl_url_set(u, CURLUPART_URL, webcam.streamURL.c_str(), 0)==CURLUE_OK &&
+        curl_url_get(u, CURLUPART_URL, &full, 0)==CURLUE_OK) {
+        url = full;
+        curl_free(full);
+    }
+    curl_url_cleanup(u);
 
-    return retData;
+    // a changed url closes the old stream with the last snapshot holding it
+    if (!this->stream || this->stream->URL()!=url) {
+        this->stream.reset(new MJPEG::Stream(this->name, url, { fmt::format("X-Api-Key: {}", this->apikey) }, this->stream_idle));
+    }
+    return this->stream;
 }
 
 Socket::Socket(std::string url) {
     this->baseurl = url;
-    this->log = spdlog::get("OctoPrint::Socket::" + url);
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt("OctoPrint::Socket::" + url);
+    this->reconnects = &Metrics::GetCounter("octoprintcontrol_octoprint_reconnects_total", "OctoPrint socket reconnects triggered by the watchdog.", {{"printer", url}});
+    this->log = Log::Get("OctoPrint", {{"socket", url}});
 
     
 }
 
 Socket::~Socket() {
-    this->websocket->Disconnect();
+    this->Disconnect();
+}
+
+void Socket::Disconnect() {
+    if (!this->reactor) return;
+
+    this->reactor->Invoke([this]() {
+        this->stopped = true;
+        this->reactor->Cancel(this->retry_timer);
+        this->reactor->Cancel(this->watchdog_timer);
+        this->websocket.reset();
+    });
 }
 
 void Socket::Connect() {
+    this->reactor = IO::Next();
+    if (!this->reactor) throw std::runtime_error("No IO reactor is running.");
+
+    std::weak_ptr<Socket> weak = this->weak_from_this();
+    this->reactor->Post([weak]() {
+        if (std::shared_ptr<Socket> self = weak.lock()) self->StartConnect();
+    });
+}
+
+void Socket::StartConnect() {
+    if (this->stopped) return;
+    this->reactor->Cancel(this->retry_timer);
+    this->reactor->Cancel(this->watchdog_timer);
+    this->socketOpen = false;
+
     int serverCode;
     std::string sessionCode;
     std::default_random_engine rand;
@@ -159,35 +445,34 @@ void Socket::Connect() {
 
     std::string fullUrl = this->baseurl + "/sockjs/" + std::to_string(serverCode) + "/" + sessionCode + "/websocket";
 
-    this->websocket.reset(new Websocket::Client(fullUrl));
+    this->websocket.reset(new Websocket::Client(fullUrl, this->baseurl, this->reactor));
     this->websocket->AddDataReceivedCallback(std::bind(&Socket::OnWebsocketData, this, std::placeholders::_1));
-    
-    while (true) {
-        try {
-            this->websocket->Connect();
-            break;
-        } catch (std::runtime_error &err) {
-            this->log->error("Error while connecting, retrying in 30 seconds: {}", err.what());
-            std::this_thread::sleep_for(std::chrono::seconds(30));
-        }
-    }        
-}
+    this->websocket->AddConnectedCallback([this]() { this->socketOpen = true; });
 
-void Socket::WatchdogMain() {
-    this->last_hb = std::chrono::steady_clock::now();
-
-    while (true) {
-        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-        std::chrono::duration<double> dur = now - this->last_hb;
-
-        if (dur.count() >= 45.0) {
-            this->log->warn("Watchdog triggered, attempting to reconnect");
-            this->Connect();
+    // a lost connection is left to the watchdog
+    this->websocket->AddClosedCallback([this](std::string error) {
+        if (this->socketOpen) {
+            this->log->error("{}", error);
             return;
         }
+        this->log->error("Error while connecting, retrying in 30 seconds: {}", error);
+        this->retry_timer = this->reactor->After(std::chrono::seconds(30), [this]() { this->StartConnect(); });
+    });
 
-        std::this_thread::sleep_for(std::chrono::seconds(10));
+    this->websocket->Connect();
+}
+
+void Socket::Watchdog() {
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - this->last_hb;
+
+    if (dur.count() >= 45.0) {
+        this->log->warn("Watchdog triggered, attempting to reconnect");
+        this->reconnects->Inc();
+        this->StartConnect();
+        return;
     }
+
+    this->watchdog_timer = this->reactor->After(std::chrono::seconds(10), [this]() { this->Watchdog(); });
 }
 
 void Socket::OnWebsocketData(std::vector<char> data) {
@@ -195,8 +480,9 @@ void Socket::OnWebsocketData(std::vector<char> data) {
 
     if (d[0]=='o') {
         //this->log->info("Websocket open");
-        std::thread t(&Socket::WatchdogMain, this);
-        t.detach();
+        this->last_hb = std::chrono::steady_clock::now();
+        this->reactor->Cancel(this->watchdog_timer);
+        this->watchdog_timer = this->reactor->After(std::chrono::seconds(10), [this]() { this->Watchdog(); });
         if (d.size()==1) return;
         d = std::vector<char>(data.begin()+1, data.end());
     }
@@ -263,8 +549,15 @@ void Socket::AddCallback(std::string event, SocketDataCallback callback) {
 }
 
 void Socket::Send(nlohmann::json data) {
+    if (!this->reactor) return;
+
     nlohmann::json msgarr = nlohmann::json::array({data.dump()});
-    this->websocket->Send(msgarr.dump());
+    // websocket is replaced on the reactor thread, gone once disconnected
+    std::weak_ptr<Socket> weak = this->weak_from_this();
+    this->reactor->Post([weak, msg=msgarr.dump()]() {
+        std::shared_ptr<Socket> self = weak.lock();
+        if (self && self->websocket) self->websocket->Send(msg);
+    });
 }
 
 }
\ No newline at end of file
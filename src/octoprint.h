@@ -11,60 +11,168 @@
 #include <map>
 #include <list>
 #include <chrono>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 
 #include "http.h"
+#include "log.h"
+#include "io.h"
+#include "task.h"
 #include "websocket.h"
+#include "metrics.h"
+#include "mjpeg.h"
+
+namespace Magick { class Image; class Blob; }
+
+namespace OctoPrintControl::Bench { struct Access; }
 
 namespace OctoPrintControl::OctoPrint {
 
+// Runs Magick::InitializeMagick on a thread of its own and then calls done.
+// Snapshots that need to be transformed wait for it.
+void InitializeMagick(std::string path, std::function<void()> done);
+// blocks until InitializeMagick is done, if it was started
+void WaitForMagick();
+
+struct WebcamSnapshot {
+    std::vector<char> data;
+    // the MIME type, from the image itself
+    std::string type;
+    // webcam.jpg, webcam.webp and so on to match type
+    std::string filename;
+};
+
+// How snapshots are re-encoded before they're uploaded. One already in format
+// and within both limits is left as it is.
+struct SnapshotEncoding {
+    // jpeg, webp or avif, empty to leave snapshots as they are
+    std::string format;
+    // 0 for no limit. The highest quality that fits is used, and the image is
+    // scaled down if even the lowest doesn't.
+    size_t max_bytes = 0;
+    // 0 for no limit, only ever scaled down
+    size_t max_width = 0;
+};
+
+// Writes img as format at the highest quality that fits max_bytes, scaling it
+// down up to three times if even the lowest doesn't. Over budget only if the
+// last scale didn't fit either. img is already no wider than max_width and is
+// left as it was last encoded.
+Magick::Blob EncodeToBudget(Magick::Image &img, const SnapshotEncoding &encoding, size_t &quality, int &shrinks);
+
 class Client {
 public:
     Client(std::string name, std::string url, std::string apikey);
     ~Client();
 
-    std::vector<char> GetWebcamSnapshot(std::string &imageType);
+    WebcamSnapshot GetWebcamSnapshot();
+    IO::Task<WebcamSnapshot> GetWebcamSnapshotAsync();
+    // flipped and rotated like a snapshot but not encoded for uploading, for
+    // frames that are decoded again anyway
+    IO::Task<WebcamSnapshot> GetWebcamFrameAsync();
+
+    // set before the first snapshot
+    void SetSnapshotEncoding(SnapshotEncoding encoding) { this->encoding = encoding; }
+
+    // Snapshots are taken from the webcam's stream, which is kept open until
+    // nobody has asked for one for idle. Falls back to the snapshot url.
+    void UseWebcamStream(std::chrono::steady_clock::duration idle);
 
     nlohmann::json PassiveLogin();
+    IO::Task<nlohmann::json> PassiveLoginAsync();
 
     nlohmann::json PluginSimpleApiCommand(std::string plugin, nlohmann::json data);
+    IO::Task<nlohmann::json> PluginSimpleApiCommandAsync(std::string plugin, nlohmann::json data);
 
 private:
+    struct WebcamSettings {
+        std::string snapshotURL;
+        std::string streamURL;
+        bool flipV = false;
+        bool flipH = false;
+        bool rotate90 = false;
+    };
+
+    std::shared_ptr<HTTP::Request> PassiveLoginRequest();
+    nlohmann::json PassiveLoginDone(std::shared_ptr<HTTP::Response> resp);
+    std::shared_ptr<HTTP::Request> PluginSimpleApiCommandRequest(std::string plugin, nlohmann::json data);
+    nlohmann::json PluginSimpleApiCommandDone(std::shared_ptr<HTTP::Response> resp);
+    WebcamSettings WebcamSettingsDone(std::shared_ptr<HTTP::Response> resp);
+    IO::Task<WebcamSnapshot> WebcamSnapshotAsync(bool upload);
+    // upload re-encodes the snapshot as SetSnapshotEncoding asked
+    WebcamSnapshot SnapshotDone(std::shared_ptr<HTTP::Response> resp, WebcamSettings &webcam, std::chrono::steady_clock::time_point fetch_start, bool upload);
+    WebcamSnapshot FrameDone(std::vector<char> data, WebcamSettings &webcam, std::chrono::steady_clock::time_point fetch_start, Metrics::Counter *source, bool upload);
+    // nullptr if snapshots don't come from the stream
+    std::shared_ptr<MJPEG::Stream> StreamFor(WebcamSettings &webcam);
+    // true if the snapshot has to be decoded and written again for encoding
+    bool NeedsEncode(WebcamSnapshot &snapshot);
+
     std::string name;
     std::string url;
     std::string apikey;
 
     std::shared_ptr<HTTP::Client> http;
 
-    std::shared_ptr<spdlog::logger> log;
+    std::mutex stream_mutex;
+    // zero without a stream
+    std::chrono::steady_clock::duration stream_idle{0};
+    std::shared_ptr<MJPEG::Stream> stream;
+
+    SnapshotEncoding encoding;
+
+    std::shared_ptr<Log::Logger> log;
+
+    Metrics::Histogram *snapshot_fetch;
+    Metrics::Histogram *snapshot_process;
+    Metrics::Histogram *snapshot_bytes;
+    Metrics::Histogram *snapshot_encoded_bytes;
+    Metrics::Counter *snapshots_fetched;
+    Metrics::Counter *snapshots_streamed;
 };
 
 typedef std::function<void(std::string, nlohmann::json)> SocketDataCallback;
 
-class Socket {
+// SockJS connection to OctoPrint, lives on an IO::Reactor and callbacks are run
+// on the reactor thread. Must be owned by a std::shared_ptr to connect.
+class Socket : public std::enable_shared_from_this<Socket> {
 public:
     Socket(std::string url);
     ~Socket();
 
+    // returns right away, failed connections are retried every 30 seconds
     void Connect();
+    // closes the connection and stops retrying, callbacks aren't run after this returns
+    void Disconnect();
 
     void AddCallback(std::string event, SocketDataCallback callback);
 
+    // safe from any thread, sent on the reactor thread
     void Send(nlohmann::json data);
 
 private:
+    friend struct Bench::Access;
+
     void ProcessMessageArray(std::vector<char> data);
     void OnWebsocketData(std::vector<char> data);
 
-    void WatchdogMain();
+    void StartConnect();
+    void Watchdog();
 
     std::chrono::steady_clock::time_point last_hb;
+    bool socketOpen = false;
+    bool stopped = false;
 
-    std::shared_ptr<spdlog::logger> log;
+    IO::Reactor *reactor = nullptr;
+    IO::TimerId retry_timer = 0;
+    IO::TimerId watchdog_timer = 0;
+
+    std::shared_ptr<Log::Logger> log;
     std::string baseurl;
     std::shared_ptr<Websocket::Client> websocket;
     std::map<std::string, std::list<SocketDataCallback>> callbacks;
+
+    Metrics::Counter *reconnects;
 };
 
 }
\ No newline at end of file
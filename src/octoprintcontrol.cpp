@@ -1,25 +1,82 @@
 #include "octoprintcontrol.h"
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include "metrics.h"
 
 namespace OctoPrintControl {
 
-nlohmann::json config;
+static std::atomic<std::shared_ptr<const Config>> config;
 
-std::map<std::string, std::shared_ptr<Printer>> printers;
+static std::atomic<std::shared_ptr<const PrinterMap>> printers(std::shared_ptr<const PrinterMap>(new PrinterMap));
 
-std::shared_ptr<Discord::Socket> gateway;
+std::shared_ptr<Discord::Gateway> gateway;
 
 std::map<std::string, std::shared_ptr<Commands::BotCommand>> commands;
 
 std::map<std::string, std::shared_ptr<Interactions::InteractionHandler>> interactions;
 
-static std::map<std::string, std::shared_ptr<Discord::Channel>> channel_cache;
+std::shared_ptr<const Config> GetConfig() {
+    return config.load();
+}
+
+void SetConfig(std::shared_ptr<const Config> c) {
+    config.store(c);
+}
+
+std::shared_ptr<const PrinterMap> GetPrinters() {
+    return printers.load();
+}
+
+void SetPrinters(std::shared_ptr<const PrinterMap> p) {
+    printers.store(p);
+}
+
+std::shared_ptr<Printer> GetPrinter(std::string id) {
+    std::shared_ptr<const PrinterMap> p = printers.load();
+    auto it = p->find(id);
+    return it==p->end() ? nullptr : it->second;
+}
+
+typedef std::list<std::pair<std::string, std::shared_ptr<Discord::Channel>>> ChannelList;
+
+static std::mutex channel_mutex;
+// most recently used first
+static ChannelList channel_lru;
+static std::unordered_map<std::string, ChannelList::iterator> channel_index;
 
 std::shared_ptr<Discord::Channel> GetChannel(std::string channel_id) {
-    if (!channel_cache.contains(channel_id)) {
-        std::string token = config.at("token").get<std::string>();
-        channel_cache[channel_id] = std::shared_ptr<Discord::Channel>(new Discord::Channel(token, channel_id));
+    static Metrics::Counter &hits = Metrics::GetCounter("octoprintcontrol_channel_cache_lookups_total", "Channel cache lookups by result.", {{"result", "hit"}});
+    static Metrics::Counter &misses = Metrics::GetCounter("octoprintcontrol_channel_cache_lookups_total", "Channel cache lookups by result.", {{"result", "miss"}});
+    static Metrics::Counter &evictions = Metrics::GetCounter("octoprintcontrol_channel_cache_evictions_total", "Channels dropped from the cache to stay within channelCacheSize.");
+    static Metrics::Gauge &size = Metrics::GetGauge("octoprintcontrol_channel_cache_size", "Channels in the cache.");
+
+    std::shared_ptr<const Config> config = GetConfig();
+
+    std::lock_guard<std::mutex> lock(channel_mutex);
+    auto it = channel_index.find(channel_id);
+    if (it!=channel_index.end()) {
+        channel_lru.splice(channel_lru.begin(), channel_lru, it->second);
+        hits.Inc();
+        return it->second->second;
     }
-    return channel_cache[channel_id];
+
+    misses.Inc();
+    std::shared_ptr<Discord::Channel> channel(new Discord::Channel(config->startup.token, channel_id));
+    channel_lru.emplace_front(channel_id, channel);
+    channel_index[channel_id] = channel_lru.begin();
+
+    // callers keep evicted channels for as long as they use them
+    while (channel_lru.size() > std::max<size_t>(config->channel_cache_size, 1)) {
+        channel_index.erase(channel_lru.back().first);
+        channel_lru.pop_back();
+        evictions.Inc();
+    }
+    size.Set((int64_t)channel_lru.size());
+
+    return channel;
 }
 
 void AddCommand(Commands::BotCommand *command) {
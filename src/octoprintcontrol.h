@@ -7,6 +7,7 @@
 #include <map>
 #include <nlohmann/json.hpp>
 
+#include "config.h"
 #include "command.h"
 #include "interaction.h"
 #include "discord.h"
@@ -14,15 +15,25 @@
 
 namespace OctoPrintControl {
 
-extern nlohmann::json config;
+// The running config and printers are replaced as a whole on a reload. Keep the
+// snapshot for as long as it's used instead of calling these again.
+std::shared_ptr<const Config> GetConfig();
+void SetConfig(std::shared_ptr<const Config> config);
 
-extern std::map<std::string, std::shared_ptr<Printer>> printers;
+typedef std::map<std::string, std::shared_ptr<Printer>> PrinterMap;
 
-extern std::shared_ptr<Discord::Socket> gateway;
+std::shared_ptr<const PrinterMap> GetPrinters();
+void SetPrinters(std::shared_ptr<const PrinterMap> printers);
+// nullptr if there's no printer with that id
+std::shared_ptr<Printer> GetPrinter(std::string id);
 
+extern std::shared_ptr<Discord::Gateway> gateway;
+
+// the least recently used channels are dropped past channelCacheSize
 std::shared_ptr<Discord::Channel> GetChannel(std::string channel_id);
 
 extern std::map<std::string, std::shared_ptr<Commands::BotCommand>> commands;
+// only used on the "discord" IO::Submit key, by message id
 extern std::map<std::string, std::shared_ptr<Interactions::InteractionHandler>> interactions;
 
 void AddCommand(Commands::BotCommand *command);
@@ -0,0 +1,508 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "pixels.h"
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <immintrin.h>
+#define OCTOPRINTCONTROL_PIXELS_X86
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define OCTOPRINTCONTROL_PIXELS_NEON
+#endif
+
+namespace OctoPrintControl::Pixels {
+
+// One set per level. Each works on a single row or tile, the loops over the
+// image are shared.
+struct Kernels {
+    // dst gets src's pixels in reverse order, they don't overlap
+    void (*reverse)(uint8_t *dst, const uint8_t *src, size_t pixels, size_t channels);
+    // acc[i] += row[i]
+    void (*add_row)(uint32_t *acc, const uint8_t *row, size_t n);
+    // dst[i] = (a[i] * (256 - w) + b[i] * w + 128) >> 8, w from 0 to 256
+    void (*lerp_rows)(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t n, uint32_t w);
+    // an 8x8 tile of one channel, dst[c] gets column c of the rows in src.
+    // nullptr to rotate with plain loops.
+    void (*transpose8)(uint8_t *const *dst, const uint8_t *const *src);
+};
+
+static void ReverseScalar(uint8_t *dst, const uint8_t *src, size_t pixels, size_t channels) {
+    if (channels==1) {
+        for (size_t i=0;i<pixels;i++) dst[i] = src[pixels - 1 - i];
+    } else if (channels==3) {
+        for (size_t i=0;i<pixels;i++) {
+            const uint8_t *s = src + (pixels - 1 - i) * 3;
+            dst[i * 3] = s[0];
+            dst[i * 3 + 1] = s[1];
+            dst[i * 3 + 2] = s[2];
+        }
+    } else {
+        for (size_t i=0;i<pixels;i++) std::memcpy(dst + i * channels, src + (pixels - 1 - i) * channels, channels);
+    }
+}
+
+static void AddRowScalar(uint32_t *acc, const uint8_t *row, size_t n) {
+    for (size_t i=0;i<n;i++) acc[i] += row[i];
+}
+
+static void LerpRowsScalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t n, uint32_t w) {
+    for (size_t i=0;i<n;i++) dst[i] = (uint8_t)((a[i] * (256 - w) + b[i] * w + 128) >> 8);
+}
+
+static const Kernels scalar_kernels = { ReverseScalar, AddRowScalar, LerpRowsScalar, nullptr };
+
+#if defined(OCTOPRINTCONTROL_PIXELS_X86)
+
+__attribute__((target("ssse3")))
+static void ReverseSSSE3(uint8_t *dst, const uint8_t *src, size_t pixels, size_t channels) {
+    size_t i = 0;
+    if (channels==1) {
+        const __m128i mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        for (;i + 16 <= pixels;i+=16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pixels - i - 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(v, mask));
+        }
+    } else if (channels==3) {
+        // five pixels a step, loaded from the byte before them so the load
+        // stays in the row. The 16th byte stored is written over by the next
+        // step.
+        const __m128i mask = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -1);
+        for (;i + 6 <= pixels;i+=5) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (pixels - i - 5) * 3 - 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm_shuffle_epi8(v, mask));
+        }
+    }
+    ReverseScalar(dst + i * channels, src, pixels - i, channels);
+}
+
+__attribute__((target("ssse3")))
+static void AddRowSSSE3(uint32_t *acc, const uint8_t *row, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (;i + 16 <= n;i+=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i *a = reinterpret_cast<__m128i*>(acc + i);
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+    AddRowScalar(acc + i, row + i, n - i);
+}
+
+// 16 bit lanes can't overflow: 255 * 256 + 128 < 65536
+__attribute__((target("ssse3")))
+static void LerpRowsSSSE3(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t n, uint32_t w) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16((short)(256 - w));
+    const __m128i wb = _mm_set1_epi16((short)w);
+    const __m128i round = _mm_set1_epi16(128);
+    size_t i = 0;
+    for (;i + 16 <= n;i+=16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    LerpRowsScalar(dst + i, a + i, b + i, n - i, w);
+}
+
+__attribute__((target("ssse3")))
+static void Transpose8SSSE3(uint8_t *const *dst, const uint8_t *const *src) {
+    __m128i r[8];
+    for (int k=0;k<8;k++) r[k] = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src[k]));
+
+    // bytes, then pairs, then quads of rows interleaved leave two columns in
+    // each register
+    __m128i t0 = _mm_unpacklo_epi8(r[0], r[1]);
+    __m128i t1 = _mm_unpacklo_epi8(r[2], r[3]);
+    __m128i t2 = _mm_unpacklo_epi8(r[4], r[5]);
+    __m128i t3 = _mm_unpacklo_epi8(r[6], r[7]);
+    __m128i u0 = _mm_unpacklo_epi16(t0, t1);
+    __m128i u1 = _mm_unpackhi_epi16(t0, t1);
+    __m128i u2 = _mm_unpacklo_epi16(t2, t3);
+    __m128i u3 = _mm_unpackhi_epi16(t2, t3);
+    __m128i v[4] = {
+        _mm_unpacklo_epi32(u0, u2),
+        _mm_unpackhi_epi32(u0, u2),
+        _mm_unpacklo_epi32(u1, u3),
+        _mm_unpackhi_epi32(u1, u3)
+    };
+
+    for (int c=0;c<4;c++) {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst[c * 2]), v[c]);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst[c * 2 + 1]), _mm_unpackhi_epi64(v[c], v[c]));
+    }
+}
+
+static const Kernels ssse3_kernels = { ReverseSSSE3, AddRowSSSE3, LerpRowsSSSE3, Transpose8SSSE3 };
+
+__attribute__((target("avx2")))
+static void ReverseAVX2(uint8_t *dst, const uint8_t *src, size_t pixels, size_t channels) {
+    size_t i = 0;
+    if (channels==1) {
+        // reversed in each half, then the halves swapped
+        const __m256i mask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                              15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        for (;i + 32 <= pixels;i+=32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + pixels - i - 32));
+            v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, mask), 0x4E);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+        }
+    }
+    ReverseSSSE3(dst + i * channels, src, pixels - i, channels);
+}
+
+__attribute__((target("avx2")))
+static void AddRowAVX2(uint32_t *acc, const uint8_t *row, size_t n) {
+    size_t i = 0;
+    for (;i + 16 <= n;i+=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m256i *a = reinterpret_cast<__m256i*>(acc + i);
+        _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), _mm256_cvtepu8_epi32(v)));
+        _mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), _mm256_cvtepu8_epi32(_mm_unpackhi_epi64(v, v))));
+    }
+    AddRowScalar(acc + i, row + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void LerpRowsAVX2(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t n, uint32_t w) {
+    const __m256i wa = _mm256_set1_epi16((short)(256 - w));
+    const __m256i wb = _mm256_set1_epi16((short)w);
+    const __m256i round = _mm256_set1_epi16(128);
+    size_t i = 0;
+    for (;i + 16 <= n;i+=16) {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        __m256i r = _mm256_add_epi16(_mm256_mullo_epi16(va, wa), _mm256_mullo_epi16(vb, wb));
+        r = _mm256_srli_epi16(_mm256_add_epi16(r, round), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+    }
+    LerpRowsScalar(dst + i, a + i, b + i, n - i, w);
+}
+
+static const Kernels avx2_kernels = { ReverseAVX2, AddRowAVX2, LerpRowsAVX2, Transpose8SSSE3 };
+
+#elif defined(OCTOPRINTCONTROL_PIXELS_NEON)
+
+static void ReverseNEON(uint8_t *dst, const uint8_t *src, size_t pixels, size_t channels) {
+    size_t i = 0;
+    if (channels==1) {
+        for (;i + 16 <= pixels;i+=16) {
+            uint8x16_t v = vrev64q_u8(vld1q_u8(src + pixels - i - 16));
+            vst1q_u8(dst + i, vextq_u8(v, v, 8));
+        }
+    } else if (channels==3) {
+        // split into planes, each reversed like one channel
+        for (;i + 16 <= pixels;i+=16) {
+            uint8x16x3_t v = vld3q_u8(src + (pixels - i - 16) * 3);
+            for (int c=0;c<3;c++) {
+                v.val[c] = vrev64q_u8(v.val[c]);
+                v.val[c] = vextq_u8(v.val[c], v.val[c], 8);
+            }
+            vst3q_u8(dst + i * 3, v);
+        }
+    }
+    ReverseScalar(dst + i * channels, src, pixels - i, channels);
+}
+
+static void AddRowNEON(uint32_t *acc, const uint8_t *row, size_t n) {
+    size_t i = 0;
+    for (;i + 16 <= n;i+=16) {
+        uint8x16_t v = vld1q_u8(row + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        vst1q_u32(acc + i, vaddw_u16(vld1q_u32(acc + i), vget_low_u16(lo)));
+        vst1q_u32(acc + i + 4, vaddw_u16(vld1q_u32(acc + i + 4), vget_high_u16(lo)));
+        vst1q_u32(acc + i + 8, vaddw_u16(vld1q_u32(acc + i + 8), vget_low_u16(hi)));
+        vst1q_u32(acc + i + 12, vaddw_u16(vld1q_u32(acc + i + 12), vget_high_u16(hi)));
+    }
+    AddRowScalar(acc + i, row + i, n - i);
+}
+
+static void LerpRowsNEON(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t n, uint32_t w) {
+    const uint16x8_t wa = vdupq_n_u16((uint16_t)(256 - w));
+    const uint16x8_t wb = vdupq_n_u16((uint16_t)w);
+    size_t i = 0;
+    for (;i + 16 <= n;i+=16) {
+        uint8x16_t va = vld1q_u8(a + i);
+        uint8x16_t vb = vld1q_u8(b + i);
+        uint16x8_t lo = vmlaq_u16(vmulq_u16(vmovl_u8(vget_low_u8(va)), wa), vmovl_u8(vget_low_u8(vb)), wb);
+        uint16x8_t hi = vmlaq_u16(vmulq_u16(vmovl_u8(vget_high_u8(va)), wa), vmovl_u8(vget_high_u8(vb)), wb);
+        // rounding shift, adds 128 first
+        vst1q_u8(dst + i, vcombine_u8(vmovn_u16(vrshrq_n_u16(lo, 8)), vmovn_u16(vrshrq_n_u16(hi, 8))));
+    }
+    LerpRowsScalar(dst + i, a + i, b + i, n - i, w);
+}
+
+static const Kernels neon_kernels = { ReverseNEON, AddRowNEON, LerpRowsNEON, nullptr };
+
+#endif
+
+Level Detected() {
+#if defined(OCTOPRINTCONTROL_PIXELS_X86)
+    static const Level level = __builtin_cpu_supports("avx2") ? Level::AVX2 : __builtin_cpu_supports("ssse3") ? Level::SSSE3 : Level::Scalar;
+    return level;
+#elif defined(OCTOPRINTCONTROL_PIXELS_NEON)
+    return Level::NEON;
+#else
+    return Level::Scalar;
+#endif
+}
+
+// -1 until set, for Detected
+static std::atomic<int> active_level(-1);
+
+Level Active() {
+    int level = active_level.load(std::memory_order_relaxed);
+    return level < 0 ? Detected() : (Level)level;
+}
+
+void SetLevel(Level level) {
+    Level detected = Detected();
+    bool supported = level==Level::Scalar || level==detected || (detected==Level::AVX2 && level==Level::SSSE3);
+    active_level.store((int)(supported ? level : detected), std::memory_order_relaxed);
+}
+
+const char *Name(Level level) {
+    switch (level) {
+    case Level::SSSE3: return "ssse3";
+    case Level::AVX2: return "avx2";
+    case Level::NEON: return "neon";
+    default: return "scalar";
+    }
+}
+
+static const Kernels &ActiveKernels() {
+    switch (Active()) {
+#if defined(OCTOPRINTCONTROL_PIXELS_X86)
+    case Level::SSSE3: return ssse3_kernels;
+    case Level::AVX2: return avx2_kernels;
+#elif defined(OCTOPRINTCONTROL_PIXELS_NEON)
+    case Level::NEON: return neon_kernels;
+#endif
+    default: return scalar_kernels;
+    }
+}
+
+void FlipHorizontal(Image &img) {
+    const Kernels &k = ActiveKernels();
+    std::vector<uint8_t> row(img.Stride());
+    for (size_t y=0;y<img.height;y++) {
+        k.reverse(row.data(), img.Row(y), img.width, img.channels);
+        std::memcpy(img.Row(y), row.data(), row.size());
+    }
+}
+
+void FlipVertical(Image &img) {
+    // memcpy is already as wide as the cpu allows
+    std::vector<uint8_t> row(img.Stride());
+    for (size_t y=0;y<img.height / 2;y++) {
+        uint8_t *top = img.Row(y);
+        uint8_t *bottom = img.Row(img.height - 1 - y);
+        std::memcpy(row.data(), top, row.size());
+        std::memcpy(top, bottom, row.size());
+        std::memcpy(bottom, row.data(), row.size());
+    }
+}
+
+// the pixels of img from [x0, x1) x [y0, y1) into out, in tiles that stay in
+// cache
+static void RotateRegion(const Image &img, Image &out, bool clockwise, size_t x0, size_t x1, size_t y0, size_t y1) {
+    static const size_t tile = 32;
+    size_t ch = img.channels;
+    for (size_t ty=y0;ty<y1;ty+=tile) {
+        for (size_t tx=x0;tx<x1;tx+=tile) {
+            for (size_t y=ty;y<std::min(ty + tile, y1);y++) {
+                const uint8_t *src = img.Row(y);
+                for (size_t x=tx;x<std::min(tx + tile, x1);x++) {
+                    uint8_t *dst = clockwise ? out.Row(x) + (img.height - 1 - y) * ch : out.Row(img.width - 1 - x) + y * ch;
+                    if (ch==3) {
+                        dst[0] = src[x * 3];
+                        dst[1] = src[x * 3 + 1];
+                        dst[2] = src[x * 3 + 2];
+                    } else {
+                        for (size_t c=0;c<ch;c++) dst[c] = src[x * ch + c];
+                    }
+                }
+            }
+        }
+    }
+}
+
+Image Rotate90(const Image &img, bool clockwise) {
+    Image out(img.height, img.width, img.channels);
+    const Kernels &k = ActiveKernels();
+    if (img.channels!=1 || !k.transpose8) {
+        RotateRegion(img, out, clockwise, 0, img.width, 0, img.height);
+        return out;
+    }
+
+    // Clockwise, the rows are read bottom up so a transposed tile is already
+    // in order. The edges that don't fill a tile go through the loop.
+    size_t w8 = img.width & ~(size_t)7;
+    size_t h8 = img.height & ~(size_t)7;
+    const uint8_t *src[8];
+    uint8_t *dst[8];
+    for (size_t y=0;y<h8;y+=8) {
+        for (size_t x=0;x<w8;x+=8) {
+            for (int i=0;i<8;i++) {
+                src[i] = img.Row(clockwise ? y + 7 - i : y + i) + x;
+                dst[i] = clockwise ? out.Row(x + i) + (img.height - 8 - y) : out.Row(img.width - 1 - x - i) + y;
+            }
+            k.transpose8(dst, src);
+        }
+    }
+    RotateRegion(img, out, clockwise, w8, img.width, 0, h8);
+    RotateRegion(img, out, clockwise, 0, img.width, h8, img.height);
+    return out;
+}
+
+// One output row from the sums of its source rows, in cells of width or
+// width + 1 columns. CH is the channel count and N the cell width if they're
+// known when compiling, so the inner loops unroll.
+//
+// A rounded-up reciprocal gives the same quotient as dividing while the sums
+// stay under 2^32 / count, which covers cells of up to 4096 pixels. Dividing is
+// most of the cost otherwise.
+template<size_t CH, size_t N>
+static void BoxRow(uint8_t *dst, const uint32_t *acc, const size_t *cx, size_t out_width, size_t width, size_t rows, size_t ch) {
+    if (CH) ch = CH;
+    uint64_t counts[2] = { rows * width, rows * (width + 1) };
+    uint64_t recips[2];
+    for (int i=0;i<2;i++) recips[i] = counts[i] && counts[i] < 4096 ? ((uint64_t(1) << 32) + counts[i] - 1) / counts[i] : 0;
+
+    for (size_t ox=0;ox<out_width;ox++) {
+        size_t n = N ? N : cx[ox + 1] - cx[ox];
+        uint64_t count = counts[n > width];
+        uint64_t recip = recips[n > width];
+        const uint32_t *p = acc + cx[ox] * ch;
+        for (size_t c=0;c<ch;c++) {
+            uint64_t sum = count / 2;
+            for (size_t x=0;x<n;x++) sum += p[x * ch + c];
+            dst[ox * ch + c] = (uint8_t)(recip ? (sum * recip) >> 32 : sum / count);
+        }
+    }
+}
+
+static Image Box(const Image &img, size_t width, size_t height) {
+    if (width > img.width || height > img.height) throw std::runtime_error("A box filter can only scale down.");
+
+    const Kernels &k = ActiveKernels();
+    Image out(width, height, img.channels);
+    size_t ch = img.channels;
+
+    std::vector<size_t> cx(width + 1);
+    for (size_t i=0;i<=width;i++) cx[i] = i * img.width / width;
+
+    // each output row sums its source rows first, then each pixel its columns
+    std::vector<uint32_t> acc(img.Stride());
+    for (size_t oy=0;oy<height;oy++) {
+        size_t y0 = oy * img.height / height;
+        size_t y1 = (oy + 1) * img.height / height;
+        std::fill(acc.begin(), acc.end(), 0);
+        for (size_t y=y0;y<y1;y++) k.add_row(acc.data(), img.Row(y), acc.size());
+
+        // halving is the usual case
+        bool half = img.width==width * 2;
+        auto row = ch==3 ? (half ? BoxRow<3, 2> : BoxRow<3, 0>) : ch==1 ? (half ? BoxRow<1, 2> : BoxRow<1, 0>) : BoxRow<0, 0>;
+        row(out.Row(oy), acc.data(), cx.data(), width, img.width / width, y1 - y0, ch);
+    }
+    return out;
+}
+
+// where an output pixel's centre falls in the source, in 1/256ths of a pixel:
+// the first of the two pixels it's between and the weight of the second
+static void Sample(size_t out_size, size_t in_size, std::vector<size_t> &first, std::vector<uint32_t> &weight) {
+    first.resize(out_size);
+    weight.resize(out_size);
+    for (size_t i=0;i<out_size;i++) {
+        int64_t s = (int64_t)(2 * i + 1) * (int64_t)in_size * 256 / (int64_t)(2 * out_size) - 128;
+        s = std::max<int64_t>(s, 0);
+        first[i] = (size_t)(s >> 8);
+        weight[i] = (uint32_t)(s & 255);
+        if (first[i] >= in_size - 1) {
+            first[i] = in_size - 1;
+            weight[i] = 0;
+        }
+    }
+}
+
+static Image Bilinear(const Image &img, size_t width, size_t height) {
+    const Kernels &k = ActiveKernels();
+    Image out(width, height, img.channels);
+    size_t ch = img.channels;
+
+    std::vector<size_t> xs, ys;
+    std::vector<uint32_t> wx, wy;
+    Sample(width, img.width, xs, wx);
+    Sample(height, img.height, ys, wy);
+
+    // vertically a whole row at a time, then horizontally per pixel
+    std::vector<uint8_t> row(img.Stride());
+    for (size_t oy=0;oy<height;oy++) {
+        size_t y1 = std::min(ys[oy] + 1, img.height - 1);
+        k.lerp_rows(row.data(), img.Row(ys[oy]), img.Row(y1), row.size(), wy[oy]);
+
+        uint8_t *dst = out.Row(oy);
+        for (size_t ox=0;ox<width;ox++) {
+            const uint8_t *a = row.data() + xs[ox] * ch;
+            const uint8_t *b = row.data() + std::min(xs[ox] + 1, img.width - 1) * ch;
+            uint32_t w = wx[ox];
+            for (size_t c=0;c<ch;c++) dst[ox * ch + c] = (uint8_t)((a[c] * (256 - w) + b[c] * w + 128) >> 8);
+        }
+    }
+    return out;
+}
+
+Image Downscale(const Image &img, size_t width, size_t height, Filter filter) {
+    if (!width || !height || !img.width || !img.height) throw std::runtime_error("Can't scale an image to or from nothing.");
+    return filter==Filter::Box ? Box(img, width, height) : Bilinear(img, width, height);
+}
+
+void FlipHorizontal(YUV &frame) {
+    FlipHorizontal(frame.y);
+    FlipHorizontal(frame.u);
+    FlipHorizontal(frame.v);
+}
+
+void FlipVertical(YUV &frame) {
+    FlipVertical(frame.y);
+    FlipVertical(frame.u);
+    FlipVertical(frame.v);
+}
+
+YUV Rotate90(const YUV &frame, bool clockwise) {
+    return { Rotate90(frame.y, clockwise), Rotate90(frame.u, clockwise), Rotate90(frame.v, clockwise) };
+}
+
+YUV Downscale(const YUV &frame, size_t width, size_t height, Filter filter) {
+    return {
+        Downscale(frame.y, width, height, filter),
+        Downscale(frame.u, (width + 1) / 2, (height + 1) / 2, filter),
+        Downscale(frame.v, (width + 1) / 2, (height + 1) / 2, filter)
+    };
+}
+
+Image Read(Magick::Image &img) {
+    Image out(img.columns(), img.rows(), 3);
+    img.write(0, 0, out.width, out.height, "RGB", Magick::CharPixel, out.data.data());
+    return out;
+}
+
+Magick::Image Write(const Image &img) {
+    if (img.channels!=1 && img.channels!=3) throw std::runtime_error("Only grey and RGB images can be written.");
+    return Magick::Image(img.width, img.height, img.channels==1 ? "I" : "RGB", Magick::CharPixel, img.data.data());
+}
+
+}
@@ -0,0 +1,68 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <vector>
+#include <cinttypes>
+#include <cstddef>
+#include <Magick++.h>
+
+// The few transforms snapshots need, on 8 bit pixels in memory instead of
+// through Magick::Image. Kernels are picked once for the cpu: AVX2 or SSSE3 on
+// x86-64 (GCC and Clang), NEON on aarch64, plain loops otherwise. Every level
+// gives the same bytes.
+namespace OctoPrintControl::Pixels {
+
+struct Image {
+    std::vector<uint8_t> data;
+    size_t width = 0;
+    size_t height = 0;
+    // 3 for RGB, 1 for grey or one plane of a YUV frame
+    size_t channels = 3;
+
+    Image() {}
+    Image(size_t width, size_t height, size_t channels) :data(width * height * channels), width(width), height(height), channels(channels) {}
+
+    size_t Stride() const { return this->width * this->channels; }
+    uint8_t *Row(size_t y) { return this->data.data() + y * this->Stride(); }
+    const uint8_t *Row(size_t y) const { return this->data.data() + y * this->Stride(); }
+};
+
+// YUV 4:2:0 as three planes, chroma at half the size rounded up
+struct YUV {
+    Image y, u, v;
+};
+
+enum class Level { Scalar, SSSE3, AVX2, NEON };
+
+// the best the cpu supports
+Level Detected();
+Level Active();
+// for benchmarks, levels the cpu doesn't have fall back to Detected
+void SetLevel(Level level);
+const char *Name(Level level);
+
+void FlipHorizontal(Image &img);
+void FlipVertical(Image &img);
+Image Rotate90(const Image &img, bool clockwise);
+
+enum class Filter {
+    // the average of every source pixel an output pixel covers, for shrinking
+    // by 2 or more
+    Box,
+    // from the nearest 4, smoother for small changes in size
+    Bilinear
+};
+Image Downscale(const Image &img, size_t width, size_t height, Filter filter);
+
+void FlipHorizontal(YUV &frame);
+void FlipVertical(YUV &frame);
+YUV Rotate90(const YUV &frame, bool clockwise);
+// width and height of the luma plane
+YUV Downscale(const YUV &frame, size_t width, size_t height, Filter filter);
+
+// RGB pixels of a decoded image, and back
+Image Read(Magick::Image &img);
+Magick::Image Write(const Image &img);
+
+}
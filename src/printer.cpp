@@ -2,7 +2,7 @@
 // Copyright (c) 2024 Taylor Talkington
 // License: MIT (see LICENSE)
 #include "printer.h"
-#include <spdlog/sinks/stdout_color_sinks.h>
+#include "io.h"
 
 namespace OctoPrintControl {
 
@@ -14,11 +14,19 @@ Printer::Printer(std::string name, std::string url, std::string apikey)
     this->socket->AddCallback("connected", std::bind(&Printer::OnSocketConnected, this, std::placeholders::_1, std::placeholders::_2));
     this->socket->AddCallback("current", std::bind(&Printer::OnSocketCurrent, this, std::placeholders::_1, std::placeholders::_2));
 
-    this->log = spdlog::get("Printer::" + name);
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt("Printer::" + name);
+    this->log = Log::Get("Printer", {{"printer", name}});
+}
+
+void Printer::Connect() {
+    this->socket->Connect();
+}
 
-    std::thread t(&OctoPrint::Socket::Connect, this->socket);
-    t.detach();
+void Printer::Disconnect() {
+    this->socket->Disconnect();
+}
+
+void Printer::AddReadyCallback(PrinterReadyCallback cb) {
+    this->ready_callbacks.push_back(cb);
 }
 
 void Printer::OnSocketConnected(std::string msgtype, nlohmann::json data) {
@@ -37,15 +45,25 @@ void Printer::OnSocketConnected(std::string msgtype, nlohmann::json data) {
 
     this->socket->Send(sub);
 
+    // no thread waits on the login, so every printer can log in at once
+    IO::Spawn(this->Login());
+}
+
+IO::Task<void> Printer::Login() {
+    // the printer can be removed by a config reload while logging in
+    std::shared_ptr<Printer> self = this->shared_from_this();
     try {
-        nlohmann::json session = this->client->PassiveLogin();
+        nlohmann::json session = co_await this->client->PassiveLoginAsync();
         nlohmann::json auth = {
             { "auth", session["name"].get<std::string>() + ":" + session["session"].get<std::string>() }
         };
         this->socket->Send(auth);
     } catch (std::runtime_error &err) {
         this->log->error("Couldn't authenticate: {}", err.what());
+        co_return;
     }
+
+    for (PrinterReadyCallback &cb : this->ready_callbacks) cb();
 }
 
 void Printer::PowerOff() {
@@ -63,6 +81,18 @@ bool Printer::IsOn() {
     return msg.at("isPSUOn").get<bool>();
 }
 
+IO::Task<void> Printer::PowerOnAsync() {
+    nlohmann::json cmd = {{"command", "turnPSUOn"}};
+    co_await this->client->PluginSimpleApiCommandAsync("psucontrol", cmd);
+}
+
+IO::Task<bool> Printer::IsOnAsync() {
+    nlohmann::json cmd = {{"command", "getPSUState"}};
+    nlohmann::json msg = co_await this->client->PluginSimpleApiCommandAsync("psucontrol", cmd);
+
+    co_return msg.at("isPSUOn").get<bool>();
+}
+
 bool Printer::IsConnected() {
     return !this->last_state.closedorerror;
 }
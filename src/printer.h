@@ -5,24 +5,45 @@
 #include <string>
 #include <memory>
 #include <ctime>
+#include <list>
+#include <functional>
 #include <spdlog/spdlog.h>
 
 #include "octoprint.h"
+#include "timelapse.h"
+#include "log.h"
+
+namespace OctoPrintControl::Bench { struct Access; }
 
 namespace OctoPrintControl {
 
-class Printer {
+typedef std::function<void()> PrinterReadyCallback;
+
+// Must be owned by a std::shared_ptr.
+class Printer : public std::enable_shared_from_this<Printer> {
 public:
     Printer(std::string name, std::string url, std::string apikey);
 
+    // connects in the background, add socket callbacks first
+    void Connect();
+    // closes the socket for good, REST calls still work
+    void Disconnect();
+
+    // run each time the socket is connected and logged in
+    void AddReadyCallback(PrinterReadyCallback cb);
+
     std::string Name() { return name; }
 
     void PowerOff();
     void PowerOn();
     bool IsOn();
+    IO::Task<void> PowerOnAsync();
+    IO::Task<bool> IsOnAsync();
     
     std::shared_ptr<OctoPrint::Client> client;
     std::shared_ptr<OctoPrint::Socket> socket;
+    // nullptr without timelapses
+    std::shared_ptr<Timelapse::Recorder> timelapse;
 
     bool IsConnected();
     bool IsPrinting();
@@ -41,7 +62,10 @@ public:
     std::map<std::string, std::shared_ptr<temp_data>> last_temps;
 
 private:
+    friend struct Bench::Access;
+
     void OnSocketConnected(std::string msgtype, nlohmann::json data);
+    IO::Task<void> Login();
     void OnSocketCurrent(std::string msgtype, nlohmann::json data);
 
     struct {
@@ -68,7 +92,9 @@ private:
     std::string name;
     std::string url;
     std::string apikey;
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Log::Logger> log;
+
+    std::list<PrinterReadyCallback> ready_callbacks;
 };
 
 }
\ No newline at end of file
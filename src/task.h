@@ -0,0 +1,201 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <variant>
+#include <tuple>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include <spdlog/spdlog.h>
+
+#include "trace.h"
+
+// Coroutines for flows that wait on the network. A Task doesn't start until it is
+// awaited or spawned. I/O is done on the reactors and the coroutine continues on
+// the worker pool, so no thread is blocked while a request is in flight.
+namespace OctoPrintControl::IO {
+
+template<typename T> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            if (h.promise().continuation) return h.promise().continuation;
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { this->error = std::current_exception(); }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T v) { this->value = std::move(v); }
+
+    T Result() {
+        if (this->error) std::rethrow_exception(this->error);
+        return std::move(*this->value);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+
+    void Result() {
+        if (this->error) std::rethrow_exception(this->error);
+    }
+};
+
+}
+
+template<typename T=void>
+class [[nodiscard]] Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    Task(Task &&other) noexcept :handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task &operator=(const Task&) = delete;
+    ~Task() { if (this->handle) this->handle.destroy(); }
+
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        this->handle.promise().continuation = caller;
+        return this->handle;
+    }
+    T await_resume() { return this->handle.promise().Result(); }
+
+private:
+    friend struct detail::Promise<T>;
+    explicit Task(std::coroutine_handle<promise_type> handle) :handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template<typename T>
+Task<T> Promise<T>::get_return_object() { return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this)); }
+
+inline Task<void> Promise<void>::get_return_object() { return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this)); }
+
+// runs eagerly and frees itself when done
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+inline Detached RunDetached(Task<void> task) {
+    try {
+        co_await task;
+    } catch (std::exception &err) {
+        spdlog::error("Unhandled exception in spawned task: {}", err.what());
+    } catch (...) {
+        spdlog::error("Unhandled exception in spawned task.");
+    }
+}
+
+template<typename T> struct NonVoid { using type = T; };
+template<> struct NonVoid<void> { using type = std::monostate; };
+
+struct WhenAllState {
+    std::atomic<size_t> remaining;
+    std::coroutine_handle<> waiter;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+};
+
+template<typename T, typename Out>
+Detached RunInto(Task<T> task, Out &out, std::shared_ptr<WhenAllState> state) {
+    try {
+        if constexpr (std::is_void_v<T>) co_await task;
+        else out = co_await task;
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(state->error_mutex);
+        if (!state->error) state->error = std::current_exception();
+    }
+    if (--state->remaining==0) state->waiter.resume();
+}
+
+template<typename Start>
+struct WhenAllAwaiter {
+    std::shared_ptr<WhenAllState> state;
+    Start start;
+
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        this->state->waiter = h;
+
+        // every task starts in the caller's trace
+        uint64_t trace = Trace::Detach();
+        this->start(trace);
+
+        // the last one to finish resumes us, which may have been everyone already
+        if (--this->state->remaining > 0) {
+            Trace::Detach();
+            return true;
+        }
+        Trace::Attach(trace);
+        return false;
+    }
+    void await_resume() {
+        if (this->state->error) std::rethrow_exception(this->state->error);
+    }
+};
+
+}
+
+// Starts a task on the calling thread and lets it finish in the background.
+// Exceptions are logged.
+inline void Spawn(Task<void> task) {
+    detail::RunDetached(std::move(task));
+}
+
+// Runs tasks concurrently, results are in the same order and void tasks give a
+// std::monostate. Rethrows the first exception once all of them are done.
+template<typename... T>
+Task<std::tuple<typename detail::NonVoid<T>::type...>> WhenAll(Task<T>... tasks) {
+    std::tuple<typename detail::NonVoid<T>::type...> results;
+    std::shared_ptr<detail::WhenAllState> state(new detail::WhenAllState);
+    state->remaining = sizeof...(T) + 1;
+
+    auto start = [&](uint64_t trace) {
+        [&]<size_t... I>(std::index_sequence<I...>) {
+            ((Trace::Attach(trace), detail::RunInto(std::move(tasks), std::get<I>(results), state)), ...);
+        }(std::index_sequence_for<T...>{});
+    };
+    // named, gcc 12 destroys an aggregate temporary awaiter twice
+    detail::WhenAllAwaiter<decltype(start)> all{ state, start };
+    co_await all;
+
+    co_return results;
+}
+
+}
@@ -0,0 +1,244 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "timelapse.h"
+#include <stdexcept>
+#include <algorithm>
+#include <Magick++.h>
+#include <fmt/core.h>
+#include "octoprint.h"
+#include "trace.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace OctoPrintControl::Timelapse {
+
+Recorder::Recorder(std::string name, Options options)
+:name(name), options(options) {
+    this->log = Log::Get("Printer", {{"printer", name}});
+
+    Metrics::Labels labels = {{"printer", name}};
+    this->ring_bytes = &Metrics::GetGauge("octoprintcontrol_timelapse_bytes", "Downscaled frames held for the current print's timelapse.", labels);
+    this->clips = &Metrics::GetCounter("octoprintcontrol_timelapse_clips_total", "Timelapse clips encoded.", labels);
+    this->encode_time = &Metrics::GetHistogram("octoprintcontrol_timelapse_encode_seconds", "Time to encode a timelapse clip.", Metrics::LatencyBuckets, labels);
+}
+
+bool Recorder::Due(std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (now - this->last_frame < this->options.interval * this->stride) return false;
+    this->last_frame = now;
+    return true;
+}
+
+void Recorder::Add(std::vector<char> image) {
+    std::shared_ptr<Recorder> self = this->shared_from_this();
+    Post([self, image = std::move(image)]() mutable { self->Keep(std::move(image)); });
+}
+
+void Recorder::Clear() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->frames.clear();
+    this->bytes = 0;
+    this->stride = 1;
+    this->last_frame = std::chrono::steady_clock::time_point();
+    this->ring_bytes->Set(0);
+}
+
+void Recorder::Finish(std::function<void(Clip)> done) {
+    std::shared_ptr<Recorder> self = this->shared_from_this();
+    Post([self, done]() { self->Encode(done); });
+}
+
+void Recorder::Keep(std::vector<char> image) {
+    Magick::Blob out;
+    try {
+        OctoPrint::WaitForMagick();
+        Magick::Image img(Magick::Blob(image.data(), image.size()));
+        // only ever smaller, keeping the aspect ratio
+        img.thumbnail(Magick::Geometry(fmt::format("{}x>", this->options.width)));
+        img.magick("JPEG");
+        img.quality(75);
+        img.write(&out);
+    } catch (std::exception &err) {
+        this->log->warn("Couldn't scale down a timelapse frame: {}", err.what());
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    const char *data = static_cast<const char*>(out.data());
+    this->frames.emplace_back(data, data + out.length());
+    this->bytes += out.length();
+    while (this->bytes > this->options.budget && this->frames.size() > min_frames) this->Thin();
+    this->ring_bytes->Set((int64_t)this->bytes);
+}
+
+void Recorder::Thin() {
+    std::deque<std::vector<char>> kept;
+    this->bytes = 0;
+    for (size_t i=0;i<this->frames.size();i+=2) {
+        this->bytes += this->frames[i].size();
+        kept.push_back(std::move(this->frames[i]));
+    }
+    this->frames.swap(kept);
+    this->stride *= 2;
+    this->log->debug("Timelapse past {} KiB, keeping {} frames and taking one every {} seconds",
+        this->options.budget / 1024, this->frames.size(), std::chrono::duration_cast<std::chrono::seconds>(this->options.interval * this->stride).count());
+}
+
+void Recorder::Encode(std::function<void(Clip)> done) {
+    std::deque<std::vector<char>> frames;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        frames.swap(this->frames);
+        this->bytes = 0;
+        this->stride = 1;
+        this->last_frame = std::chrono::steady_clock::time_point();
+        this->ring_bytes->Set(0);
+    }
+
+    if (frames.size() < min_frames) {
+        this->log->info("Only {} timelapse frames, not making a clip", frames.size());
+        return;
+    }
+
+    Trace::Span span("Timelapse encode", "image");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    Clip clip;
+    clip.filename = "timelapse." + this->options.format;
+    if (this->options.format=="mp4") clip.content_type = "video/mp4";
+    else clip.content_type = "image/" + this->options.format;
+
+    try {
+        // decoded as 16 bit RGBA
+        Magick::Image first;
+        first.ping(Magick::Blob(frames[0].data(), frames[0].size()));
+        size_t frame_bytes = std::max<size_t>(first.columns() * first.rows() * 8, 1);
+        size_t keep = decode_budget / frame_bytes;
+        if (keep > max_frames) keep = max_frames;
+        if (keep < min_frames) keep = min_frames;
+        if (frames.size() > keep) {
+            this->log->debug("Timelapse of {} frames, encoding {} of them", frames.size(), keep);
+            std::deque<std::vector<char>> picked;
+            for (size_t i=0;i<keep;i++) picked.push_back(std::move(frames[i * frames.size() / keep]));
+            frames.swap(picked);
+        }
+        clip.frames = frames.size();
+
+        std::vector<Magick::Image> images;
+        images.reserve(frames.size());
+        for (std::vector<char> &f : frames) {
+            images.emplace_back(Magick::Blob(f.data(), f.size()));
+            images.back().animationDelay(100 / fps);
+            images.back().animationIterations(0);
+            images.back().magick(this->options.format=="mp4" ? "MP4" : this->options.format=="webp" ? "WEBP" : "GIF");
+            // each is read back as it's needed
+            f = std::vector<char>();
+        }
+
+        Magick::Blob out;
+        Magick::writeImages(images.begin(), images.end(), &out, true);
+        const char *data = static_cast<const char*>(out.data());
+        clip.data.assign(data, data + out.length());
+    } catch (std::exception &err) {
+        this->log->warn("Couldn't encode timelapse: {}", err.what());
+        return;
+    }
+
+    std::chrono::steady_clock::duration took = std::chrono::steady_clock::now() - start;
+    this->encode_time->Observe(took);
+    this->clips->Inc();
+    this->log->info("Timelapse of {} frames encoded to {} KiB in {} ms", clip.frames, clip.data.size() / 1024,
+        std::chrono::duration_cast<std::chrono::milliseconds>(took).count());
+
+    done(std::move(clip));
+}
+
+Worker::Worker() {
+    this->thread = std::thread(&Worker::ThreadMain, this);
+}
+
+Worker::~Worker() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cv.notify_all();
+    this->thread.join();
+}
+
+void Worker::Post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queue.push_back(fn);
+    }
+    this->cv.notify_one();
+}
+
+void Worker::ThreadMain() {
+    std::shared_ptr<Log::Logger> log = Log::Get("App");
+
+    // below every other thread, the scheduler only runs it on an idle cpu
+#if defined(__linux__)
+    sched_param param = {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param)) log->warn("Couldn't lower the timelapse thread's priority");
+#elif defined(_WIN32)
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+#endif
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->cv.wait(lock, [this]() { return this->stopping || this->queue.size(); });
+        if (this->stopping) return;
+
+        std::function<void()> fn = std::move(this->queue.front());
+        this->queue.pop_front();
+
+        lock.unlock();
+        try {
+            fn();
+        } catch (std::exception &err) {
+            log->error("Unhandled exception in timelapse work: {}", err.what());
+        }
+        lock.lock();
+    }
+}
+
+// samples are posted from worker threads while Stop runs
+static std::mutex worker_mutex;
+static std::unique_ptr<Worker> worker;
+static bool worker_stopped = false;
+
+void Start() {
+    std::lock_guard<std::mutex> lock(worker_mutex);
+    worker.reset(new Worker);
+}
+
+void Stop() {
+    std::unique_ptr<Worker> stopping;
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        worker_stopped = true;
+        stopping.swap(worker);
+    }
+    stopping.reset();
+}
+
+void Post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        if (worker) {
+            worker->Post(fn);
+            return;
+        }
+        if (worker_stopped) return;
+    }
+    fn();
+}
+
+}
@@ -0,0 +1,116 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+
+#include "log.h"
+#include "metrics.h"
+
+// Short animated clips of a print, made from webcam frames sampled while it
+// runs. Downscaling and encoding happen on a thread of their own at the lowest
+// priority, so they only use CPU nothing else wants.
+namespace OctoPrintControl::Timelapse {
+
+struct Options {
+    // gif, webp or mp4, mp4 needs ImageMagick's ffmpeg delegate
+    std::string format = "gif";
+    // frames are scaled down to this width
+    size_t width = 480;
+    // for the downscaled frames of one print, though min_frames are kept
+    // whatever their size
+    size_t budget = 4 * 1024 * 1024;
+    std::chrono::steady_clock::duration interval = std::chrono::seconds(30);
+};
+
+struct Clip {
+    std::vector<char> data;
+    std::string filename;
+    std::string content_type;
+    size_t frames = 0;
+};
+
+// Frames for one printer's clip. Once they pass the budget every other frame is
+// dropped and frames are taken half as often, so a clip always covers the
+// whole print however long it runs. Must be owned by a std::shared_ptr.
+class Recorder : public std::enable_shared_from_this<Recorder> {
+public:
+    Recorder(std::string name, Options options);
+
+    // true if a frame should be taken now, and counts it as taken
+    bool Due(std::chrono::steady_clock::time_point now);
+    // scaled down and kept on the timelapse thread
+    void Add(std::vector<char> image);
+    // drops the frames so far, for a new print
+    void Clear();
+    // encodes the frames so far on the timelapse thread and clears them. done
+    // runs there too, and isn't called if there weren't enough frames or
+    // encoding failed.
+    void Finish(std::function<void(Clip)> done);
+
+    // fewer frames than this aren't worth a clip
+    static const size_t min_frames = 4;
+    // Every frame of a clip is decoded at once to encode it, so no more than fit
+    // decode_budget are used, and never more than max_frames. The rest are
+    // dropped evenly across the print.
+    static const size_t max_frames = 100;
+    static const size_t decode_budget = 64 * 1024 * 1024;
+    static const int fps = 10;
+
+private:
+    // the rest run on the timelapse thread
+    void Keep(std::vector<char> image);
+    void Thin();
+    void Encode(std::function<void(Clip)> done);
+
+    std::string name;
+    Options options;
+    std::shared_ptr<Log::Logger> log;
+
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point last_frame;
+    // frames are taken every interval * stride, doubled each time they're thinned
+    size_t stride = 1;
+    std::deque<std::vector<char>> frames;
+    size_t bytes = 0;
+
+    Metrics::Gauge *ring_bytes;
+    Metrics::Counter *clips;
+    Metrics::Histogram *encode_time;
+};
+
+// The single low priority thread. Work is run in order, and work still queued
+// when it stops is dropped.
+class Worker {
+public:
+    Worker();
+    ~Worker();
+
+    void Post(std::function<void()> fn);
+
+private:
+    void ThreadMain();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::deque<std::function<void()>> queue;
+
+    std::thread thread;
+};
+
+void Start();
+void Stop();
+
+// run on the timelapse thread, or right away if it was never started
+void Post(std::function<void()> fn);
+
+}
@@ -0,0 +1,168 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "trace.h"
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <nlohmann/json.hpp>
+
+namespace OctoPrintControl::Trace {
+
+struct Event {
+    std::string name;
+    std::string category;
+    std::map<std::string, std::string> args;
+    int64_t ts;  // us since process start
+    int64_t dur; // us
+    uint64_t tid;
+    uint64_t trace_id;
+};
+
+static const std::chrono::steady_clock::time_point process_start = std::chrono::steady_clock::now();
+
+static double sample_rate = 1.0;
+
+static std::mutex buffer_mutex;
+static std::vector<Event> buffer(8192);
+static size_t buffer_next = 0;
+static bool buffer_wrapped = false;
+
+static std::atomic<uint64_t> next_trace_id = 1;
+static std::atomic<uint64_t> next_tid = 1;
+
+static thread_local uint64_t current_trace = 0;
+
+static uint64_t ThreadId() {
+    static thread_local uint64_t tid = next_tid.fetch_add(1);
+    return tid;
+}
+
+static bool Sample() {
+    if (sample_rate >= 1.0) return true;
+    if (sample_rate <= 0.0) return false;
+
+    static thread_local std::minstd_rand rand((unsigned int)std::chrono::steady_clock::now().time_since_epoch().count());
+    std::uniform_real_distribution<double> dist(0, 1);
+    return dist(rand) < sample_rate;
+}
+
+static int64_t Micros(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+static void Record(Event &&ev) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (buffer.size()==0) return;
+
+    buffer[buffer_next] = std::move(ev);
+    buffer_next++;
+    if (buffer_next==buffer.size()) {
+        buffer_next = 0;
+        buffer_wrapped = true;
+    }
+}
+
+void Configure(double rate, size_t buffer_events) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    sample_rate = rate;
+    buffer = std::vector<Event>(buffer_events);
+    buffer_next = 0;
+    buffer_wrapped = false;
+}
+
+Span::Span(const char *name, const char *category, bool root)
+:name(name), category(category), root(root) {
+    if (root && current_trace==0 && Sample()) current_trace = next_trace_id.fetch_add(1);
+    else this->root = false;
+
+    if (current_trace==0) return;
+
+    this->trace_id = current_trace;
+    this->start = std::chrono::steady_clock::now();
+}
+
+Span::~Span() {
+    if (!this->trace_id) return;
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    Record(Event{
+        .name = this->dynamic_name.empty() ? std::string(this->name) : std::move(this->dynamic_name),
+        .category = this->category,
+        .args = std::move(this->args),
+        .ts = Micros(this->start - process_start),
+        .dur = Micros(end - this->start),
+        .tid = ThreadId(),
+        .trace_id = this->trace_id
+    });
+
+    if (this->root) current_trace = 0;
+}
+
+void Span::Name(std::string name) {
+    if (this->trace_id) this->dynamic_name = std::move(name);
+}
+
+void Span::Arg(const char *key, std::string_view value) {
+    if (this->trace_id) this->args[key] = std::string(value);
+}
+
+void AddCompleteEvent(const char *name, const char *category, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    if (current_trace==0) return;
+
+    Record(Event{
+        .name = name,
+        .category = category,
+        .ts = Micros(start - process_start),
+        .dur = Micros(end - start),
+        .tid = ThreadId(),
+        .trace_id = current_trace
+    });
+}
+
+uint64_t Detach() {
+    uint64_t trace_id = current_trace;
+    current_trace = 0;
+    return trace_id;
+}
+
+void Attach(uint64_t trace_id) {
+    current_trace = trace_id;
+}
+
+std::string DumpChromeTrace() {
+    nlohmann::json events = nlohmann::json::array();
+
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+
+    // oldest first
+    size_t count = buffer_wrapped ? buffer.size() : buffer_next;
+    size_t first = buffer_wrapped ? buffer_next : 0;
+    for (size_t i=0;i<count;i++) {
+        Event &ev = buffer[(first + i) % buffer.size()];
+
+        nlohmann::json args = ev.args;
+        args["trace"] = ev.trace_id;
+
+        events.push_back({
+            { "name", ev.name },
+            { "cat", ev.category },
+            { "ph", "X" },
+            { "ts", ev.ts },
+            { "dur", ev.dur },
+            { "pid", 1 },
+            { "tid", ev.tid },
+            { "args", args }
+        });
+    }
+
+    nlohmann::json trace = {
+        { "traceEvents", events },
+        { "displayTimeUnit", "ms" }
+    };
+
+    return trace.dump();
+}
+
+}
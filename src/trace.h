@@ -0,0 +1,54 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <cinttypes>
+#include <map>
+
+namespace OctoPrintControl::Trace {
+
+// Spans are only recorded inside a sampled trace. A root span makes the sampling
+// decision and the trace follows the thread until the root span ends, so child spans
+// in lower layers (HTTP, image processing) cost a thread local check when not tracing.
+// Names and categories are string literals, nothing is copied unless the span is
+// recorded.
+void Configure(double sample_rate, size_t buffer_events);
+
+class Span {
+public:
+    Span(const char *name, const char *category, bool root=false);
+    ~Span();
+
+    // replaces the name, only worth building one when Active()
+    void Name(std::string name);
+    void Arg(const char *key, std::string_view value);
+
+    bool Active() { return this->trace_id!=0; }
+
+private:
+    const char *name;
+    const char *category;
+    // set by Name, used instead of name
+    std::string dynamic_name;
+    std::map<std::string, std::string> args;
+    std::chrono::steady_clock::time_point start;
+    uint64_t trace_id = 0;
+    bool root;
+};
+
+// Records a span with explicit times into the current trace, if there is one.
+void AddCompleteEvent(const char *name, const char *category, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+// A coroutine can suspend on one thread and continue on another. Detach takes the
+// current trace off this thread and returns it, Attach puts it on the thread it
+// continues on.
+uint64_t Detach();
+void Attach(uint64_t trace_id);
+
+// Recent events as Chrome trace_event JSON, loadable in chrome://tracing or Perfetto.
+std::string DumpChromeTrace();
+
+}
@@ -6,112 +6,236 @@
 #include <fmt/core.h>
 #include <stdexcept>
 #include <chrono>
-#include <spdlog/sinks/stdout_color_sinks.h>
 
 namespace OctoPrintControl::Websocket {
 
-Client::Client(std::string url)
-:url(url) {
-    this->curl = curl_easy_init();
+Client::Client(std::string url, std::string name, IO::Reactor *reactor)
+:reactor(reactor), url(url) {
+    if (!this->reactor) this->reactor = IO::Next();
+    if (!this->reactor) throw std::runtime_error("No IO reactor is running.");
+
+    Metrics::Labels labels = {{ "connection", name.size() ? name : url }};
+    this->messages_in = &Metrics::GetCounter("octoprintcontrol_websocket_messages_received_total", "Complete websocket messages received.", labels);
+    this->messages_out = &Metrics::GetCounter("octoprintcontrol_websocket_messages_sent_total", "Websocket messages sent.", labels);
+    this->bytes_in = &Metrics::GetCounter("octoprintcontrol_websocket_received_bytes_total", "Websocket payload bytes received.", labels);
+    this->bytes_out = &Metrics::GetCounter("octoprintcontrol_websocket_sent_bytes_total", "Websocket payload bytes sent.", labels);
+    this->send_queue_depth = &Metrics::GetGauge("octoprintcontrol_websocket_send_queue_depth", "Messages waiting to be sent on a websocket.", labels);
 
-    this->log = spdlog::get(fmt::format("Websocket::Client::{}", url));
-    if (!this->log.get()) this->log = spdlog::stdout_color_mt(fmt::format("Websocket::Client::{}", url));
+    this->log = Log::Get("Websocket", {{"url", url}});
 }
 
 Client::~Client() {
-    this->Disconnect();
-    if (this->thread.joinable()) this->thread.join();
-    curl_easy_cleanup(this->curl);
+    // the handle and socket belong to the reactor thread
+    this->reactor->Invoke([this]() { this->Close("", false); });
+    this->send_queue_depth->Dec((int64_t)this->sendQueue.size());
 }
 
 void Client::Connect() {
-    curl_easy_reset(this->curl);
+    std::weak_ptr<Client> weak = this->weak_from_this();
+    this->reactor->Post([weak]() {
+        if (std::shared_ptr<Client> self = weak.lock()) self->StartConnect();
+    });
+}
+
+void Client::Disconnect() {
+    std::weak_ptr<Client> weak = this->weak_from_this();
+    auto close = [weak]() {
+        if (std::shared_ptr<Client> self = weak.lock()) self->Close("", false);
+    };
+
+    if (this->reactor->InThread()) close();
+    else this->reactor->Post(close);
+}
+
+void Client::UserAgent(std::string userAgent) {
+    this->userAgent = userAgent;
+}
+
+void Client::Send(std::vector<char> data) {
+    {
+        std::lock_guard<std::mutex> lock(this->send_mutex);
+        this->sendQueue.push_back(std::move(data));
+        this->send_queue_depth->Inc();
+        if (this->flushPosted) return;
+        this->flushPosted = true;
+    }
+
+    std::weak_ptr<Client> weak = this->weak_from_this();
+    this->reactor->Post([weak]() {
+        if (std::shared_ptr<Client> self = weak.lock()) self->Flush();
+    });
+}
+
+void Client::Send(const std::string &data) {
+    this->Send(std::vector<char>(data.begin(), data.end()));
+}
+
+void Client::AddDataReceivedCallback(DataReceivedCallback cb) {
+    this->callbacks.push_back(cb);
+}
+
+void Client::AddConnectedCallback(ConnectedCallback cb) {
+    this->connectedCallbacks.push_back(cb);
+}
+
+void Client::AddClosedCallback(ClosedCallback cb) {
+    this->closedCallbacks.push_back(cb);
+}
+
+void Client::StartConnect() {
+    this->Close("", false);
+
+    this->curl = curl_easy_init();
     curl_easy_setopt(this->curl, CURLOPT_URL, this->url.c_str());
-    curl_easy_setopt(this->curl, CURLOPT_USERAGENT, this->userAgent);
+    if (this->userAgent.size()) curl_easy_setopt(this->curl, CURLOPT_USERAGENT, this->userAgent.c_str());
     curl_easy_setopt(this->curl, CURLOPT_CONNECT_ONLY, 2L);
+    curl_easy_setopt(this->curl, CURLOPT_CONNECTTIMEOUT, 30L);
 
     this->log->debug("Connecting...");
 
-    CURLcode res = curl_easy_perform(this->curl);
-    if (res!=CURLE_OK) {
-        int respcode;
+    this->state = State::Connecting;
+    this->reactor->AddTransfer(this->curl, [this](CURLcode result) { this->OnConnectDone(result); });
+}
+
+void Client::OnConnectDone(CURLcode result) {
+    if (this->state!=State::Connecting) return;
+
+    std::shared_ptr<Client> self = this->shared_from_this();
+
+    if (result!=CURLE_OK) {
+        long respcode = 0;
         curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &respcode);
-        std::string msg = fmt::format("Couldn't connect websocket at {}: {}", this->url, respcode);
-        throw std::runtime_error(msg);
+        this->Close(fmt::format("Couldn't connect websocket at {}: {} ({})", this->url, respcode, curl_easy_strerror(result)), true);
+        return;
     }
 
     curl_easy_getinfo(this->curl, CURLINFO_ACTIVESOCKET, &this->socket);
 
     this->log->debug("Connected.");
 
-    this->connected = true;
-    this->thread = std::thread(&Client::ThreadMain, this);
-}
+    this->state = State::Open;
+    this->UpdateWatch();
 
-void Client::Disconnect() {
-    this->connected = false;
-}
+    for (ConnectedCallback cb : this->connectedCallbacks) cb();
 
-void Client::UserAgent(std::string userAgent) {
-    this->userAgent = userAgent;
+    this->Flush();
+    // the first messages can arrive with the handshake and already be buffered
+    this->Receive();
 }
 
-void Client::Send(std::vector<char> data) {
-    this->sendQueue.push(data);
-}
+void Client::OnSocketEvent(int events) {
+    std::shared_ptr<Client> self = this->shared_from_this();
 
-void Client::Send(std::string data) {
-    this->Send(std::vector<char>(data.begin(), data.end()));
+    if (events & IO::Writable) this->Flush();
+    if (events & IO::Readable) this->Receive();
 }
 
-void Client::AddDataReceivedCallback(DataReceivedCallback cb) {
-    this->callbacks.push_back(cb);
+void Client::UpdateWatch() {
+    std::weak_ptr<Client> weak = this->weak_from_this();
+    this->reactor->Watch(this->socket, IO::Readable | (this->wantWrite ? IO::Writable : 0), [weak](int events) {
+        if (std::shared_ptr<Client> self = weak.lock()) self->OnSocketEvent(events);
+    });
 }
 
-void Client::ThreadMain() {
-    char *buf = new char[1024];
-    std::vector<char> data;
+void Client::Receive() {
+    char buf[16384];
     size_t recv = 0;
     const struct curl_ws_frame *frame;
-    
-    CURLcode res;
-    while (this->connected) {
-        //data.clear();
-        bool lastCont = false;
-        do {
-            res = curl_ws_recv(this->curl, buf, 1024, &recv, &frame);
-            if (res==CURLE_GOT_NOTHING) {
-                spdlog::error("Websocket disconnected.");
-                this->connected = false;
-                break;
-            }
-            for (size_t i=0;i<recv;i++) data.push_back(buf[i]);
-            if (res==CURLE_OK) lastCont = frame->flags & CURLWS_CONT;
-        } while (res==CURLE_OK && recv > 0);
-
-        if (data.size() && !lastCont) {
-            //this->log->debug("Received: {}", std::string(data.begin(), data.end()));
-            for (DataReceivedCallback cb : this->callbacks) cb(data);
-            data.clear();
+
+    while (this->state==State::Open) {
+        CURLcode res = curl_ws_recv(this->curl, buf, sizeof(buf), &recv, &frame);
+        if (res==CURLE_AGAIN) return;
+        if (res==CURLE_GOT_NOTHING) {
+            this->Close("Websocket disconnected.", true);
+            return;
+        }
+        if (res!=CURLE_OK) {
+            this->Close(fmt::format("Websocket receive failed: {}", curl_easy_strerror(res)), true);
+            return;
+        }
+        if (frame->flags & CURLWS_CLOSE) {
+            this->Close("Websocket closed by the server.", true);
+            return;
+        }
+        if (frame->flags & (CURLWS_PING | CURLWS_PONG)) continue;
+
+        this->message.insert(this->message.end(), buf, buf + recv);
+        if (frame->bytesleft || (frame->flags & CURLWS_CONT)) continue;
+
+        std::vector<char> data;
+        data.swap(this->message);
+
+        //this->log->debug("Received: {}", std::string(data.begin(), data.end()));
+        this->messages_in->Inc();
+        this->bytes_in->Inc(data.size());
+        for (DataReceivedCallback cb : this->callbacks) cb(data);
+    }
+}
+
+void Client::Flush() {
+    std::unique_lock<std::mutex> lock(this->send_mutex);
+    this->flushPosted = false;
+    if (this->state!=State::Open) return;
+
+    bool wasWaiting = this->wantWrite;
+    this->wantWrite = false;
+
+    while (this->sendQueue.size()) {
+        std::vector<char> &d = this->sendQueue.front();
+        size_t sent = 0;
+        //this->log->debug("Sending: {}", std::string(d.begin(), d.end()));
+        CURLcode res = curl_ws_send(this->curl, d.data() + this->sendOffset, d.size() - this->sendOffset, &sent, 0, CURLWS_TEXT);
+        this->sendOffset += sent;
+
+        if (res==CURLE_AGAIN) {
+            this->wantWrite = true;
+            break;
         }
+        if (res!=CURLE_OK) {
+            lock.unlock();
+            this->log->warn("Couldn't send data on websocket.");
+            this->Close(fmt::format("Websocket send failed: {}", curl_easy_strerror(res)), true);
+            return;
+        }
+        if (this->sendOffset < d.size()) continue;
 
-        while (this->sendQueue.size()) {
-            std::vector<char> d = this->sendQueue.front();
-            size_t sent = 0;
-            //this->log->debug("Sending: {}", std::string(d.begin(), d.end()));
-            if (curl_ws_send(this->curl, d.data(), d.size(), &sent, 0, CURLWS_TEXT)) {
-                this->log->warn("Couldn't send data on websocket.");
-                this->connected = false;
-                break;
-            }
-            this->sendQueue.pop();
+        this->messages_out->Inc();
+        this->bytes_out->Inc(d.size());
+        this->sendQueue.pop_front();
+        this->sendOffset = 0;
+        this->send_queue_depth->Dec();
+    }
+
+    if (this->wantWrite!=wasWaiting) this->UpdateWatch();
+}
+
+void Client::Close(std::string error, bool notify) {
+    if (this->state==State::Idle || this->state==State::Closed) return;
+
+    if (this->state==State::Open) {
+        if (!notify) {
+            size_t sent;
+            curl_ws_send(this->curl, "", 0, &sent, 0, CURLWS_CLOSE);
         }
+        this->reactor->Unwatch(this->socket);
+    }
+
+    this->state = State::Closed;
+    this->reactor->RemoveTransfer(this->curl);
+    curl_easy_cleanup(this->curl);
+    this->curl = nullptr;
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(25));
+    this->message.clear();
+    {
+        std::lock_guard<std::mutex> lock(this->send_mutex);
+        this->wantWrite = false;
+        this->sendOffset = 0;
     }
 
+    if (!notify) return;
 
-    delete[] buf;
+    this->log->debug("Closed: {}", error);
+    for (ClosedCallback cb : this->closedCallbacks) cb(error);
 }
 
-}
\ No newline at end of file
+}
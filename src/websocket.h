@@ -6,42 +6,88 @@
 #include <functional>
 #include <vector>
 #include <list>
-#include <queue>
-#include <thread>
+#include <deque>
+#include <mutex>
+#include <memory>
 #include <spdlog/spdlog.h>
 #include <curl/curl.h>
 
+#include "io.h"
+#include "log.h"
+#include "metrics.h"
+
 namespace OctoPrintControl::Websocket {
 
 typedef std::function<void(std::vector<char>)> DataReceivedCallback;
+typedef std::function<void()> ConnectedCallback;
+// error says why the connection attempt failed or the connection was lost
+typedef std::function<void(std::string error)> ClosedCallback;
 
-class Client {
+// A websocket owned by an IO::Reactor. Connect returns right away and callbacks
+// are run on the reactor thread. Must be owned by a std::shared_ptr.
+class Client : public std::enable_shared_from_this<Client> {
 public:
-    Client(std::string url);
+    // name identifies the connection in metrics, the url is used if it is empty
+    // reactor defaults to IO::Next()
+    Client(std::string url, std::string name="", IO::Reactor *reactor=nullptr);
     ~Client();
     void Connect();
+    // closes the connection without calling the closed callbacks
     void Disconnect();
 
     void UserAgent(std::string userAgent);
 
+    // safe from any thread, data sent before the connection opens is queued
     void Send(std::vector<char> data);
-    void Send(std::string data);
+    void Send(const std::string &data);
 
     void AddDataReceivedCallback(DataReceivedCallback cb);
+    void AddConnectedCallback(ConnectedCallback cb);
+    void AddClosedCallback(ClosedCallback cb);
 
 private:
-    void ThreadMain();
+    enum class State {
+        Idle,
+        Connecting,
+        Open,
+        Closed
+    };
+
+    void StartConnect();
+    void OnConnectDone(CURLcode result);
+    void OnSocketEvent(int events);
+    void Receive();
+    void Flush();
+    void UpdateWatch();
+    void Close(std::string error, bool notify);
 
-    std::shared_ptr<spdlog::logger> log;
+    std::shared_ptr<Log::Logger> log;
 
-    CURL *curl;
+    IO::Reactor *reactor;
+    CURL *curl = nullptr;
     curl_socket_t socket;
     std::string url;
-    bool connected;
+    State state = State::Idle;
     std::string userAgent;
-    std::queue<std::vector<char>> sendQueue;
+
+    std::mutex send_mutex;
+    std::deque<std::vector<char>> sendQueue;
+    // bytes of the front message already sent
+    size_t sendOffset = 0;
+    bool flushPosted = false;
+    bool wantWrite = false;
+
+    std::vector<char> message;
+
     std::list<DataReceivedCallback> callbacks;
-    std::thread thread;
+    std::list<ConnectedCallback> connectedCallbacks;
+    std::list<ClosedCallback> closedCallbacks;
+
+    Metrics::Counter *messages_in;
+    Metrics::Counter *messages_out;
+    Metrics::Counter *bytes_in;
+    Metrics::Counter *bytes_out;
+    Metrics::Gauge *send_queue_depth;
 };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,686 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+//
+// A stand-in for the Discord gateway and the REST endpoints the bot uses, with a
+// load driver that measures command round trips.
+//
+// Point the bot at it with:
+//     "discordApiUrl": "http://127.0.0.1:8090/api/v10"
+// and add --author-id to the bot's trustedUsers. Then, for example:
+//     OctoPrintControlMockDiscord --load 2000 --duration 30 --command-ratio 0.05
+// sends 2000 MESSAGE_CREATE/s for 30 seconds, 5% of them `!ping`, and reports
+// the time from dispatch to the bot's first response (reaction or reply) and to
+// its reply. Print notifications for events from OctoPrintControlMockOctoPrint
+// are timed from when the event was sent. With --slash, commands are sent as
+// application command interactions instead, timed to the deferred response and
+// to the edit of the original response. Like Discord, MESSAGE_CREATE is only
+// sent for the guild messages intent and has empty content without the message
+// content intent. Identifies faster than one per 5 seconds for each of the
+// --max-concurrency buckets get an invalid session.
+//
+// Control endpoints: POST /mock/reconnect, POST /mock/invalid-session, GET /mock/stats
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <signal.h>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include "mockserver.h"
+
+using namespace OctoPrintControl;
+
+struct Options {
+    std::string address = "127.0.0.1";
+    int port = 8090;
+
+    int latency_ms = 0;
+    int jitter_ms = 0;
+    int connect_latency_ms = 0;
+    int rate_limit = 5;
+    double rate_window = 5.0;
+    bool enforce_rate_limit = false;
+    double inject_429 = 0.0;
+    double retry_after = 0.5;
+
+    int hb_interval = 41250;
+    double reconnect_every = 0;
+    double invalid_session_every = 0;
+    int shards = 1;
+    int max_concurrency = 1;
+
+    double load = 0;
+    double duration = 10;
+    double warmup = 2;
+    double command_ratio = 1.0;
+    std::string command = "!ping";
+    bool slash = false;
+    std::string author_id = "290384756102938475";
+    std::string channel_id = "1102938477204125727";
+    std::string guild_id = "1102938475610293846";
+    std::string bot_id = "1000000000000000001";
+};
+
+struct Session {
+    std::string id;
+    int64_t seq = 0;
+    bool identified = false;
+    int shard = 0;
+    int shard_count = 1;
+    int intents = 0;
+};
+
+struct Stats {
+    uint64_t messages_sent = 0;
+    uint64_t commands_sent = 0;
+    uint64_t rest_requests = 0;
+    uint64_t rest_requests_http2 = 0;
+    uint64_t served_429 = 0;
+    uint64_t identifies = 0;
+    uint64_t identifies_too_soon = 0;
+    uint64_t commands_registered = 0;
+    uint64_t resumes = 0;
+    uint64_t timelapses = 0;
+    std::vector<double> first_response_ms;
+    std::vector<double> reply_ms;
+    std::vector<double> notification_ms;
+};
+
+static Options options;
+static Stats stats;
+static Mock::Server *server;
+
+static std::map<Mock::ConnectionId, Session> connections;
+// session id -> last seq, for RESUME after the connection is gone
+static std::map<std::string, int64_t> resumable;
+// session id -> the session as identified, a resume keeps its intents and shard
+static std::map<std::string, Session> identified;
+// shard % max_concurrency -> last identify
+static std::map<int, std::chrono::steady_clock::time_point> identify_buckets;
+// command message id -> when it was dispatched
+static std::map<std::string, std::chrono::steady_clock::time_point> pending;
+static std::set<std::string> responded;
+// route bucket -> request times in the current window
+static std::map<std::string, std::vector<std::chrono::steady_clock::time_point>> buckets;
+
+static std::default_random_engine rng((unsigned int)std::chrono::steady_clock::now().time_since_epoch().count());
+
+static void Send(Mock::ConnectionId id, int op, nlohmann::json d, std::string t="") {
+    nlohmann::json msg = {
+        { "op", op },
+        { "d", d },
+        { "s", nullptr },
+        { "t", nullptr }
+    };
+    if (op==0) {
+        Session &s = connections[id];
+        msg["s"] = ++s.seq;
+        msg["t"] = t;
+        resumable[s.id] = s.seq;
+    }
+    server->SendText(id, msg.dump());
+}
+
+static void OnGatewayMessage(Mock::ConnectionId id, std::string &data) {
+    nlohmann::json msg;
+    try {
+        msg = nlohmann::json::parse(data);
+    } catch (nlohmann::json::parse_error &) {
+        server->Close(id, 4002);
+        return;
+    }
+
+    Session &s = connections[id];
+
+    switch(msg.at("op").get<int>()) {
+    case 1: // heartbeat
+        Send(id, 11, nullptr);
+        break;
+    case 2: { // identify
+        stats.identifies++;
+        nlohmann::json &d = msg.at("d");
+        int shard = d.contains("shard") ? d.at("shard")[0].get<int>() : 0;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int bucket = shard % options.max_concurrency;
+        if (identify_buckets.contains(bucket) && now - identify_buckets[bucket] < std::chrono::seconds(5)) {
+            stats.identifies_too_soon++;
+            Send(id, 9, false);
+            break;
+        }
+        identify_buckets[bucket] = now;
+
+        s.id = fmt::format("{:016x}", rng());
+        s.seq = 0;
+        s.identified = true;
+        s.intents = d.value("intents", 0);
+        if (d.contains("shard")) {
+            s.shard = shard;
+            s.shard_count = d.at("shard")[1].get<int>();
+        }
+        identified[s.id] = s;
+        Send(id, 0, {
+            { "v", 10 },
+            { "user", { { "id", options.bot_id }, { "username", "OctoPrintControl" }, { "discriminator", "0" }, { "bot", true } } },
+            { "session_id", s.id },
+            { "resume_gateway_url", fmt::format("ws://{}:{}/gateway", options.address, server->Port()) },
+            { "guilds", nlohmann::json::array({ { { "id", options.guild_id }, { "unavailable", true } } }) },
+            { "shard", { s.shard, s.shard_count } },
+            { "application", { { "id", options.bot_id }, { "flags", 0 } } }
+        }, "READY");
+        break;
+    }
+    case 6: { // resume
+        std::string session = msg.at("d").at("session_id").get<std::string>();
+        if (!resumable.contains(session)) {
+            Send(id, 9, false);
+            break;
+        }
+        stats.resumes++;
+        s.id = session;
+        s.seq = resumable[session];
+        s.intents = identified[session].intents;
+        s.shard = identified[session].shard;
+        s.shard_count = identified[session].shard_count;
+        s.identified = true;
+        Send(id, 0, nullptr, "RESUMED");
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static bool OnGatewayOpen(Mock::ConnectionId id, Mock::Request &req) {
+    if (req.path!="/gateway") return false;
+
+    connections[id] = Session();
+    Send(id, 10, { { "heartbeat_interval", options.hb_interval } });
+    return true;
+}
+
+static void OnGatewayClose(Mock::ConnectionId id) {
+    connections.erase(id);
+}
+
+static void SendReconnect() {
+    for (auto &[id, s] : connections) Send(id, 7, nullptr);
+}
+
+static void SendInvalidSession() {
+    for (auto &[id, s] : connections) {
+        resumable.erase(s.id);
+        Send(id, 9, false);
+    }
+}
+
+static void RecordResponse(std::string message_id, bool reply) {
+    if (!pending.contains(message_id)) return;
+
+    std::chrono::duration<double, std::milli> rtt = std::chrono::steady_clock::now() - pending[message_id];
+    if (!responded.contains(message_id)) {
+        responded.insert(message_id);
+        stats.first_response_ms.push_back(rtt.count());
+    }
+    if (reply) {
+        stats.reply_ms.push_back(rtt.count());
+        pending.erase(message_id);
+        responded.erase(message_id);
+    }
+}
+
+// OctoPrintControlMockOctoPrint stamps print event file names with the time the
+// event was sent: sim-p3-12-t1715538161341.gcode
+static void RecordNotification(nlohmann::json &payload) {
+    if (!payload.contains("embeds")) return;
+    for (nlohmann::json &embed : payload["embeds"]) {
+        // posted once the clip is encoded, not when the print finished
+        if (embed.value("description", "")=="Timelapse") {
+            stats.timelapses++;
+            continue;
+        }
+        if (!embed.contains("fields")) continue;
+        for (nlohmann::json &field : embed["fields"]) {
+            std::string value = field.value("value", "");
+            size_t t = value.rfind("-t");
+            if (!value.starts_with("sim-") || t==std::string::npos || !value.ends_with(".gcode")) continue;
+
+            int64_t sent;
+            try {
+                sent = std::stoll(value.substr(t + 2, value.size() - t - 2 - 6));
+            } catch (std::exception &) {
+                continue;
+            }
+            int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            stats.notification_ms.push_back((double)(now - sent));
+        }
+    }
+}
+
+// the bot sends messages as multipart with a payload_json part
+// an empty object if the body is missing or isn't valid json
+static nlohmann::json PayloadJSON(Mock::Request &req) {
+    std::string body;
+    if (req.Header("content-type").starts_with("application/json")) body = req.body;
+    else {
+        size_t name = req.body.find("name=\"payload_json\"");
+        if (name==std::string::npos) return nlohmann::json::object();
+        size_t start = req.body.find("\r\n\r\n", name);
+        size_t end = req.body.find("\r\n--", start);
+        if (start==std::string::npos) return nlohmann::json::object();
+        body = req.body.substr(start + 4, end - start - 4);
+    }
+
+    nlohmann::json payload = nlohmann::json::parse(body, nullptr, false);
+    if (payload.is_discarded()) {
+        fmt::print(stderr, "Invalid JSON in {} {}\n", req.method, req.path);
+        return nlohmann::json::object();
+    }
+    return payload;
+}
+
+static std::vector<std::string> Split(std::string path) {
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        size_t next = path.find('/', pos);
+        if (next==std::string::npos) next = path.size();
+        if (next > pos) parts.push_back(path.substr(pos, next - pos));
+        pos = next + 1;
+    }
+    return parts;
+}
+
+static std::string Percentiles(std::vector<double> samples) {
+    if (samples.empty()) return "no samples";
+    std::sort(samples.begin(), samples.end());
+    auto p = [&samples](double q) { return samples[std::min(samples.size() - 1, (size_t)(q * samples.size()))]; };
+    return fmt::format("n={} p50={:.1f}ms p90={:.1f}ms p99={:.1f}ms max={:.1f}ms", samples.size(), p(0.5), p(0.9), p(0.99), samples.back());
+}
+
+static nlohmann::json StatsJSON() {
+    return {
+        { "messages_sent", stats.messages_sent },
+        { "commands_sent", stats.commands_sent },
+        { "commands_unanswered", pending.size() },
+        { "rest_requests", stats.rest_requests },
+        { "rest_requests_http2", stats.rest_requests_http2 },
+        { "served_429", stats.served_429 },
+        { "identifies", stats.identifies },
+        { "identifies_too_soon", stats.identifies_too_soon },
+        { "commands_registered", stats.commands_registered },
+        { "resumes", stats.resumes },
+        { "timelapses", stats.timelapses },
+        { "first_response", Percentiles(stats.first_response_ms) },
+        { "reply", Percentiles(stats.reply_ms) },
+        { "notification", Percentiles(stats.notification_ms) }
+    };
+}
+
+// Discord style per-route buckets, keyed on the major parameter (channel)
+static bool RateLimit(Mock::Request &req, std::vector<std::string> &parts, Mock::Response &resp) {
+    std::string bucket = req.method + " " + (parts.size() > 3 ? parts[2] + "/" + parts[3] : req.path);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> window(options.rate_window);
+
+    std::vector<std::chrono::steady_clock::time_point> &times = buckets[bucket];
+    times.erase(std::remove_if(times.begin(), times.end(), [&](auto t) { return now - t > window; }), times.end());
+    times.push_back(now);
+
+    int remaining = std::max(0, options.rate_limit - (int)times.size());
+    double reset_after = std::chrono::duration<double>(times.front() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(window) - now).count();
+    double reset = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count() + reset_after;
+
+    resp.headers["X-RateLimit-Limit"] = std::to_string(options.rate_limit);
+    resp.headers["X-RateLimit-Remaining"] = std::to_string(remaining);
+    resp.headers["X-RateLimit-Reset"] = fmt::format("{:.3f}", reset);
+    resp.headers["X-RateLimit-Reset-After"] = fmt::format("{:.3f}", reset_after);
+    resp.headers["X-RateLimit-Bucket"] = fmt::format("{:016x}", std::hash<std::string>()(bucket));
+
+    std::uniform_real_distribution<double> dist(0, 1);
+    bool limited = (options.enforce_rate_limit && (int)times.size() > options.rate_limit) || dist(rng) < options.inject_429;
+    if (limited) {
+        stats.served_429++;
+        resp.status = 429;
+        resp.headers["Retry-After"] = fmt::format("{:.3f}", options.retry_after);
+        resp.headers["X-RateLimit-Scope"] = "user";
+        resp.body = nlohmann::json({ { "message", "You are being rate limited." }, { "retry_after", options.retry_after }, { "global", false } }).dump();
+    }
+    return limited;
+}
+
+static void OnRequest(Mock::Request &req, Mock::Responder respond) {
+    std::vector<std::string> parts = Split(req.path);
+    Mock::Response resp;
+
+    if (req.path=="/mock/stats") {
+        resp.body = StatsJSON().dump(2);
+        respond(resp);
+        return;
+    } else if (req.path=="/mock/reconnect") {
+        SendReconnect();
+        resp.status = 204;
+        respond(resp);
+        return;
+    } else if (req.path=="/mock/invalid-session") {
+        SendInvalidSession();
+        resp.status = 204;
+        respond(resp);
+        return;
+    }
+
+    if (parts.size() < 3 || parts[0]!="api") {
+        resp.status = 404;
+        resp.body = "{\"message\": \"404: Not Found\", \"code\": 0}";
+        respond(resp);
+        return;
+    }
+
+    stats.rest_requests++;
+    if (req.protocol=="HTTP/2") stats.rest_requests_http2++;
+    std::string gateway_url = fmt::format("ws://{}:{}/gateway", options.address, server->Port());
+
+    // parts: api, v10, ...
+    if (req.method=="GET" && parts[2]=="gateway" && parts.size()==3) {
+        resp.body = nlohmann::json({ { "url", gateway_url } }).dump();
+    } else if (req.method=="GET" && parts[2]=="gateway" && parts.size()==4 && parts[3]=="bot") {
+        resp.body = nlohmann::json({
+            { "url", gateway_url },
+            { "shards", options.shards },
+            { "session_start_limit", {
+                { "total", 1000 },
+                { "remaining", 1000 - stats.identifies },
+                { "reset_after", 86400000 },
+                { "max_concurrency", options.max_concurrency }
+            }}
+        }).dump();
+    } else if (parts[2]=="channels" && parts.size() >= 5 && parts[4]=="messages") {
+        if (RateLimit(req, parts, resp)) {
+            // fall through to respond with the 429
+        } else if (req.method=="POST" && parts.size()==5) {
+            nlohmann::json payload = PayloadJSON(req);
+            if (payload.contains("message_reference")) RecordResponse(payload["message_reference"].value("message_id", ""), true);
+            RecordNotification(payload);
+            resp.body = nlohmann::json({
+                { "id", Mock::Snowflake() },
+                { "channel_id", parts[3] },
+                { "content", payload.value("content", "") },
+                { "author", { { "id", options.bot_id }, { "username", "OctoPrintControl" }, { "bot", true } } },
+                { "type", 0 }
+            }).dump();
+        } else if (req.method=="PATCH" && parts.size()==6) {
+            resp.body = nlohmann::json({ { "id", parts[5] }, { "channel_id", parts[3] } }).dump();
+        } else if (req.method=="DELETE" && parts.size()==6) {
+            resp.status = 204;
+        } else if (req.method=="PUT" && parts.size()==9 && parts[6]=="reactions") {
+            RecordResponse(parts[5], false);
+            resp.status = 204;
+        } else {
+            resp.status = 404;
+        }
+    } else if (req.method=="POST" && parts[2]=="channels" && parts.size()==5 && parts[4]=="typing") {
+        if (!RateLimit(req, parts, resp)) resp.status = 204;
+    } else if (req.method=="POST" && parts[2]=="interactions" && parts.size()==6 && parts[5]=="callback") {
+        // type 5 is the deferred response to an application command
+        if (PayloadJSON(req).value("type", 0)==5) RecordResponse(parts[3], false);
+        resp.status = 204;
+    } else if (req.method=="PUT" && parts[2]=="applications" && parts.back()=="commands") {
+        nlohmann::json commands = PayloadJSON(req);
+        for (nlohmann::json &c : commands) c["id"] = Mock::Snowflake();
+        stats.commands_registered = commands.size();
+        resp.body = commands.dump();
+    } else if (parts[2]=="webhooks" && parts.size() >= 5) {
+        // interaction tokens are "token-<interaction id>"
+        std::string interaction = parts[4].substr(parts[4].find('-') + 1);
+        if (req.method=="PATCH" && parts.size()==7 && parts[6]=="@original") RecordResponse(interaction, true);
+        nlohmann::json payload = PayloadJSON(req);
+        resp.body = nlohmann::json({
+            { "id", Mock::Snowflake() },
+            { "channel_id", options.channel_id },
+            { "content", payload.value("content", "") },
+            { "author", { { "id", options.bot_id }, { "username", "OctoPrintControl" }, { "bot", true } } },
+            { "type", 20 }
+        }).dump();
+    } else {
+        resp.status = 404;
+        resp.body = "{\"message\": \"404: Not Found\", \"code\": 0}";
+    }
+
+    int delay = options.latency_ms;
+    if (options.jitter_ms) delay += std::uniform_int_distribution<int>(0, options.jitter_ms)(rng);
+
+    if (delay) server->After(std::chrono::milliseconds(delay), [respond, resp]() { respond(resp); });
+    else respond(resp);
+}
+
+// options.command as an application command, the first argument is the printer
+static nlohmann::json InteractionData(std::string id) {
+    std::vector<std::string> tokens;
+    size_t pos = 0;
+    while (pos < options.command.size()) {
+        size_t next = options.command.find(' ', pos);
+        if (next==std::string::npos) next = options.command.size();
+        if (next > pos) tokens.push_back(options.command.substr(pos, next - pos));
+        pos = next + 1;
+    }
+
+    nlohmann::json data = {
+        { "id", Mock::Snowflake() },
+        { "name", tokens.size() ? tokens[0].substr(tokens[0][0]=='!' ? 1 : 0) : "ping" },
+        { "type", 1 },
+        { "options", nlohmann::json::array() }
+    };
+    for (size_t i=1;i<tokens.size();i++) {
+        data["options"].push_back({ { "name", i==1 ? "printer" : fmt::format("arg{}", i) }, { "type", 3 }, { "value", tokens[i] } });
+    }
+
+    return {
+        { "id", id },
+        { "application_id", options.bot_id },
+        { "type", 2 },
+        { "token", "token-" + id },
+        { "version", 1 },
+        { "channel_id", options.channel_id },
+        { "guild_id", options.guild_id },
+        { "member", { { "user", { { "username", "loaddriver" }, { "id", options.author_id }, { "discriminator", "0" }, { "global_name", "Load Driver" } } } } },
+        { "data", data }
+    };
+}
+
+static void DispatchMessage() {
+    std::uniform_real_distribution<double> dist(0, 1);
+    bool command = dist(rng) < options.command_ratio;
+
+    std::string id = Mock::Snowflake();
+    nlohmann::json d = {
+        { "type", 0 },
+        { "tts", false },
+        { "timestamp", "2024-05-12T18:22:41.512000+00:00" },
+        { "pinned", false },
+        { "mentions", nlohmann::json::array() },
+        { "mention_roles", nlohmann::json::array() },
+        { "mention_everyone", false },
+        { "id", id },
+        { "flags", 0 },
+        { "embeds", nlohmann::json::array() },
+        { "content", command ? options.command : "just chatting about printers, nothing for the bot here" },
+        { "components", nlohmann::json::array() },
+        { "channel_id", options.channel_id },
+        { "author", { { "username", "loaddriver" }, { "id", options.author_id }, { "discriminator", "0" }, { "global_name", "Load Driver" } } },
+        { "attachments", nlohmann::json::array() },
+        { "guild_id", options.guild_id }
+    };
+
+    // guild events go to the shard that owns the guild
+    uint64_t guild = std::stoull(options.guild_id);
+    for (auto &[cid, s] : connections) {
+        if (!s.identified || (int)((guild >> 22) % s.shard_count)!=s.shard) continue;
+
+        if (command) {
+            stats.commands_sent++;
+            pending[id] = std::chrono::steady_clock::now();
+        }
+
+        if (command && options.slash) {
+            Send(cid, 0, InteractionData(id), "INTERACTION_CREATE");
+            break;
+        }
+
+        if (!(s.intents & (1 << 9))) break; // GUILD_MESSAGES
+        if (!(s.intents & (1 << 15))) d["content"] = ""; // MESSAGE_CONTENT
+
+        stats.messages_sent++;
+        Send(cid, 0, d, "MESSAGE_CREATE");
+        break;
+    }
+}
+
+static void LoadTick(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point last, double carry) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - start;
+
+    if (elapsed.count() >= options.warmup + options.duration) {
+        fmt::print("Load finished, waiting for outstanding replies...\n");
+        server->After(std::chrono::seconds(5), []() {
+            fmt::print("{}\n", StatsJSON().dump(2));
+            server->Stop();
+        });
+        return;
+    }
+
+    double due = options.load * std::chrono::duration<double>(now - last).count() + carry;
+    if (elapsed.count() >= options.warmup) {
+        while (due >= 1.0) {
+            DispatchMessage();
+            due -= 1.0;
+        }
+    } else due = 0;
+
+    server->After(std::chrono::milliseconds(5), [start, now, due]() { LoadTick(start, now, due); });
+}
+
+static void WaitForReady() {
+    for (auto &[id, s] : connections) {
+        if (s.identified) {
+            fmt::print("Bot connected, {:.0f} messages/s for {:.0f}s after a {:.0f}s warmup\n", options.load, options.duration, options.warmup);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            LoadTick(now, now, 0);
+            return;
+        }
+    }
+    server->After(std::chrono::milliseconds(100), WaitForReady);
+}
+
+static void Every(double seconds, std::function<void()> fn) {
+    server->After(std::chrono::milliseconds((int64_t)(seconds * 1000)), [seconds, fn]() {
+        fn();
+        Every(seconds, fn);
+    });
+}
+
+static void Usage(const char *argv0) {
+    fmt::print(
+        "Usage: {} [options]\n"
+        "  --address ADDR              listen address (127.0.0.1)\n"
+        "  --port N                    listen port (8090)\n"
+        "  --latency-ms N              delay every REST response\n"
+        "  --jitter-ms N               add up to N ms of random delay\n"
+        "  --connect-latency-ms N      delay every new connection, like a TLS handshake\n"
+        "  --rate-limit N              requests per bucket per window in rate limit headers (5)\n"
+        "  --rate-window S             rate limit window (5)\n"
+        "  --enforce-rate-limit        answer 429 when a bucket is exhausted\n"
+        "  --inject-429 P              answer 429 with probability P\n"
+        "  --retry-after S             retry_after on 429 responses (0.5)\n"
+        "  --hb-interval MS            gateway heartbeat interval (41250)\n"
+        "  --reconnect-every S         send op 7 every S seconds\n"
+        "  --invalid-session-every S   send op 9 every S seconds\n"
+        "  --shards N                  recommended shards from /gateway/bot (1)\n"
+        "  --max-concurrency N         identify concurrency from /gateway/bot (1)\n"
+        "  --load N                    MESSAGE_CREATE per second, 0 to only serve (0)\n"
+        "  --duration S                load duration (10)\n"
+        "  --warmup S                  wait after READY before measuring (2)\n"
+        "  --command TEXT              command message content (!ping)\n"
+        "  --command-ratio F           fraction of messages that are commands (1.0)\n"
+        "  --slash                     send commands as application command interactions\n"
+        "  --author-id ID              message author, must be a trusted user\n"
+        "  --channel-id ID\n"
+        "  --guild-id ID\n",
+        argv0);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i=1;i<argc;i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fmt::print("{} needs a value\n", arg);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg=="--address") options.address = next();
+        else if (arg=="--port") options.port = std::stoi(next());
+        else if (arg=="--latency-ms") options.latency_ms = std::stoi(next());
+        else if (arg=="--jitter-ms") options.jitter_ms = std::stoi(next());
+        else if (arg=="--connect-latency-ms") options.connect_latency_ms = std::stoi(next());
+        else if (arg=="--rate-limit") options.rate_limit = std::stoi(next());
+        else if (arg=="--rate-window") options.rate_window = std::stod(next());
+        else if (arg=="--enforce-rate-limit") options.enforce_rate_limit = true;
+        else if (arg=="--inject-429") options.inject_429 = std::stod(next());
+        else if (arg=="--retry-after") options.retry_after = std::stod(next());
+        else if (arg=="--hb-interval") options.hb_interval = std::stoi(next());
+        else if (arg=="--reconnect-every") options.reconnect_every = std::stod(next());
+        else if (arg=="--invalid-session-every") options.invalid_session_every = std::stod(next());
+        else if (arg=="--shards") options.shards = std::stoi(next());
+        else if (arg=="--max-concurrency") options.max_concurrency = std::max(1, std::stoi(next()));
+        else if (arg=="--load") options.load = std::stod(next());
+        else if (arg=="--duration") options.duration = std::stod(next());
+        else if (arg=="--warmup") options.warmup = std::stod(next());
+        else if (arg=="--command") options.command = next();
+        else if (arg=="--command-ratio") options.command_ratio = std::stod(next());
+        else if (arg=="--slash") options.slash = true;
+        else if (arg=="--author-id") options.author_id = next();
+        else if (arg=="--channel-id") options.channel_id = next();
+        else if (arg=="--guild-id") options.guild_id = next();
+        else {
+            Usage(argv[0]);
+            return arg=="--help" ? 0 : 1;
+        }
+    }
+
+    // progress lines should show up promptly when piped to a log
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    std::unique_ptr<Mock::Server> s;
+    try {
+        s.reset(new Mock::Server(options.address, options.port));
+    } catch (std::runtime_error &err) {
+        fmt::print(stderr, "{}\n", err.what());
+        return 1;
+    }
+    server = s.get();
+
+    s->connect_latency = std::chrono::milliseconds(options.connect_latency_ms);
+    s->OnRequest = OnRequest;
+    s->OnWebsocketOpen = OnGatewayOpen;
+    s->OnWebsocketMessage = OnGatewayMessage;
+    s->OnWebsocketClose = OnGatewayClose;
+
+    if (options.reconnect_every > 0) Every(options.reconnect_every, SendReconnect);
+    if (options.invalid_session_every > 0) Every(options.invalid_session_every, SendInvalidSession);
+    if (options.load > 0) WaitForReady();
+
+    fmt::print("Mock Discord API at http://{}:{}/api/v10, gateway at ws://{}:{}/gateway\n", options.address, s->Port(), options.address, s->Port());
+
+    s->Run();
+
+    return 0;
+}
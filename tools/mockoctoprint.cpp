@@ -0,0 +1,855 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+//
+// Simulates a farm of OctoPrint instances in one process. Printer N lives under
+// http://ADDR:PORT/p/N and serves the SockJS websocket, /api/login,
+// /api/settings, /api/plugin/psucontrol and a webcam snapshot.
+//
+// /api/settings has an ETag and answers a matching If-None-Match with a 304,
+// as OctoPrint does. --settings-kb pads it with plugin settings to a more
+// realistic size and --gzip compresses it for clients that accept gzip.
+//
+// /webcam/?action=stream is an mjpg-streamer style multipart stream of the
+// snapshot at --stream-fps. --snapshot-latency-ms delays single snapshots, which
+// mjpg-streamer often takes hundreds of ms to answer.
+//
+//     OctoPrintControlMockOctoPrint --printers 200 --print-config > printers.json
+//
+// prints a `printers` array for the bot's config and then starts serving. With
+// --watch-pid the bot's RSS, thread count and CPU use are reported alongside the
+// simulator's own counters every --report-interval seconds.
+//
+// Print events carry the time they were sent in the file name
+// (sim-p3-12-t1715538161341.gcode), OctoPrintControlMockDiscord uses this to
+// report notification latency.
+//
+// Control endpoints: POST /mock/drop?printer=N, POST /mock/stall?printer=N,
+// POST /mock/event?printer=N&type=PrintDone, GET /mock/stats
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <functional>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+#ifdef OCTOPRINTCONTROL_MOCK_GZIP
+#include <zlib.h>
+#endif
+
+#include "mockserver.h"
+
+using namespace OctoPrintControl;
+
+struct Options {
+    std::string address = "127.0.0.1";
+    int port = 8091;
+    int printers = 10;
+    std::string api_key = "mockapikey";
+    bool print_config = false;
+
+    double current_interval = 0.5;
+    double hb_interval = 25;
+    double idle_seconds = 60;
+    double print_seconds = 300;
+    double cancel_ratio = 0.1;
+
+    int rest_latency_ms = 0;
+    int rest_jitter_ms = 0;
+    double rest_fail = 0;
+
+    int snapshot_width = 640;
+    int snapshot_height = 480;
+    size_t snapshot_bytes = 0;
+    bool flip = false;
+    bool rotate = false;
+
+    size_t settings_bytes = 0;
+    bool gzip = false;
+
+    double stream_fps = 10;
+    int snapshot_latency_ms = 0;
+
+    double stall_ratio = 0;
+    double stall_after = 60;
+    double drop_every = 0;
+
+    int watch_pid = 0;
+    double report_interval = 10;
+};
+
+struct Printer {
+    int index;
+    bool psu_on = true;
+    bool printing = false;
+    int job = 0;
+    std::string file;
+    std::chrono::steady_clock::time_point print_start;
+    double print_length = 0;
+    double tool = 24.0;
+    double bed = 23.0;
+    // picked by --stall-ratio, every socket to this printer stalls
+    bool stalls = false;
+    std::set<Mock::ConnectionId> sockets;
+};
+
+struct SocketState {
+    int printer;
+    // stalled sockets send nothing, like an OctoPrint that hung
+    bool stalled = false;
+};
+
+struct Stats {
+    uint64_t sockets_opened = 0;
+    uint64_t frames_sent = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t events_sent = 0;
+    uint64_t logins = 0;
+    uint64_t settings = 0;
+    uint64_t settings_not_modified = 0;
+    uint64_t settings_gzip = 0;
+    uint64_t settings_bytes = 0;
+    uint64_t psucontrol = 0;
+    uint64_t snapshots = 0;
+    uint64_t streams_opened = 0;
+    uint64_t stream_frames = 0;
+    uint64_t rest_failed = 0;
+    uint64_t drops = 0;
+    uint64_t stalls = 0;
+};
+
+static Options options;
+static Stats stats;
+static Mock::Server *server;
+static std::vector<Printer> printers;
+static std::map<Mock::ConnectionId, SocketState> sockets;
+static std::string snapshot;
+
+static std::default_random_engine rng((unsigned int)std::chrono::steady_clock::now().time_since_epoch().count());
+
+static double Uniform(double lo, double hi) {
+    return std::uniform_real_distribution<double>(lo, hi)(rng);
+}
+
+static std::chrono::steady_clock::duration Seconds(double s) {
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(s));
+}
+
+static std::string PrinterURL(int index) {
+    return fmt::format("http://{}:{}/p/{}", options.address, server->Port(), index);
+}
+
+// A mid grey baseline JPEG: every block is DC 0 then EOB, which Huffman tables
+// with a single one bit code each encode as two zero bits. Decoders do the
+// full IDCT work for it, so flips cost about what a real frame would.
+static std::string SyntheticJPEG(int width, int height, size_t min_bytes) {
+    auto u16 = [](std::string &s, int v) { s += (char)((v >> 8) & 0xFF); s += (char)(v & 0xFF); };
+
+    std::string jpeg = "\xFF\xD8";
+
+    // APP0 JFIF
+    jpeg += "\xFF\xE0";
+    u16(jpeg, 16);
+    jpeg += std::string("JFIF\0", 5);
+    jpeg += "\x01\x01";
+    jpeg += (char)0;
+    u16(jpeg, 1);
+    u16(jpeg, 1);
+    jpeg += std::string(2, '\0');
+
+    // pad to the requested size with comments, real snapshots are 50-300 KiB
+    size_t blocks = (size_t)((width + 7) / 8) * ((height + 7) / 8);
+    size_t scan_bytes = (blocks * 2 + 7) / 8;
+    size_t fixed = jpeg.size() + 69 + 13 + 22 + 22 + 10 + scan_bytes + 2;
+    size_t padding = min_bytes > fixed ? min_bytes - fixed : 0;
+    while (padding > 4) {
+        size_t len = std::min<size_t>(padding - 2, 65535);
+        jpeg += "\xFF\xFE";
+        u16(jpeg, (int)len);
+        jpeg += std::string(len - 2, 'x');
+        padding -= len + 2;
+    }
+
+    // DQT, table 0, all ones
+    jpeg += "\xFF\xDB";
+    u16(jpeg, 67);
+    jpeg += (char)0;
+    jpeg += std::string(64, '\x01');
+
+    // SOF0, 8 bit, one component
+    jpeg += "\xFF\xC0";
+    u16(jpeg, 11);
+    jpeg += (char)8;
+    u16(jpeg, height);
+    u16(jpeg, width);
+    jpeg += "\x01\x01\x11";
+    jpeg += (char)0;
+
+    // DHT DC 0 and AC 0, one symbol (0) with a one bit code
+    for (char cls : { '\x00', '\x10' }) {
+        jpeg += "\xFF\xC4";
+        u16(jpeg, 20);
+        jpeg += cls;
+        jpeg += '\x01';
+        jpeg += std::string(15, '\0');
+        jpeg += (char)0;
+    }
+
+    // SOS
+    jpeg += "\xFF\xDA";
+    u16(jpeg, 8);
+    jpeg += "\x01\x01";
+    jpeg += (char)0;
+    jpeg += (char)0;
+    jpeg += (char)63;
+    jpeg += (char)0;
+
+    // two zero bits per block, the last byte padded with ones
+    std::string scan(scan_bytes, '\0');
+    size_t used_bits = blocks * 2 % 8;
+    if (used_bits) scan.back() = (char)(0xFF >> used_bits);
+    jpeg += scan;
+
+    jpeg += "\xFF\xD9";
+    return jpeg;
+}
+
+static void SendFrame(Mock::ConnectionId id, const std::string &frame) {
+    if (!sockets.contains(id) || sockets[id].stalled) return;
+    stats.frames_sent++;
+    stats.bytes_sent += frame.size();
+    server->SendText(id, frame);
+}
+
+static void Broadcast(Printer &p, nlohmann::json message) {
+    std::string frame = "a" + nlohmann::json::array({ message }).dump();
+    for (Mock::ConnectionId id : p.sockets) SendFrame(id, frame);
+}
+
+static nlohmann::json CurrentMessage(Printer &p) {
+    double elapsed = p.printing ? std::chrono::duration<double>(std::chrono::steady_clock::now() - p.print_start).count() : 0;
+    std::string text = !p.psu_on ? "Offline" : (p.printing ? "Printing" : "Operational");
+
+    nlohmann::json file = {
+        { "name", p.printing ? nlohmann::json(p.file) : nlohmann::json(nullptr) },
+        { "path", p.printing ? nlohmann::json(p.file) : nlohmann::json(nullptr) },
+        { "display", p.printing ? nlohmann::json(p.file) : nlohmann::json(nullptr) },
+        { "origin", p.printing ? nlohmann::json("local") : nlohmann::json(nullptr) },
+        { "size", p.printing ? nlohmann::json(3184527) : nlohmann::json(nullptr) },
+        { "date", p.printing ? nlohmann::json(1715530012) : nlohmann::json(nullptr) }
+    };
+
+    double server_time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    return { { "current", {
+        { "state", {
+            { "text", text },
+            { "flags", {
+                { "operational", p.psu_on },
+                { "printing", p.printing },
+                { "cancelling", false },
+                { "pausing", false },
+                { "resuming", false },
+                { "finishing", false },
+                { "closedOrError", !p.psu_on },
+                { "error", false },
+                { "paused", false },
+                { "ready", p.psu_on && !p.printing },
+                { "sdReady", true }
+            }},
+            { "error", "" }
+        }},
+        { "job", {
+            { "file", file },
+            { "estimatedPrintTime", p.printing ? nlohmann::json(p.print_length) : nlohmann::json(nullptr) },
+            { "averagePrintTime", nullptr },
+            { "lastPrintTime", nullptr },
+            { "filament", p.printing ? nlohmann::json({ { "tool0", { { "length", 4392.91 }, { "volume", 10.57 } } } }) : nlohmann::json(nullptr) },
+            { "user", p.printing ? nlohmann::json("printfarmer") : nlohmann::json(nullptr) }
+        }},
+        { "currentZ", p.printing ? nlohmann::json(elapsed / p.print_length * 40.0) : nlohmann::json(nullptr) },
+        { "progress", {
+            { "completion", p.printing ? nlohmann::json(elapsed / p.print_length * 100.0) : nlohmann::json(nullptr) },
+            { "filepos", p.printing ? nlohmann::json((int64_t)(elapsed / p.print_length * 3184527)) : nlohmann::json(nullptr) },
+            { "printTime", p.printing ? nlohmann::json((int64_t)elapsed) : nlohmann::json(nullptr) },
+            { "printTimeLeft", p.printing ? nlohmann::json((int64_t)(p.print_length - elapsed)) : nlohmann::json(nullptr) },
+            { "printTimeLeftOrigin", p.printing ? nlohmann::json("estimate") : nlohmann::json(nullptr) }
+        }},
+        { "offsets", nlohmann::json::object() },
+        { "resends", { { "count", 0 }, { "transmitted", 48213 }, { "ratio", 0 } } },
+        { "serverTime", server_time },
+        { "temps", nlohmann::json::array({ {
+            { "time", (int64_t)server_time },
+            { "tool0", { { "actual", std::round(p.tool * 10) / 10 }, { "target", p.printing ? 215.0 : 0.0 } } },
+            { "bed", { { "actual", std::round(p.bed * 10) / 10 }, { "target", p.printing ? 60.0 : 0.0 } } },
+            { "chamber", { { "actual", nullptr }, { "target", nullptr } } }
+        } }) },
+        { "logs", nlohmann::json::array() },
+        { "messages", nlohmann::json::array() },
+        { "busyFiles", nlohmann::json::array() },
+        { "markings", nlohmann::json::array() },
+        { "plugins", nlohmann::json::object() }
+    }}};
+}
+
+static void SendEvent(Printer &p, std::string type, nlohmann::json payload) {
+    stats.events_sent++;
+    Broadcast(p, { { "event", { { "type", type }, { "payload", payload } } } });
+}
+
+static nlohmann::json JobPayload(Printer &p) {
+    return {
+        { "name", p.file },
+        { "path", p.file },
+        { "origin", "local" },
+        { "size", 3184527 },
+        { "owner", "printfarmer" },
+        { "user", "printfarmer" }
+    };
+}
+
+static std::string StampedFile(Printer &p) {
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    return fmt::format("sim-p{}-{}-t{}.gcode", p.index, p.job, ms);
+}
+
+static void ScheduleStart(Printer &p);
+
+static void FinishPrint(int index, int job) {
+    Printer &p = printers[index - 1];
+    if (!p.printing || p.job!=job) return;
+
+    bool cancelled = Uniform(0, 1) < options.cancel_ratio;
+    p.printing = false;
+    p.file = StampedFile(p);
+    SendEvent(p, cancelled ? "PrintCancelled" : "PrintDone", JobPayload(p));
+    ScheduleStart(p);
+}
+
+static void StartPrint(Printer &p) {
+    if (p.printing || !p.psu_on) return;
+
+    p.job++;
+    p.printing = true;
+    p.print_start = std::chrono::steady_clock::now();
+    p.print_length = options.print_seconds * Uniform(0.5, 1.5);
+    p.file = StampedFile(p);
+    SendEvent(p, "PrintStarted", JobPayload(p));
+
+    int index = p.index, job = p.job;
+    server->After(Seconds(p.print_length), [index, job]() { FinishPrint(index, job); });
+}
+
+static void ScheduleStart(Printer &p) {
+    int index = p.index;
+    double idle = std::exponential_distribution<double>(1.0 / options.idle_seconds)(rng);
+    server->After(Seconds(idle), [index]() {
+        Printer &p = printers[index - 1];
+        if (p.psu_on) StartPrint(p);
+        else ScheduleStart(p);
+    });
+}
+
+static void CurrentTick(int index) {
+    Printer &p = printers[index - 1];
+
+    // temperatures drift toward their targets
+    p.tool += ((p.printing ? 215.0 : 24.0) - p.tool) * 0.1 + Uniform(-0.3, 0.3);
+    p.bed += ((p.printing ? 60.0 : 23.0) - p.bed) * 0.05 + Uniform(-0.2, 0.2);
+
+    if (p.sockets.size()) Broadcast(p, CurrentMessage(p));
+
+    server->After(Seconds(options.current_interval), [index]() { CurrentTick(index); });
+}
+
+static void HeartbeatTick(int index) {
+    Printer &p = printers[index - 1];
+    for (Mock::ConnectionId id : p.sockets) SendFrame(id, "h");
+    server->After(Seconds(options.hb_interval), [index]() { HeartbeatTick(index); });
+}
+
+static void StallSocket(Mock::ConnectionId id) {
+    if (!sockets.contains(id) || sockets[id].stalled) return;
+    sockets[id].stalled = true;
+    stats.stalls++;
+}
+
+static void Stall(Printer &p) {
+    for (Mock::ConnectionId id : p.sockets) StallSocket(id);
+}
+
+static void Drop(Printer &p) {
+    std::vector<Mock::ConnectionId> ids(p.sockets.begin(), p.sockets.end());
+    for (Mock::ConnectionId id : ids) {
+        stats.drops++;
+        server->Drop(id);
+    }
+}
+
+// path is /p/N/..., returns N or 0 and leaves the rest in path
+static int RoutePrinter(std::string &path) {
+    if (!path.starts_with("/p/")) return 0;
+    size_t end = path.find('/', 3);
+    int index = 0;
+    try {
+        index = std::stoi(path.substr(3, end - 3));
+    } catch (...) {
+        return 0;
+    }
+    if (index < 1 || index > (int)printers.size()) return 0;
+    path = end==std::string::npos ? "/" : path.substr(end);
+    return index;
+}
+
+static std::string QueryValue(std::string query, std::string name) {
+    size_t pos = 0;
+    while (pos <= query.size()) {
+        size_t end = query.find('&', pos);
+        if (end==std::string::npos) end = query.size();
+        std::string pair = query.substr(pos, end - pos);
+        if (pair.starts_with(name + "=")) return pair.substr(name.size() + 1);
+        pos = end + 1;
+    }
+    return "";
+}
+
+static bool OnSocketOpen(Mock::ConnectionId id, Mock::Request &req) {
+    std::string path = req.path;
+    int index = RoutePrinter(path);
+    if (!index || !path.starts_with("/sockjs/") || !path.ends_with("/websocket")) return false;
+
+    Printer &p = printers[index - 1];
+    p.sockets.insert(id);
+    sockets[id] = SocketState{ .printer = index };
+    stats.sockets_opened++;
+
+    SendFrame(id, "o");
+    std::string connected = "a" + nlohmann::json::array({ { { "connected", {
+        { "apikey", nullptr },
+        { "version", "1.10.0" },
+        { "display_version", "1.10.0" },
+        { "branch", nullptr },
+        { "python_version", "3.11.2" },
+        { "plugin_hash", "0a1b2c3d4e5f" },
+        { "config_hash", "f5e4d3c2b1a0" },
+        { "debug", false },
+        { "safe_mode", nullptr },
+        { "online", true },
+        { "permissions", nlohmann::json::array() }
+    } } } }).dump();
+    SendFrame(id, connected);
+
+    if (p.stalls) server->After(Seconds(options.stall_after), [id]() { StallSocket(id); });
+    return true;
+}
+
+static void OnSocketMessage(Mock::ConnectionId, std::string &) {
+    // subscribe and auth, nothing to do with either
+}
+
+static void OnSocketClose(Mock::ConnectionId id) {
+    if (!sockets.contains(id)) return;
+    printers[sockets[id].printer - 1].sockets.erase(id);
+    sockets.erase(id);
+}
+
+static nlohmann::json StatsJSON() {
+    size_t stalled = 0;
+    for (auto &[id, s] : sockets) if (s.stalled) stalled++;
+    size_t printing = 0;
+    for (Printer &p : printers) if (p.printing) printing++;
+
+    return {
+        { "printers", printers.size() },
+        { "printing", printing },
+        { "sockets_open", sockets.size() },
+        { "sockets_stalled", stalled },
+        { "sockets_opened", stats.sockets_opened },
+        { "frames_sent", stats.frames_sent },
+        { "bytes_sent", stats.bytes_sent },
+        { "events_sent", stats.events_sent },
+        { "logins", stats.logins },
+        { "settings", stats.settings },
+        { "settings_not_modified", stats.settings_not_modified },
+        { "settings_gzip", stats.settings_gzip },
+        { "settings_bytes", stats.settings_bytes },
+        { "psucontrol", stats.psucontrol },
+        { "snapshots", stats.snapshots },
+        { "streams_opened", stats.streams_opened },
+        { "stream_frames", stats.stream_frames },
+        { "rest_failed", stats.rest_failed },
+        { "drops", stats.drops },
+        { "stalls", stats.stalls }
+    };
+}
+
+// made once per printer, it doesn't change
+static std::string &SettingsJSON(int index) {
+    static std::map<int, std::string> made;
+    if (made.contains(index)) return made[index];
+
+    nlohmann::json settings = {
+        { "api", { { "allowCrossOrigin", false } } },
+        { "appearance", { { "name", fmt::format("Sim {:03}", index) }, { "color", "default" } } },
+        { "webcam", {
+            { "webcamEnabled", true },
+            { "streamUrl", PrinterURL(index) + "/webcam/?action=stream" },
+            { "snapshotUrl", PrinterURL(index) + "/webcam/?action=snapshot" },
+            { "flipH", options.flip },
+            { "flipV", options.flip },
+            { "rotate90", options.rotate }
+        }}
+    };
+
+    // OctoPrint's own is tens of KiB, mostly plugin settings
+    for (int i=0;options.settings_bytes && settings.dump().size() < options.settings_bytes;i++) {
+        settings["plugins"][fmt::format("plugin_{:03}", i)] = {
+            { "enabled", true },
+            { "interval", 30 },
+            { "command", "M117 hello from the plugin" },
+            { "notifications", { "PrintStarted", "PrintDone", "PrintFailed" } }
+        };
+    }
+    return made[index] = settings.dump();
+}
+
+static std::string Gzip(const std::string &data) {
+#ifdef OCTOPRINTCONTROL_MOCK_GZIP
+    z_stream z = {};
+    deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&z, data.size()), '\0');
+    z.next_in = (Bytef*)data.data();
+    z.avail_in = (uInt)data.size();
+    z.next_out = (Bytef*)out.data();
+    z.avail_out = (uInt)out.size();
+    deflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    return out;
+#else
+    return data;
+#endif
+}
+
+// one part as mjpg-streamer writes it
+static std::string StreamPart() {
+    std::chrono::microseconds now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch());
+    return fmt::format(
+        "--boundarydonotcross\r\nContent-Type: image/jpeg\r\nContent-Length: {}\r\nX-Timestamp: {}.{:06}\r\n\r\n{}\r\n",
+        snapshot.size(), now.count() / 1000000, now.count() % 1000000, snapshot
+    );
+}
+
+static void StreamTick(Mock::ConnectionId id) {
+    if (!server->Stream(id, StreamPart())) return;
+    stats.stream_frames++;
+    server->After(Seconds(1.0 / options.stream_fps), [id]() { StreamTick(id); });
+}
+
+static void OnControl(Mock::Request &req, Mock::Response &resp) {
+    if (req.path=="/mock/stats") {
+        resp.body = StatsJSON().dump(2);
+        return;
+    }
+
+    int index = std::atoi(QueryValue(req.query, "printer").c_str());
+    if (index < 1 || index > (int)printers.size()) {
+        resp.status = 404;
+        resp.body = "{\"error\": \"unknown printer\"}";
+        return;
+    }
+    Printer &p = printers[index - 1];
+
+    resp.status = 204;
+    if (req.path=="/mock/drop") Drop(p);
+    else if (req.path=="/mock/stall") Stall(p);
+    else if (req.path=="/mock/event") {
+        std::string type = QueryValue(req.query, "type");
+        if (type=="PrintStarted") StartPrint(p);
+        else if (type=="PrintDone" || type=="PrintCancelled") {
+            p.file = StampedFile(p);
+            SendEvent(p, type, JobPayload(p));
+        } else SendEvent(p, type, nlohmann::json::object());
+    } else resp.status = 404;
+}
+
+static void OnRequest(Mock::Request &req, Mock::Responder respond) {
+    Mock::Response resp;
+
+    if (req.path.starts_with("/mock/")) {
+        OnControl(req, resp);
+        respond(resp);
+        return;
+    }
+
+    std::string path = req.path;
+    int index = RoutePrinter(path);
+    if (!index) {
+        resp.status = 404;
+        resp.body = "{\"error\": \"Not found\"}";
+        respond(resp);
+        return;
+    }
+    Printer &p = printers[index - 1];
+
+    if (path!="/webcam/" && req.Header("x-api-key")!=options.api_key) {
+        resp.status = 403;
+        resp.body = "{\"error\": \"You don't have the permission to access the requested resource.\"}";
+    } else if (Uniform(0, 1) < options.rest_fail) {
+        stats.rest_failed++;
+        resp.status = 503;
+        resp.contentType = "text/html";
+        resp.body = "<html><body><h1>503 Service Unavailable</h1></body></html>";
+    } else if (req.method=="POST" && path=="/api/login") {
+        stats.logins++;
+        resp.body = nlohmann::json({
+            { "name", "_api" },
+            { "active", true },
+            { "admin", true },
+            { "user", true },
+            { "apikey", nullptr },
+            { "session", fmt::format("{:032x}", rng()) },
+            { "_is_external_client", false },
+            { "_login_mechanism", "apikey" }
+        }).dump();
+    } else if (req.method=="GET" && path=="/api/settings") {
+        stats.settings++;
+        std::string &body = SettingsJSON(index);
+        std::string etag = fmt::format("\"{:016x}\"", std::hash<std::string>()(body));
+        resp.headers["ETag"] = etag;
+        if (req.Header("if-none-match")==etag) {
+            stats.settings_not_modified++;
+            resp.status = 304;
+        } else if (options.gzip && req.Header("accept-encoding").find("gzip")!=std::string::npos) {
+            stats.settings_gzip++;
+            resp.headers["Content-Encoding"] = "gzip";
+            resp.body = Gzip(body);
+        } else {
+            resp.body = body;
+        }
+        stats.settings_bytes += resp.body.size();
+    } else if (req.method=="GET" && path=="/webcam/" && QueryValue(req.query, "action")=="snapshot") {
+        stats.snapshots++;
+        resp.contentType = "image/jpeg";
+        resp.body = snapshot;
+    } else if (req.method=="GET" && path=="/webcam/" && QueryValue(req.query, "action")=="stream") {
+        stats.streams_opened++;
+        resp.contentType = "multipart/x-mixed-replace;boundary=boundarydonotcross";
+        resp.stream = true;
+        resp.body = StreamPart();
+    } else if (req.method=="POST" && path=="/api/plugin/psucontrol") {
+        stats.psucontrol++;
+        std::string command;
+        try {
+            command = nlohmann::json::parse(req.body).at("command").get<std::string>();
+        } catch (...) {
+            resp.status = 400;
+        }
+
+        if (command=="getPSUState") {
+            resp.body = nlohmann::json({ { "isPSUOn", p.psu_on } }).dump();
+        } else if (command=="turnPSUOn" || command=="turnPSUOff") {
+            bool on = command=="turnPSUOn";
+            resp.status = 204;
+            if (p.psu_on!=on) {
+                p.psu_on = on;
+                if (!on) p.printing = false;
+                SendEvent(p, "plugin_psucontrol_psu_state_changed", { { "isPSUOn", on } });
+            }
+        } else if (resp.status==200) resp.status = 400;
+    } else {
+        resp.status = 404;
+        resp.body = "{\"error\": \"Not found\"}";
+    }
+
+    int delay = options.rest_latency_ms;
+    if (options.rest_jitter_ms) delay += std::uniform_int_distribution<int>(0, options.rest_jitter_ms)(rng);
+    if (resp.contentType=="image/jpeg") delay += options.snapshot_latency_ms;
+    if (resp.stream) {
+        Mock::ConnectionId id = req.connection;
+        server->After(std::chrono::milliseconds(delay) + Seconds(1.0 / options.stream_fps), [id]() { StreamTick(id); });
+    }
+
+    if (delay) server->After(std::chrono::milliseconds(delay), [respond, resp]() { respond(resp); });
+    else respond(resp);
+}
+
+static void Report(double last_cpu, std::chrono::steady_clock::time_point last) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    size_t stalled = 0;
+    for (auto &[id, s] : sockets) if (s.stalled) stalled++;
+
+    std::string line = fmt::format("sockets={} stalled={} opened={} frames={} events={} snapshots={} drops={}",
+        sockets.size(), stalled, stats.sockets_opened, stats.frames_sent, stats.events_sent, stats.snapshots, stats.drops);
+
+    double cpu = last_cpu;
+    if (options.watch_pid) {
+        Mock::ProcessSample sample = Mock::SampleProcess(options.watch_pid);
+        if (sample.valid) {
+            double wall = std::chrono::duration<double>(now - last).count();
+            double cpu_pct = last_cpu >= 0 ? (sample.cpu_seconds - last_cpu) / wall * 100.0 : 0;
+            line += fmt::format(" | pid {} rss={:.1f}MiB threads={} cpu={:.1f}%", options.watch_pid, sample.rss_bytes / (1024.0 * 1024.0), sample.threads, cpu_pct);
+            cpu = sample.cpu_seconds;
+        } else line += fmt::format(" | pid {} not running", options.watch_pid);
+    }
+
+    fmt::print("{}\n", line);
+    server->After(Seconds(options.report_interval), [cpu, now]() { Report(cpu, now); });
+}
+
+static void Every(double seconds, std::function<void()> fn) {
+    server->After(Seconds(seconds), [seconds, fn]() {
+        fn();
+        Every(seconds, fn);
+    });
+}
+
+static void Usage(const char *argv0) {
+    fmt::print(
+        "Usage: {} [options]\n"
+        "  --address ADDR            listen address (127.0.0.1)\n"
+        "  --port N                  listen port (8091)\n"
+        "  --printers N              number of printers (10)\n"
+        "  --api-key KEY             required X-Api-Key (mockapikey)\n"
+        "  --print-config            print a printers array for the bot config\n"
+        "  --current-interval S      seconds between current messages (0.5)\n"
+        "  --hb-interval S           SockJS heartbeat interval (25)\n"
+        "  --idle-seconds S          mean idle time between prints (60)\n"
+        "  --print-seconds S         mean print length (300)\n"
+        "  --cancel-ratio F          fraction of prints that end cancelled (0.1)\n"
+        "  --rest-latency-ms N       delay every REST response\n"
+        "  --rest-jitter-ms N        add up to N ms of random delay\n"
+        "  --rest-fail P             answer REST requests with 503 with probability P\n"
+        "  --snapshot-size WxH       snapshot dimensions (640x480)\n"
+        "  --snapshot-kb N           pad snapshots to at least N KiB\n"
+        "  --flip                    have the bot flip snapshots\n"
+        "  --rotate                  have the bot rotate snapshots\n"
+        "  --settings-kb N           pad /api/settings to at least N KiB\n"
+        "  --gzip                    gzip /api/settings when the client accepts it\n"
+        "  --stream-fps N            frames per second on webcam streams (10)\n"
+        "  --snapshot-latency-ms N   delay single snapshots\n"
+        "  --stall-ratio F           fraction of printers that stop sending, heartbeats included\n"
+        "  --stall-after S           seconds after connecting that they stop (60)\n"
+        "  --drop-every S            drop a random printer's socket every S seconds\n"
+        "  --watch-pid PID           report RSS, threads and CPU of PID\n"
+        "  --report-interval S       (10)\n",
+        argv0);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i=1;i<argc;i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fmt::print(stderr, "{} needs a value\n", arg);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg=="--address") options.address = next();
+        else if (arg=="--port") options.port = std::stoi(next());
+        else if (arg=="--printers") options.printers = std::stoi(next());
+        else if (arg=="--api-key") options.api_key = next();
+        else if (arg=="--print-config") options.print_config = true;
+        else if (arg=="--current-interval") options.current_interval = std::stod(next());
+        else if (arg=="--hb-interval") options.hb_interval = std::stod(next());
+        else if (arg=="--idle-seconds") options.idle_seconds = std::stod(next());
+        else if (arg=="--print-seconds") options.print_seconds = std::stod(next());
+        else if (arg=="--cancel-ratio") options.cancel_ratio = std::stod(next());
+        else if (arg=="--rest-latency-ms") options.rest_latency_ms = std::stoi(next());
+        else if (arg=="--rest-jitter-ms") options.rest_jitter_ms = std::stoi(next());
+        else if (arg=="--rest-fail") options.rest_fail = std::stod(next());
+        else if (arg=="--snapshot-size") {
+            std::string size = next();
+            size_t x = size.find('x');
+            options.snapshot_width = std::stoi(size.substr(0, x));
+            options.snapshot_height = std::stoi(size.substr(x + 1));
+        }
+        else if (arg=="--snapshot-kb") options.snapshot_bytes = std::stoul(next()) * 1024;
+        else if (arg=="--flip") options.flip = true;
+        else if (arg=="--rotate") options.rotate = true;
+        else if (arg=="--settings-kb") options.settings_bytes = std::stoul(next()) * 1024;
+        else if (arg=="--gzip") options.gzip = true;
+        else if (arg=="--stream-fps") options.stream_fps = std::max(0.1, std::stod(next()));
+        else if (arg=="--snapshot-latency-ms") options.snapshot_latency_ms = std::stoi(next());
+        else if (arg=="--stall-ratio") options.stall_ratio = std::stod(next());
+        else if (arg=="--stall-after") options.stall_after = std::stod(next());
+        else if (arg=="--drop-every") options.drop_every = std::stod(next());
+        else if (arg=="--watch-pid") options.watch_pid = std::stoi(next());
+        else if (arg=="--report-interval") options.report_interval = std::stod(next());
+        else {
+            Usage(argv[0]);
+            return arg=="--help" ? 0 : 1;
+        }
+    }
+
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+#ifndef OCTOPRINTCONTROL_MOCK_GZIP
+    if (options.gzip) fmt::print(stderr, "built without zlib, --gzip is ignored\n");
+#endif
+
+    std::unique_ptr<Mock::Server> s;
+    try {
+        s.reset(new Mock::Server(options.address, options.port));
+    } catch (std::runtime_error &err) {
+        fmt::print(stderr, "{}\n", err.what());
+        return 1;
+    }
+    server = s.get();
+
+    s->OnRequest = OnRequest;
+    s->OnWebsocketOpen = OnSocketOpen;
+    s->OnWebsocketMessage = OnSocketMessage;
+    s->OnWebsocketClose = OnSocketClose;
+
+    snapshot = SyntheticJPEG(options.snapshot_width, options.snapshot_height, options.snapshot_bytes);
+
+    nlohmann::json config = nlohmann::json::array();
+    for (int i=1;i<=options.printers;i++) {
+        Printer p;
+        p.index = i;
+        printers.push_back(p);
+        config.push_back({
+            { "id", fmt::format("sim{:03}", i) },
+            { "name", fmt::format("Sim {:03}", i) },
+            { "url", PrinterURL(i) },
+            { "apiKey", options.api_key }
+        });
+    }
+
+    if (options.print_config) fmt::print("{}\n", config.dump(4));
+
+    // stagger the timers so the farm doesn't send in lockstep
+    for (Printer &p : printers) {
+        int index = p.index;
+        s->After(Seconds(Uniform(0, options.current_interval)), [index]() { CurrentTick(index); });
+        s->After(Seconds(Uniform(0, options.hb_interval)), [index]() { HeartbeatTick(index); });
+        p.stalls = Uniform(0, 1) < options.stall_ratio;
+        ScheduleStart(p);
+    }
+
+    if (options.drop_every > 0) {
+        Every(options.drop_every, []() {
+            std::vector<int> connected;
+            for (Printer &p : printers) if (p.sockets.size()) connected.push_back(p.index);
+            if (connected.empty()) return;
+            Drop(printers[connected[std::uniform_int_distribution<size_t>(0, connected.size() - 1)(rng)] - 1]);
+        });
+    }
+
+    if (options.report_interval > 0) Report(-1, std::chrono::steady_clock::now());
+
+    fmt::print(stderr, "Mock OctoPrint farm of {} printers at {}\n", options.printers, PrinterURL(1).substr(0, PrinterURL(1).size() - 2));
+
+    s->Run();
+
+    return 0;
+}
@@ -0,0 +1,707 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#include "mockserver.h"
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <fmt/core.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+
+#ifdef OCTOPRINTCONTROL_MOCK_HTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+
+namespace OctoPrintControl::Mock {
+
+struct Server::Connection {
+    ConnectionId id;
+    int fd;
+    std::string in;
+    std::string out;
+    bool websocket = false;
+    bool close_after_write = false;
+    bool dead = false;
+
+    // websocket message being reassembled from continuation frames
+    std::string fragments;
+
+    // responses can finish out of order, they're written in request order
+    uint64_t next_request = 0;
+    uint64_t next_response = 0;
+    std::map<uint64_t, std::string> responses;
+
+#ifdef OCTOPRINTCONTROL_MOCK_HTTP2
+    struct Stream {
+        Request request;
+        std::string response;
+        size_t sent = 0;
+    };
+
+    Server *server = nullptr;
+    nghttp2_session *h2 = nullptr;
+    // responses can't be written from inside nghttp2's callbacks
+    bool h2_receiving = false;
+    std::map<int32_t, Stream> streams;
+
+    ~Connection() { if (this->h2) nghttp2_session_del(this->h2); }
+#endif
+};
+
+// --- Sec-WebSocket-Accept needs SHA-1 and base64 ---
+
+static uint32_t Rotl(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
+
+static std::string SHA1(const std::string &input) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    std::string msg = input;
+    uint64_t bitlen = (uint64_t)input.size() * 8;
+    msg += (char)0x80;
+    while (msg.size() % 64 != 56) msg += (char)0;
+    for (int i=7;i>=0;i--) msg += (char)((bitlen >> (i * 8)) & 0xFF);
+
+    for (size_t chunk=0;chunk<msg.size();chunk+=64) {
+        uint32_t w[80];
+        for (int i=0;i<16;i++) {
+            w[i] = ((uint32_t)(uint8_t)msg[chunk + i*4] << 24) | ((uint32_t)(uint8_t)msg[chunk + i*4 + 1] << 16) |
+                   ((uint32_t)(uint8_t)msg[chunk + i*4 + 2] << 8) | (uint32_t)(uint8_t)msg[chunk + i*4 + 3];
+        }
+        for (int i=16;i<80;i++) w[i] = Rotl(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i=0;i<80;i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = Rotl(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = Rotl(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    std::string digest;
+    for (int i=0;i<5;i++) for (int j=3;j>=0;j--) digest += (char)((h[i] >> (j * 8)) & 0xFF);
+    return digest;
+}
+
+static std::string Base64(const std::string &data) {
+    static const char *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (;i + 2 < data.size();i+=3) {
+        uint32_t v = ((uint8_t)data[i] << 16) | ((uint8_t)data[i+1] << 8) | (uint8_t)data[i+2];
+        out += table[(v >> 18) & 63]; out += table[(v >> 12) & 63]; out += table[(v >> 6) & 63]; out += table[v & 63];
+    }
+    if (i + 1==data.size()) {
+        uint32_t v = (uint8_t)data[i] << 16;
+        out += table[(v >> 18) & 63]; out += table[(v >> 12) & 63]; out += "==";
+    } else if (i + 2==data.size()) {
+        uint32_t v = ((uint8_t)data[i] << 16) | ((uint8_t)data[i+1] << 8);
+        out += table[(v >> 18) & 63]; out += table[(v >> 12) & 63]; out += table[(v >> 6) & 63]; out += '=';
+    }
+    return out;
+}
+
+static std::string StatusText(int status) {
+    switch(status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+std::string Snowflake() {
+    static uint64_t increment = 0;
+    uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    uint64_t id = ((ms - 1420070400000ULL) << 22) | (increment++ & 0xFFF);
+    return std::to_string(id);
+}
+
+ProcessSample SampleProcess(int pid) {
+    ProcessSample sample;
+
+    std::ifstream status(fmt::format("/proc/{}/status", pid));
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("VmRSS:")) sample.rss_bytes = std::stoull(line.substr(6)) * 1024;
+        else if (line.starts_with("Threads:")) sample.threads = std::stoi(line.substr(8));
+    }
+
+    std::ifstream stat(fmt::format("/proc/{}/stat", pid));
+    std::string content((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+    // the command name can contain spaces, fields are counted from after it
+    size_t paren = content.rfind(')');
+    if (paren==std::string::npos) return sample;
+
+    std::istringstream fields(content.substr(paren + 2));
+    std::string field;
+    uint64_t utime = 0, stime = 0;
+    // state is field 3, utime 14 and stime 15
+    for (int i=3;i<=15 && fields >> field;i++) {
+        if (i==14) utime = std::stoull(field);
+        else if (i==15) stime = std::stoull(field);
+    }
+
+    sample.cpu_seconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    sample.valid = true;
+    return sample;
+}
+
+Server::Server(std::string address, int port)
+:port(port) {
+    signal(SIGPIPE, SIG_IGN);
+
+    this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (this->listen_fd < 0) throw std::runtime_error("Couldn't create socket.");
+
+    int reuse = 1;
+    setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    inet_pton(AF_INET, address.c_str(), &addr.sin_addr);
+
+    if (bind(this->listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(this->listen_fd, 1024)) {
+        close(this->listen_fd);
+        throw std::runtime_error(fmt::format("Couldn't listen on {}:{}", address, port));
+    }
+
+    socklen_t len = sizeof(addr);
+    getsockname(this->listen_fd, (sockaddr*)&addr, &len);
+    this->port = ntohs(addr.sin_port);
+
+    fcntl(this->listen_fd, F_SETFL, O_NONBLOCK);
+}
+
+Server::~Server() {
+    for (auto &[id, c] : this->connections) close(c->fd);
+    close(this->listen_fd);
+}
+
+void Server::After(std::chrono::steady_clock::duration delay, std::function<void()> fn) {
+    this->timers.insert({ std::chrono::steady_clock::now() + delay, fn });
+}
+
+void Server::RunTimers() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (this->timers.size() && this->timers.begin()->first <= now) {
+        std::function<void()> fn = this->timers.begin()->second;
+        this->timers.erase(this->timers.begin());
+        fn();
+    }
+}
+
+void Server::Run() {
+    this->running = true;
+
+    std::vector<pollfd> fds;
+    std::vector<ConnectionId> ids;
+
+    while (this->running) {
+        fds.clear();
+        ids.clear();
+
+        fds.push_back({ this->listen_fd, POLLIN, 0 });
+        ids.push_back(0);
+
+        for (auto it=this->connections.begin(); it!=this->connections.end();) {
+            Connection &c = *it->second;
+            if (c.dead || (c.close_after_write && c.out.empty())) {
+                if (c.websocket && this->OnWebsocketClose) this->OnWebsocketClose(c.id);
+                close(c.fd);
+                it = this->connections.erase(it);
+                continue;
+            }
+            fds.push_back({ c.fd, (short)(POLLIN | (c.out.size() ? POLLOUT : 0)), 0 });
+            ids.push_back(c.id);
+            it++;
+        }
+
+        int timeout = 100;
+        if (this->timers.size()) {
+            std::chrono::steady_clock::duration until = this->timers.begin()->first - std::chrono::steady_clock::now();
+            timeout = (int)std::clamp<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(until).count(), 0, 100);
+        }
+
+        poll(fds.data(), fds.size(), timeout);
+
+        if (fds[0].revents & POLLIN) this->Accept();
+
+        for (size_t i=1;i<fds.size();i++) {
+            if (!this->connections.contains(ids[i])) continue;
+            Connection &c = *this->connections[ids[i]];
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) this->Read(c);
+            if (!c.dead && (fds[i].revents & POLLOUT)) this->Write(c);
+        }
+
+        this->RunTimers();
+    }
+}
+
+void Server::Accept() {
+    while (true) {
+        int fd = accept(this->listen_fd, nullptr, nullptr);
+        if (fd < 0) return;
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        std::shared_ptr<Connection> c(new Connection);
+        c->id = this->next_id++;
+        c->fd = fd;
+#ifdef OCTOPRINTCONTROL_MOCK_HTTP2
+        c->server = this;
+#endif
+        if (this->connect_latency.count()) this->After(this->connect_latency, [this, c]() { this->connections[c->id] = c; });
+        else this->connections[c->id] = c;
+    }
+}
+
+void Server::Read(Connection &c) {
+    char buf[65536];
+    while (true) {
+        ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+        if (r > 0) {
+            c.in.append(buf, r);
+            continue;
+        }
+        if (r==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK)) c.dead = true;
+        break;
+    }
+
+    if (c.websocket) this->ProcessWebsocket(c);
+    else this->ProcessHTTP(c);
+}
+
+void Server::Write(Connection &c) {
+    while (c.out.size()) {
+        ssize_t s = send(c.fd, c.out.data(), c.out.size(), 0);
+        if (s > 0) {
+            c.out.erase(0, s);
+            continue;
+        }
+        if (errno!=EAGAIN && errno!=EWOULDBLOCK) c.dead = true;
+        break;
+    }
+}
+
+void Server::Queue(Connection &c, std::string data) {
+    c.out += data;
+    this->Write(c);
+}
+
+#ifdef OCTOPRINTCONTROL_MOCK_HTTP2
+static const std::string h2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#endif
+
+void Server::ProcessHTTP(Connection &c) {
+#ifdef OCTOPRINTCONTROL_MOCK_HTTP2
+    if (c.h2 || c.in.starts_with(h2_preface)) {
+        this->ProcessHTTP2(c);
+        return;
+    }
+    // not enough yet to tell
+    if (h2_preface.starts_with(c.in)) return;
+#endif
+
+    while (!c.dead && !c.websocket) {
+        size_t header_end = c.in.find("\r\n\r\n");
+        if (header_end==std::string::npos) return;
+
+        Request req;
+        req.connection = c.id;
+        std::string head = c.in.substr(0, header_end);
+        size_t line_end = head.find("\r\n");
+        std::string request_line = head.substr(0, line_end);
+
+        size_t sp1 = request_line.find(' ');
+        size_t sp2 = request_line.find(' ', sp1 + 1);
+        if (sp1==std::string::npos || sp2==std::string::npos) {
+            c.dead = true;
+            return;
+        }
+        req.method = request_line.substr(0, sp1);
+        std::string target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+        size_t q = target.find('?');
+        req.path = target.substr(0, q);
+        if (q!=std::string::npos) req.query = target.substr(q + 1);
+
+        size_t pos = line_end==std::string::npos ? head.size() : line_end + 2;
+        while (pos < head.size()) {
+            size_t eol = head.find("\r\n", pos);
+            if (eol==std::string::npos) eol = head.size();
+            std::string line = head.substr(pos, eol - pos);
+            size_t colon = line.find(':');
+            if (colon!=std::string::npos) {
+                std::string name = line.substr(0, colon);
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                size_t vstart = line.find_first_not_of(' ', colon + 1);
+                req.headers[name] = vstart==std::string::npos ? "" : line.substr(vstart);
+            }
+            pos = eol + 2;
+        }
+
+        size_t body_start = header_end + 4;
+        size_t consumed;
+
+        if (req.Header("transfer-encoding").find("chunked")!=std::string::npos) {
+            size_t p = body_start;
+            bool complete = false;
+            while (true) {
+                size_t eol = c.in.find("\r\n", p);
+                if (eol==std::string::npos) break;
+                size_t len = std::stoul(c.in.substr(p, eol - p), nullptr, 16);
+                if (c.in.size() < eol + 2 + len + 2) break;
+                req.body.append(c.in, eol + 2, len);
+                p = eol + 2 + len + 2;
+                if (len==0) {
+                    complete = true;
+                    break;
+                }
+            }
+            if (!complete) {
+                if (req.Header("expect")=="100-continue" && c.next_request==c.next_response && c.out.empty()) this->Queue(c, "HTTP/1.1 100 Continue\r\n\r\n");
+                return;
+            }
+            consumed = p;
+        } else {
+            size_t len = req.headers.contains("content-length") ? std::stoul(req.headers["content-length"]) : 0;
+            if (c.in.size() < body_start + len) {
+                // curl waits a second for this before sending large bodies
+                if (req.Header("expect")=="100-continue" && c.in.size()==body_start) this->Queue(c, "HTTP/1.1 100 Continue\r\n\r\n");
+                return;
+            }
+            req.body = c.in.substr(body_start, len);
+            consumed = body_start + len;
+        }
+
+        c.in.erase(0, consumed);
+
+        if (req.Header("upgrade")=="websocket") {
+            this->Upgrade(c, req);
+            return;
+        }
+
+        uint64_t seq = c.next_request++;
+        ConnectionId id = c.id;
+        Responder respond = [this, id, seq](Response resp) {
+            if (!this->connections.contains(id)) return;
+            Connection &conn = *this->connections[id];
+
+            std::string out = fmt::format("HTTP/1.1 {} {}\r\n", resp.status, StatusText(resp.status));
+            if (resp.stream) {
+                out += fmt::format("Content-Type: {}\r\nConnection: close\r\n", resp.contentType);
+            } else if (resp.status!=204 && resp.status!=304) {
+                out += fmt::format("Content-Type: {}\r\nContent-Length: {}\r\n", resp.contentType, resp.body.size());
+            }
+            for (auto &[name, value] : resp.headers) out += fmt::format("{}: {}\r\n", name, value);
+            out += "\r\n";
+            if (resp.status!=204 && resp.status!=304) out += resp.body;
+
+            conn.responses[seq] = out;
+            while (conn.responses.contains(conn.next_response)) {
+                this->Queue(conn, conn.responses[conn.next_response]);
+                conn.responses.erase(conn.next_response);
+                conn.next_response++;
+            }
+        };
+
+        if (this->OnRequest) this->OnRequest(req, respond);
+        else respond(Response{ .status = 404, .contentType = "text/plain", .body = "Not Found" });
+    }
+}
+
+void Server::Upgrade(Connection &c, Request &req) {
+    if (!this->OnWebsocketOpen) {
+        this->Queue(c, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        c.close_after_write = true;
+        return;
+    }
+
+    std::string accept = Base64(SHA1(req.Header("sec-websocket-key") + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+    this->Queue(c, fmt::format("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: {}\r\n\r\n", accept));
+    c.websocket = true;
+
+    if (!this->OnWebsocketOpen(c.id, req)) {
+        this->Close(c.id, 1008);
+        return;
+    }
+
+    if (c.in.size()) this->ProcessWebsocket(c);
+}
+
+#ifdef OCTOPRINTCONTROL_MOCK_HTTP2
+// nghttp2's callbacks, the connection is the session's user data
+struct HTTP2Session {
+    typedef Server::Connection Connection;
+
+    static int OnBeginHeaders(nghttp2_session*, const nghttp2_frame *frame, void *user) {
+        Connection *c = static_cast<Connection*>(user);
+        if (frame->hd.type==NGHTTP2_HEADERS && frame->headers.cat==NGHTTP2_HCAT_REQUEST) {
+            c->streams[frame->hd.stream_id].request.protocol = "HTTP/2";
+        }
+        return 0;
+    }
+
+    static int OnHeader(nghttp2_session*, const nghttp2_frame *frame, const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen, uint8_t, void *user) {
+        Connection *c = static_cast<Connection*>(user);
+        if (!c->streams.contains(frame->hd.stream_id)) return 0;
+        Request &req = c->streams[frame->hd.stream_id].request;
+
+        // names are already lower case
+        std::string n((const char*)name, namelen);
+        std::string v((const char*)value, valuelen);
+        if (n==":method") req.method = v;
+        else if (n==":path") {
+            size_t q = v.find('?');
+            req.path = v.substr(0, q);
+            if (q!=std::string::npos) req.query = v.substr(q + 1);
+        } else if (n==":authority") req.headers["host"] = v;
+        else if (!n.starts_with(":")) req.headers[n] = v;
+        return 0;
+    }
+
+    static int OnData(nghttp2_session*, uint8_t, int32_t stream_id, const uint8_t *data, size_t len, void *user) {
+        Connection *c = static_cast<Connection*>(user);
+        if (c->streams.contains(stream_id)) c->streams[stream_id].request.body.append((const char*)data, len);
+        return 0;
+    }
+
+    static int OnFrame(nghttp2_session*, const nghttp2_frame *frame, void *user) {
+        Connection *c = static_cast<Connection*>(user);
+        if (frame->hd.type!=NGHTTP2_HEADERS && frame->hd.type!=NGHTTP2_DATA) return 0;
+        if (!(frame->hd.flags & NGHTTP2_FLAG_END_STREAM) || !c->streams.contains(frame->hd.stream_id)) return 0;
+        Dispatch(*c, frame->hd.stream_id);
+        return 0;
+    }
+
+    static int OnStreamClose(nghttp2_session*, int32_t stream_id, uint32_t, void *user) {
+        static_cast<Connection*>(user)->streams.erase(stream_id);
+        return 0;
+    }
+
+    static ssize_t ReadBody(nghttp2_session*, int32_t stream_id, uint8_t *buf, size_t length, uint32_t *flags, nghttp2_data_source*, void *user) {
+        Connection *c = static_cast<Connection*>(user);
+        if (!c->streams.contains(stream_id)) return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        Connection::Stream &s = c->streams[stream_id];
+
+        size_t n = std::min(length, s.response.size() - s.sent);
+        memcpy(buf, s.response.data() + s.sent, n);
+        s.sent += n;
+        if (s.sent==s.response.size()) *flags |= NGHTTP2_DATA_FLAG_EOF;
+        return (ssize_t)n;
+    }
+
+    static void Dispatch(Connection &c, int32_t stream_id) {
+        Server *server = c.server;
+        ConnectionId id = c.id;
+        Responder respond = [server, id, stream_id](Response resp) {
+            if (!server->connections.contains(id)) return;
+            Connection &conn = *server->connections[id];
+            if (!conn.h2 || !conn.streams.contains(stream_id)) return;
+
+            bool body = resp.status!=204 && resp.status!=304;
+            std::vector<std::pair<std::string, std::string>> headers = { { ":status", std::to_string(resp.status) } };
+            if (body) {
+                headers.push_back({ "content-type", resp.contentType });
+                headers.push_back({ "content-length", std::to_string(resp.body.size()) });
+            }
+            for (auto &[name, value] : resp.headers) {
+                std::string lower = name;
+                std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+                headers.push_back({ lower, value });
+            }
+
+            std::vector<nghttp2_nv> nva;
+            for (auto &[name, value] : headers) {
+                nva.push_back({ (uint8_t*)name.data(), (uint8_t*)value.data(), name.size(), value.size(), NGHTTP2_NV_FLAG_NONE });
+            }
+
+            conn.streams[stream_id].response = resp.body;
+            nghttp2_data_provider provider;
+            provider.source.ptr = nullptr;
+            provider.read_callback = ReadBody;
+            nghttp2_submit_response(conn.h2, stream_id, nva.data(), nva.size(), body ? &provider : nullptr);
+
+            if (!conn.h2_receiving) server->SendHTTP2(conn);
+        };
+
+        Request &req = c.streams[stream_id].request;
+        if (server->OnRequest) server->OnRequest(req, respond);
+        else respond(Response{ .status = 404, .contentType = "text/plain", .body = "Not Found" });
+    }
+};
+
+void Server::ProcessHTTP2(Connection &c) {
+    if (!c.h2) {
+        nghttp2_session_callbacks *callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, HTTP2Session::OnBeginHeaders);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, HTTP2Session::OnHeader);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, HTTP2Session::OnData);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, HTTP2Session::OnFrame);
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, HTTP2Session::OnStreamClose);
+        nghttp2_session_server_new(&c.h2, callbacks, &c);
+        nghttp2_session_callbacks_del(callbacks);
+
+        nghttp2_settings_entry settings[] = { { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100 } };
+        nghttp2_submit_settings(c.h2, NGHTTP2_FLAG_NONE, settings, 1);
+    }
+
+    c.h2_receiving = true;
+    ssize_t r = nghttp2_session_mem_recv(c.h2, (const uint8_t*)c.in.data(), c.in.size());
+    c.h2_receiving = false;
+    c.in.clear();
+    if (r < 0) {
+        c.dead = true;
+        return;
+    }
+
+    this->SendHTTP2(c);
+}
+
+void Server::SendHTTP2(Connection &c) {
+    std::string out;
+    const uint8_t *data;
+    ssize_t n;
+    while ((n = nghttp2_session_mem_send(c.h2, &data)) > 0) out.append((const char*)data, n);
+    if (out.size()) this->Queue(c, out);
+
+    if (!nghttp2_session_want_read(c.h2) && !nghttp2_session_want_write(c.h2)) c.close_after_write = true;
+}
+#endif
+
+static std::string Frame(uint8_t opcode, const std::string &payload) {
+    std::string f;
+    f += (char)(0x80 | opcode);
+    if (payload.size() < 126) {
+        f += (char)payload.size();
+    } else if (payload.size() < 65536) {
+        f += (char)126;
+        f += (char)((payload.size() >> 8) & 0xFF);
+        f += (char)(payload.size() & 0xFF);
+    } else {
+        f += (char)127;
+        for (int i=7;i>=0;i--) f += (char)(((uint64_t)payload.size() >> (i * 8)) & 0xFF);
+    }
+    f += payload;
+    return f;
+}
+
+void Server::ProcessWebsocket(Connection &c) {
+    while (!c.dead && c.in.size() >= 2) {
+        uint8_t b0 = c.in[0];
+        uint8_t b1 = c.in[1];
+        bool fin = b0 & 0x80;
+        uint8_t opcode = b0 & 0x0F;
+        bool masked = b1 & 0x80;
+        uint64_t len = b1 & 0x7F;
+        size_t pos = 2;
+
+        if (len==126) {
+            if (c.in.size() < 4) return;
+            len = ((uint8_t)c.in[2] << 8) | (uint8_t)c.in[3];
+            pos = 4;
+        } else if (len==127) {
+            if (c.in.size() < 10) return;
+            len = 0;
+            for (int i=0;i<8;i++) len = (len << 8) | (uint8_t)c.in[2 + i];
+            pos = 10;
+        }
+
+        uint8_t mask[4] = { 0, 0, 0, 0 };
+        if (masked) {
+            if (c.in.size() < pos + 4) return;
+            memcpy(mask, c.in.data() + pos, 4);
+            pos += 4;
+        }
+
+        if (c.in.size() < pos + len) return;
+
+        std::string payload = c.in.substr(pos, len);
+        if (masked) for (size_t i=0;i<payload.size();i++) payload[i] ^= mask[i % 4];
+        c.in.erase(0, pos + len);
+
+        switch(opcode) {
+        case 0x0: // continuation
+        case 0x1: // text
+        case 0x2: // binary
+            c.fragments += payload;
+            if (fin) {
+                std::string message;
+                message.swap(c.fragments);
+                if (this->OnWebsocketMessage) this->OnWebsocketMessage(c.id, message);
+            }
+            break;
+        case 0x8: // close
+            this->Queue(c, Frame(0x8, payload.substr(0, 2)));
+            c.close_after_write = true;
+            return;
+        case 0x9: // ping
+            this->Queue(c, Frame(0xA, payload));
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void Server::SendText(ConnectionId id, const std::string &data) {
+    if (!this->connections.contains(id)) return;
+    Connection &c = *this->connections[id];
+    if (!c.websocket || c.close_after_write) return;
+    this->Queue(c, Frame(0x1, data));
+}
+
+void Server::Close(ConnectionId id, uint16_t code) {
+    if (!this->connections.contains(id)) return;
+    Connection &c = *this->connections[id];
+    std::string payload;
+    payload += (char)(code >> 8);
+    payload += (char)(code & 0xFF);
+    this->Queue(c, Frame(0x8, payload));
+    c.close_after_write = true;
+}
+
+void Server::Drop(ConnectionId id) {
+    if (!this->connections.contains(id)) return;
+    this->connections[id]->dead = true;
+}
+
+bool Server::Stream(ConnectionId id, const std::string &data) {
+    if (!this->connections.contains(id)) return false;
+    Connection &c = *this->connections[id];
+    if (c.dead) return false;
+    if (c.out.size() < 1024 * 1024) this->Queue(c, data);
+    return true;
+}
+
+}
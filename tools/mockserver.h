@@ -0,0 +1,117 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+#pragma once
+#include <string>
+#include <map>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <cinttypes>
+
+// A single threaded HTTP/1.1 and websocket server for local stand-ins of the
+// services the bot talks to. Everything, including handlers and timers, runs on
+// the thread that calls Run(), so handlers don't need any locking. Built with
+// nghttp2 it also takes cleartext HTTP/2 from clients that start with it.
+namespace OctoPrintControl::Mock {
+
+typedef uint64_t ConnectionId;
+
+struct Request {
+    ConnectionId connection = 0;
+    // HTTP/1.1 or HTTP/2
+    std::string protocol = "HTTP/1.1";
+    std::string method;
+    std::string path;
+    std::string query;
+    // header names are lower case
+    std::map<std::string, std::string> headers;
+    std::string body;
+
+    std::string Header(std::string name) { return this->headers.contains(name) ? this->headers[name] : ""; }
+};
+
+struct Response {
+    int status = 200;
+    std::string contentType = "application/json";
+    std::map<std::string, std::string> headers;
+    std::string body;
+    // HTTP/1.1 only: the body goes on with Server::Stream until the connection
+    // closes, like a webcam's multipart stream
+    bool stream = false;
+};
+
+// Send a response later, e.g. after an injected delay. HTTP/1.1 responses on a
+// connection are written in request order, HTTP/2 ones as soon as they're sent.
+typedef std::function<void(Response)> Responder;
+
+class Server {
+public:
+    Server(std::string address, int port);
+    ~Server();
+
+    int Port() { return this->port; }
+
+    std::function<void(Request &req, Responder respond)> OnRequest;
+    // return false to refuse the upgrade with a 404
+    std::function<bool(ConnectionId id, Request &req)> OnWebsocketOpen;
+    std::function<void(ConnectionId id, std::string &data)> OnWebsocketMessage;
+    std::function<void(ConnectionId id)> OnWebsocketClose;
+
+    void SendText(ConnectionId id, const std::string &data);
+    void Close(ConnectionId id, uint16_t code=1000);
+    // drops the TCP connection without a close frame
+    void Drop(ConnectionId id);
+    // more of a streamed response's body, false once the connection is gone.
+    // Data is dropped while the client is more than a MiB behind.
+    bool Stream(ConnectionId id, const std::string &data);
+
+    void After(std::chrono::steady_clock::duration delay, std::function<void()> fn);
+
+    // new connections wait this long before anything is read from them, a
+    // stand-in for the round trips of a TLS handshake
+    std::chrono::steady_clock::duration connect_latency{0};
+
+    void Run();
+    void Stop() { this->running = false; }
+
+private:
+    struct Connection;
+    friend struct HTTP2Session;
+
+    void Accept();
+    void Read(Connection &c);
+    void Write(Connection &c);
+    void ProcessHTTP(Connection &c);
+    void ProcessHTTP2(Connection &c);
+    void SendHTTP2(Connection &c);
+    void ProcessWebsocket(Connection &c);
+    void Upgrade(Connection &c, Request &req);
+    void Queue(Connection &c, std::string data);
+    void RunTimers();
+
+    int listen_fd = -1;
+    int port;
+    bool running = false;
+
+    ConnectionId next_id = 1;
+    std::map<ConnectionId, std::shared_ptr<Connection>> connections;
+    std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timers;
+};
+
+// Discord style snowflake for the current time.
+std::string Snowflake();
+
+// Resource use of another process, read from /proc (Linux only).
+struct ProcessSample {
+    bool valid = false;
+    uint64_t rss_bytes = 0;
+    int threads = 0;
+    // user + system
+    double cpu_seconds = 0;
+};
+
+ProcessSample SampleProcess(int pid);
+
+}
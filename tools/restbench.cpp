@@ -0,0 +1,146 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+//
+// Times a burst of concurrent Discord REST calls, alternating AddReaction and
+// CreateMessage, over HTTP/1.1 and HTTP/2 against the Discord stand-in.
+//
+//     OctoPrintControlMockDiscord --port 8202 --latency-ms 20 --connect-latency-ms 30
+//     OctoPrintControlRESTBench --discord-api http://127.0.0.1:8202/api/v10 --calls 50 --runs 5
+//
+// The stand-in is cleartext, so HTTP/2 runs use prior knowledge unless the url is
+// https. Connections stay pooled between runs, the first run of each version
+// opens them and later runs reuse what's left, so both are reported.
+#include <string>
+#include <vector>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <curl/curl.h>
+#include <fmt/core.h>
+
+#include "io.h"
+#include "task.h"
+#include "http.h"
+#include "discord.h"
+
+using namespace OctoPrintControl;
+
+struct Options {
+    std::string discord_api = "http://127.0.0.1:8090/api/v10";
+    std::string channel = "1000000000000000001";
+    int calls = 50;
+    int runs = 5;
+    int io_threads = 1;
+    size_t worker_threads = 4;
+};
+
+static Options options;
+
+typedef std::chrono::duration<double, std::milli> Millis;
+
+struct Burst {
+    std::atomic<int> done = 0;
+    std::atomic<int> failed = 0;
+    std::promise<void> finished;
+};
+
+static IO::Task<void> Call(std::shared_ptr<Discord::Channel> channel, int i, std::shared_ptr<Burst> burst) {
+    try {
+        if (i % 2) co_await channel->AddReactionAsync("1000000000000000002", "\xF0\x9F\x91\x8D");
+        else co_await channel->CreateMessageAsync(Discord::NewChannelMessage(fmt::format("burst call {}", i)));
+    } catch (...) {
+        burst->failed++;
+    }
+    if (++burst->done==options.calls) burst->finished.set_value();
+}
+
+static Millis RunBurst(HTTP::Version version, int &failed) {
+    Discord::SetHTTPVersion(version);
+    std::shared_ptr<Discord::Channel> channel(new Discord::Channel("bench", options.channel));
+    std::shared_ptr<Burst> burst(new Burst);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i=0;i<options.calls;i++) IO::Spawn(Call(channel, i, burst));
+    burst->finished.get_future().wait();
+
+    failed = burst->failed;
+    return std::chrono::steady_clock::now() - start;
+}
+
+static std::string Summary(std::vector<double> samples) {
+    if (samples.empty()) return "n=0";
+    std::sort(samples.begin(), samples.end());
+    return fmt::format("n={} min={:.1f}ms median={:.1f}ms max={:.1f}ms", samples.size(), samples.front(), samples[samples.size() / 2], samples.back());
+}
+
+static void Usage(const char *argv0) {
+    fmt::print(
+        "Usage: {} [options]\n"
+        "  --discord-api URL         OctoPrintControlMockDiscord api url (http://127.0.0.1:8090/api/v10)\n"
+        "  --channel ID              channel to post and react in\n"
+        "  --calls N                 concurrent calls per burst (50)\n"
+        "  --runs N                  bursts per HTTP version (5)\n"
+        "  --io-threads N            (1)\n"
+        "  --worker-threads N        (4)\n",
+        argv0);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i=1;i<argc;i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fmt::print(stderr, "{} needs a value\n", arg);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg=="--discord-api") options.discord_api = next();
+        else if (arg=="--channel") options.channel = next();
+        else if (arg=="--calls") options.calls = std::max(1, std::stoi(next()));
+        else if (arg=="--runs") options.runs = std::max(1, std::stoi(next()));
+        else if (arg=="--io-threads") options.io_threads = std::stoi(next());
+        else if (arg=="--worker-threads") options.worker_threads = std::stoul(next());
+        else {
+            Usage(argv[0]);
+            return arg=="--help" ? 0 : 1;
+        }
+    }
+
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+    Log::SetLevels("warn");
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    Discord::SetAPIBaseURL(options.discord_api);
+
+    IO::Start(options.io_threads, false, options.worker_threads);
+
+    struct Mode {
+        const char *name;
+        HTTP::Version version;
+    };
+    std::vector<Mode> modes = { { "HTTP/1.1", HTTP::Version::HTTP1 } };
+    if (!HTTP::HTTP2Available()) fmt::print("curl was built without HTTP/2, only timing HTTP/1.1\n");
+    else if (options.discord_api.starts_with("https:")) modes.push_back({ "HTTP/2", HTTP::Version::HTTP2 });
+    else modes.push_back({ "HTTP/2", HTTP::Version::HTTP2PriorKnowledge });
+
+    for (Mode &mode : modes) {
+        std::vector<double> warm;
+        for (int r=0;r<options.runs;r++) {
+            int failed = 0;
+            Millis t = RunBurst(mode.version, failed);
+            fmt::print("{} run {}: {} calls in {:.1f}ms{}\n", mode.name, r + 1, options.calls, t.count(), failed ? fmt::format(", {} failed", failed) : "");
+            if (r > 0) warm.push_back(t.count());
+        }
+        fmt::print("{} pooled: {}\n", mode.name, Summary(warm));
+    }
+
+    IO::StopWork();
+    IO::Stop();
+    curl_global_cleanup();
+    return 0;
+}
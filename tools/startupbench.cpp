@@ -0,0 +1,190 @@
+// OctoPrintControl - An OctoPrint Discord Bot
+// Copyright (c) 2024 Taylor Talkington
+// License: MIT (see LICENSE)
+//
+// Times the bot's startup against the local stand-ins: Magick init, every printer
+// connected and logged in, and the gateway's first READY.
+//
+//     OctoPrintControlMockOctoPrint --port 8201 --printers 50 --rest-latency-ms 100
+//     OctoPrintControlMockDiscord --port 8202 --hb-interval 1000
+//     OctoPrintControlStartupBench --octoprint http://127.0.0.1:8201 --printers 50
+//         --discord-api http://127.0.0.1:8202/api/v10 --runs 5
+//
+// The last command is a single line, wrapped here to fit.
+//
+// Each run starts from scratch except Magick, which can only be initialized once
+// per process. Runs against the Discord stand-in are 5 seconds apart so its
+// identify limit isn't hit.
+#include <string>
+#include <vector>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <curl/curl.h>
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+#include "io.h"
+#include "octoprint.h"
+#include "printer.h"
+#include "discord.h"
+
+using namespace OctoPrintControl;
+
+struct Options {
+    std::string octoprint = "http://127.0.0.1:8091";
+    int printers = 10;
+    std::string api_key = "mockapikey";
+    std::string discord_api;
+    int runs = 5;
+    int io_threads = 1;
+    size_t worker_threads = 4;
+    double timeout = 60;
+};
+
+static Options options;
+
+typedef std::chrono::duration<double, std::milli> Millis;
+
+struct Run {
+    Millis printers{0};
+    Millis gateway{0};
+};
+
+static Run StartOnce() {
+    Run run;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + std::chrono::milliseconds((long)(options.timeout * 1000));
+
+    std::promise<std::chrono::steady_clock::time_point> printers_done;
+    std::atomic<int> printers_ready = 0;
+    std::vector<std::shared_ptr<Printer>> printers;
+    for (int i=1;i<=options.printers;i++) {
+        std::shared_ptr<Printer> p(new Printer(fmt::format("bench{}", i), fmt::format("{}/p/{}", options.octoprint, i), options.api_key));
+        // once per printer, reconnects would run it again
+        std::shared_ptr<std::once_flag> once(new std::once_flag);
+        p->AddReadyCallback([&printers_done, &printers_ready, once]() {
+            std::call_once(*once, [&]() {
+                if (++printers_ready==options.printers) printers_done.set_value(std::chrono::steady_clock::now());
+            });
+        });
+        printers.push_back(p);
+    }
+
+    std::promise<std::chrono::steady_clock::time_point> gateway_done;
+    std::shared_ptr<Discord::Gateway> gateway;
+    if (options.discord_api.size()) {
+        gateway.reset(new Discord::Gateway("bench"));
+        std::shared_ptr<std::once_flag> once(new std::once_flag);
+        gateway->AddEventCallback("READY", [&gateway_done, once](std::string, nlohmann::json) {
+            std::call_once(*once, [&]() { gateway_done.set_value(std::chrono::steady_clock::now()); });
+        });
+        gateway->Connect();
+    }
+    for (std::shared_ptr<Printer> &p : printers) p->Connect();
+
+    std::future<std::chrono::steady_clock::time_point> printers_at = printers_done.get_future();
+    if (printers_at.wait_until(deadline)==std::future_status::ready) {
+        run.printers = printers_at.get() - start;
+    } else {
+        fmt::print(stderr, "Only {} of {} printers were ready in time\n", printers_ready.load(), options.printers);
+    }
+
+    if (gateway) {
+        std::future<std::chrono::steady_clock::time_point> gateway_at = gateway_done.get_future();
+        if (gateway_at.wait_until(deadline)==std::future_status::ready) {
+            run.gateway = gateway_at.get() - start;
+        } else {
+            fmt::print(stderr, "No READY in time\n");
+        }
+    }
+
+    gateway.reset();
+    printers.clear();
+    return run;
+}
+
+static std::string Summary(std::vector<double> samples) {
+    if (samples.empty()) return "n=0";
+    std::sort(samples.begin(), samples.end());
+    return fmt::format("n={} min={:.0f}ms median={:.0f}ms max={:.0f}ms", samples.size(), samples.front(), samples[samples.size() / 2], samples.back());
+}
+
+static void Usage(const char *argv0) {
+    fmt::print(
+        "Usage: {} [options]\n"
+        "  --octoprint URL           OctoPrintControlMockOctoPrint base url (http://127.0.0.1:8091)\n"
+        "  --printers N              printers to connect, /p/1 to /p/N (10)\n"
+        "  --api-key KEY             (mockapikey)\n"
+        "  --discord-api URL         also time the gateway against OctoPrintControlMockDiscord\n"
+        "  --runs N                  (5)\n"
+        "  --io-threads N            (1)\n"
+        "  --worker-threads N        (4)\n"
+        "  --timeout S               give up on a run after S seconds (60)\n",
+        argv0);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i=1;i<argc;i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fmt::print(stderr, "{} needs a value\n", arg);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg=="--octoprint") options.octoprint = next();
+        else if (arg=="--printers") options.printers = std::stoi(next());
+        else if (arg=="--api-key") options.api_key = next();
+        else if (arg=="--discord-api") options.discord_api = next();
+        else if (arg=="--runs") options.runs = std::stoi(next());
+        else if (arg=="--io-threads") options.io_threads = std::stoi(next());
+        else if (arg=="--worker-threads") options.worker_threads = std::stoul(next());
+        else if (arg=="--timeout") options.timeout = std::stod(next());
+        else {
+            Usage(argv[0]);
+            return arg=="--help" ? 0 : 1;
+        }
+    }
+
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+    Log::SetLevels("warn");
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    if (options.discord_api.size()) Discord::SetAPIBaseURL(options.discord_api);
+
+    std::chrono::steady_clock::time_point magick_start = std::chrono::steady_clock::now();
+    std::promise<void> magick_done;
+    OctoPrint::InitializeMagick(argv[0], [&magick_done]() { magick_done.set_value(); });
+    magick_done.get_future().wait();
+    fmt::print("magick init: {:.0f}ms\n", Millis(std::chrono::steady_clock::now() - magick_start).count());
+
+    IO::Start(options.io_threads, false, options.worker_threads);
+
+    std::vector<double> printers;
+    std::vector<double> gateway;
+    for (int r=0;r<options.runs;r++) {
+        if (r > 0 && options.discord_api.size()) std::this_thread::sleep_for(std::chrono::milliseconds(5100));
+
+        Run run = StartOnce();
+        fmt::print("run {}: {} printers ready {:.0f}ms", r + 1, options.printers, run.printers.count());
+        if (options.discord_api.size()) fmt::print(", gateway READY {:.0f}ms", run.gateway.count());
+        fmt::print("\n");
+
+        if (run.printers.count()) printers.push_back(run.printers.count());
+        if (run.gateway.count()) gateway.push_back(run.gateway.count());
+    }
+
+    fmt::print("printers ready: {}\n", Summary(printers));
+    if (options.discord_api.size()) fmt::print("gateway READY:  {}\n", Summary(gateway));
+
+    IO::StopWork();
+    IO::Stop();
+    curl_global_cleanup();
+    return 0;
+}